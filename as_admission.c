@@ -0,0 +1,148 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_admission.h"
+
+#include <sys/mman.h>
+
+// The table and the entry the process counts in, see admission_bind
+static Admission *table = NULL;
+static AdmissionEntry *entry = NULL;
+
+
+static long _now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+Admission *admission_create(const AdmissionLimits *limits) {
+    Admission *admission = mmap(NULL, sizeof(Admission), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission == MAP_FAILED) {
+        perror("admission_create: mmap");
+        return NULL;
+    }
+    admission->limits = *limits;
+    return admission;
+}
+
+
+void admission_destroy(Admission *admission) {
+    if (admission != NULL) {
+        munmap(admission, sizeof(Admission));
+    }
+}
+
+
+/*
+** Helper for: admission_admit
+** returns the entry of address, or a free one for it, NULL if the table is
+** full around it
+*/
+static AdmissionEntry *_find_entry(Admission *admission, in_addr_t address) {
+    uint32_t start = (address * 2654435761u) >> 16;
+    AdmissionEntry *free_entry = NULL;
+    for (int i = 0; i < ADMISSION_PROBES; i++) {
+        AdmissionEntry *candidate = &admission->entries[(start + i) % ADMISSION_TABLE_SIZE];
+        // An address keeps its entry, and budget, after its connections end
+        if (candidate->address == address) {
+            return candidate;
+        }
+        if (free_entry == NULL && candidate->connections == 0) {
+            free_entry = candidate;
+        }
+    }
+    if (free_entry != NULL) {
+        // Nothing counts in it without connections
+        free_entry->address = address;
+        __atomic_store_n(&free_entry->streams, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&free_entry->bucket_full_us, 0, __ATOMIC_RELAXED);
+    }
+    return free_entry;
+}
+
+
+int admission_admit(Admission *admission, in_addr_t address, const char **reason) {
+    const AdmissionLimits *limits = &admission->limits;
+    if (limits->max_connections > 0 && admission->connections >= limits->max_connections) {
+        *reason = "too many connections";
+        return -1;
+    }
+    AdmissionEntry *address_entry = _find_entry(admission, address);
+    if (address_entry == NULL) {
+        *reason = "too many addresses";
+        return -1;
+    }
+    if (limits->max_connections_per_address > 0 &&
+        address_entry->connections >= limits->max_connections_per_address) {
+        *reason = "too many connections from the address";
+        return -1;
+    }
+    address_entry->connections++;
+    admission->connections++;
+    return address_entry - admission->entries;
+}
+
+
+void admission_release(Admission *admission, int slot) {
+    AdmissionEntry *address_entry = &admission->entries[slot];
+    address_entry->connections--;
+    admission->connections--;
+    if (address_entry->connections == 0) {
+        // In case a client process died in the middle of a stream
+        __atomic_store_n(&address_entry->streams, 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+void admission_bind(Admission *admission, int slot) {
+    table = admission;
+    entry = admission != NULL ? &admission->entries[slot] : NULL;
+}
+
+
+int admission_stream_begin(void) {
+    if (entry == NULL) {
+        return 0;
+    }
+    int max_streams = table->limits.max_streams_per_address;
+    int streams = __atomic_add_fetch(&entry->streams, 1, __ATOMIC_RELAXED);
+    if (max_streams > 0 && streams > max_streams) {
+        __atomic_sub_fetch(&entry->streams, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+
+void admission_stream_end(void) {
+    if (entry != NULL) {
+        __atomic_sub_fetch(&entry->streams, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+void admission_throttle(size_t num) {
+    if (entry == NULL || table->limits.byte_rate_per_address == 0) {
+        return;
+    }
+    long cost_us = num * 1000000 / table->limits.byte_rate_per_address;
+    long now = _now_us();
+    long full = __atomic_load_n(&entry->bucket_full_us, __ATOMIC_RELAXED);
+    long start;
+    do {
+        start = MAX(full, now);
+    } while (!__atomic_compare_exchange_n(&entry->bucket_full_us, &full, start + cost_us, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    // The bytes may go once the bucket holds no more than a burst of debt
+    long wait_us = start - now - ADMISSION_BURST_MS * 1000;
+    if (wait_us > 0) {
+        struct timespec wait = {wait_us / 1000000, (wait_us % 1000000) * 1000};
+        while (nanosleep(&wait, &wait) == -1 && errno == EINTR) {
+        }
+    }
+}
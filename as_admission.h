@@ -0,0 +1,116 @@
+#ifndef AS_ADMISSION_H_
+#define AS_ADMISSION_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** Admission control
+** -----------------
+** Every connection costs the server a process, so the parent only forks one
+** when the server has room for it: under its limit of connections overall,
+** and of connections from the client's address. Otherwise it sheds the
+** connection on the spot with a RESPONSE_BUSY, rather than letting it queue
+** and fail slowly. Each address may also only have so many streams going at
+** once, and share a bandwidth budget, so one client can't starve the others.
+**
+** The parent keeps a table of the addresses it has connections from, in
+** shared memory mapped before the server forks. Only the parent adds and
+** removes addresses, when it accepts and reaps connections. A client process
+** counts its address's streams and spends its bandwidth budget in the entry
+** of its address, with atomics.
+**
+** The budget is a token bucket, kept as the time at which the address's
+** bucket is next full (a generic cell rate algorithm): sending n bytes moves
+** that time n / byte rate later, and a sender that moves it more than
+** ADMISSION_BURST_MS into the future sleeps for the difference.
+*/
+// Addresses tracked at once, a power of two
+#define ADMISSION_TABLE_SIZE 1024
+// Entries looked at for an address, before the table counts as full
+#define ADMISSION_PROBES 16
+#define ADMISSION_BURST_MS 100
+
+
+/*
+** The limits, 0 for none.
+*/
+typedef struct admission_limits {
+    int max_connections;
+    int max_connections_per_address;
+    int max_streams_per_address;
+    uint64_t byte_rate_per_address;     // bytes per second
+} AdmissionLimits;
+
+
+typedef struct admission_entry {
+    in_addr_t address;
+    int connections;            // only touched by the parent
+    int streams;
+    long bucket_full_us;        // when the token bucket is full again
+} __attribute__((aligned(32))) AdmissionEntry;
+
+
+typedef struct admission {
+    AdmissionLimits limits;
+    int connections;
+    AdmissionEntry entries[ADMISSION_TABLE_SIZE];
+} Admission;
+
+
+/*
+** Maps an empty table with the limits, shared with every process forked
+** afterwards.
+**
+** returns the table, NULL on error
+*/
+Admission *admission_create(const AdmissionLimits *limits);
+
+/*
+** Unmaps the table.
+*/
+void admission_destroy(Admission *admission);
+
+/*
+** For the parent: admits a connection from address, if it fits in the limits.
+**
+** returns the connection's slot in the table, to release it with, or -1 if
+** it must be refused, with *reason set to why
+*/
+int admission_admit(Admission *admission, in_addr_t address, const char **reason);
+
+/*
+** For the parent: releases the connection admitted in slot, once it ended.
+*/
+void admission_release(Admission *admission, int slot);
+
+/*
+** For a client process: makes it count its streams and bandwidth in slot
+** from now on. Until a process is bound, or when admission is NULL, there are
+** no limits.
+*/
+void admission_bind(Admission *admission, int slot);
+
+/*
+** Starts a stream, if the client's address has room for another.
+**
+** returns 0 if the stream may go ahead, -1 if it must be refused
+*/
+int admission_stream_begin(void);
+
+/*
+** Ends a stream that admission_stream_begin let go ahead.
+*/
+void admission_stream_end(void);
+
+/*
+** Spends num bytes of the client's bandwidth budget, first sleeping as long
+** as it takes the budget to allow them.
+*/
+void admission_throttle(size_t num);
+
+#endif // AS_ADMISSION_H_
@@ -0,0 +1,821 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_bench.h"
+
+#include <math.h>
+
+static const char *kind_names[] = {"list", "stream", "partial", "slow"};
+
+// How long the LIST made to size the library may take
+#define BENCH_SETUP_TIMEOUT_SEC 5
+
+
+typedef enum {
+    CONN_CLOSED,
+    CONN_CONNECTING,
+    CONN_HEADER,    // waiting for the file size
+    CONN_BODY,
+} ConnState;
+
+typedef struct bench_conn {
+    int fd;
+    ConnState state;
+    BenchKind kind;
+    uint32_t watched;
+    uint8_t paused;         // a slow reader that is ahead of its rate
+
+    uint8_t header[sizeof(uint32_t)];
+    int header_bytes;
+    uint64_t expected;      // bytes of the response body the request reads
+    uint64_t received;
+    double sent_ms;
+    uint8_t got_first_byte;
+    // A LIST response ends with the line of file 0
+    char line_start[2];
+    int line_len;
+    uint8_t prev_cr;
+} BenchConn;
+
+typedef struct bench {
+    const BenchConfig *config;
+    BenchResult *result;
+    struct sockaddr_in addr;
+    uint32_t num_files;
+    uint32_t total_weight;
+    Poller poller;
+    BenchConn *conns;
+    uint8_t buf[BENCH_READ_SIZE];
+} Bench;
+
+
+static double _now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+
+static void _add_sample(Samples *samples, double value) {
+    if (samples->num == samples->capacity) {
+        size_t capacity = samples->capacity ? 2 * samples->capacity : 1024;
+        double *values = realloc(samples->values, capacity * sizeof(double));
+        if (values == NULL) {
+            // Losing a sample beats losing the run
+            return;
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->num++] = value;
+}
+
+
+static int _compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+** returns the p-th quantile of the sorted samples, NAN if there are none
+*/
+static double _percentile(const Samples *samples, double p) {
+    if (samples->num == 0) {
+        return NAN;
+    }
+    size_t rank = (size_t)ceil(p * samples->num);
+    return samples->values[rank > 0 ? rank - 1 : 0];
+}
+
+
+int bench_parse_mix(const char *mix, uint32_t weights[BENCH_NUM_KINDS]) {
+    memset(weights, 0, BENCH_NUM_KINDS * sizeof(uint32_t));
+    char *copy = strdup(mix);
+    if (copy == NULL) {
+        perror("bench_parse_mix");
+        return -1;
+    }
+
+    int result = 0;
+    uint32_t total = 0;
+    char *saveptr;
+    for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        char *equals = strchr(item, '=');
+        int kind = 0;
+        while (kind < BENCH_NUM_KINDS && (equals == NULL ||
+               strncmp(item, kind_names[kind], equals - item) != 0 ||
+               strlen(kind_names[kind]) != (size_t)(equals - item))) {
+            kind++;
+        }
+        long weight = equals != NULL ? strtol(equals + 1, NULL, 10) : -1;
+        if (kind == BENCH_NUM_KINDS || weight < 0) {
+            ERR_PRINT("Invalid mix item %s\n", item);
+            result = -1;
+            break;
+        }
+        weights[kind] = weight;
+        total += weight;
+    }
+    if (result == 0 && total == 0) {
+        ERR_PRINT("The mix %s has no requests\n", mix);
+        result = -1;
+    }
+    free(copy);
+    return result;
+}
+
+
+/*
+** Helper for: run_bench
+** Finds out how many files the target's library has, with a blocking LIST.
+**
+** returns the number of files, -1 on error
+*/
+static int _count_files(const struct sockaddr_in *addr) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1 || connect(sockfd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        perror("as_bench: connect");
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+        return -1;
+    }
+    // An empty library sends no LIST response at all
+    struct timeval timeout = {BENCH_SETUP_TIMEOUT_SEC, 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int num_files = -1;
+    LineReader reader;
+    if (line_reader_init(&reader, RESPONSE_BUFFER_SIZE, 0) == -1) {
+        close(sockfd);
+        return -1;
+    }
+    if (write_precisely(sockfd, REQUEST_LIST END_OF_MESSAGE_TOKEN, 6) == 6) {
+        char *line;
+        while ((line = line_reader_next(&reader, NULL)) == NULL) {
+            if (line_reader_fill(&reader, sockfd) <= 0) {
+                break;
+            }
+        }
+        // The files are listed from the last one
+        if (line != NULL) {
+            num_files = strtol(line, NULL, 10) + 1;
+        }
+    }
+    if (num_files == -1) {
+        ERR_PRINT("The server sent no library, is it empty?\n");
+    }
+    line_reader_free(&reader);
+    close(sockfd);
+    return num_files;
+}
+
+
+static void _watch(Bench *bench, BenchConn *conn, uint32_t events) {
+    if (conn->watched != events) {
+        poller_watch(&bench->poller, conn->fd, events, conn);
+        conn->watched = events;
+    }
+}
+
+
+static void _conn_close(Bench *bench, BenchConn *conn) {
+    if (conn->fd >= 0) {
+        _watch(bench, conn, 0);
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    conn->state = CONN_CLOSED;
+    conn->paused = 0;
+}
+
+
+static BenchKind _pick_kind(const Bench *bench) {
+    uint32_t pick = rand() % bench->total_weight;
+    int kind = 0;
+    while (pick >= bench->config->weights[kind]) {
+        pick -= bench->config->weights[kind];
+        kind++;
+    }
+    return kind;
+}
+
+
+/*
+** Helper for: _conn_start
+** Writes the connection's next request. Requests are small enough to always
+** fit in an empty socket buffer.
+*/
+static void _conn_send(Bench *bench, BenchConn *conn) {
+    uint8_t request[12];
+    int len;
+    if (conn->kind == BENCH_LIST) {
+        memcpy(request, REQUEST_LIST END_OF_MESSAGE_TOKEN, 6);
+        len = 6;
+        conn->state = CONN_BODY;
+        conn->expected = UINT64_MAX;
+    } else {
+        uint32_t file_index = bench->config->file_index >= 0 ? (uint32_t)bench->config->file_index
+                                                            : rand() % bench->num_files;
+        uint32_t network_file_index = htonl(file_index);
+        memcpy(request, REQUEST_STREAM END_OF_MESSAGE_TOKEN, 8);
+        memcpy(request + 8, &network_file_index, sizeof(uint32_t));
+        len = 12;
+        conn->state = CONN_HEADER;
+    }
+    conn->header_bytes = 0;
+    conn->received = 0;
+    conn->got_first_byte = 0;
+    conn->line_len = 0;
+    conn->prev_cr = 0;
+
+    if (write(conn->fd, request, len) != len) {
+        bench->result->kinds[conn->kind].failed++;
+        _conn_close(bench, conn);
+        return;
+    }
+    conn->sent_ms = _now_ms();
+    _watch(bench, conn, POLLER_READ);
+}
+
+
+/*
+** Starts the connection's next request, connecting first if needed.
+*/
+static void _conn_start(Bench *bench, BenchConn *conn) {
+    conn->kind = _pick_kind(bench);
+    if (conn->fd >= 0) {
+        _conn_send(bench, conn);
+        return;
+    }
+
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->fd == -1) {
+        perror("as_bench: socket");
+        bench->result->connect_errors++;
+        return;
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    conn->watched = 0;
+    if (connect(conn->fd, (struct sockaddr *)&bench->addr, sizeof(bench->addr)) == -1 &&
+        errno != EINPROGRESS) {
+        bench->result->connect_errors++;
+        _conn_close(bench, conn);
+        return;
+    }
+    bench->result->connects++;
+    conn->state = CONN_CONNECTING;
+    _watch(bench, conn, POLLER_WRITE);
+}
+
+
+static void _conn_connected(Bench *bench, BenchConn *conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+        bench->result->connects--;
+        bench->result->connect_errors++;
+        _conn_close(bench, conn);
+        return;
+    }
+    _conn_send(bench, conn);
+}
+
+
+static void _conn_complete(Bench *bench, BenchConn *conn) {
+    KindResult *kind = &bench->result->kinds[conn->kind];
+    kind->completed++;
+    _add_sample(&kind->latency_ms, _now_ms() - conn->sent_ms);
+    if (conn->kind == BENCH_PARTIAL) {
+        // The rest of the file is still coming, only a new connection is clean
+        _conn_close(bench, conn);
+        return;
+    }
+    _conn_start(bench, conn);
+}
+
+
+/*
+** Helper for: _conn_read
+** Handles num bytes of a LIST response.
+**
+** returns 1 if they end the response, 0 if not
+*/
+static uint8_t _list_received(BenchConn *conn, const uint8_t *data, int num) {
+    for (int i = 0; i < num; i++) {
+        if (conn->line_len < 2) {
+            conn->line_start[conn->line_len] = data[i];
+        }
+        conn->line_len++;
+        if (conn->prev_cr && data[i] == '\n') {
+            if (conn->line_len > 2 && conn->line_start[0] == '0' && conn->line_start[1] == ':') {
+                return 1;
+            }
+            conn->line_len = 0;
+        }
+        conn->prev_cr = data[i] == '\r';
+    }
+    return 0;
+}
+
+
+/*
+** returns how many bytes of its response a slow reader may have read by now
+*/
+static uint64_t _slow_allowance(const BenchConn *conn) {
+    return (uint64_t)((_now_ms() - conn->sent_ms) * BENCH_SLOW_BYTE_RATE / 1000)
+           + BENCH_READ_SIZE;
+}
+
+
+static void _conn_read(Bench *bench, BenchConn *conn) {
+    KindResult *kind = &bench->result->kinds[conn->kind];
+    size_t count = BENCH_READ_SIZE;
+    if (conn->state == CONN_HEADER) {
+        count = sizeof(conn->header) - conn->header_bytes;
+    } else if (conn->kind != BENCH_LIST) {
+        count = MIN(count, conn->expected - conn->received);
+    }
+    if (conn->kind == BENCH_SLOW && conn->state == CONN_BODY) {
+        uint64_t allowance = _slow_allowance(conn);
+        if (conn->received >= allowance) {
+            conn->paused = 1;
+            _watch(bench, conn, 0);
+            return;
+        }
+        count = MIN(count, allowance - conn->received);
+    }
+
+    int num = read(conn->fd, bench->buf, count);
+    if (num == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (num <= 0) {
+        kind->failed++;
+        _conn_close(bench, conn);
+        return;
+    }
+    if (!conn->got_first_byte) {
+        conn->got_first_byte = 1;
+        _add_sample(&kind->ttfb_ms, _now_ms() - conn->sent_ms);
+    }
+
+    if (conn->state == CONN_HEADER) {
+        memcpy(conn->header + conn->header_bytes, bench->buf, num);
+        conn->header_bytes += num;
+        if (conn->header_bytes < (int)sizeof(conn->header)) {
+            return;
+        }
+        uint32_t file_size;
+        memcpy(&file_size, conn->header, sizeof(uint32_t));
+        file_size = ntohl(file_size);
+        conn->expected = conn->kind == BENCH_PARTIAL ? MIN(file_size, BENCH_PARTIAL_BYTES)
+                                                     : file_size;
+        conn->state = CONN_BODY;
+        if (conn->expected == 0) {
+            _conn_complete(bench, conn);
+        }
+        return;
+    }
+
+    conn->received += num;
+    kind->bytes += num;
+    if (conn->kind == BENCH_LIST ? _list_received(conn, bench->buf, num)
+                                 : conn->received == conn->expected) {
+        _conn_complete(bench, conn);
+    }
+}
+
+
+/*
+** Helper for: run_bench
+** Raises the limit on open descriptors to fit the connections, if allowed.
+*/
+static void _raise_fd_limit(int connections) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        return;
+    }
+    rlim_t wanted = connections + 64;
+    if (limit.rlim_cur >= wanted) {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? wanted : MIN(wanted, limit.rlim_max);
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur < wanted) {
+        fprintf(stderr, "Only %llu descriptors allowed, some connections will fail\n",
+                (unsigned long long)limit.rlim_cur);
+    }
+}
+
+
+int run_bench(const BenchConfig *config, const BenchTarget *target, BenchResult *result) {
+    memset(result, 0, sizeof(BenchResult));
+    result->target = target;
+
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    bench.config = config;
+    bench.result = result;
+    for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+        bench.total_weight += config->weights[kind];
+    }
+
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_port = htons(target->port);
+    struct hostent *hp = gethostbyname(target->host);
+    if (hp == NULL) {
+        ERR_PRINT("Unknown host: %s\n", target->host);
+        return -1;
+    }
+    bench.addr.sin_addr = *((struct in_addr *) hp->h_addr);
+
+    int num_files = _count_files(&bench.addr);
+    if (num_files <= 0) {
+        return -1;
+    }
+    bench.num_files = num_files;
+    if (config->file_index >= num_files) {
+        ERR_PRINT("The library only has %d files\n", num_files);
+        return -1;
+    }
+
+    _raise_fd_limit(config->connections);
+    if (poller_init(&bench.poller) == -1) {
+        return -1;
+    }
+    bench.conns = calloc(config->connections, sizeof(BenchConn));
+    if (bench.conns == NULL) {
+        perror("run_bench");
+        poller_destroy(&bench.poller);
+        return -1;
+    }
+
+    printf("Running %s (%s:%d) with %d connections for %d s\n", target->label,
+           target->host, target->port, config->connections, config->duration_sec);
+    double start = _now_ms();
+    double end = start + config->duration_sec * 1000.0;
+    for (int i = 0; i < config->connections; i++) {
+        bench.conns[i].fd = -1;
+        _conn_start(&bench, &bench.conns[i]);
+    }
+
+    double now;
+    uint8_t any_paused = 0;
+    while ((now = _now_ms()) < end) {
+        int timeout = (int)(end - now) + 1;
+        if (any_paused) {
+            timeout = MIN(timeout, BENCH_SLOW_TICK_MS);
+        }
+        PollerEvent events[BENCH_MAX_EVENTS];
+        int num_events = poller_wait(&bench.poller, events, BENCH_MAX_EVENTS, timeout);
+        if (num_events == -1) {
+            break;
+        }
+        for (int i = 0; i < num_events; i++) {
+            BenchConn *conn = events[i].data;
+            if (conn->state == CONN_CONNECTING && (events[i].events & POLLER_WRITE)) {
+                _conn_connected(&bench, conn);
+            } else if (conn->state != CONN_CLOSED && (events[i].events & POLLER_READ)) {
+                _conn_read(&bench, conn);
+            }
+        }
+
+        // Replace closed connections, and wake slow readers that are due more
+        any_paused = 0;
+        for (int i = 0; i < config->connections; i++) {
+            BenchConn *conn = &bench.conns[i];
+            if (conn->state == CONN_CLOSED) {
+                _conn_start(&bench, conn);
+            } else if (conn->paused && _slow_allowance(conn) > conn->received) {
+                conn->paused = 0;
+                _watch(&bench, conn, POLLER_READ);
+            }
+            any_paused |= conn->paused;
+        }
+    }
+    result->seconds = (_now_ms() - start) / 1000;
+
+    for (int i = 0; i < config->connections; i++) {
+        _conn_close(&bench, &bench.conns[i]);
+    }
+    free(bench.conns);
+    poller_destroy(&bench.poller);
+
+    for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+        Samples *ttfb = &result->kinds[kind].ttfb_ms;
+        Samples *latency = &result->kinds[kind].latency_ms;
+        qsort(ttfb->values, ttfb->num, sizeof(double), _compare_doubles);
+        qsort(latency->values, latency->num, sizeof(double), _compare_doubles);
+    }
+    return 0;
+}
+
+
+static double _requests_per_sec(const BenchResult *result) {
+    uint64_t completed = 0;
+    for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+        completed += result->kinds[kind].completed;
+    }
+    return result->seconds > 0 ? completed / result->seconds : 0;
+}
+
+
+static double _mb_per_sec(const BenchResult *result) {
+    uint64_t bytes = 0;
+    for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+        bytes += result->kinds[kind].bytes;
+    }
+    return result->seconds > 0 ? bytes / result->seconds / 1e6 : 0;
+}
+
+
+/*
+** Helper for: bench_print_results
+** Prints one row of the table, a value per target.
+*/
+static void _print_row(const char *name, const double *values, int num_results, int decimals) {
+    printf("%-22s", name);
+    for (int i = 0; i < num_results; i++) {
+        if (isnan(values[i])) {
+            printf(" %14s", "-");
+        } else {
+            printf(" %14.*f", decimals, values[i]);
+        }
+    }
+    printf("\n");
+}
+
+
+void bench_print_results(const BenchConfig *config, BenchResult *results, int num_results) {
+    double values[BENCH_MAX_TARGETS] = {0};
+    printf("\n%-22s", "");
+    for (int i = 0; i < num_results; i++) {
+        printf(" %14.14s", results[i].target->label);
+    }
+    printf("\n");
+
+    for (int i = 0; i < num_results; i++) {
+        values[i] = _requests_per_sec(&results[i]);
+    }
+    _print_row("requests/s", values, num_results, 1);
+    for (int i = 0; i < num_results; i++) {
+        values[i] = _mb_per_sec(&results[i]);
+    }
+    _print_row("MB/s", values, num_results, 2);
+    for (int i = 0; i < num_results; i++) {
+        values[i] = results[i].connects;
+    }
+    _print_row("connections", values, num_results, 0);
+    for (int i = 0; i < num_results; i++) {
+        values[i] = results[i].connect_errors;
+    }
+    _print_row("connect errors", values, num_results, 0);
+
+    for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+        if (config->weights[kind] == 0) {
+            continue;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%s done", kind_names[kind]);
+        for (int i = 0; i < num_results; i++) {
+            values[i] = results[i].kinds[kind].completed;
+        }
+        _print_row(name, values, num_results, 0);
+        snprintf(name, sizeof(name), "%s failed", kind_names[kind]);
+        for (int i = 0; i < num_results; i++) {
+            values[i] = results[i].kinds[kind].failed;
+        }
+        _print_row(name, values, num_results, 0);
+
+        const double quantiles[] = {0.5, 0.99, 0.999};
+        const char *quantile_names[] = {"p50", "p99", "p999"};
+        for (int q = 0; q < 3; q++) {
+            snprintf(name, sizeof(name), "%s ttfb %s ms", kind_names[kind], quantile_names[q]);
+            for (int i = 0; i < num_results; i++) {
+                values[i] = _percentile(&results[i].kinds[kind].ttfb_ms, quantiles[q]);
+            }
+            _print_row(name, values, num_results, 2);
+        }
+        for (int q = 0; q < 3; q++) {
+            snprintf(name, sizeof(name), "%s %s ms", kind_names[kind], quantile_names[q]);
+            for (int i = 0; i < num_results; i++) {
+                values[i] = _percentile(&results[i].kinds[kind].latency_ms, quantiles[q]);
+            }
+            _print_row(name, values, num_results, 2);
+        }
+    }
+}
+
+
+static void _write_json_number(FILE *out, double value) {
+    if (isnan(value)) {
+        fprintf(out, "null");
+    } else {
+        fprintf(out, "%.3f", value);
+    }
+}
+
+
+static void _write_json_quantiles(FILE *out, const Samples *samples) {
+    fprintf(out, "{\"count\": %zu, \"p50\": ", samples->num);
+    _write_json_number(out, _percentile(samples, 0.5));
+    fprintf(out, ", \"p99\": ");
+    _write_json_number(out, _percentile(samples, 0.99));
+    fprintf(out, ", \"p999\": ");
+    _write_json_number(out, _percentile(samples, 0.999));
+    fprintf(out, "}");
+}
+
+
+void bench_write_json(FILE *out, const BenchConfig *config, BenchResult *results,
+                      int num_results) {
+    fprintf(out, "{\"config\": {\"connections\": %d, \"duration_sec\": %d, \"file_index\": %d, "
+            "\"mix\": {", config->connections, config->duration_sec, config->file_index);
+    for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+        fprintf(out, "%s\"%s\": %u", kind ? ", " : "", kind_names[kind], config->weights[kind]);
+    }
+    fprintf(out, "}},\n \"results\": [");
+
+    for (int i = 0; i < num_results; i++) {
+        const BenchResult *result = &results[i];
+        fprintf(out, "%s\n  {\"label\": \"%s\", \"host\": \"%s\", \"port\": %d, "
+                "\"seconds\": %.3f, \"requests_per_sec\": %.3f, \"mb_per_sec\": %.3f, "
+                "\"connections\": %llu, \"connect_errors\": %llu, \"kinds\": {",
+                i ? "," : "", result->target->label, result->target->host,
+                result->target->port, result->seconds, _requests_per_sec(result),
+                _mb_per_sec(result), (unsigned long long)result->connects,
+                (unsigned long long)result->connect_errors);
+        for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+            const KindResult *kind_result = &result->kinds[kind];
+            fprintf(out, "%s\n    \"%s\": {\"completed\": %llu, \"failed\": %llu, "
+                    "\"bytes\": %llu, \"ttfb_ms\": ", kind ? "," : "", kind_names[kind],
+                    (unsigned long long)kind_result->completed,
+                    (unsigned long long)kind_result->failed,
+                    (unsigned long long)kind_result->bytes);
+            _write_json_quantiles(out, &kind_result->ttfb_ms);
+            fprintf(out, ", \"latency_ms\": ");
+            _write_json_quantiles(out, &kind_result->latency_ms);
+            fprintf(out, "}");
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n ]}\n");
+}
+
+
+void bench_free_result(BenchResult *result) {
+    for (int kind = 0; kind < BENCH_NUM_KINDS; kind++) {
+        free(result->kinds[kind].ttfb_ms.values);
+        free(result->kinds[kind].latency_ms.values);
+    }
+}
+
+
+/*
+** Helper for: main
+** Parses a target of the form [label=][host:]port.
+**
+** returns 0 on success, -1 if it is invalid
+*/
+static int _parse_target(char *arg, BenchTarget *target) {
+    target->label = arg;
+    char *equals = strchr(arg, '=');
+    if (equals != NULL) {
+        *equals = '\0';
+        arg = equals + 1;
+    }
+
+    char *colon = strrchr(arg, ':');
+    const char *port = arg;
+    snprintf(target->host, sizeof(target->host), "localhost");
+    if (colon != NULL) {
+        snprintf(target->host, sizeof(target->host), "%.*s", (int)(colon - arg), arg);
+        port = colon + 1;
+    }
+    char *end;
+    target->port = strtol(port, &end, 10);
+    if (*end != '\0' || target->port <= 0 || target->port > 65535) {
+        ERR_PRINT("Invalid target %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void print_usage() {
+    printf("Usage: as_bench [-h] [-c connections] [-d seconds] [-m mix] [-i file_index]\n"
+           "                [-j json_file] [[label=][host:]port ...]\n");
+    printf("  -h  Print this message\n");
+    printf("  -c  Connections to keep busy (default: " XSTR(BENCH_DEFAULT_CONNECTIONS) ")\n");
+    printf("  -d  Seconds to run each target for (default: " XSTR(BENCH_DEFAULT_DURATION_SEC) ")\n");
+    printf("  -m  Weights of the kinds of requests, list, stream, partial and slow\n");
+    printf("      (default: " BENCH_DEFAULT_MIX ")\n");
+    printf("  -i  Stream this file every time, instead of random ones\n");
+    printf("  -j  Also write the results as JSON to this file, - for stdout\n");
+    printf("Each target is a server to benchmark (default: localhost:" XSTR(DEFAULT_PORT) "),\n");
+    printf("and several are run one after the other and reported side by side.\n");
+}
+
+
+int main(int argc, char * const *argv) {
+    int opt;
+    const char *json_path = NULL;
+    BenchConfig config = {BENCH_DEFAULT_CONNECTIONS, BENCH_DEFAULT_DURATION_SEC, {0}, -1};
+    if (bench_parse_mix(BENCH_DEFAULT_MIX, config.weights) == -1) {
+        return 1;
+    }
+
+    while ((opt = getopt(argc, argv, "hc:d:m:i:j:")) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage();
+                return 0;
+            case 'c':
+                config.connections = strtol(optarg, NULL, 10);
+                if (config.connections <= 0) {
+                    ERR_PRINT("Invalid number of connections %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                config.duration_sec = strtol(optarg, NULL, 10);
+                if (config.duration_sec <= 0) {
+                    ERR_PRINT("Invalid duration %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if (bench_parse_mix(optarg, config.weights) == -1) {
+                    return 1;
+                }
+                break;
+            case 'i':
+                config.file_index = strtol(optarg, NULL, 10);
+                if (config.file_index < 0) {
+                    ERR_PRINT("Invalid file index %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    BenchTarget targets[BENCH_MAX_TARGETS];
+    int num_targets = argc - optind;
+    if (num_targets > BENCH_MAX_TARGETS) {
+        ERR_PRINT("At most %d targets can be compared\n", BENCH_MAX_TARGETS);
+        return 1;
+    }
+    for (int i = 0; i < num_targets; i++) {
+        if (_parse_target(argv[optind + i], &targets[i]) == -1) {
+            return 1;
+        }
+    }
+    if (num_targets == 0) {
+        targets[0].label = "server";
+        snprintf(targets[0].host, sizeof(targets[0].host), "localhost");
+        targets[0].port = DEFAULT_PORT;
+        num_targets = 1;
+    }
+    // A server that resets a connection must not take the benchmark with it
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(NULL));
+
+    BenchResult results[BENCH_MAX_TARGETS];
+    int num_results = 0;
+    for (int i = 0; i < num_targets; i++) {
+        if (run_bench(&config, &targets[i], &results[num_results]) == -1) {
+            ERR_PRINT("Could not benchmark %s\n", targets[i].label);
+            continue;
+        }
+        num_results++;
+    }
+    if (num_results == 0) {
+        return 1;
+    }
+
+    bench_print_results(&config, results, num_results);
+    if (json_path != NULL) {
+        FILE *json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (json == NULL) {
+            perror("as_bench: fopen");
+        } else {
+            bench_write_json(json, &config, results, num_results);
+            if (json != stdout) {
+                fclose(json);
+            }
+        }
+    }
+    for (int i = 0; i < num_results; i++) {
+        bench_free_result(&results[i]);
+    }
+    return 0;
+}
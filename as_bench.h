@@ -0,0 +1,134 @@
+#ifndef AS_BENCH_H_
+#define AS_BENCH_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+/*
+** Server benchmark
+** ----------------
+** as_bench keeps a number of connections to an as_server busy for a while,
+** each making one request after another from a weighted mix of:
+**   - list: a LIST, read to the end (the library must not be empty).
+**   - stream: a STREAM of a file, read as fast as possible.
+**   - partial: a STREAM that is abandoned after BENCH_PARTIAL_BYTES, like a
+**     listener skipping a track; the connection is closed and made again.
+**   - slow: a STREAM read at the rate of a player, BENCH_SLOW_BYTE_RATE.
+** Every connection is non-blocking and driven by a single Poller, so there
+** can be thousands of them.
+**
+** For each kind of request it records the time to the first byte of the
+** response and the time to the last, from when the request was written. A
+** slow request may well not finish in the time the benchmark runs, but still
+** counts its first byte and the bytes it read.
+**
+** Several servers (say, one per set of options) can be given as targets;
+** they are run one after the other with the same workload, and reported side
+** by side, as a table and optionally as JSON.
+*/
+#define BENCH_DEFAULT_CONNECTIONS 64
+#define BENCH_DEFAULT_DURATION_SEC 10
+#define BENCH_DEFAULT_MIX "list=1,stream=4,partial=2,slow=1"
+#define BENCH_PARTIAL_BYTES 65536
+#define BENCH_SLOW_BYTE_RATE 40000
+#define BENCH_READ_SIZE 65536
+#define BENCH_SLOW_TICK_MS 10
+#define BENCH_MAX_EVENTS 256
+#define BENCH_MAX_TARGETS 8
+
+
+typedef enum {BENCH_LIST, BENCH_STREAM, BENCH_PARTIAL, BENCH_SLOW, BENCH_NUM_KINDS} BenchKind;
+
+
+/*
+** connections: connections kept busy at once.
+** duration_sec: how long each target is run for.
+** weights: relative frequency of each kind of request.
+** file_index: the file every STREAM asks for, -1 for a random one each time.
+*/
+typedef struct bench_config {
+    int connections;
+    int duration_sec;
+    uint32_t weights[BENCH_NUM_KINDS];
+    int file_index;
+} BenchConfig;
+
+
+/*
+** A server to benchmark, labelled in the report.
+*/
+typedef struct bench_target {
+    const char *label;
+    char host[MAX_FILE_NAME];
+    int port;
+} BenchTarget;
+
+
+typedef struct samples {
+    double *values;
+    size_t num;
+    size_t capacity;
+} Samples;
+
+
+/*
+** completed, failed: requests that read their whole response, and that lost
+**     their connection before that.
+** bytes: response bytes read, by finished and unfinished requests.
+** ttfb_ms, latency_ms: time to the first and last byte of each response.
+*/
+typedef struct kind_result {
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t bytes;
+    Samples ttfb_ms;
+    Samples latency_ms;
+} KindResult;
+
+
+typedef struct bench_result {
+    const BenchTarget *target;
+    double seconds;
+    uint64_t connects;
+    uint64_t connect_errors;
+    KindResult kinds[BENCH_NUM_KINDS];
+} BenchResult;
+
+
+/*
+** Parses a mix such as "list=1,stream=4" into weights, leaving out the kinds
+** it does not name.
+**
+** returns 0 on success, -1 if the mix is invalid
+*/
+int bench_parse_mix(const char *mix, uint32_t weights[BENCH_NUM_KINDS]);
+
+/*
+** Runs the benchmark described by config against target.
+**
+** returns 0 on success, -1 on error
+*/
+int run_bench(const BenchConfig *config, const BenchTarget *target, BenchResult *result);
+
+/*
+** Prints the results of num_results targets side by side.
+*/
+void bench_print_results(const BenchConfig *config, BenchResult *results, int num_results);
+
+/*
+** Writes the configuration and results of num_results targets as JSON.
+*/
+void bench_write_json(FILE *out, const BenchConfig *config, BenchResult *results,
+                      int num_results);
+
+/*
+** Frees the samples of a result.
+*/
+void bench_free_result(BenchResult *result);
+
+#endif // AS_BENCH_H_
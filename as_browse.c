@@ -0,0 +1,296 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_browse.h"
+
+#define BROWSE_INITIAL_DIRS 64
+
+
+/*
+** Compares the len bytes of a with the b_len bytes of b, as strcmp would.
+*/
+static int _compare(const char *a, uint32_t a_len, const char *b, uint32_t b_len) {
+    int result = memcmp(a, b, MIN(a_len, b_len));
+    if (result != 0) {
+        return result;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+
+static int _digits(uint32_t number) {
+    int digits = 1;
+    while (number >= 10) {
+        number /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+
+/*
+** Helper for: browse_tree_build
+** Appends a directory to the tree, growing it if needed.
+**
+** returns its index in the tree, -1 on error
+*/
+static int64_t _add_dir(BrowseTree *tree, uint32_t *capacity, uint32_t **parents,
+                        const char *path, uint32_t path_len, uint32_t parent) {
+    if (tree->num_dirs == *capacity) {
+        uint32_t new_capacity = 2 * *capacity;
+        BrowseDir *dirs = realloc(tree->dirs, new_capacity * sizeof(BrowseDir));
+        if (dirs == NULL) {
+            perror("browse_tree_build: realloc");
+            return -1;
+        }
+        tree->dirs = dirs;
+        uint32_t *new_parents = realloc(*parents, new_capacity * sizeof(uint32_t));
+        if (new_parents == NULL) {
+            perror("browse_tree_build: realloc");
+            return -1;
+        }
+        *parents = new_parents;
+        *capacity = new_capacity;
+    }
+    BrowseDir *dir = &tree->dirs[tree->num_dirs];
+    memset(dir, 0, sizeof(BrowseDir));
+    dir->path = path;
+    dir->path_len = path_len;
+    (*parents)[tree->num_dirs] = parent;
+    return tree->num_dirs++;
+}
+
+
+int browse_tree_build(BrowseTree *tree, const Library *library) {
+    memset(tree, 0, sizeof(BrowseTree));
+    uint32_t num_files = library->num_files;
+    uint32_t capacity = BROWSE_INITIAL_DIRS;
+    tree->dirs = malloc(capacity * sizeof(BrowseDir));
+    uint32_t *parents = malloc(capacity * sizeof(uint32_t));
+    uint32_t *file_parents = malloc(MAX(num_files, 1) * sizeof(uint32_t));
+    tree->files = malloc(MAX(num_files, 1) * sizeof(uint32_t));
+    if (tree->dirs == NULL || parents == NULL || file_parents == NULL || tree->files == NULL) {
+        perror("browse_tree_build: malloc");
+        goto error;
+    }
+    _add_dir(tree, &capacity, &parents, "", 0, 0);
+
+    // The files are sorted, so those of a directory all come together, and
+    // only the directories that the last file was in can still get more
+    uint32_t current = 0;
+    for (uint32_t i = 0; i < num_files; i++) {
+        const char *path = library->files[i];
+        while (current != 0 &&
+               strncmp(path, tree->dirs[current].path, tree->dirs[current].path_len) != 0) {
+            current = parents[current];
+        }
+        const char *slash;
+        while ((slash = strchr(path + tree->dirs[current].path_len, '/')) != NULL) {
+            int64_t dir = _add_dir(tree, &capacity, &parents, path, slash - path + 1, current);
+            if (dir == -1) {
+                goto error;
+            }
+            current = dir;
+        }
+        file_parents[i] = current;
+        for (uint32_t dir = current; ; dir = parents[dir]) {
+            tree->dirs[dir].num_files++;
+            if (dir == 0) {
+                break;
+            }
+        }
+    }
+
+    // Each directory's children, together and in the order they were found
+    tree->subdirs = malloc(MAX(tree->num_dirs, 1) * sizeof(uint32_t));
+    if (tree->subdirs == NULL) {
+        perror("browse_tree_build: malloc");
+        goto error;
+    }
+    for (uint32_t dir = 1; dir < tree->num_dirs; dir++) {
+        tree->dirs[parents[dir]].num_subdirs++;
+    }
+    for (uint32_t i = 0; i < num_files; i++) {
+        tree->dirs[file_parents[i]].num_own_files++;
+    }
+    uint32_t num_subdirs = 0, num_own_files = 0;
+    for (uint32_t dir = 0; dir < tree->num_dirs; dir++) {
+        tree->dirs[dir].first_subdir = num_subdirs;
+        tree->dirs[dir].first_file = num_own_files;
+        num_subdirs += tree->dirs[dir].num_subdirs;
+        num_own_files += tree->dirs[dir].num_own_files;
+        // Counted again as the children are placed
+        tree->dirs[dir].num_subdirs = 0;
+        tree->dirs[dir].num_own_files = 0;
+    }
+    for (uint32_t dir = 1; dir < tree->num_dirs; dir++) {
+        BrowseDir *parent = &tree->dirs[parents[dir]];
+        tree->subdirs[parent->first_subdir + parent->num_subdirs++] = dir;
+    }
+    for (uint32_t i = 0; i < num_files; i++) {
+        BrowseDir *parent = &tree->dirs[file_parents[i]];
+        tree->files[parent->first_file + parent->num_own_files++] = i;
+    }
+    free(parents);
+    free(file_parents);
+    return 0;
+
+error:
+    free(parents);
+    free(file_parents);
+    browse_tree_free(tree);
+    return -1;
+}
+
+
+/*
+** Helper for: browse_page
+** returns the directory at the dir_len bytes of dir, with or without slashes
+** around it, NULL if there is none
+*/
+static const BrowseDir *_find_dir(const BrowseTree *tree, const char *dir, uint32_t dir_len) {
+    while (dir_len > 0 && dir[0] == '/') {
+        dir++;
+        dir_len--;
+    }
+    while (dir_len > 0 && dir[dir_len - 1] == '/') {
+        dir_len--;
+    }
+    if (tree->num_dirs == 0 || dir_len > BROWSE_MAX_ARG) {
+        return NULL;
+    }
+    if (dir_len == 0) {
+        return &tree->dirs[0];
+    }
+    char key[BROWSE_MAX_ARG + 1];
+    memcpy(key, dir, dir_len);
+    key[dir_len++] = '/';
+
+    uint32_t low = 1, high = tree->num_dirs;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const BrowseDir *candidate = &tree->dirs[middle];
+        int result = _compare(key, dir_len, candidate->path, candidate->path_len);
+        if (result == 0) {
+            return candidate;
+        }
+        if (result < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+** Helper for: browse_page
+** Finds the name of a directory's child, a subdirectory's with its trailing
+** '/'.
+**
+** returns the name, of *len bytes
+*/
+static const char *_child_name(const BrowseTree *tree, const Library *library,
+                               const BrowseDir *dir, uint32_t child, uint32_t *len) {
+    if (child < dir->num_subdirs) {
+        const BrowseDir *subdir = &tree->dirs[tree->subdirs[dir->first_subdir + child]];
+        *len = subdir->path_len - dir->path_len;
+        return subdir->path + dir->path_len;
+    }
+    const char *name = library->files[tree->files[dir->first_file + child - dir->num_subdirs]] +
+                       dir->path_len;
+    *len = strlen(name);
+    return name;
+}
+
+
+/*
+** Helper for: browse_page
+** returns the number in the entry for a directory's child: a
+** subdirectory's number of files, or a file's index
+*/
+static uint32_t _child_number(const BrowseTree *tree, const BrowseDir *dir, uint32_t child) {
+    if (child < dir->num_subdirs) {
+        return tree->dirs[tree->subdirs[dir->first_subdir + child]].num_files;
+    }
+    return tree->files[dir->first_file + child - dir->num_subdirs];
+}
+
+
+/*
+** Helper for: browse_page
+** returns the first child of the directory after the one the token names
+*/
+static uint32_t _after_token(const BrowseTree *tree, const Library *library,
+                             const BrowseDir *dir, const char *token, uint32_t token_len) {
+    // The subdirectories' names end in '/', which sets them apart from files
+    uint8_t is_dir = token_len > 0 && token[token_len - 1] == '/';
+    uint32_t low = is_dir ? 0 : dir->num_subdirs;
+    uint32_t high = is_dir ? dir->num_subdirs : dir->num_subdirs + dir->num_own_files;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint32_t name_len;
+        const char *name = _child_name(tree, library, dir, middle, &name_len);
+        if (_compare(name, name_len, token, token_len) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+uint8_t *browse_page(const BrowseTree *tree, const Library *library, const char *dir_path,
+                     uint32_t dir_len, const char *token, uint32_t token_len, uint32_t offset,
+                     uint32_t count, uint32_t *len) {
+    static const BrowseDir empty = {"", 0, 0, 0, 0, 0, 0};
+    const BrowseDir *dir = _find_dir(tree, dir_path, dir_len);
+    if (dir == NULL) {
+        dir = &empty;
+    }
+    uint32_t num_children = dir->num_subdirs + dir->num_own_files;
+    uint32_t start = token_len > 0 ? _after_token(tree, library, dir, token, token_len) : 0;
+    start += MIN(offset, num_children - start);
+    uint32_t end = start + MIN(count, num_children - start);
+
+    // Sized first, so the response is a single allocation
+    const char *next_token = "";
+    uint32_t next_token_len = 0;
+    if (end > start && end < num_children) {
+        next_token = _child_name(tree, library, dir, end - 1, &next_token_len);
+    }
+    uint32_t body_len = _digits(num_children) + 1 + next_token_len + 2;
+    for (uint32_t child = start; child < end; child++) {
+        uint32_t name_len;
+        _child_name(tree, library, dir, child, &name_len);
+        body_len += _digits(_child_number(tree, dir, child)) + 1 + name_len + 2;
+    }
+
+    uint8_t *response = malloc(sizeof(uint32_t) + body_len + 1);
+    if (response == NULL) {
+        perror("browse_page");
+        return NULL;
+    }
+    uint32_t network_body_len = htonl(body_len);
+    memcpy(response, &network_body_len, sizeof(uint32_t));
+    char *out = (char *)response + sizeof(uint32_t);
+    out += sprintf(out, "%u:%.*s\r\n", num_children, (int)next_token_len, next_token);
+    for (uint32_t child = start; child < end; child++) {
+        uint32_t name_len;
+        const char *name = _child_name(tree, library, dir, child, &name_len);
+        out += sprintf(out, "%u:%.*s\r\n", _child_number(tree, dir, child), (int)name_len, name);
+    }
+    *len = sizeof(uint32_t) + body_len;
+    return response;
+}
+
+
+void browse_tree_free(BrowseTree *tree) {
+    free(tree->dirs);
+    free(tree->subdirs);
+    free(tree->files);
+    memset(tree, 0, sizeof(BrowseTree));
+}
@@ -0,0 +1,99 @@
+#ifndef AS_BROWSE_H_
+#define AS_BROWSE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Library browsing
+** ----------------
+** A client showing a single directory would otherwise LIST the whole
+** library for it. Instead, the server builds a tree of the library's
+** directories with each scan, and a BROWSE request gets a page of one
+** directory's children: its subdirectories first, each with the number of
+** files under it, then its own files, each by name.
+**
+** A BROWSE request is followed by BROWSE_HEADER_SIZE bytes, all in network
+** byte order: the offset of the page as a 32-bit integer, the most children
+** wanted as a 16-bit integer (0 for BROWSE_DEFAULT_COUNT), then the lengths
+** of the directory and of the continuation token as 16-bit integers. The
+** directory's path comes next ("" or "/" for the top of the library), then
+** the token. The page starts offset children after the one the token names,
+** or after the start without a token.
+**
+** Like a STATS response, the response starts with the size of what follows
+** as a 32-bit integer in network byte order. Then, each line ending in the
+** network newline "\r\n":
+**                   <number of children>:<continuation token>
+**                   <number of files>:<subdirectory name>/
+**                   <file index>:<file name>
+** The continuation token names the last child of the page, empty if the page
+** reached the end. As it is a name rather than a position, the next page
+** starts at the right child even if the library was scanned in between. A
+** directory that is not in the library has no children.
+*/
+#define BROWSE_HEADER_SIZE 10
+#define BROWSE_DEFAULT_COUNT 100
+#define BROWSE_MAX_COUNT 1000
+// The longest directory or token a request can have
+#define BROWSE_MAX_ARG 1024
+
+
+/*
+** A directory of the library, and where its children are in its tree.
+** path: its path with a trailing '/', the start of a file's path in the
+**     library, "" for the top of the library.
+** num_files: the files in it and in its subdirectories.
+*/
+typedef struct browse_dir {
+    const char *path;
+    uint32_t path_len;
+    uint32_t num_files;
+    uint32_t first_subdir;
+    uint32_t num_subdirs;
+    uint32_t first_file;
+    uint32_t num_own_files;
+} BrowseDir;
+
+/*
+** dirs: num_dirs directories sorted by path, so the top of the library first.
+** subdirs, files: the subdirectories' dirs and the files' indices in the
+**     library, each directory's together and sorted by name.
+*/
+typedef struct browse_tree {
+    BrowseDir *dirs;
+    uint32_t num_dirs;
+    uint32_t *subdirs;
+    uint32_t *files;
+} BrowseTree;
+
+
+/*
+** Builds the tree of library, whose files must be sorted by path. The tree
+** points into the library's paths, so it must be built again once the
+** library is scanned again.
+**
+** returns 0 on success, -1 on error, leaving the tree empty
+*/
+int browse_tree_build(BrowseTree *tree, const Library *library);
+
+/*
+** Builds a response with up to count children of the directory at the
+** dir_len bytes of dir_path, starting offset children after the one the
+** token_len bytes of token name.
+**
+** returns the heap-allocated response, size included, of *len bytes, NULL on
+** error
+*/
+uint8_t *browse_page(const BrowseTree *tree, const Library *library, const char *dir_path,
+                     uint32_t dir_len, const char *token, uint32_t token_len, uint32_t offset,
+                     uint32_t count, uint32_t *len);
+
+/*
+** Frees everything the tree holds, leaving it empty.
+*/
+void browse_tree_free(BrowseTree *tree);
+
+#endif // AS_BROWSE_H_
@@ -0,0 +1,359 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_cache.h"
+
+
+/*
+** Helper for: most cache functions
+** Returns the heap-allocated path of the file holding the track at path in the
+** cache, with the given extension. Tracks are named after the 64-bit FNV-1a
+** hash of their library path, so nested library directories are flattened.
+*/
+static char *_cache_file_path(const TrackCache *cache, const char *path, const char *ext) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    char name[MAX_FILE_NAME];
+    snprintf(name, MAX_FILE_NAME, "%016llx%s", (unsigned long long)hash, ext);
+    return _join_path(cache->directory, name);
+}
+
+
+static int _find_entry(const TrackCache *cache, const char *path) {
+    for (int i = 0; i < cache->num_entries; i++) {
+        if (strcmp(cache->entries[i].path, path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+** Helper for: cache_lookup, cache_commit_insert
+** Removes the i-th entry and its track file from the cache.
+*/
+static void _remove_entry(TrackCache *cache, int i) {
+    char *track_path = _cache_file_path(cache, cache->entries[i].path, CACHE_TRACK_EXT);
+    if (track_path != NULL) {
+        unlink(track_path);
+        free(track_path);
+    }
+
+    cache->used_bytes -= cache->entries[i].size;
+    free(cache->entries[i].path);
+    cache->num_entries--;
+    cache->entries[i] = cache->entries[cache->num_entries];
+}
+
+
+static int _add_entry(TrackCache *cache, const char *path, uint32_t size,
+                      uint32_t mtime, uint64_t last_used) {
+    CacheEntry *entries = realloc(cache->entries,
+                                  (cache->num_entries + 1) * sizeof(CacheEntry));
+    if (entries == NULL) {
+        perror("_add_entry");
+        return -1;
+    }
+    cache->entries = entries;
+
+    CacheEntry *entry = &cache->entries[cache->num_entries];
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        perror("_add_entry");
+        return -1;
+    }
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->last_used = last_used;
+
+    cache->num_entries++;
+    cache->used_bytes += size;
+    if (last_used >= cache->clock) {
+        cache->clock = last_used + 1;
+    }
+    return 0;
+}
+
+
+/*
+** Writes the index to a temporary file first, so a crash never leaves a
+** half-written index behind.
+*/
+static int _save_index(const TrackCache *cache) {
+    char *index_path = _join_path(cache->directory, CACHE_INDEX_FILENAME);
+    char *tmp_path = _join_path(cache->directory, CACHE_INDEX_FILENAME CACHE_TMP_EXT);
+    if (index_path == NULL || tmp_path == NULL) {
+        free(index_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    int result = -1;
+    FILE *index = fopen(tmp_path, "w");
+    if (index == NULL) {
+        perror("_save_index: fopen");
+        goto free_paths;
+    }
+    for (int i = 0; i < cache->num_entries; i++) {
+        const CacheEntry *entry = &cache->entries[i];
+        fprintf(index, "%u %u %llu %s\n", entry->size, entry->mtime,
+                (unsigned long long)entry->last_used, entry->path);
+    }
+    if (fclose(index) != 0) {
+        perror("_save_index: fclose");
+        goto free_paths;
+    }
+    if (rename(tmp_path, index_path) == -1) {
+        perror("_save_index: rename");
+        goto free_paths;
+    }
+    result = 0;
+
+free_paths:
+    free(index_path);
+    free(tmp_path);
+    return result;
+}
+
+
+static int _load_index(TrackCache *cache) {
+    char *index_path = _join_path(cache->directory, CACHE_INDEX_FILENAME);
+    if (index_path == NULL) {
+        return -1;
+    }
+    FILE *index = fopen(index_path, "r");
+    free(index_path);
+    if (index == NULL) {
+        // A new cache
+        return 0;
+    }
+
+    char line[MAX_PATH + 64];
+    while (fgets(line, sizeof(line), index) != NULL) {
+        unsigned int size, mtime;
+        unsigned long long last_used;
+        int path_start;
+        if (sscanf(line, "%u %u %llu %n", &size, &mtime, &last_used, &path_start) != 3) {
+            continue;
+        }
+        char *path = line + path_start;
+        path[strcspn(path, "\n")] = '\0';
+
+        // Tracks deleted behind our back are dropped from the index
+        char *track_path = _cache_file_path(cache, path, CACHE_TRACK_EXT);
+        struct stat track_stat;
+        int exists = track_path != NULL && stat(track_path, &track_stat) == 0
+                     && track_stat.st_size == size;
+        free(track_path);
+        if (!exists) {
+            continue;
+        }
+
+        if (_add_entry(cache, path, size, mtime, last_used) == -1) {
+            fclose(index);
+            return -1;
+        }
+    }
+    fclose(index);
+    return 0;
+}
+
+
+int cache_open(TrackCache *cache, const char *directory, uint64_t max_bytes) {
+    memset(cache, 0, sizeof(TrackCache));
+    cache->directory = directory;
+    cache->max_bytes = max_bytes;
+    if (max_bytes == 0) {
+        return 0;
+    }
+
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST) {
+        perror("cache_open: mkdir");
+        return -1;
+    }
+    return _load_index(cache);
+}
+
+
+static void _free_entries(TrackCache *cache) {
+    for (int i = 0; i < cache->num_entries; i++) {
+        free(cache->entries[i].path);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->num_entries = 0;
+    cache->used_bytes = 0;
+}
+
+
+void cache_close(TrackCache *cache) {
+    if (cache->max_bytes > 0) {
+        _save_index(cache);
+    }
+    _free_entries(cache);
+}
+
+
+int cache_save(const TrackCache *cache) {
+    return cache->max_bytes > 0 ? _save_index(cache) : 0;
+}
+
+
+int cache_reload(TrackCache *cache) {
+    _free_entries(cache);
+    return cache->max_bytes > 0 ? _load_index(cache) : 0;
+}
+
+
+int cache_lookup(TrackCache *cache, const char *path, uint32_t size, uint32_t mtime) {
+    int i = cache->max_bytes > 0 ? _find_entry(cache, path) : -1;
+    if (i == -1) {
+        cache->misses++;
+        return -1;
+    }
+
+    CacheEntry *entry = &cache->entries[i];
+    if (entry->size != size || entry->mtime != mtime) {
+        goto invalidate;
+    }
+
+    char *track_path = _cache_file_path(cache, path, CACHE_TRACK_EXT);
+    if (track_path == NULL) {
+        goto invalidate;
+    }
+    int fd = open(track_path, O_RDONLY);
+    free(track_path);
+    struct stat track_stat;
+    if (fd == -1 || fstat(fd, &track_stat) == -1 || track_stat.st_size != size) {
+        if (fd != -1) {
+            close(fd);
+        }
+        goto invalidate;
+    }
+
+    entry->last_used = cache->clock++;
+    cache->hits++;
+    return fd;
+
+invalidate:
+    _remove_entry(cache, i);
+    cache->invalidations++;
+    cache->misses++;
+    return -1;
+}
+
+
+int cache_begin_insert(TrackCache *cache, const char *path, uint32_t size) {
+    if (cache->max_bytes == 0 || size > cache->max_bytes) {
+        return -1;
+    }
+
+    char *tmp_path = _cache_file_path(cache, path, CACHE_TMP_EXT);
+    if (tmp_path == NULL) {
+        return -1;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("cache_begin_insert: open");
+    }
+    free(tmp_path);
+    return fd;
+}
+
+
+int cache_commit_insert(TrackCache *cache, const char *path, uint32_t size, uint32_t mtime) {
+    char *tmp_path = _cache_file_path(cache, path, CACHE_TMP_EXT);
+    char *track_path = _cache_file_path(cache, path, CACHE_TRACK_EXT);
+    int result = -1;
+    if (tmp_path == NULL || track_path == NULL) {
+        goto free_paths;
+    }
+
+    struct stat tmp_stat;
+    if (stat(tmp_path, &tmp_stat) == -1 || tmp_stat.st_size != size) {
+        ERR_PRINT("cache_commit_insert: incomplete track %s\n", path);
+        unlink(tmp_path);
+        goto free_paths;
+    }
+
+    // Replace any previous version, then make room for the new one
+    int i = _find_entry(cache, path);
+    if (i != -1) {
+        _remove_entry(cache, i);
+    }
+    while (cache->num_entries > 0 && cache->used_bytes + size > cache->max_bytes) {
+        int lru = 0;
+        for (int j = 1; j < cache->num_entries; j++) {
+            if (cache->entries[j].last_used < cache->entries[lru].last_used) {
+                lru = j;
+            }
+        }
+#ifdef DEBUG
+        printf("Evicting %s from the cache\n", cache->entries[lru].path);
+#endif
+        _remove_entry(cache, lru);
+        cache->evictions++;
+    }
+
+    if (rename(tmp_path, track_path) == -1) {
+        perror("cache_commit_insert: rename");
+        unlink(tmp_path);
+        goto free_paths;
+    }
+    if (_add_entry(cache, path, size, mtime, cache->clock) == -1) {
+        unlink(track_path);
+        goto free_paths;
+    }
+    result = _save_index(cache);
+
+free_paths:
+    free(tmp_path);
+    free(track_path);
+    return result;
+}
+
+
+void cache_abort_insert(TrackCache *cache, const char *path) {
+    char *tmp_path = _cache_file_path(cache, path, CACHE_TMP_EXT);
+    if (tmp_path != NULL) {
+        unlink(tmp_path);
+        free(tmp_path);
+    }
+}
+
+
+int cache_open_insert(const TrackCache *cache, const char *path) {
+    char *tmp_path = _cache_file_path(cache, path, CACHE_TMP_EXT);
+    if (tmp_path == NULL) {
+        return -1;
+    }
+    int fd = open(tmp_path, O_RDONLY);
+    free(tmp_path);
+    return fd;
+}
+
+
+void cache_print_stats(const TrackCache *cache) {
+    if (cache->max_bytes == 0) {
+        printf("Track cache is disabled\n");
+        return;
+    }
+
+    printf("Track cache in %s: %u tracks, %llu / %llu KiB\n", cache->directory,
+           cache->num_entries, (unsigned long long)cache->used_bytes / 1024,
+           (unsigned long long)cache->max_bytes / 1024);
+    for (int i = 0; i < cache->num_entries; i++) {
+        printf("  %s (%u bytes)\n", cache->entries[i].path, cache->entries[i].size);
+    }
+
+    uint32_t lookups = cache->hits + cache->misses;
+    printf("Hits: %u, misses: %u (%.1f%% hit rate), invalidations: %u, evictions: %u\n",
+           cache->hits, cache->misses, lookups ? 100.0 * cache->hits / lookups : 0.0,
+           cache->invalidations, cache->evictions);
+}
@@ -0,0 +1,138 @@
+#ifndef AS_CACHE_H_
+#define AS_CACHE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Client track cache
+** ------------------
+** A size-bounded directory of tracks that have already been streamed, so that
+** replaying them does not touch the network. Every entry is keyed by the
+** track's path in the server library and validated against the size and
+** modification time reported by the server's STAT request; a stale entry is
+** dropped on lookup.
+**
+** Each track is stored in its own file, named after a hash of its path, and
+** the cache keeps a plain text index of its entries in CACHE_INDEX_FILENAME so
+** that it survives restarts. The index holds one entry per line:
+**                   <size> <mtime> <last_used> <path>\n
+** When the cache is full, the least recently used entries are evicted.
+*/
+#define CACHE_DEFAULT_DIRECTORY ".as_cache"
+#define CACHE_DEFAULT_MAX_MB 256
+#define CACHE_INDEX_FILENAME "index"
+#define CACHE_TRACK_EXT ".track"
+#define CACHE_TMP_EXT ".part"
+
+
+typedef struct cache_entry {
+    char *path;
+    uint32_t size;
+    uint32_t mtime;
+    uint64_t last_used;
+} CacheEntry;
+
+
+/*
+** directory: where the tracks and index are stored (not heap-allocated).
+** max_bytes: the cache never holds more track data than this, 0 disables it.
+** used_bytes: sum of the sizes of all entries.
+** clock: logical clock used to order entries by last use.
+** entries: dynamic array of num_entries entries.
+** hits, misses, invalidations, evictions: counters since the cache was opened.
+*/
+typedef struct track_cache {
+    const char *directory;
+    uint64_t max_bytes;
+    uint64_t used_bytes;
+    uint64_t clock;
+    CacheEntry *entries;
+    uint32_t num_entries;
+
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t invalidations;
+    uint32_t evictions;
+} TrackCache;
+
+
+/*
+** Opens the cache in directory, creating the directory if needed, and loads
+** its index. Entries whose track file is missing are dropped. If max_bytes is
+** 0 the cache is disabled, and every lookup misses without touching the disk.
+**
+** returns 0 on success, -1 on error
+*/
+int cache_open(TrackCache *cache, const char *directory, uint64_t max_bytes);
+
+/*
+** Saves the index of the cache and frees its entries.
+*/
+void cache_close(TrackCache *cache);
+
+/*
+** Saves the index of the cache, for other processes using the same directory.
+**
+** returns 0 on success, -1 on error
+*/
+int cache_save(const TrackCache *cache);
+
+/*
+** Loads the index of the cache again, as another process using the same
+** directory saved it, in place of the entries the cache held.
+**
+** returns 0 on success, -1 on error
+*/
+int cache_reload(TrackCache *cache);
+
+/*
+** Looks up the track at path in the cache. The entry is only a hit if the
+** size and mtime match those reported by the server, and its track file still
+** has the expected size. A stale entry is removed.
+**
+** returns a file descriptor open for reading the cached track on a hit,
+** -1 on a miss
+*/
+int cache_lookup(TrackCache *cache, const char *path, uint32_t size, uint32_t mtime);
+
+/*
+** Starts inserting the track at path in the cache. The track data must be
+** written to the returned file descriptor, which the caller closes, before
+** calling cache_commit_insert or cache_abort_insert with the same path.
+**
+** returns a file descriptor open for writing, -1 if the track cannot be cached
+*/
+int cache_begin_insert(TrackCache *cache, const char *path, uint32_t size);
+
+/*
+** Finishes inserting the track at path, evicting least recently used entries
+** as needed to stay within max_bytes. The data written must be exactly size
+** bytes long, otherwise the insertion is aborted.
+**
+** returns 0 on success, -1 on error
+*/
+int cache_commit_insert(TrackCache *cache, const char *path, uint32_t size, uint32_t mtime);
+
+/*
+** Discards a track started with cache_begin_insert.
+*/
+void cache_abort_insert(TrackCache *cache, const char *path);
+
+/*
+** Opens the track at path that is being inserted, possibly by another
+** process, to read it as it is written.
+**
+** returns a file descriptor open for reading, -1 if no track is being
+** inserted at path
+*/
+int cache_open_insert(const TrackCache *cache, const char *path);
+
+/*
+** Prints the contents and hit/miss counters of the cache.
+*/
+void cache_print_stats(const TrackCache *cache);
+
+#endif // AS_CACHE_H_
@@ -5,7 +5,7 @@
 #include "as_client.h"
 
 
-static int connect_to_server(int port, const char *hostname) {
+int connect_to_server(int port, const char *hostname) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("connect_to_server");
@@ -27,6 +27,7 @@ static int connect_to_server(int port, const char *hostname) {
     struct hostent *hp = gethostbyname(hostname);
     if (hp == NULL) {
         ERR_PRINT("Unknown host: %s\n", hostname);
+        close(sockfd);
         return -1;
     }
 
@@ -35,6 +36,7 @@ static int connect_to_server(int port, const char *hostname) {
     // Request connection to server.
     if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         perror("connect");
+        close(sockfd);
         return -1;
     }
 
@@ -42,6 +44,36 @@ static int connect_to_server(int port, const char *hostname) {
 }
 
 
+/*
+** returns whether the response starting with these 4 bytes is RESPONSE_BUSY,
+** after telling the user
+*/
+static uint8_t _is_busy(const void *response) {
+    if (memcmp(response, RESPONSE_BUSY, 4) != 0) {
+        return 0;
+    }
+    ERR_PRINT("The server is busy, try again later\n");
+    return 1;
+}
+
+
+/*
+** returns whether the response starting with these 4 bytes, read from
+** sockfd, is RESPONSE_UNSUPPORTED, reading the rest of its line, -1 on error
+*/
+static int _is_unsupported(int sockfd, const void *response) {
+    if (memcmp(response, RESPONSE_UNSUPPORTED, 4) != 0) {
+        return 0;
+    }
+    char newline[2];
+    if (read_precisely(sockfd, newline, 2) != 2) {
+        ERR_PRINT("Unexpected EOF\n");
+        return -1;
+    }
+    return 1;
+}
+
+
 /*
 ** Helper for: list_request
 ** This function reads from the socket until it finds a network newline.
@@ -50,57 +82,67 @@ static int connect_to_server(int port, const char *hostname) {
 **                   <index>:<filename>\r\n
 **
 ** returns index on success, -1 on error
-** filename is a heap allocated string pointing to the parsed filename
+** filename points to the parsed filename inside the reader's buffer, and is
+** only valid until the next call
 */
-static int get_next_filename(int sockfd, char **filename) {
-    static int bytes_in_buffer = 0;
-    static char buf[RESPONSE_BUFFER_SIZE];
-
-    while((*filename = find_network_newline(buf, &bytes_in_buffer)) == NULL) {
-        int num = read(sockfd, buf + bytes_in_buffer,
-                       RESPONSE_BUFFER_SIZE - bytes_in_buffer);
-        if (num < 0) {
-            perror("list_request");
+static int get_next_filename(int sockfd, LineReader *reader, char **filename) {
+    char *line;
+    while((line = line_reader_next(reader, NULL)) == NULL) {
+        if (sockfd < 0) {
+            ERR_PRINT("list_request: Truncated response\n");
             return -1;
         }
-        bytes_in_buffer += num;
-        if (bytes_in_buffer == RESPONSE_BUFFER_SIZE) {
-            ERR_PRINT("Response buffer filled without finding file\n");
-            ERR_PRINT("Bleeding data, this shouldn't happen, but not giving up\n");
-            memmove(buf, buf + BUFFER_BLEED_OFF, RESPONSE_BUFFER_SIZE - BUFFER_BLEED_OFF);
+        int num = line_reader_fill(reader, sockfd);
+        if (num <= 0) {
+            if (num == 0) {
+                ERR_PRINT("list_request: Unexpected EOF\n");
+            } else {
+                perror("list_request");
+            }
+            return -1;
         }
     }
 
-    char *parse_ptr = strtok(*filename, ":");
-    int index = strtol(parse_ptr, NULL, 10);
-    parse_ptr = strtok(NULL, ":");
-    // moves the filename to the start of the string (overwriting the index)
-    memmove(*filename, parse_ptr, strlen(parse_ptr) + 1);
+    if (strcmp(line, RESPONSE_BUSY) == 0) {
+        _is_busy(line);
+        return -1;
+    }
+    // Filenames may contain colons, only the first one ends the index
+    char *colon = strchr(line, ':');
+    if (colon == NULL) {
+        ERR_PRINT("list_request: Malformed entry %s\n", line);
+        return -1;
+    }
+    *colon = '\0';
+    *filename = colon + 1;
+    return strtol(line, NULL, 10);
+}
+
+// Cleared once a server leaves CLIST unanswered, so LIST is sent from then on
+static uint8_t clist_supported = 1;
 
-    return index;
+uint8_t list_request_prints = 1;
+
+
+/*
+** Helper for: list_request, the protocol v2 shell
+** Prints the library's files, by index.
+*/
+static void _print_library(const Library *library) {
+    for (int i = 0; i < library->num_files; i++) {
+        printf("%d: %s\n", i, library->files[i]);
+    }
 }
 
+
 /*
-** Sends a list request to the server and prints the list of files in the
-** library. Also parses the list of files and stores it in the list parameter.
-**
-** The list of files is stored as a dynamic array of strings. Each string is
-** a path to a file in the file library. The indexes of the array correspond
-** to the file indexes that can be used to request each file from the server.
-**
-** You may free and malloc or realloc the library->files array as preferred.
+** Helper for: list_request, the protocol v2 shell
+** Parses a LIST response from reader, reading more of it from sockfd as
+** needed (-1 if the reader already holds the whole response), into library.
 **
 ** returns the length of the new library on success, -1 on error
 */
-// https://piazza.com/class/lr04m5y3web1yr/post/3004
-int list_request(int sockfd, Library *library) {
-    // Send list request to the server
-    const char *list_request_msg = "LIST\r\n";
-    if (write_precisely(sockfd, list_request_msg, 6 * sizeof(char)) != 6) {
-        perror("list_request: write");
-        return -1;
-    }
-
+static int _read_list_response(int sockfd, LineReader *reader, Library *library) {
     // Initialize the library
     _free_library(library);
     library->num_files = 0;
@@ -110,16 +152,16 @@ int list_request(int sockfd, Library *library) {
     // Receive and process response from the server
     while (1) {
         char *filename;
-        int index = get_next_filename(sockfd, &filename);
+        int index = get_next_filename(sockfd, reader, &filename);
         if (index == -1) {
             perror("list_request: get_next_filename");
             break;
         }
         // Store filename in library object
         if (num_files == 0) {
-            library->files = malloc((index + 1) * sizeof(char *));
+            library->files = calloc(index + 1, sizeof(char *));
             if (library->files == NULL) {
-                perror("list_request: realloc");
+                perror("list_request: calloc");
                 return -1;
             }
         }
@@ -133,431 +175,2875 @@ int list_request(int sockfd, Library *library) {
             break;
         }
     }
+
     library->num_files = num_files;
-    for (int i = 0; i < num_files; i++) {
-        printf("%d: %s\n", i, library->files[i]);
+    if (list_request_prints) {
+        _print_library(library);
     }
     return library->num_files;
 }
 
+
 /*
-** Get the permission of the library directory. If the library
-** directory does not exist, this function shall create it.
-**
-** library_dir: the path of the directory storing the audio files
-** perpt:       an output parameter for storing the permission of the
-**              library directory.
-**
-** returns 0 on success, -1 on error
+** Helper for: list_request, the protocol v2 shell
+** Decodes a CLIST response's body, whose size *size holds, into library.
 **
-** References:
- * https://stackoverflow.com/questions/12510874/how-can-i-check-if-a-directory-exists
- * https://stackoverflow.com/questions/7430248/creating-a-new-directory-in-c
+** returns the length of the new library on success, -1 on error
 */
-static int get_library_dir_permission(const char *library_dir, mode_t * perpt) {
-    struct stat dir_stat;
-    if (stat(library_dir, &dir_stat) == 0) {
-        // Directory exists, store its permission
-        *perpt = dir_stat.st_mode;
-        return 0;
-    } else {
-        // Directory doesn't exist, create it with permission 0700
-        if (mkdir(library_dir, 0700) == 0) {
-            // Directory created successfully, set permission to 0700
-            *perpt = 0700;
-            return 0;
-        } else {
-            // Error creating directory
-            perror("mkdir");
-            return -1;
-        }
+static int _read_clist_response(const uint32_t *size, const uint8_t *body, uint32_t len,
+                                Library *library) {
+    if (ntohl(*size) != len) {
+        ERR_PRINT("list_request: Expected %u bytes of compact list, got %u\n",
+                  ntohl(*size), len);
+        return -1;
+    }
+    if (clist_decode(body, len, library) == -1) {
+        return -1;
+    }
+    if (list_request_prints) {
+        _print_library(library);
     }
+    return library->num_files;
 }
 
+
 /*
-** Creates any directories needed within the library dir so that the file can be
-** written to the correct destination. All directories will inherit the permissions
-** of the library_dir.
-**
-** This function is recursive, and will create all directories needed to reach the
-** file in destination.
-**
-** Destination shall be a path without a leading /
-**
-** library_dir can be an absolute or relative path, and can optionally end with a '/'
+** Helper for: _await_answer, negotiate_v2
+** Replaces the connection at sockfd with a new one to the same server, for
+** requests it was taken not to know: should it answer late after all, the
+** answer can't be taken for the next request's.
 **
+** returns 0 on success, -1 on error
 */
-static void create_missing_directories(const char *destination, const char *library_dir) {
-    // get the permissions of the library dir
-    mode_t permissions;
-    if (get_library_dir_permission(library_dir, &permissions) == -1) {
-        exit(1);
+static int _reconnect(int sockfd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(sockfd, (struct sockaddr *)&addr, &addr_len) == -1) {
+        perror("reconnect: getpeername");
+        return -1;
     }
-
-    char *str_de_tokville = strdup(destination);
-    if (str_de_tokville == NULL) {
-        perror("create_missing_directories");
-        return;
+    int new_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (new_sockfd < 0) {
+        perror("reconnect: socket");
+        return -1;
     }
-
-    char *before_filename = strrchr(str_de_tokville, '/');
-    if (!before_filename){
-        goto free_tokville;
+    // The new connection takes the old one's descriptor, which callers hold
+    if (connect(new_sockfd, (struct sockaddr *)&addr, addr_len) == -1 ||
+        dup2(new_sockfd, sockfd) == -1) {
+        perror("reconnect");
+        close(new_sockfd);
+        return -1;
     }
+    close(new_sockfd);
+    return 0;
+}
 
-    char *path = malloc(strlen(library_dir) + strlen(destination) + 2);
-    if (path == NULL) {
-        goto free_tokville;
-    } *path = '\0';
 
-    char *dir = strtok(str_de_tokville, "/");
-    if (dir == NULL){
-        goto free_path;
+/*
+** Helper for: _clist_request, search_request, browse_request, waveform_request
+** Waits for the answer to a request, and reads the size it starts with into
+** size, in network byte order. A server that does not know the request
+** answers RESPONSE_UNSUPPORTED, or, from before there was one, doesn't answer
+** within CLIST_NEGOTIATE_TIMEOUT_MS. The connection is then replaced (see
+** _reconnect), unless the server answered a request without arguments: only
+** arguments could be left over, for the server to take for a request.
+**
+** returns 1 once the answer comes, -2 if the server does not know the request,
+** -1 on error
+*/
+static int _await_answer(int sockfd, uint8_t has_arguments, uint32_t *size) {
+    struct pollfd server_pollfd = {sockfd, POLLIN, 0};
+    int ready = poll(&server_pollfd, 1, CLIST_NEGOTIATE_TIMEOUT_MS);
+    if (ready == -1) {
+        perror("poll");
+        return -1;
     }
-    strcpy(path, library_dir);
-    if (path[strlen(path) - 1] != '/') {
-        strcat(path, "/");
+    if (ready == 0) {
+        return _reconnect(sockfd) == 0 ? -2 : -1;
     }
-    strcat(path, dir);
 
-    while (dir != NULL && dir != before_filename + 1) {
-#ifdef DEBUG
-        printf("Creating directory %s\n", path);
-#endif
-        if (mkdir(path, permissions) == -1) {
-            if (errno != EEXIST) {
-                perror("create_missing_directories");
-                goto free_path;
-            }
-        }
-        dir = strtok(NULL, "/");
-        if (dir != NULL) {
-            strcat(path, "/");
-            strcat(path, dir);
-        }
+    if (read_precisely(sockfd, size, sizeof(uint32_t)) != sizeof(uint32_t) || _is_busy(size)) {
+        return -1;
     }
-    free_path:
-    free(path);
-    free_tokville:
-    free(str_de_tokville);
+    int unsupported = _is_unsupported(sockfd, size);
+    if (unsupported == 1) {
+        return !has_arguments || _reconnect(sockfd) == 0 ? -2 : -1;
+    }
+    return unsupported == 0 ? 1 : -1;
 }
 
 
 /*
-** Helper for: get_file_request
+** Helper for: list_request
+** Asks for the library compactly, see as_clist.h.
+**
+** returns the length of the new library on success, -2 if the server does not
+** know CLIST, -1 on error
 */
-static int file_index_to_fd(uint32_t file_index, const Library * library){
-    create_missing_directories(library->files[file_index], library->path);
-
-    char *filepath = _join_path(library->path, library->files[file_index]);
-    if (filepath == NULL) {
+static int _clist_request(int sockfd, Library *library) {
+    if (write_precisely(sockfd, REQUEST_CLIST END_OF_MESSAGE_TOKEN, 7) != 7) {
+        perror("list_request: write");
         return -1;
     }
 
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-#ifdef DEBUG
-    printf("Opened file %s\n", filepath);
-#endif
-    free(filepath);
-    if (fd < 0 ) {
-        perror("file_index_to_fd");
+    uint32_t size;
+    int answered = _await_answer(sockfd, 0, &size);
+    if (answered != 1) {
+        return answered;
+    }
+    uint32_t len = ntohl(size);
+    uint8_t *body = malloc(MAX(len, 1));
+    if (body == NULL) {
+        perror("list_request: malloc");
         return -1;
     }
-
-    return fd;
+    int result = -1;
+    if (read_precisely(sockfd, body, len) == len) {
+        result = _read_clist_response(&size, body, len, library);
+    }
+    free(body);
+    return result;
 }
 
+/*
+** Sends a list request to the server and prints the list of files in the
+** library. Also parses the list of files and stores it in the list parameter.
+**
+** The list of files is stored as a dynamic array of strings. Each string is
+** a path to a file in the file library. The indexes of the array correspond
+** to the file indexes that can be used to request each file from the server.
+**
+** You may free and malloc or realloc the library->files array as preferred.
+**
+** returns the length of the new library on success, -1 on error
+*/
+// https://piazza.com/class/lr04m5y3web1yr/post/3004
+int list_request(int sockfd, Library *library) {
+    if (clist_supported) {
+        int result = _clist_request(sockfd, library);
+        if (result != -2) {
+            return result;
+        }
+        printf("Server does not support compact lists, using LIST\n");
+        clist_supported = 0;
+    }
 
-int get_file_request(int sockfd, uint32_t file_index, const Library * library){
-#ifdef DEBUG
-    printf("Getting file %s\n", library->files[file_index]);
-#endif
+    // Send list request to the server
+    const char *list_request_msg = "LIST\r\n";
+    if (write_precisely(sockfd, list_request_msg, 6 * sizeof(char)) != 6) {
+        perror("list_request: write");
+        return -1;
+    }
 
-    int file_dest_fd = file_index_to_fd(file_index, library);
-    if (file_dest_fd == -1) {
+    LineReader reader;
+    if (line_reader_init(&reader, RESPONSE_BUFFER_SIZE, 0) == -1) {
         return -1;
     }
+    int result = _read_list_response(sockfd, &reader, library);
+    line_reader_free(&reader);
+    return result;
+}
 
-    int result = send_and_process_stream_request(sockfd, file_index, -1, file_dest_fd);
-    if (result == -1) {
+int stat_request(int sockfd, uint32_t file_index, uint32_t *size, uint32_t *mtime) {
+    Writer writer;
+    writer_init(&writer, sockfd);
+    uint32_t network_file_index = htonl(file_index);
+    writer_add(&writer, REQUEST_STAT END_OF_MESSAGE_TOKEN, 6);
+    writer_add(&writer, &network_file_index, sizeof(uint32_t));
+    if (writer_flush(&writer) != 10) {
         return -1;
     }
 
+    // A busy server only sends RESPONSE_BUSY and its newline
+    uint32_t response[2];
+    if (read_precisely(sockfd, response, 6) < 0 || _is_busy(response) ||
+        read_precisely(sockfd, (uint8_t *)response + 6, 2) < 0) {
+        return -1;
+    }
+    *size = ntohl(response[0]);
+    *mtime = ntohl(response[1]);
     return 0;
 }
 
+int stats_request(int sockfd) {
+    if (write_precisely(sockfd, REQUEST_STATS END_OF_MESSAGE_TOKEN, 7) != 7) {
+        perror("stats_request: write");
+        return -1;
+    }
 
-int start_audio_player_process(int *audio_out_fd) {
-    // Create pipe for communication with the child process
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
+    uint32_t report_len;
+    if (read_precisely(sockfd, &report_len, sizeof(uint32_t)) != sizeof(uint32_t) ||
+        _is_busy(&report_len)) {
         return -1;
     }
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("fork");
+    report_len = ntohl(report_len);
+    char *report = malloc(report_len);
+    if (report == NULL) {
+        perror("stats_request: malloc");
         return -1;
-    } else if (pid == 0) { // Child process
-        // Close the write end of the pipe
-        close(pipefd[1]);
+    }
+    int result = -1;
+    if (read_precisely(sockfd, report, report_len) == report_len) {
+        printf("%.*s", (int)report_len, report);
+        result = 0;
+    }
+    free(report);
+    return result;
+}
 
-        // Redirect stdin to the read end of the pipe
-        if (dup2(pipefd[0], STDIN_FILENO) == -1) {
-            perror("dup2");
-        }
-        close(pipefd[0]);
+/*
+** Helper for: search_request, _mux_search_request
+** Writes the search request for query into request, which has room for
+** SEARCH_MAX_QUERY bytes of it.
+**
+** returns the length of the request
+*/
+static uint32_t _build_search_request(uint8_t *request, uint8_t mode, uint16_t limit,
+                                      const char *query) {
+    size_t query_len = MIN(strlen(query), SEARCH_MAX_QUERY);
+    uint32_t len = strlen(REQUEST_SEARCH END_OF_MESSAGE_TOKEN);
+    memcpy(request, REQUEST_SEARCH END_OF_MESSAGE_TOKEN, len);
+    request[len++] = mode;
+    request[len++] = limit >> 8;
+    request[len++] = limit & 0xff;
+    request[len++] = query_len;
+    memcpy(request + len, query, query_len);
+    return len + query_len;
+}
 
-        // Execute the audio player process
-        char *args[] = AUDIO_PLAYER_ARGS;
-        execvp(AUDIO_PLAYER, args);
 
-        // execvp() returns only if an error occurs
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else { // Parent process
-        // Close the read end of the pipe
-        close(pipefd[0]);
+/*
+** Helper for: search_request, _mux_search_request
+** Prints the len bytes of a SEARCH response's body, which are in the format
+** of a LIST response.
+**
+** returns the number of matches
+*/
+static int _print_search_response(const char *body, uint32_t len) {
+    int num_matches = 0;
+    const char *end = body + len;
+    while (body < end) {
+        const char *crlf = find_crlf(body, end - body);
+        if (crlf == NULL) {
+            break;
+        }
+        const char *colon = memchr(body, ':', crlf - body);
+        if (colon != NULL) {
+            printf("%.*s: %.*s\n", (int)(colon - body), body, (int)(crlf - colon - 1), colon + 1);
+            num_matches++;
+        }
+        body = crlf + 2;
+    }
+    if (num_matches == 0) {
+        printf("No matches\n");
+    }
+    return num_matches;
+}
 
-        // Pass the file descriptor of the write end of the pipe to the caller
-        *audio_out_fd = pipefd[1];
 
-        // Sleep for a while to allow the audio player process to boot up
-        sleep(AUDIO_PLAYER_BOOT_DELAY);
+int search_request(int sockfd, uint8_t mode, uint16_t limit, const char *query) {
+    uint8_t request[sizeof(REQUEST_SEARCH END_OF_MESSAGE_TOKEN) + SEARCH_HEADER_SIZE +
+                    SEARCH_MAX_QUERY];
+    uint32_t len = _build_search_request(request, mode, limit, query);
+    if (write_precisely(sockfd, request, len) != len) {
+        perror("search_request: write");
+        return -1;
+    }
 
-        return pid; // Return the PID of the child process to the parent
+    uint32_t body_len;
+    int answered = _await_answer(sockfd, 1, &body_len);
+    if (answered != 1) {
+        return answered;
+    }
+    body_len = ntohl(body_len);
+    char *body = malloc(MAX(body_len, 1));
+    if (body == NULL) {
+        perror("search_request: malloc");
+        return -1;
+    }
+    int result = -1;
+    if (read_precisely(sockfd, body, body_len) == body_len) {
+        result = _print_search_response(body, body_len);
     }
+    free(body);
+    return result;
 }
 
+/*
+** Helper for: browse_request, _mux_browse_request
+** Writes the browse request for a page of dir into request, which has room
+** for BROWSE_MAX_ARG bytes of both dir and token.
+**
+** returns the length of the request
+*/
+static uint32_t _build_browse_request(uint8_t *request, const char *dir, uint16_t count,
+                                      const char *token) {
+    uint16_t dir_len = MIN(strlen(dir), BROWSE_MAX_ARG);
+    uint16_t token_len = MIN(strlen(token), BROWSE_MAX_ARG);
+    uint32_t len = strlen(REQUEST_BROWSE END_OF_MESSAGE_TOKEN);
+    memcpy(request, REQUEST_BROWSE END_OF_MESSAGE_TOKEN, len);
+    // Pages go on from the token, so the offset is always 0
+    memset(request + len, 0, sizeof(uint32_t));
+    len += sizeof(uint32_t);
+    uint16_t header[3] = {htons(count), htons(dir_len), htons(token_len)};
+    memcpy(request + len, header, sizeof(header));
+    len += sizeof(header);
+    memcpy(request + len, dir, dir_len);
+    len += dir_len;
+    memcpy(request + len, token, token_len);
+    return len + token_len;
+}
 
-static void _wait_on_audio_player(int audio_player_pid) {
-    int status;
-    if (waitpid(audio_player_pid, &status, 0) == -1) {
-        perror("_wait_on_audio_player");
+
+/*
+** Helper for: browse_request, _mux_browse_request
+** Stores the file at index in library, where the rest of its files may not
+** be known, as NULL.
+*/
+static void _remember_file(Library *library, uint32_t index, const char *dir, const char *name,
+                           int name_len) {
+    if (index >= library->num_files) {
+        char **files = realloc(library->files, (index + 1) * sizeof(char *));
+        if (files == NULL) {
+            perror("_remember_file: realloc");
+            return;
+        }
+        memset(files + library->num_files, 0, (index + 1 - library->num_files) * sizeof(char *));
+        library->files = files;
+        library->num_files = index + 1;
+    }
+    free(library->files[index]);
+    library->files[index] = NULL;
+    // The directory without the slashes around it, if it isn't the top
+    while (*dir == '/') {
+        dir++;
+    }
+    int dir_len = strlen(dir);
+    while (dir_len > 0 && dir[dir_len - 1] == '/') {
+        dir_len--;
+    }
+    size_t path_len = dir_len + (dir_len > 0) + name_len;
+    char *path = malloc(path_len + 1);
+    if (path == NULL) {
+        perror("_remember_file: malloc");
         return;
     }
-    if (WIFEXITED(status)) {
-        fprintf(stderr, "Audio player exited with status %d\n", WEXITSTATUS(status));
+    snprintf(path, path_len + 1, "%.*s%s%.*s", dir_len, dir, dir_len > 0 ? "/" : "",
+             name_len, name);
+    library->files[index] = path;
+}
+
+
+/*
+** Helper for: browse_request, _mux_browse_request
+** Prints the len bytes of a BROWSE response's body, copies its continuation
+** token into token, and stores its files in library.
+**
+** returns the number of children in the directory, -1 if it is malformed
+*/
+static int _read_browse_response(const char *body, uint32_t len, const char *dir, char *token,
+                                 Library *library) {
+    const char *end = body + len;
+    const char *crlf = find_crlf(body, len);
+    const char *colon = crlf == NULL ? NULL : memchr(body, ':', crlf - body);
+    if (colon == NULL || crlf - colon - 1 > BROWSE_MAX_ARG) {
+        ERR_PRINT("Malformed browse response\n");
+        return -1;
+    }
+    int num_children = strtol(body, NULL, 10);
+    memcpy(token, colon + 1, crlf - colon - 1);
+    token[crlf - colon - 1] = '\0';
+
+    for (body = crlf + 2; body < end && (crlf = find_crlf(body, end - body)) != NULL;
+         body = crlf + 2) {
+        colon = memchr(body, ':', crlf - body);
+        if (colon == NULL) {
+            continue;
+        }
+        uint32_t number = strtoul(body, NULL, 10);
+        const char *name = colon + 1;
+        int name_len = crlf - name;
+        if (name_len > 0 && name[name_len - 1] == '/') {
+            printf("%.*s (%u files)\n", name_len, name, number);
+        } else {
+            printf("%u: %.*s\n", number, name_len, name);
+            _remember_file(library, number, dir, name, name_len);
+        }
+    }
+    if (num_children == 0) {
+        printf("Nothing in %s\n", dir[0] == '\0' ? "the library" : dir);
+    } else if (token[0] != '\0') {
+        printf("%d in all, \"%s\" for more\n", num_children, CMD_MORE);
+    }
+    return num_children;
+}
+
+
+int browse_request(int sockfd, const char *dir, uint16_t count, char *token, Library *library) {
+    uint8_t request[sizeof(REQUEST_BROWSE END_OF_MESSAGE_TOKEN) + BROWSE_HEADER_SIZE +
+                    2 * BROWSE_MAX_ARG];
+    uint32_t len = _build_browse_request(request, dir, count, token);
+    if (write_precisely(sockfd, request, len) != len) {
+        perror("browse_request: write");
+        return -1;
+    }
+    uint32_t body_len;
+    int answered = _await_answer(sockfd, 1, &body_len);
+    if (answered != 1) {
+        return answered;
+    }
+    body_len = ntohl(body_len);
+    char *body = malloc(MAX(body_len, 1));
+    if (body == NULL) {
+        perror("browse_request: malloc");
+        return -1;
+    }
+    int result = -1;
+    if (read_precisely(sockfd, body, body_len) == body_len) {
+        result = _read_browse_response(body, body_len, dir, token, library);
+    }
+    free(body);
+    return result;
+}
+
+/*
+** Helper for: waveform_request, _mux_waveform_request
+** Writes the waveform request for num_buckets buckets of the file at
+** file_index into request.
+*/
+static void _build_waveform_request(uint8_t request[WAVEFORM_REQUEST_SIZE], uint32_t file_index,
+                                    uint16_t num_buckets) {
+    uint32_t network_file_index = htonl(file_index);
+    memcpy(request, REQUEST_WAVEFORM END_OF_MESSAGE_TOKEN, 10);
+    memcpy(request + 10, &network_file_index, sizeof(uint32_t));
+    request[14] = num_buckets >> 8;
+    request[15] = num_buckets & 0xff;
+}
+
+
+/*
+** Helper for: waveform_request, _mux_waveform_request
+** Prints the loudness and duration in the len bytes of a WAVEFORM response's
+** body, then draws its envelope in WAVEFORM_PLOT_ROWS lines, from full scale
+** at the top to negative full scale at the bottom.
+**
+** returns 0 on success, -1 if the body is malformed
+*/
+static int _print_waveform_response(const uint8_t *body, uint32_t len) {
+    if (len == 0) {
+        printf("Not a PCM WAV file\n");
+        return 0;
+    }
+    uint32_t values[2];
+    uint16_t num_buckets;
+    if (len < WAVE_RESPONSE_HEADER_SIZE) {
+        return -1;
+    }
+    memcpy(values, body, sizeof(values));
+    memcpy(&num_buckets, body + sizeof(values), sizeof(uint16_t));
+    num_buckets = ntohs(num_buckets);
+    if (num_buckets > WAVE_MAX_BUCKETS || len != WAVE_RESPONSE_HEADER_SIZE + 2 * num_buckets) {
+        return -1;
+    }
+    int32_t loudness = ntohl(values[0]);
+    uint32_t duration_ms = ntohl(values[1]);
+    if (loudness == WAVE_SILENT) {
+        printf("Loudness: silent");
     } else {
-        printf("Audio player exited abnormally\n");
+        printf("Loudness: %.2f LUFS", loudness / 100.0);
+    }
+    printf(", duration: %u:%02u.%03u\n", duration_ms / 60000, duration_ms / 1000 % 60,
+           duration_ms % 1000);
+
+    // A bucket is drawn in every line whose share of the scale it reaches
+    const int8_t *peaks = (const int8_t *)body + WAVE_RESPONSE_HEADER_SIZE;
+    char line[WAVE_MAX_BUCKETS + 1];
+    for (int row = 0; row < WAVEFORM_PLOT_ROWS; row++) {
+        int top = 127 - row * 254 / WAVEFORM_PLOT_ROWS;
+        int bottom = 127 - (row + 1) * 254 / WAVEFORM_PLOT_ROWS;
+        for (uint16_t i = 0; i < num_buckets; i++) {
+            line[i] = peaks[2 * i] <= top && peaks[2 * i + 1] >= bottom ? '#' : ' ';
+        }
+        printf("|%.*s|\n", num_buckets, line);
     }
+    return 0;
 }
 
 
-int stream_request(int sockfd, uint32_t file_index) {
-    int audio_out_fd;
-    int audio_player_pid = start_audio_player_process(&audio_out_fd);
+int waveform_request(int sockfd, uint32_t file_index, uint16_t num_buckets) {
+    uint8_t request[WAVEFORM_REQUEST_SIZE];
+    _build_waveform_request(request, file_index, num_buckets);
+    if (write_precisely(sockfd, request, WAVEFORM_REQUEST_SIZE) != WAVEFORM_REQUEST_SIZE) {
+        perror("waveform_request: write");
+        return -1;
+    }
+    uint32_t body_len;
+    int answered = _await_answer(sockfd, 1, &body_len);
+    if (answered != 1) {
+        return answered;
+    }
+    body_len = ntohl(body_len);
+    uint8_t *body = malloc(MAX(body_len, 1));
+    if (body == NULL) {
+        perror("waveform_request: malloc");
+        return -1;
+    }
+    int result = -1;
+    if (read_precisely(sockfd, body, body_len) == body_len) {
+        result = _print_waveform_response(body, body_len);
+    }
+    free(body);
+    return result;
+}
 
-    int result = send_and_process_stream_request(sockfd, file_index, audio_out_fd, -1);
-    if (result == -1) {
-        ERR_PRINT("stream_request: send_and_process_stream_request failed\n");
+int negotiate_v2(int sockfd) {
+    if (write_precisely(sockfd, REQUEST_V2 END_OF_MESSAGE_TOKEN, 4) != 4) {
         return -1;
     }
 
-    _wait_on_audio_player(audio_player_pid);
+    // A v1 server does not answer at all
+    struct pollfd server_pollfd = {sockfd, POLLIN, 0};
+    int ready = poll(&server_pollfd, 1, V2_NEGOTIATE_TIMEOUT_MS);
+    if (ready == -1) {
+        perror("negotiate_v2: poll");
+        return -1;
+    }
+    if (ready == 0) {
+        // A late acceptance would leave the server framing its answers
+        return _reconnect(sockfd) == 0 ? 0 : -1;
+    }
 
-    return 0;
+    char answer[4];
+    if (read_precisely(sockfd, answer, 4) != 4 || _is_busy(answer)) {
+        return -1;
+    }
+    // A server that knows it only speaks v1 says so
+    int unsupported = _is_unsupported(sockfd, answer);
+    if (unsupported != 0) {
+        return unsupported == 1 ? 0 : -1;
+    }
+    if (memcmp(answer, REQUEST_V2 END_OF_MESSAGE_TOKEN, 4) != 0) {
+        ERR_PRINT("negotiate_v2: Unexpected answer from the server\n");
+        return -1;
+    }
+    return 1;
 }
 
+/*
+** Get the permission of the library directory. If the library
+** directory does not exist, this function shall create it.
+**
+** library_dir: the path of the directory storing the audio files
+** perpt:       an output parameter for storing the permission of the
+**              library directory.
+**
+** returns 0 on success, -1 on error
+**
+** References:
+ * https://stackoverflow.com/questions/12510874/how-can-i-check-if-a-directory-exists
+ * https://stackoverflow.com/questions/7430248/creating-a-new-directory-in-c
+*/
+static int get_library_dir_permission(const char *library_dir, mode_t * perpt) {
+    struct stat dir_stat;
+    if (stat(library_dir, &dir_stat) == 0) {
+        // Directory exists, store its permission
+        *perpt = dir_stat.st_mode;
+        return 0;
+    } else {
+        // Directory doesn't exist, create it with permission 0700
+        if (mkdir(library_dir, 0700) == 0) {
+            // Directory created successfully, set permission to 0700
+            *perpt = 0700;
+            return 0;
+        } else {
+            // Error creating directory
+            perror("mkdir");
+            return -1;
+        }
+    }
+}
 
-int stream_and_get_request(int sockfd, uint32_t file_index, const Library * library) {
-    int audio_out_fd;
-    int audio_player_pid = start_audio_player_process(&audio_out_fd);
+/*
+** Creates any directories needed within the library dir so that the file can be
+** written to the correct destination. All directories will inherit the permissions
+** of the library_dir.
+**
+** This function is recursive, and will create all directories needed to reach the
+** file in destination.
+**
+** Destination shall be a path without a leading /
+**
+** library_dir can be an absolute or relative path, and can optionally end with a '/'
+**
+*/
+static void create_missing_directories(const char *destination, const char *library_dir) {
+    // get the permissions of the library dir
+    mode_t permissions;
+    if (get_library_dir_permission(library_dir, &permissions) == -1) {
+        exit(1);
+    }
+
+    char *str_de_tokville = strdup(destination);
+    if (str_de_tokville == NULL) {
+        perror("create_missing_directories");
+        return;
+    }
+
+    char *before_filename = strrchr(str_de_tokville, '/');
+    if (!before_filename){
+        goto free_tokville;
+    }
+
+    char *path = malloc(strlen(library_dir) + strlen(destination) + 2);
+    if (path == NULL) {
+        goto free_tokville;
+    } *path = '\0';
+
+    char *dir = strtok(str_de_tokville, "/");
+    if (dir == NULL){
+        goto free_path;
+    }
+    strcpy(path, library_dir);
+    if (path[strlen(path) - 1] != '/') {
+        strcat(path, "/");
+    }
+    strcat(path, dir);
+
+    while (dir != NULL && dir != before_filename + 1) {
+#ifdef DEBUG
+        printf("Creating directory %s\n", path);
+#endif
+        if (mkdir(path, permissions) == -1) {
+            if (errno != EEXIST) {
+                perror("create_missing_directories");
+                goto free_path;
+            }
+        }
+        dir = strtok(NULL, "/");
+        if (dir != NULL) {
+            strcat(path, "/");
+            strcat(path, dir);
+        }
+    }
+    free_path:
+    free(path);
+    free_tokville:
+    free(str_de_tokville);
+}
+
+
+/*
+** Helper for: get_file_request
+*/
+static int file_index_to_fd(uint32_t file_index, const Library * library){
+    create_missing_directories(library->files[file_index], library->path);
+
+    char *filepath = _join_path(library->path, library->files[file_index]);
+    if (filepath == NULL) {
+        return -1;
+    }
+
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#ifdef DEBUG
+    printf("Opened file %s\n", filepath);
+#endif
+    free(filepath);
+    if (fd < 0 ) {
+        perror("file_index_to_fd");
+        return -1;
+    }
+
+    return fd;
+}
 
+
+int get_file_request(int sockfd, uint32_t file_index, const Library * library){
 #ifdef DEBUG
     printf("Getting file %s\n", library->files[file_index]);
 #endif
 
     int file_dest_fd = file_index_to_fd(file_index, library);
     if (file_dest_fd == -1) {
-        ERR_PRINT("stream_and_get_request: file_index_to_fd failed\n");
         return -1;
     }
 
-    int result = send_and_process_stream_request(sockfd, file_index,
-                                                 audio_out_fd, file_dest_fd);
-    if (result == -1) {
-        ERR_PRINT("stream_and_get_request: send_and_process_stream_request failed\n");
+    int result = send_and_process_stream_request(sockfd, file_index, -1, file_dest_fd);
+    if (result == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int start_audio_player_process(int *audio_out_fd) {
+    // Create pipe for communication with the child process
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) { // Child process
+        // Close the write end of the pipe
+        close(pipefd[1]);
+
+        // Redirect stdin to the read end of the pipe
+        if (dup2(pipefd[0], STDIN_FILENO) == -1) {
+            perror("dup2");
+        }
+        close(pipefd[0]);
+
+        // Execute the audio player process
+        char *args[] = AUDIO_PLAYER_ARGS;
+        execvp(AUDIO_PLAYER, args);
+
+        // execvp() returns only if an error occurs
+        perror("execvp");
+        exit(EXIT_FAILURE);
+    } else { // Parent process
+        // Close the read end of the pipe
+        close(pipefd[0]);
+
+        // Pass the file descriptor of the write end of the pipe to the caller
+        *audio_out_fd = pipefd[1];
+
+        // Sleep for a while to allow the audio player process to boot up
+        sleep(AUDIO_PLAYER_BOOT_DELAY);
+
+        return pid; // Return the PID of the child process to the parent
+    }
+}
+
+
+static void _wait_on_audio_player(int audio_player_pid) {
+    int status;
+    if (waitpid(audio_player_pid, &status, 0) == -1) {
+        perror("_wait_on_audio_player");
+        return;
+    }
+    if (WIFEXITED(status)) {
+        fprintf(stderr, "Audio player exited with status %d\n", WEXITSTATUS(status));
+    } else {
+        printf("Audio player exited abnormally\n");
+    }
+}
+
+
+/*
+** State of the warm audio player, see AUDIO_PLAYER_WARM
+*/
+static struct {
+    pid_t pid;
+    int ipc_fd;
+    unsigned int num_tracks;
+    char ipc_path[MAX_PATH];
+    // partial line of output received from mpv
+    char line[RESPONSE_BUFFER_SIZE];
+    int line_len;
+    // mpv's playlist entry for the last track loaded, -1 until known, and how
+    // that track ended; awaiting_start: the loadfile reply named no entry, so
+    // the next file mpv starts is the track
+    long track_id;
+    uint8_t awaiting_start;
+    uint8_t track_ended;
+    uint8_t track_failed;
+} warm_player = {-1, -1, 0, "", "", 0, -1, 0, 0, 0};
+
+
+static long _elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+           + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+
+/*
+** Helper for: warm_audio_player_open_track
+** Starts the warm player if it is not running yet. Readiness is signalled by
+** mpv accepting connections on its IPC socket, which replaces the fixed
+** AUDIO_PLAYER_BOOT_DELAY sleep.
+**
+** returns 0 on success, -1 on error
+*/
+static int _start_warm_audio_player(void) {
+    if (warm_player.pid > 0) {
+        return 0;
+    }
+
+    snprintf(warm_player.ipc_path, MAX_PATH, AUDIO_PLAYER_IPC_FMT, getpid());
+    unlink(warm_player.ipc_path);
+
+    char ipc_arg[MAX_PATH + 32];
+    snprintf(ipc_arg, sizeof(ipc_arg), "--input-ipc-server=%s", warm_player.ipc_path);
+    char *args[] = AUDIO_PLAYER_WARM_ARGS;
+    // The IPC socket is only known at runtime, it fills the placeholder before NULL
+    args[sizeof(args) / sizeof(char *) - 2] = ipc_arg;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("_start_warm_audio_player: fork");
+        return -1;
+    } else if (pid == 0) {
+        execvp(AUDIO_PLAYER, args);
+        perror("execvp");
+        exit(EXIT_FAILURE);
+    }
+    warm_player.pid = pid;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, warm_player.ipc_path,
+           MIN(strlen(warm_player.ipc_path), sizeof(addr.sun_path) - 1));
+
+    while (1) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            perror("_start_warm_audio_player: socket");
+            stop_warm_audio_player();
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            warm_player.ipc_fd = fd;
+            break;
+        }
+        close(fd);
+
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            ERR_PRINT("Audio player exited before it was ready\n");
+            warm_player.pid = -1;
+            return -1;
+        }
+        if (_elapsed_ms(&start) > AUDIO_PLAYER_READY_TIMEOUT_MS) {
+            ERR_PRINT("Audio player did not become ready\n");
+            stop_warm_audio_player();
+            return -1;
+        }
+        poll(NULL, 0, AUDIO_PLAYER_READY_POLL_MS);
+    }
+
+#ifdef DEBUG
+    printf("Warm audio player ready in %ld ms\n", _elapsed_ms(&start));
+#endif
+    return 0;
+}
+
+
+int warm_audio_player_open_track(int *audio_out_fd) {
+    if (_start_warm_audio_player() == -1) {
+        return -1;
+    }
+
+    char fifo_path[MAX_PATH];
+    snprintf(fifo_path, MAX_PATH, AUDIO_PLAYER_FIFO_FMT, getpid(), warm_player.num_tracks++);
+    if (mkfifo(fifo_path, 0600) == -1) {
+        perror("warm_audio_player_open_track: mkfifo");
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // The reply to the request, with its number, names the track's entry
+    warm_player.track_id = -1;
+    warm_player.awaiting_start = 0;
+    warm_player.track_ended = 0;
+    warm_player.track_failed = 0;
+    char command[2 * MAX_PATH];
+    snprintf(command, sizeof(command),
+             "{\"command\": [\"loadfile\", \"%s\", \"replace\"], \"request_id\": %u}\n",
+             fifo_path, warm_player.num_tracks - 1);
+    if (write_precisely(warm_player.ipc_fd, command, strlen(command)) < 0) {
+        unlink(fifo_path);
+        stop_warm_audio_player();
+        return -1;
+    }
+
+    // Opening the write end of a FIFO without a reader fails with ENXIO, so
+    // this only succeeds once the player has picked up the track.
+    int fd;
+    while ((fd = open(fifo_path, O_WRONLY | O_NONBLOCK)) == -1) {
+        if (errno != ENXIO && errno != EINTR) {
+            perror("warm_audio_player_open_track: open");
+            unlink(fifo_path);
+            return -1;
+        }
+        if (_elapsed_ms(&start) > AUDIO_PLAYER_READY_TIMEOUT_MS) {
+            ERR_PRINT("Audio player did not open the track\n");
+            unlink(fifo_path);
+            return -1;
+        }
+        poll(NULL, 0, AUDIO_PLAYER_READY_POLL_MS);
+    }
+    // Both ends are open, the name is no longer needed
+    unlink(fifo_path);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+#ifdef DEBUG
+    printf("Audio player opened track in %ld ms\n", _elapsed_ms(&start));
+#endif
+    *audio_out_fd = fd;
+    return 0;
+}
+
+
+int warm_audio_player_fd(void) {
+    return warm_player.ipc_fd;
+}
+
+
+/*
+** Helper for: warm_audio_player_poll_track
+** returns the integer after key in a line of mpv's JSON, -1 if it has none
+*/
+static long _json_number(const char *line, const char *key) {
+    const char *found = strstr(line, key);
+    if (found == NULL) {
+        return -1;
+    }
+    return strtol(found + strlen(key), NULL, 10);
+}
+
+
+/*
+** Helper for: warm_audio_player_poll_track
+** Notes what a line from mpv says about the last track loaded.
+*/
+static void _track_event(const char *line) {
+    long entry_id = _json_number(line, "\"playlist_entry_id\":");
+    if (strstr(line, "\"event\"") == NULL) {
+        // A reply, of which only the last loadfile's matters
+        if (_json_number(line, "\"request_id\":") == (long)warm_player.num_tracks - 1) {
+            warm_player.track_id = entry_id;
+            warm_player.awaiting_start = entry_id == -1;
+            if (strstr(line, "\"error\":\"success\"") == NULL) {
+                // mpv refused the file, so no end will come for it
+                warm_player.awaiting_start = 0;
+                warm_player.track_ended = 1;
+                warm_player.track_failed = 1;
+            }
+        }
+    } else if (strstr(line, "\"event\":\"start-file\"") != NULL) {
+        // mpv older than its loadfile replies naming the entry
+        if (warm_player.awaiting_start) {
+            warm_player.track_id = entry_id;
+            warm_player.awaiting_start = 0;
+        }
+    } else if (strstr(line, "\"event\":\"end-file\"") != NULL &&
+               entry_id != -1 && entry_id == warm_player.track_id) {
+        warm_player.track_ended = 1;
+        warm_player.track_failed = strstr(line, "\"reason\":\"error\"") != NULL;
+    }
+}
+
+
+int warm_audio_player_poll_track(void) {
+    if (warm_player.ipc_fd < 0) {
+        return -1;
+    }
+
+    char buf[RESPONSE_BUFFER_SIZE];
+    int num = recv(warm_player.ipc_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (num == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (num <= 0) {
+        ERR_PRINT("Lost connection to the audio player\n");
+        stop_warm_audio_player();
+        return -1;
+    }
+
+    // mpv sends one JSON object per line
+    int num_ended = 0;
+    for (int i = 0; i < num; i++) {
+        if (buf[i] != '\n') {
+            if (warm_player.line_len < sizeof(warm_player.line) - 1) {
+                warm_player.line[warm_player.line_len++] = buf[i];
+            }
+            continue;
+        }
+        warm_player.line[warm_player.line_len] = '\0';
+        warm_player.line_len = 0;
+        if (strstr(warm_player.line, "\"event\":\"end-file\"") != NULL) {
+            num_ended++;
+        }
+        _track_event(warm_player.line);
+    }
+    return num_ended;
+}
+
+
+int warm_audio_player_wait_track(void) {
+    while (1) {
+        struct pollfd pfd = {warm_player.ipc_fd, POLLIN, 0};
+        if (pfd.fd < 0) {
+            return -1;
+        }
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("warm_audio_player_wait_track: poll");
+            return -1;
+        }
+
+        // Only the end of the last track loaded counts, not that of the one
+        // it replaced
+        if (warm_audio_player_poll_track() == -1) {
+            return -1;
+        }
+        if (warm_player.track_ended) {
+            if (warm_player.track_failed) {
+                ERR_PRINT("Audio player could not play the track\n");
+                return -1;
+            }
+            return 0;
+        }
+    }
+}
+
+
+int warm_audio_player_stop_track(void) {
+    if (warm_player.ipc_fd < 0) {
+        return -1;
+    }
+    const char *stop = "{\"command\": [\"stop\"]}\n";
+    if (write_precisely(warm_player.ipc_fd, stop, strlen(stop)) < 0) {
+        stop_warm_audio_player();
+        return -1;
+    }
+    return 0;
+}
+
+
+void stop_warm_audio_player(void) {
+    if (warm_player.pid <= 0) {
+        return;
+    }
+
+    const char *quit = "{\"command\": [\"quit\"]}\n";
+    if (warm_player.ipc_fd < 0 ||
+        write_precisely(warm_player.ipc_fd, quit, strlen(quit)) < 0) {
+        kill(warm_player.pid, SIGTERM);
+    }
+    if (warm_player.ipc_fd >= 0) {
+        close(warm_player.ipc_fd);
+        warm_player.ipc_fd = -1;
+    }
+
+    _wait_on_audio_player(warm_player.pid);
+    warm_player.pid = -1;
+    warm_player.line_len = 0;
+    unlink(warm_player.ipc_path);
+}
+
+
+/*
+** Helpers for: stream_request, stream_and_get_request, cached_stream_request
+** Open an audio output for a single track and wait for it to finish playing,
+** or stop it when the track could not be streamed whole, using either the
+** warm player or a fresh AUDIO_PLAYER process.
+**
+** _open_audio_output returns the player handle to wait on, -1 on error
+*/
+static int _open_audio_output(int *audio_out_fd) {
+#ifdef AUDIO_PLAYER_WARM
+    return warm_audio_player_open_track(audio_out_fd);
+#else
+    return start_audio_player_process(audio_out_fd);
+#endif
+}
+
+
+static void _wait_on_audio_output(int audio_player) {
+#ifdef AUDIO_PLAYER_WARM
+    warm_audio_player_wait_track();
+#else
+    _wait_on_audio_player(audio_player);
+#endif
+}
+
+
+static void _stop_audio_output(int audio_player) {
+#ifdef AUDIO_PLAYER_WARM
+    warm_audio_player_stop_track();
+#else
+    kill(audio_player, SIGTERM);
+    _wait_on_audio_player(audio_player);
+#endif
+}
+
+
+int stream_request(int sockfd, uint32_t file_index) {
+    int audio_out_fd;
+    int audio_player = _open_audio_output(&audio_out_fd);
+    if (audio_player == -1) {
+        return -1;
+    }
+
+    int result = send_and_process_stream_request(sockfd, file_index, audio_out_fd, -1);
+    if (result == -1) {
+        ERR_PRINT("stream_request: send_and_process_stream_request failed\n");
+        // Only closed by it once the whole file was received
+        close(audio_out_fd);
+        _stop_audio_output(audio_player);
+        return -1;
+    }
+
+    _wait_on_audio_output(audio_player);
+
+    return 0;
+}
+
+
+/*
+** Helper for: cached_stream_request
+** Copies everything from in_fd to out_fd.
+**
+** returns 0 on success, -1 on error
+*/
+static int _copy_fd(int in_fd, int out_fd) {
+    uint8_t buffer[NETWORK_PRE_DYNAMIC_BUFF_SIZE];
+    int num;
+    while ((num = read(in_fd, buffer, NETWORK_PRE_DYNAMIC_BUFF_SIZE)) != 0) {
+        if (num == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("_copy_fd: read");
+            return -1;
+        }
+        if (write_precisely(out_fd, buffer, num) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int cached_stream_request(int sockfd, uint32_t file_index, const Library *library,
+                          TrackCache *cache) {
+    uint32_t size, mtime;
+    if (stat_request(sockfd, file_index, &size, &mtime) == -1) {
+        ERR_PRINT("cached_stream_request: stat_request failed\n");
+        return -1;
+    }
+    const char *path = library->files[file_index];
+
+    int audio_out_fd;
+    int cached_fd = cache_lookup(cache, path, size, mtime);
+    if (cached_fd != -1) {
+#ifdef DEBUG
+        printf("Playing %s from the cache\n", path);
+#endif
+        int audio_player = _open_audio_output(&audio_out_fd);
+        if (audio_player == -1) {
+            close(cached_fd);
+            return -1;
+        }
+        int result = _copy_fd(cached_fd, audio_out_fd);
+        close(cached_fd);
+        close(audio_out_fd);
+        if (result == -1) {
+            return -1;
+        }
+        _wait_on_audio_output(audio_player);
+        return 0;
+    }
+
+    int cache_fd = cache_begin_insert(cache, path, size);
+    int audio_player = _open_audio_output(&audio_out_fd);
+    if (audio_player == -1) {
+        if (cache_fd != -1) {
+            close(cache_fd);
+            cache_abort_insert(cache, path);
+        }
+        return -1;
+    }
+
+    int result = send_and_process_stream_request(sockfd, file_index, audio_out_fd, cache_fd);
+    if (result == -1) {
+        ERR_PRINT("cached_stream_request: send_and_process_stream_request failed\n");
+        // Only closed by it once the whole file was received
+        close(audio_out_fd);
+        _stop_audio_output(audio_player);
+        if (cache_fd != -1) {
+            close(cache_fd);
+            cache_abort_insert(cache, path);
+        }
+        return -1;
+    }
+    if (cache_fd != -1) {
+        cache_commit_insert(cache, path, size, mtime);
+    }
+
+    _wait_on_audio_output(audio_player);
+    return 0;
+}
+
+
+int stream_and_get_request(int sockfd, uint32_t file_index, const Library * library) {
+    int audio_out_fd;
+    int audio_player = _open_audio_output(&audio_out_fd);
+    if (audio_player == -1) {
+        return -1;
+    }
+
+#ifdef DEBUG
+    printf("Getting file %s\n", library->files[file_index]);
+#endif
+
+    int file_dest_fd = file_index_to_fd(file_index, library);
+    if (file_dest_fd == -1) {
+        ERR_PRINT("stream_and_get_request: file_index_to_fd failed\n");
+        close(audio_out_fd);
+        _stop_audio_output(audio_player);
+        return -1;
+    }
+
+    int result = send_and_process_stream_request(sockfd, file_index,
+                                                 audio_out_fd, file_dest_fd);
+    if (result == -1) {
+        ERR_PRINT("stream_and_get_request: send_and_process_stream_request failed\n");
+        // Only closed by it once the whole file was received
+        close(audio_out_fd);
+        close(file_dest_fd);
+        _stop_audio_output(audio_player);
+        return -1;
+    }
+
+    _wait_on_audio_output(audio_player);
+
+    return 0;
+}
+
+/*
+** Helper for: send_and_process_stream_request, the shell's jobs
+** Writes a stream request for file_index to the server.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_stream_request(int sockfd, uint32_t file_index) {
+    Writer writer;
+    writer_init(&writer, sockfd);
+    uint32_t network_file_index = htonl(file_index);
+    writer_add(&writer, REQUEST_STREAM END_OF_MESSAGE_TOKEN, 8);
+    writer_add(&writer, &network_file_index, sizeof(uint32_t));
+
+    if (writer_flush(&writer) != 12) {
+        return -1;
+    }
+    return 0;
+}
+
+
+int send_and_process_stream_request(int sockfd, uint32_t file_index,
+                                    int audio_out_fd, int file_dest_fd) {
+    if (audio_out_fd < 0 && file_dest_fd < 0) {
+        fprintf(stderr, "Invalid file descriptors\n");
+        return -1;
+    }
+
+    // Write Stream Request to Socket
+    if (_send_stream_request(sockfd, file_index) == -1) {
+        return -1;
+    }
+
+    // Read In the File Size
+    int file_size;
+    if ((read_precisely(sockfd, &file_size, sizeof(int))) < 0 || _is_busy(&file_size)) {
+        return -1;
+    }
+    file_size = ntohl(file_size);
+
+    // Create fixed-size buffer to read from the socket
+    int bytes_to_read = file_size;
+    u_int8_t fixed_buffer[NETWORK_PRE_DYNAMIC_BUFF_SIZE];
+    u_int8_t *dynamic_buffer = NULL;
+    size_t dynamic_buffer_size = 0;
+
+    int audio_read_start_idx = 0;
+    int file_read_start_idx = 0;
+
+    int audio_out_written_count = 0;
+    int file_dest_written_count = 0;
+
+    // Set Parameters for select syscall
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sockfd, &read_fds);
+
+    struct timeval timeout;
+    timeout.tv_sec = SELECT_TIMEOUT_SEC;
+    timeout.tv_usec = SELECT_TIMEOUT_USEC;
+
+    // numfd parameter in the select syscall is the value of the highest file descriptor in the set + 1.
+    int numfd;
+    if (sockfd > audio_out_fd && sockfd > file_dest_fd) {
+        numfd = sockfd + 1;
+    } else if (audio_out_fd > sockfd && audio_out_fd > file_dest_fd) {
+        numfd = audio_out_fd + 1;
+    } else {
+        numfd = file_dest_fd + 1;
+    }
+
+    while (1) {
+        // Set up a copy of read_fds as select mutates the read_fds set.
+        // This ensures only a copy is being mutated and not the actual set
+        fd_set curr_read_fd_sets = read_fds;
+        // select counts the timeout down, so a slow server would be polled
+        timeout.tv_sec = SELECT_TIMEOUT_SEC;
+        timeout.tv_usec = SELECT_TIMEOUT_USEC;
+
+        // Our select call does not use write_fds as write calls are not blocked as there is always something to read
+        // from the fixed buffer (as we select on the read_fds to ensure that read is never blocked.
+        if ((select(numfd, &curr_read_fd_sets, NULL, NULL, &timeout)) < 0) {
+            perror("select");
+            exit(1);
+        }
+
+        if (FD_ISSET(sockfd, &curr_read_fd_sets)) {
+            int r;
+            if ((r = read(sockfd, fixed_buffer, sizeof(u_int8_t) * NETWORK_PRE_DYNAMIC_BUFF_SIZE)) < 0) {
+                // Read from socket to the fixed_buffer
+                // Using read instead of read_precisely is better in this case as it does not block
+                // until it has read NETWORK_PRE_DYNAMIC_BUFF_SIZE bytes (it reads as many as available)
+                perror("read");
+                exit(1);
+            }
+            // A server gone before the end would otherwise be read from forever
+            if (r == 0) {
+                ERR_PRINT("send_and_process_stream_request: Unexpected EOF\n");
+                free(dynamic_buffer);
+                return -1;
+            }
+
+            dynamic_buffer = realloc(dynamic_buffer, dynamic_buffer_size + r);
+            u_int8_t *write_to_dynamic_buffer_from = dynamic_buffer + dynamic_buffer_size;
+            dynamic_buffer_size += r;
+            memcpy(write_to_dynamic_buffer_from, fixed_buffer, r);
+            bytes_to_read = bytes_to_read - r;
+        }
+
+        int audio_bytes_written = 0;
+        int audio_bytes_to_write;
+        int file_bytes_written = 0;
+        int file_bytes_to_write;
+
+        if (audio_out_fd > -1 && file_dest_fd > -1 && dynamic_buffer != NULL) {
+            int written_differential_audio = audio_out_written_count - file_dest_written_count;
+            int written_differential_file = file_dest_written_count - audio_out_written_count;
+            if (written_differential_audio > 0) {
+                audio_read_start_idx = written_differential_audio;
+            }
+            if (written_differential_file > 0) {
+                file_read_start_idx = written_differential_file;
+            }
+            audio_bytes_to_write = dynamic_buffer_size - audio_read_start_idx;
+            if ((audio_bytes_written = write(audio_out_fd, dynamic_buffer + audio_read_start_idx, audio_bytes_to_write)) < 0) {
+                perror("write");
+                exit(1);
+            }
+            audio_out_written_count += audio_bytes_written;
+            file_bytes_to_write = dynamic_buffer_size - file_read_start_idx;
+            if ((file_bytes_written = write(file_dest_fd, dynamic_buffer + file_read_start_idx, file_bytes_to_write)) < 0) {
+                perror("write");
+                exit(1);
+            }
+            file_dest_written_count += file_bytes_written;
+        } else if (audio_out_fd > -1 && dynamic_buffer != NULL) {
+            audio_bytes_to_write = dynamic_buffer_size - audio_read_start_idx;
+            if ((audio_bytes_written = write(audio_out_fd, dynamic_buffer + audio_read_start_idx, audio_bytes_to_write)) < 0) {
+                perror("write");
+                exit(1);
+            }
+            audio_out_written_count += audio_bytes_written;
+        } else if (file_dest_fd > -1  && dynamic_buffer != NULL) {
+            file_bytes_to_write = dynamic_buffer_size - file_read_start_idx;
+            if ((file_bytes_written = write(file_dest_fd, dynamic_buffer + file_read_start_idx, file_bytes_to_write)) < 0) {
+                perror("write");
+                exit(1);
+            }
+            file_dest_written_count += file_bytes_written;
+        }
+
+        int lowest_bytes_written = 0;
+        if (file_dest_fd > -1 && audio_out_fd > -1 && dynamic_buffer != NULL) {
+            if (file_read_start_idx + file_bytes_written < audio_read_start_idx + audio_bytes_written) {
+                lowest_bytes_written = file_read_start_idx + file_bytes_written;
+            } else {
+                lowest_bytes_written = audio_read_start_idx + audio_bytes_written;
+            }
+        } else if (file_dest_fd < 0 && dynamic_buffer != NULL) {
+            lowest_bytes_written = audio_bytes_written;
+        } else if (audio_out_fd < 0 && dynamic_buffer != NULL) {
+            lowest_bytes_written = file_bytes_written;
+        }
+
+        if (dynamic_buffer != NULL && dynamic_buffer_size == lowest_bytes_written) {
+            // All written, as a file always is, so there is nothing to keep
+            free(dynamic_buffer);
+            dynamic_buffer = NULL;
+            dynamic_buffer_size = 0;
+        } else if (dynamic_buffer != NULL) {
+            dynamic_buffer_size = dynamic_buffer_size - lowest_bytes_written;
+            u_int8_t dynamic_buffer_stack[dynamic_buffer_size];
+            memcpy(dynamic_buffer_stack, dynamic_buffer + lowest_bytes_written, dynamic_buffer_size);
+            dynamic_buffer = realloc(dynamic_buffer, sizeof(u_int8_t) * dynamic_buffer_size);
+            memset(dynamic_buffer, '\0', dynamic_buffer_size);
+            memcpy(dynamic_buffer, dynamic_buffer_stack, dynamic_buffer_size);
+        }
+
+        if (bytes_to_read == 0 || file_dest_written_count >= file_size || audio_out_written_count >= file_size) {
+            break;
+        }
+    }
+
+    if (bytes_to_read == 0) {
+        free(dynamic_buffer);
+        close(audio_out_fd);
+        close(file_dest_fd);
+    }
+
+    return 0;
+}
+
+
+int udp_stream_request(int port, const char *hostname, uint32_t file_index) {
+    // The player is ready before the stream is requested, so that it does not
+    // add to the latency
+    int audio_out_fd;
+    int audio_player = _open_audio_output(&audio_out_fd);
+    if (audio_player == -1) {
+        return -1;
+    }
+    fcntl(audio_out_fd, F_SETFL, fcntl(audio_out_fd, F_GETFL) | O_NONBLOCK);
+
+    struct timespec request_start;
+    clock_gettime(CLOCK_MONOTONIC, &request_start);
+    int result = -1;
+    int sockfd = connect_to_server(port, hostname);
+    if (sockfd == -1) {
+        goto close_player;
+    }
+    // The server sends from its own socket, and NACKs go back to it
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in udp_addr;
+    memset(&udp_addr, 0, sizeof(udp_addr));
+    udp_addr.sin_family = AF_INET;
+    udp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    socklen_t addr_len = sizeof(udp_addr);
+    if (udp_fd == -1 || bind(udp_fd, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) == -1 ||
+        getsockname(udp_fd, (struct sockaddr *)&udp_addr, &addr_len) == -1) {
+        perror("udp_stream_request: socket");
+        goto close_sockets;
+    }
+
+    uint8_t request[15];
+    uint32_t network_file_index = htonl(file_index);
+    memcpy(request, REQUEST_USTREAM END_OF_MESSAGE_TOKEN, 9);
+    memcpy(request + 9, &network_file_index, sizeof(uint32_t));
+    memcpy(request + 13, &udp_addr.sin_port, sizeof(uint16_t));
+    // A busy server only sends RESPONSE_BUSY and its newline
+    uint32_t response[2];
+    if (write_precisely(sockfd, request, sizeof(request)) != sizeof(request) ||
+        read_precisely(sockfd, response, 6) != 6 || _is_busy(response)) {
+        goto close_sockets;
+    }
+    // As does an edge, see as_edge.h, with its newline
+    if (memcmp(response, RESPONSE_UNSUPPORTED, 4) == 0) {
+        ERR_PRINT("The server does not serve USTREAM\n");
+        goto close_sockets;
+    }
+    if (read_precisely(sockfd, (uint8_t *)response + 6, 2) != 2) {
+        goto close_sockets;
+    }
+    uint32_t file_size = ntohl(response[0]);
+    uint32_t byte_rate = ntohl(response[1]);
+
+    // Only the server's first datagram tells where to send NACKs
+    uint8_t first[UDP_HEADER_SIZE + UDP_PAYLOAD_SIZE];
+    struct sockaddr_in server_addr;
+    addr_len = sizeof(server_addr);
+    struct pollfd udp_pollfd = {udp_fd, POLLIN, 0};
+    if (file_size > 0 && (poll(&udp_pollfd, 1, AUDIO_PLAYER_READY_TIMEOUT_MS) != 1 ||
+        recvfrom(udp_fd, first, sizeof(first), MSG_PEEK, (struct sockaddr *)&server_addr,
+                 &addr_len) == -1 ||
+        connect(udp_fd, (struct sockaddr *)&server_addr, addr_len) == -1)) {
+        ERR_PRINT("No datagrams from the server\n");
+        goto close_sockets;
+    }
+
+    UdpStats stats;
+    memset(&stats, 0, sizeof(UdpStats));
+    result = udp_receive_file(udp_fd, file_size, byte_rate, audio_out_fd, &request_start, &stats);
+    udp_print_stats(&stats);
+
+close_sockets:
+    if (udp_fd != -1) {
+        close(udp_fd);
+    }
+    close(sockfd);
+close_player:
+    close(audio_out_fd);
+    _wait_on_audio_output(audio_player);
+    return result;
+}
+
+
+// The shell, left out of the requests servers make of another, see as_edge.h
+#ifndef AS_NO_MAIN
+/*
+** Shell jobs
+** ----------
+** Every get, stream and stream+ command runs as a job in the shell's event
+** loop. A job has its own connection to the server, or a cached track, as its
+** source, and moves the file to its outputs as they become ready, so several
+** jobs can be in flight at once. A job started with a trailing & runs in the
+** background; otherwise the shell waits for it before reading the next command.
+**
+** A job that plays audio lasts until the player has finished the track, which
+** for the warm player is reported by its end-file events, in the order the
+** tracks were opened.
+**
+** A listen job plays the server's station, whose stream has no end, so it
+** lasts until it is cancelled or the server stops sending, and always runs in
+** the background. It has a connection of its own, even over protocol v2.
+**
+** A seek job plays a track from a point in time, with a SEEK instead of a
+** STREAM, and never goes through the track cache as it only gets part of it.
+*/
+typedef enum {JOB_GET, JOB_STREAM, JOB_STREAM_AND_GET, JOB_LISTEN, JOB_SEEK} JobKind;
+static const char *job_kind_names[] = {CMD_GET, CMD_STREAM, CMD_STREAM_AND_GET, CMD_LISTEN,
+                                       CMD_SEEK};
+
+typedef enum {
+    JOB_HEADER,     // waiting for the file size
+    JOB_TRANSFER,   // moving the file to its outputs
+    JOB_PLAYING,    // transfer over, waiting for the player to finish the track
+} JobState;
+
+typedef struct job {
+    int id;
+    JobKind kind;
+    JobState state;
+    uint32_t file_index;
+    uint32_t seek_ms;       // where a seek job starts the track
+    char *path;
+    uint8_t background;
+    uint8_t hidden;         // cancelled or failed, only waiting on its player
+    uint8_t finished;       // to be freed once the current events are handled
+
+    int src_fd;
+    uint32_t src_events;
+    uint8_t src_is_cache;
+    int audio_out_fd;
+    uint32_t audio_events;
+    int audio_player;       // AUDIO_PLAYER pid, 0 for the warm player, -1 for none
+    uint8_t track_ended;    // the warm player reported the end of this track
+    int file_dest_fd;
+    uint8_t caching;        // file_dest_fd is an insertion in the track cache
+    uint32_t mtime;
+    // Over a protocol v2 connection, the job is a stream instead of an src_fd
+    uint32_t stream_id;
+    uint8_t stream_open;    // the server may still send frames for the stream
+    uint32_t ungranted;     // bytes consumed but not yet added back to the window
+
+    uint8_t header[sizeof(uint32_t)];
+    int header_bytes;
+    uint32_t file_size;
+    uint32_t received;
+    // audio not yet written to the player
+    uint8_t buffer[JOB_BUFFER_SIZE];
+    int buf_start;
+    int buf_end;
+
+    struct timespec started;
+    long elapsed_ms;
+    struct job *next;
+} Job;
+
+typedef struct shell {
+    Poller poller;
+    int sockfd;
+    int port;
+    const char *hostname;
+    Library library;
+    TrackCache *cache;
+
+    // Protocol v2: every job and request is a stream on sockfd
+    uint8_t multiplexed;
+    LineReader frames;
+    uint32_t next_stream_id;
+    uint32_t control_stream;        // the LIST or STAT being waited on
+    LineReader *control_response;
+    int control_status;             // 1 once answered, -1 if it failed
+    uint32_t control_ungranted;
+
+    Job *jobs;
+    int next_job_id;
+    int foreground_job;
+    uint32_t stdin_events;
+    int player_fd;
+
+    // The directory browsed last, and the token of its next page
+    char browse_dir[BROWSE_MAX_ARG + 1];
+    char browse_token[BROWSE_MAX_ARG + 1];
+    uint16_t browse_count;
+
+    char input[REQUEST_BUFFER_SIZE];
+    int input_len;
+    uint8_t input_eof;
+    uint8_t quit;
+} Shell;
+
+
+/*
+** Helper for: the protocol v2 shell
+** Sends a single frame to the server.
+**
+** returns 0 on success, -1 on error
+*/
+static int _mux_send(Shell *shell, uint8_t type, uint32_t stream_id,
+                     const void *payload, uint32_t length) {
+    Writer writer;
+    writer_init(&writer, shell->sockfd);
+    if (frame_add(&writer, type, 0, stream_id, payload, length) == -1 ||
+        writer_flush(&writer) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Gives the server back the window of num bytes of the stream that left the
+** client, in increments of at least V2_WINDOW_UPDATE_MIN bytes.
+*/
+static void _mux_grant(Shell *shell, uint32_t stream_id, uint32_t *ungranted, uint32_t num) {
+    *ungranted += num;
+    if (*ungranted < V2_WINDOW_UPDATE_MIN) {
+        return;
+    }
+    uint32_t increment = htonl(*ungranted);
+    _mux_send(shell, V2_FRAME_WINDOW, stream_id, &increment, sizeof(uint32_t));
+    *ungranted = 0;
+}
+
+
+/*
+** Helper for: the shell's jobs
+** Bytes that left the job's buffer make room for more of its stream.
+*/
+static void _job_consumed(Shell *shell, Job *job, uint32_t num) {
+    if (job->stream_id != 0 && job->stream_open) {
+        _mux_grant(shell, job->stream_id, &job->ungranted, num);
+    }
+}
+
+
+/*
+** Helpers for: the shell's jobs
+** Watch (or stop watching) one of a job's descriptors, only calling into the
+** poller when the events change.
+*/
+static void _job_watch(Shell *shell, Job *job, int fd, uint32_t *watched, uint32_t events) {
+    if (fd < 0 || *watched == events) {
+        return;
+    }
+    if (poller_watch(&shell->poller, fd, events, job) == 0) {
+        *watched = events;
+    }
+}
+
+
+static void _job_close(Shell *shell, Job *job, int *fd, uint32_t *watched) {
+    if (*fd < 0) {
+        return;
+    }
+    _job_watch(shell, job, *fd, watched, 0);
+    close(*fd);
+    *fd = -1;
+}
+
+
+/*
+** A job reads while it has room in its buffer, and writes to the player while
+** there is audio in it.
+*/
+static void _job_update_watch(Shell *shell, Job *job) {
+    uint32_t src_events = 0;
+    uint32_t audio_events = 0;
+    if (job->state == JOB_HEADER) {
+        src_events = POLLER_READ;
+    } else if (job->state == JOB_TRANSFER) {
+        if (job->received < job->file_size && job->buf_end < JOB_BUFFER_SIZE) {
+            src_events = POLLER_READ;
+        }
+        if (job->buf_end > job->buf_start) {
+            audio_events = POLLER_WRITE;
+        }
+    }
+    _job_watch(shell, job, job->src_fd, &job->src_events, src_events);
+    _job_watch(shell, job, job->audio_out_fd, &job->audio_events, audio_events);
+}
+
+
+static void _job_finish(Shell *shell, Job *job) {
+    if (!job->hidden && job->background) {
+        printf("[%d] Done %s %u: %s (%u bytes in %ld ms)\n", job->id,
+               job_kind_names[job->kind], job->file_index, job->path,
+               job->received, job->elapsed_ms);
+    }
+    job->finished = 1;
+}
+
+
+/*
+** The warm player only plays one track at a time, so only the most recently
+** opened track can still be playing.
+*/
+static uint8_t _job_is_current_track(const Job *job) {
+    if (job->audio_player != 0 || job->track_ended) {
+        return 0;
+    }
+    for (const Job *later = job->next; later != NULL; later = later->next) {
+        if (later->audio_player == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static void _job_stop_player(Job *job) {
+    if (job->audio_player > 0) {
+        kill(job->audio_player, SIGTERM);
+    } else if (_job_is_current_track(job)) {
+        warm_audio_player_stop_track();
+    }
+}
+
+
+/*
+** Ends the job's transfer, successfully if failure is NULL. A job with a
+** player then waits for it to finish the track, while other jobs are done.
+*/
+static void _job_end_transfer(Shell *shell, Job *job, const char *failure) {
+    job->elapsed_ms = _elapsed_ms(&job->started);
+    if (job->stream_open) {
+        _mux_send(shell, V2_FRAME_CANCEL, job->stream_id, NULL, 0);
+        job->stream_open = 0;
+    }
+    _job_close(shell, job, &job->src_fd, &job->src_events);
+    _job_close(shell, job, &job->audio_out_fd, &job->audio_events);
+    if (job->file_dest_fd >= 0) {
+        close(job->file_dest_fd);
+        job->file_dest_fd = -1;
+    }
+
+    if (job->caching) {
+        if (failure == NULL) {
+            cache_commit_insert(shell->cache, job->path, job->file_size, job->mtime);
+        } else {
+            cache_abort_insert(shell->cache, job->path);
+        }
+        job->caching = 0;
+    }
+
+    if (failure != NULL) {
+        printf("[%d] %s %s %u: %s\n", job->id, failure,
+               job_kind_names[job->kind], job->file_index, job->path);
+        job->hidden = 1;
+        _job_stop_player(job);
+    }
+
+    if (job->audio_player == -1 || (job->audio_player == 0 && job->track_ended)) {
+        _job_finish(shell, job);
+        return;
+    }
+    job->state = JOB_PLAYING;
+}
+
+
+static void _job_progress(Shell *shell, Job *job) {
+    if (job->state == JOB_TRANSFER && job->received == job->file_size
+        && job->buf_start == job->buf_end) {
+        _job_end_transfer(shell, job, NULL);
+        return;
+    }
+    _job_update_watch(shell, job);
+}
+
+
+static void _job_received_header(Shell *shell, Job *job) {
+    if (memcmp(job->header, RESPONSE_BUSY, 4) == 0) {
+        _job_end_transfer(shell, job, "Server busy for");
+        return;
+    }
+    // As an edge answers SEEK and STATION, see as_edge.h
+    if (memcmp(job->header, RESPONSE_UNSUPPORTED, 4) == 0) {
+        _job_end_transfer(shell, job, "Server does not serve");
+        return;
+    }
+    uint32_t file_size;
+    memcpy(&file_size, job->header, sizeof(uint32_t));
+    job->file_size = ntohl(file_size);
+    job->state = JOB_TRANSFER;
+    if (job->kind == JOB_LISTEN && job->file_size == 0) {
+        _job_end_transfer(shell, job, "No station for");
+        return;
+    }
+    _job_progress(shell, job);
+}
+
+
+/*
+** Handles num bytes of the file that were just placed at the end of the
+** job's buffer.
+*/
+static void _job_received(Shell *shell, Job *job, int num) {
+    if (job->file_dest_fd >= 0 &&
+        write_precisely(job->file_dest_fd, job->buffer + job->buf_end, num) < 0) {
+        _job_end_transfer(shell, job, "Failed");
+        return;
+    }
+    job->received += num;
+    // Without a player, the buffer only stages data for the file
+    if (job->audio_out_fd >= 0) {
+        job->buf_end += num;
+    } else {
+        _job_consumed(shell, job, num);
+    }
+    _job_progress(shell, job);
+}
+
+
+static void _job_read(Shell *shell, Job *job) {
+    if (job->state == JOB_HEADER) {
+        int num = read(job->src_fd, job->header + job->header_bytes,
+                       sizeof(job->header) - job->header_bytes);
+        if (num == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (num <= 0) {
+            _job_end_transfer(shell, job, "Failed");
+            return;
+        }
+        job->header_bytes += num;
+        if (job->header_bytes == sizeof(job->header)) {
+            _job_received_header(shell, job);
+        }
+        return;
+    }
+
+    int room = JOB_BUFFER_SIZE - job->buf_end;
+    int num = read(job->src_fd, job->buffer + job->buf_end,
+                   MIN((uint32_t)room, job->file_size - job->received));
+    __atomic_fetch_add(&io_stats.read_calls, 1, __ATOMIC_RELAXED);
+    if (num == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (num <= 0) {
+        if (num == -1) {
+            perror("_job_read: read");
+        }
+        _job_end_transfer(shell, job, "Failed");
+        return;
+    }
+    _job_received(shell, job, num);
+}
+
+
+/*
+** Handles the payload of a DATA frame of the job's stream, which is the next
+** len bytes of the same response _job_read would have read.
+*/
+static void _job_deliver(Shell *shell, Job *job, const uint8_t *data, uint32_t len) {
+    while (len > 0 && !job->finished && job->state != JOB_PLAYING) {
+        if (job->state == JOB_HEADER) {
+            uint32_t num = MIN(len, sizeof(job->header) - job->header_bytes);
+            memcpy(job->header + job->header_bytes, data, num);
+            job->header_bytes += num;
+            data += num;
+            len -= num;
+            if (job->header_bytes == sizeof(job->header)) {
+                _job_received_header(shell, job);
+            }
+            continue;
+        }
+
+        // The window never lets more arrive than the buffer has room for in
+        // total, but that room may be split around the buffered audio
+        if (job->buf_end + len > JOB_BUFFER_SIZE && job->buf_start > 0) {
+            memmove(job->buffer, job->buffer + job->buf_start, job->buf_end - job->buf_start);
+            job->buf_end -= job->buf_start;
+            job->buf_start = 0;
+        }
+        uint32_t num = MIN(len, MIN((uint32_t)(JOB_BUFFER_SIZE - job->buf_end),
+                                    job->file_size - job->received));
+        if (num == 0) {
+            ERR_PRINT("Server overran stream %u\n", job->stream_id);
+            _job_end_transfer(shell, job, "Failed");
+            return;
+        }
+        memcpy(job->buffer + job->buf_end, data, num);
+        data += num;
+        len -= num;
+        _job_received(shell, job, num);
+    }
+}
+
+
+static void _job_write(Shell *shell, Job *job) {
+    int num = write(job->audio_out_fd, job->buffer + job->buf_start,
+                    job->buf_end - job->buf_start);
+    __atomic_fetch_add(&io_stats.write_calls, 1, __ATOMIC_RELAXED);
+    if (num == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (num == -1) {
+        if (errno != EPIPE) {
+            perror("_job_write: write");
+        }
+        // The player stopped reading, possibly replaced by a newer track; a
+        // job that also saves the file carries on without it
+        _job_close(shell, job, &job->audio_out_fd, &job->audio_events);
+        _job_consumed(shell, job, job->buf_end - job->buf_start);
+        job->buf_start = job->buf_end = 0;
+        if (job->file_dest_fd < 0 || job->caching) {
+            _job_end_transfer(shell, job, "Stopped");
+            return;
+        }
+        _job_progress(shell, job);
+        return;
+    }
+
+    job->buf_start += num;
+    if (job->buf_start == job->buf_end) {
+        job->buf_start = job->buf_end = 0;
+    }
+    _job_consumed(shell, job, num);
+    _job_progress(shell, job);
+}
+
+
+/*
+** Helper for: the protocol v2 shell
+** Handles every frame that has arrived from the server, handing DATA to the
+** job or request whose stream it belongs to. Frames of streams that were
+** cancelled are dropped.
+**
+** returns 0 on success, -1 if the connection is lost
+*/
+static int _mux_read(Shell *shell) {
+    int num = line_reader_fill(&shell->frames, shell->sockfd);
+    if (num == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (num <= 0) {
+        if (num == 0) {
+            ERR_PRINT("Server closed the connection\n");
+        } else {
+            perror("_mux_read");
+        }
+        return -1;
+    }
+
+    FrameHeader header;
+    uint8_t *payload;
+    int ret;
+    while ((ret = frame_next(&shell->frames, &header, &payload, V2_MAX_FRAME_PAYLOAD)) == 1) {
+        uint8_t end = header.type == V2_FRAME_ERROR || (header.flags & V2_FLAG_END);
+
+        if (shell->control_stream != 0 && header.stream_id == shell->control_stream) {
+            if (header.type == V2_FRAME_ERROR) {
+                ERR_PRINT("%.*s\n", (int)header.length, payload);
+                shell->control_status = -1;
+            } else if (line_reader_feed(shell->control_response, payload, header.length) == -1) {
+                shell->control_status = -1;
+            } else if (end) {
+                shell->control_status = 1;
+            } else {
+                // Responses are small, so the window is given back as they arrive
+                _mux_grant(shell, header.stream_id, &shell->control_ungranted, header.length);
+            }
+            if (end) {
+                shell->control_stream = 0;
+            }
+            continue;
+        }
+
+        Job *job = shell->jobs;
+        while (job != NULL && (job->stream_id != header.stream_id || !job->stream_open)) {
+            job = job->next;
+        }
+        if (job == NULL) {
+            continue;
+        }
+        if (end) {
+            job->stream_open = 0;
+        }
+        if (header.type == V2_FRAME_ERROR) {
+            ERR_PRINT("%.*s\n", (int)header.length, payload);
+            _job_end_transfer(shell, job, "Failed");
+            continue;
+        }
+        _job_deliver(shell, job, payload, header.length);
+        if (end && !job->finished && job->state != JOB_PLAYING &&
+            (job->state == JOB_HEADER || job->received < job->file_size)) {
+            _job_end_transfer(shell, job, "Failed");
+        }
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+
+/*
+** Helper for: the protocol v2 shell
+** Makes a request on a stream of its own, and waits for the whole response in
+** response, while the jobs' streams keep being received.
+**
+** returns 0 on success, -1 on error
+*/
+static int _mux_request(Shell *shell, const void *request, uint32_t length,
+                        LineReader *response) {
+    shell->control_stream = ++shell->next_stream_id;
+    shell->control_response = response;
+    shell->control_status = 0;
+    shell->control_ungranted = 0;
+    if (_mux_send(shell, V2_FRAME_REQUEST, shell->control_stream, request, length) == -1) {
+        shell->control_stream = 0;
+        return -1;
+    }
+
+    while (shell->control_status == 0) {
+        if (_mux_read(shell) == -1) {
+            shell->control_stream = 0;
+            return -1;
+        }
+    }
+    return shell->control_status == 1 ? 0 : -1;
+}
+
+
+static int _mux_list_request(Shell *shell) {
+    LineReader response;
+    if (line_reader_init(&response, RESPONSE_BUFFER_SIZE, 0) == -1) {
+        return -1;
+    }
+    int result = -1;
+    uint32_t size;
+    if (clist_supported) {
+        // A server that does not know CLIST answers with an ERROR frame
+        if (_mux_request(shell, REQUEST_CLIST END_OF_MESSAGE_TOKEN, 7, &response) == 0) {
+            if (line_reader_take(&response, &size, sizeof(uint32_t)) == sizeof(uint32_t)) {
+                result = _read_clist_response(&size, (uint8_t *)response.buf + response.start,
+                                              response.end - response.start, &shell->library);
+            }
+            line_reader_free(&response);
+            return result;
+        }
+        printf("Server does not support compact lists, using LIST\n");
+        clist_supported = 0;
+        line_reader_free(&response);
+        if (line_reader_init(&response, RESPONSE_BUFFER_SIZE, 0) == -1) {
+            return -1;
+        }
+    }
+    if (_mux_request(shell, REQUEST_LIST END_OF_MESSAGE_TOKEN, 6, &response) == 0) {
+        result = _read_list_response(-1, &response, &shell->library);
+    }
+    line_reader_free(&response);
+    return result;
+}
+
+
+static int _mux_stat_request(Shell *shell, uint32_t file_index, uint32_t *size, uint32_t *mtime) {
+    uint8_t request[10];
+    uint32_t network_file_index = htonl(file_index);
+    memcpy(request, REQUEST_STAT END_OF_MESSAGE_TOKEN, 6);
+    memcpy(request + 6, &network_file_index, sizeof(uint32_t));
+
+    LineReader response;
+    if (line_reader_init(&response, 2 * sizeof(uint32_t), 0) == -1) {
+        return -1;
+    }
+    int result = -1;
+    uint32_t stat[2];
+    if (_mux_request(shell, request, sizeof(request), &response) == 0 &&
+        line_reader_take(&response, stat, sizeof(stat)) == sizeof(stat)) {
+        *size = ntohl(stat[0]);
+        *mtime = ntohl(stat[1]);
+        result = 0;
+    }
+    line_reader_free(&response);
+    return result;
+}
+
+
+static int _mux_stats_request(Shell *shell) {
+    LineReader response;
+    if (line_reader_init(&response, RESPONSE_BUFFER_SIZE, 0) == -1) {
+        return -1;
+    }
+    int result = -1;
+    uint32_t report_len;
+    if (_mux_request(shell, REQUEST_STATS END_OF_MESSAGE_TOKEN, 7, &response) == 0 &&
+        line_reader_take(&response, &report_len, sizeof(uint32_t)) == sizeof(uint32_t)) {
+        report_len = ntohl(report_len);
+        char *report = malloc(report_len);
+        if (report != NULL && line_reader_take(&response, report, report_len) == report_len) {
+            printf("%.*s", (int)report_len, report);
+            result = 0;
+        }
+        free(report);
+    }
+    line_reader_free(&response);
+    return result;
+}
+
+
+static int _mux_search_request(Shell *shell, uint8_t mode, uint16_t limit, const char *query) {
+    uint8_t request[sizeof(REQUEST_SEARCH END_OF_MESSAGE_TOKEN) + SEARCH_HEADER_SIZE +
+                    SEARCH_MAX_QUERY];
+    uint32_t len = _build_search_request(request, mode, limit, query);
+
+    LineReader response;
+    if (line_reader_init(&response, RESPONSE_BUFFER_SIZE, 0) == -1) {
+        return -1;
+    }
+    int result = -1;
+    uint32_t body_len;
+    if (_mux_request(shell, request, len, &response) == 0 &&
+        line_reader_take(&response, &body_len, sizeof(uint32_t)) == sizeof(uint32_t)) {
+        body_len = ntohl(body_len);
+        char *body = malloc(MAX(body_len, 1));
+        if (body != NULL && line_reader_take(&response, body, body_len) == body_len) {
+            result = _print_search_response(body, body_len);
+        }
+        free(body);
+    }
+    line_reader_free(&response);
+    return result;
+}
+
+
+static int _mux_browse_request(Shell *shell) {
+    uint8_t request[sizeof(REQUEST_BROWSE END_OF_MESSAGE_TOKEN) + BROWSE_HEADER_SIZE +
+                    2 * BROWSE_MAX_ARG];
+    uint32_t len = _build_browse_request(request, shell->browse_dir, shell->browse_count,
+                                         shell->browse_token);
+
+    LineReader response;
+    if (line_reader_init(&response, RESPONSE_BUFFER_SIZE, 0) == -1) {
+        return -1;
+    }
+    int result = -1;
+    uint32_t body_len;
+    if (_mux_request(shell, request, len, &response) == 0 &&
+        line_reader_take(&response, &body_len, sizeof(uint32_t)) == sizeof(uint32_t)) {
+        body_len = ntohl(body_len);
+        char *body = malloc(MAX(body_len, 1));
+        if (body != NULL && line_reader_take(&response, body, body_len) == body_len) {
+            result = _read_browse_response(body, body_len, shell->browse_dir,
+                                           shell->browse_token, &shell->library);
+        }
+        free(body);
+    }
+    line_reader_free(&response);
+    return result;
+}
+
+
+static int _mux_waveform_request(Shell *shell, uint32_t file_index, uint16_t num_buckets) {
+    uint8_t request[WAVEFORM_REQUEST_SIZE];
+    _build_waveform_request(request, file_index, num_buckets);
+
+    LineReader response;
+    if (line_reader_init(&response, RESPONSE_BUFFER_SIZE, 0) == -1) {
+        return -1;
+    }
+    int result = -1;
+    uint32_t body_len;
+    if (_mux_request(shell, request, WAVEFORM_REQUEST_SIZE, &response) == 0 &&
+        line_reader_take(&response, &body_len, sizeof(uint32_t)) == sizeof(uint32_t)) {
+        body_len = ntohl(body_len);
+        uint8_t *body = malloc(MAX(body_len, 1));
+        if (body != NULL && line_reader_take(&response, body, body_len) == body_len) {
+            result = _print_waveform_response(body, body_len);
+        }
+        free(body);
+    }
+    line_reader_free(&response);
+    return result;
+}
+
+
+/*
+** Helper for: _run_command
+** Parses the options and directory of a browse command, or continues the
+** last one for a more command, and runs it.
+**
+** returns 0 on success, -1 if the shell can't go on
+*/
+static int _browse_command(Shell *shell, uint8_t more) {
+    if (more) {
+        if (shell->browse_token[0] == '\0') {
+            printf("Nothing more to browse\n");
+            return 0;
+        }
+    } else {
+        shell->browse_count = 0;
+        char *arg = strtok(NULL, " \n");
+        if (arg != NULL && strcmp(arg, "-n") == 0 && (arg = strtok(NULL, " \n")) != NULL) {
+            shell->browse_count = MIN(strtoul(arg, NULL, 10), BROWSE_MAX_COUNT);
+            arg = strtok(NULL, " \n");
+        }
+        // The directory is the rest of the line, spaces and all
+        if (arg != NULL && strtok(NULL, "\n") != NULL) {
+            arg[strlen(arg)] = ' ';
+        }
+        snprintf(shell->browse_dir, sizeof(shell->browse_dir), "%s", arg == NULL ? "" : arg);
+        shell->browse_token[0] = '\0';
+    }
+
+    if (shell->multiplexed) {
+        if (_mux_browse_request(shell) == -1) {
+            shell->browse_token[0] = '\0';
+            ERR_PRINT("Could not browse the library\n");
+        }
+        return 0;
+    }
+    int result = browse_request(shell->sockfd, shell->browse_dir, shell->browse_count,
+                                shell->browse_token, &shell->library);
+    if (result < 0) {
+        shell->browse_token[0] = '\0';
+    }
+    if (result == -2) {
+        printf("Server does not support browsing\n");
+    } else if (result == -1) {
+        ERR_PRINT("Could not browse the library\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: _run_command
+** Parses the options and query of a search command, and runs it.
+**
+** returns 0 on success, -1 if the shell can't go on
+*/
+static int _search_command(Shell *shell) {
+    uint8_t mode = SEARCH_SUBSTRING;
+    uint16_t limit = 0;
+    char *arg = strtok(NULL, " \n");
+    while (arg != NULL && arg[0] == '-') {
+        if (strcmp(arg, "-p") == 0) {
+            mode = SEARCH_PREFIX;
+        } else if (strcmp(arg, "-f") == 0) {
+            mode = SEARCH_FUZZY;
+        } else if (strcmp(arg, "-n") == 0 && (arg = strtok(NULL, " \n")) != NULL) {
+            limit = MIN(strtoul(arg, NULL, 10), SEARCH_MAX_LIMIT);
+        } else {
+            break;
+        }
+        arg = strtok(NULL, " \n");
+    }
+    if (arg == NULL) {
+        printf("Usage: search [-p] [-f] [-n <max_matches>] <query>\n");
+        return 0;
+    }
+    // The query is the rest of the line, spaces and all
+    char *rest = strtok(NULL, "\n");
+    if (rest != NULL) {
+        arg[strlen(arg)] = ' ';
+    }
+
+    if (shell->multiplexed) {
+        if (_mux_search_request(shell, mode, limit, arg) == -1) {
+            ERR_PRINT("Could not search the library\n");
+        }
+        return 0;
+    }
+    int result = search_request(shell->sockfd, mode, limit, arg);
+    if (result == -2) {
+        printf("Server does not support searching\n");
+    } else if (result == -1) {
+        ERR_PRINT("Could not search the library\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: _start_job
+** Builds the STREAM, or for a seek job the SEEK, request of a job in request.
+**
+** returns the request's length
+*/
+static uint32_t _build_job_request(const Job *job, uint8_t request[SEEK_REQUEST_SIZE]) {
+    uint32_t network_file_index = htonl(job->file_index);
+    if (job->kind != JOB_SEEK) {
+        memcpy(request, REQUEST_STREAM END_OF_MESSAGE_TOKEN, 8);
+        memcpy(request + 8, &network_file_index, sizeof(uint32_t));
+        return 8 + sizeof(uint32_t);
+    }
+    uint32_t network_ms = htonl(job->seek_ms);
+    memcpy(request, REQUEST_SEEK END_OF_MESSAGE_TOKEN, 6);
+    memcpy(request + 6, &network_file_index, sizeof(uint32_t));
+    memcpy(request + 6 + sizeof(uint32_t), &network_ms, sizeof(uint32_t));
+    return SEEK_REQUEST_SIZE;
+}
+
+
+/*
+** Creates a job for the command, and starts its transfer. A seek job starts
+** the track at seek_ms.
+**
+** returns the new job, NULL on error
+*/
+static Job *_start_job(Shell *shell, JobKind kind, uint32_t file_index, uint32_t seek_ms,
+                       uint8_t background) {
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL) {
+        perror("_start_job");
+        return NULL;
+    }
+    job->kind = kind;
+    job->file_index = file_index;
+    job->seek_ms = seek_ms;
+    job->background = background;
+    job->src_fd = job->audio_out_fd = job->file_dest_fd = job->audio_player = -1;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    job->path = strdup(kind == JOB_LISTEN ? STATION_JOB_PATH : shell->library.files[file_index]);
+    if (job->path == NULL) {
+        perror("_start_job");
+        goto error;
+    }
+
+    if (kind == JOB_STREAM && shell->cache->max_bytes > 0) {
+        uint32_t size;
+        int stat_result = shell->multiplexed
+                          ? _mux_stat_request(shell, file_index, &size, &job->mtime)
+                          : stat_request(shell->sockfd, file_index, &size, &job->mtime);
+        if (stat_result == -1) {
+            goto error;
+        }
+        job->src_fd = cache_lookup(shell->cache, job->path, size, job->mtime);
+        if (job->src_fd != -1) {
+            job->src_is_cache = 1;
+            job->file_size = size;
+            job->state = JOB_TRANSFER;
+        } else {
+            job->file_dest_fd = cache_begin_insert(shell->cache, job->path, size);
+            job->caching = job->file_dest_fd != -1;
+        }
+    } else if (kind == JOB_GET || kind == JOB_STREAM_AND_GET) {
+        job->file_dest_fd = file_index_to_fd(file_index, &shell->library);
+        if (job->file_dest_fd == -1) {
+            goto error;
+        }
+    }
+
+    if (kind == JOB_LISTEN) {
+        job->src_fd = connect_to_server(shell->port, shell->hostname);
+        if (job->src_fd == -1 ||
+            write_precisely(job->src_fd, REQUEST_STATION END_OF_MESSAGE_TOKEN, 9) != 9) {
+            goto error;
+        }
+        fcntl(job->src_fd, F_SETFL, fcntl(job->src_fd, F_GETFL) | O_NONBLOCK);
+        job->state = JOB_HEADER;
+    } else if (job->src_fd == -1 && shell->multiplexed) {
+        uint8_t request[SEEK_REQUEST_SIZE];
+        uint32_t request_len = _build_job_request(job, request);
+        job->stream_id = ++shell->next_stream_id;
+        if (_mux_send(shell, V2_FRAME_REQUEST, job->stream_id, request, request_len) == -1) {
+            goto error;
+        }
+        job->stream_open = 1;
+        job->state = JOB_HEADER;
+    } else if (job->src_fd == -1) {
+        uint8_t request[SEEK_REQUEST_SIZE];
+        uint32_t request_len = _build_job_request(job, request);
+        job->src_fd = connect_to_server(shell->port, shell->hostname);
+        if (job->src_fd == -1 || write_precisely(job->src_fd, request, request_len) != request_len) {
+            goto error;
+        }
+        fcntl(job->src_fd, F_SETFL, fcntl(job->src_fd, F_GETFL) | O_NONBLOCK);
+        job->state = JOB_HEADER;
+    }
+
+    if (kind != JOB_GET) {
+        job->audio_player = _open_audio_output(&job->audio_out_fd);
+        if (job->audio_player == -1) {
+            goto error;
+        }
+        fcntl(job->audio_out_fd, F_SETFL, fcntl(job->audio_out_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    job->id = ++shell->next_job_id;
+    Job **tail = &shell->jobs;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = job;
+
+    _job_progress(shell, job);
+    return job;
+
+error:
+    if (job->stream_open) {
+        _mux_send(shell, V2_FRAME_CANCEL, job->stream_id, NULL, 0);
+    }
+    if (job->src_fd >= 0) {
+        close(job->src_fd);
+    }
+    if (job->file_dest_fd >= 0) {
+        close(job->file_dest_fd);
+    }
+    if (job->caching) {
+        cache_abort_insert(shell->cache, job->path);
+    }
+    free(job->path);
+    free(job);
+    return NULL;
+}
+
+
+static Job *_find_job(const Shell *shell, int id) {
+    for (Job *job = shell->jobs; job != NULL; job = job->next) {
+        if (job->id == id && !job->hidden && !job->finished) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+
+static void _cancel_job(Shell *shell, Job *job) {
+    if (job->state != JOB_PLAYING) {
+        _job_end_transfer(shell, job, "Cancelled");
+        return;
+    }
+    printf("[%d] Cancelled %s %u: %s\n", job->id, job_kind_names[job->kind],
+           job->file_index, job->path);
+    job->hidden = 1;
+    _job_stop_player(job);
+}
+
+
+/*
+** Finishes the jobs whose players are done with their tracks.
+*/
+static void _check_players(Shell *shell) {
+    // The warm player went away, none of its tracks will report an end
+    if (warm_audio_player_fd() != shell->player_fd) {
+        if (shell->player_fd >= 0) {
+            poller_watch(&shell->poller, shell->player_fd, 0, NULL);
+            for (Job *job = shell->jobs; job != NULL; job = job->next) {
+                if (job->audio_player == 0) {
+                    job->track_ended = 1;
+                }
+            }
+        }
+        shell->player_fd = warm_audio_player_fd();
+        if (shell->player_fd >= 0) {
+            poller_watch(&shell->poller, shell->player_fd, POLLER_READ, NULL);
+        }
+    }
+
+    for (Job *job = shell->jobs; job != NULL; job = job->next) {
+        if (job->finished || job->state != JOB_PLAYING) {
+            continue;
+        }
+        int status;
+        if ((job->audio_player == 0 && job->track_ended) ||
+            (job->audio_player > 0 && waitpid(job->audio_player, &status, WNOHANG) != 0)) {
+            _job_finish(shell, job);
+        }
+    }
+}
+
+
+static void _track_ended(Shell *shell) {
+    for (Job *job = shell->jobs; job != NULL; job = job->next) {
+        if (job->audio_player == 0 && !job->track_ended) {
+            job->track_ended = 1;
+            return;
+        }
+    }
+}
+
+
+static void _reap_jobs(Shell *shell) {
+    Job **link = &shell->jobs;
+    while (*link != NULL) {
+        Job *job = *link;
+        if (!job->finished) {
+            link = &job->next;
+            continue;
+        }
+        if (job->id == shell->foreground_job) {
+            shell->foreground_job = 0;
+        }
+        *link = job->next;
+        free(job->path);
+        free(job);
+    }
+}
+
+
+/*
+** Players started per track are polled, since they only report by exiting.
+*/
+static int _next_timeout(const Shell *shell) {
+    for (const Job *job = shell->jobs; job != NULL; job = job->next) {
+        if (job->state == JOB_PLAYING && job->audio_player > 0) {
+            return JOB_POLL_INTERVAL_MS;
+        }
+    }
+    return -1;
+}
+
+
+static void _print_jobs(const Shell *shell) {
+    int num_jobs = 0;
+    double total_rate = 0;
+    for (const Job *job = shell->jobs; job != NULL; job = job->next) {
+        if (job->hidden || job->finished) {
+            continue;
+        }
+        num_jobs++;
+        printf("[%d] %s %u: %s: ", job->id, job_kind_names[job->kind],
+               job->file_index, job->path);
+        if (job->state == JOB_PLAYING) {
+            printf("playing\n");
+            continue;
+        }
+
+        long ms = _elapsed_ms(&job->started);
+        double rate = ms > 0 ? job->received / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+        total_rate += rate;
+        if (job->file_size == STATION_LIVE_SIZE) {
+            printf("%u KiB live at %.2f MiB/s\n", job->received / 1024, rate);
+            continue;
+        }
+        printf("%u / %u KiB (%.0f%%) at %.2f MiB/s%s\n", job->received / 1024,
+               job->file_size / 1024,
+               job->file_size ? 100.0 * job->received / job->file_size : 0.0,
+               rate, job->src_is_cache ? " from the cache" : "");
+    }
+
+    if (num_jobs == 0) {
+        printf("No jobs\n");
+    } else {
+        printf("%d jobs, %.2f MiB/s in total\n", num_jobs, total_rate);
+    }
+    printf("%llu reads and %llu writes so far\n", (unsigned long long)io_stats.read_calls,
+           (unsigned long long)io_stats.write_calls);
+}
+
+
+static void _print_shell_help(){
+    printf("Commands:\n");
+    printf("  list: List the files in the library\n");
+    printf("  get <file_index>: Get a file from the library\n");
+    printf("  stream <file_index>: Stream a file from the library (without saving it)\n");
+    printf("  stream+ <file_index>: Stream a file from the library\n");
+    printf("                        and save it to the local library\n");
+    printf("  ustream <file_index>: Stream a file over UDP, for lower latency\n");
+    printf("  listen: Tune in to the server's station in the background, until cancelled\n");
+    printf("  seek <file_index> <[h:]m:s or seconds>: Stream a file from a point in time\n");
+    printf("  Add & after get, stream, stream+ or seek to run it in the background\n");
+    printf("  jobs: List the transfers in progress\n");
+    printf("  cancel <job_id>: Cancel a transfer\n");
+    printf("  cache: Show the contents and hit rate of the track cache\n");
+    printf("  stats: Show the server's statistics\n");
+    printf("  search [-p] [-f] [-n <max_matches>] <query>: Find files whose paths have the\n");
+    printf("                        query in them, -p at the start of a word, -f roughly\n");
+    printf("  browse [-n <max_children>] [<dir>]: List a directory of the library\n");
+    printf("  more: List the next page of the directory browsed last\n");
+    printf("  waveform <file_index> [<buckets>]: Show a WAV file's loudness and draw its\n");
+    printf("                        waveform, %d buckets wide unless given\n",
+           WAVEFORM_PLOT_BUCKETS);
+    printf("  help: Display this help message\n");
+    printf("  quit: Quit the client\n");
+}
+
+
+/*
+** Helper for: _run_command
+** Parses the file index argument of a command.
+**
+** returns the file index, -1 if it is missing or invalid
+*/
+static int _parse_file_index(const char *command, const Library *library) {
+    char *file_index_str = strtok(NULL, " \n");
+    if (file_index_str == NULL) {
+        printf("Usage: %s <file_index>\n", command);
+        return -1;
+    }
+    int file_index = strtol(file_index_str, NULL, 10);
+    // Browsing only fills in the files it came across
+    if (file_index < 0 || file_index >= library->num_files || library->files[file_index] == NULL) {
+        printf("Invalid file index\n");
+        return -1;
+    }
+    return file_index;
+}
+
+
+/*
+** Helper for: _run_command
+** Reads the time a seek starts at from the next token, as [h:]m:s or as
+** seconds, either with a fraction.
+**
+** returns the time in milliseconds, -1 if it is missing or invalid
+*/
+static int64_t _parse_seek_time(const char *command) {
+    char *time_str = strtok(NULL, " \n");
+    if (time_str == NULL) {
+        printf("Usage: %s <file_index> <[h:]m:s or seconds>\n", command);
+        return -1;
+    }
+    // Each field before the last counts 60 of the next
+    double seconds = 0;
+    char *field = time_str;
+    for (int num_fields = 1; ; num_fields++) {
+        char *end;
+        double value = strtod(field, &end);
+        if (end == field || value < 0 || num_fields > 3 || (*end != ':' && *end != '\0')) {
+            printf("Invalid time\n");
+            return -1;
+        }
+        seconds = 60 * seconds + value;
+        if (*end == '\0') {
+            break;
+        }
+        field = end + 1;
+    }
+    if (seconds * 1000 > UINT32_MAX) {
+        printf("Invalid time\n");
+        return -1;
+    }
+    return (int64_t)(seconds * 1000);
+}
+
+
+/*
+** Helper for: _run_command
+** Parses the file index and number of buckets of a waveform command, and
+** runs it.
+**
+** returns 0 on success, -1 if the shell can't go on
+*/
+static int _waveform_command(Shell *shell, const char *command) {
+    int file_index = _parse_file_index(command, &shell->library);
+    if (file_index == -1) {
+        return 0;
+    }
+    char *arg = strtok(NULL, " \n");
+    uint16_t num_buckets = arg == NULL ? WAVEFORM_PLOT_BUCKETS
+                                       : MIN(strtoul(arg, NULL, 10), WAVE_MAX_BUCKETS);
+    if (num_buckets == 0) {
+        printf("Usage: %s <file_index> [<buckets>]\n", command);
+        return 0;
+    }
+
+    if (shell->multiplexed) {
+        if (_mux_waveform_request(shell, file_index, num_buckets) == -1) {
+            ERR_PRINT("Could not get the waveform of file %d\n", file_index);
+        }
+        return 0;
+    }
+    int result = waveform_request(shell->sockfd, file_index, num_buckets);
+    if (result == -2) {
+        printf("Server does not support waveforms\n");
+    } else if (result == -1) {
+        ERR_PRINT("Could not get the waveform of file %d\n", file_index);
         return -1;
     }
-
-    _wait_on_audio_player(audio_player_pid);
-
     return 0;
 }
 
-int send_and_process_stream_request(int sockfd, uint32_t file_index,
-                                    int audio_out_fd, int file_dest_fd) {
-    if (audio_out_fd < 0 && file_dest_fd < 0) {
-        fprintf(stderr, "Invalid file descriptors\n");
-        return -1;
-    }
-
-    // Write Stream Request to Socket
-    char stream_request_msg[12];
-    memcpy(stream_request_msg, "STREAM\r\n", 8);
-    uint32_t network_file_index = htonl(file_index);
-    memcpy(stream_request_msg + 8, &network_file_index, sizeof(uint32_t));
 
-    if (write_precisely(sockfd, stream_request_msg, 12) != 12) {
-        return -1;
+/*
+** Runs a single command line.
+**
+** returns 0 on success, -1 if the shell can't go on
+*/
+static int _run_command(Shell *shell, char *line) {
+    // A trailing & runs the command in the background
+    uint8_t background = 0;
+    char *ampersand = strrchr(line, '&');
+    if (ampersand != NULL && strspn(ampersand + 1, " \t\r") == strlen(ampersand + 1)) {
+        *ampersand = '\0';
+        background = 1;
     }
 
-    // Read In the File Size
-    int file_size;
-    if ((read_precisely(sockfd, &file_size, sizeof(int))) < 0) {
-        return -1;
+    char *command = strtok(line, " \n");
+    if (command == NULL) {
+        return 0;
     }
-    file_size = ntohl(file_size);
-
-    // Create fixed-size buffer to read from the socket
-    int bytes_to_read = file_size;
-    u_int8_t fixed_buffer[NETWORK_PRE_DYNAMIC_BUFF_SIZE];
-    u_int8_t *dynamic_buffer = NULL;
-    size_t dynamic_buffer_size = 0;
 
-    int audio_read_start_idx = 0;
-    int file_read_start_idx = 0;
+    JobKind kind;
+    // List Request -- list the files in the library
+    if (strcmp(command, CMD_LIST) == 0) {
+        int result = shell->multiplexed ? _mux_list_request(shell)
+                                        : list_request(shell->sockfd, &shell->library);
+        if (result == -1) {
+            return -1;
+        }
+        return 0;
 
-    int audio_out_written_count = 0;
-    int file_dest_written_count = 0;
+        // Get Request -- get a file from the library
+    } else if (strcmp(command, CMD_GET) == 0) {
+        kind = JOB_GET;
 
-    // Set Parameters for select syscall
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(sockfd, &read_fds);
+        // Stream Request -- stream a file from the library (without saving it)
+    } else if (strcmp(command, CMD_STREAM) == 0) {
+        kind = JOB_STREAM;
 
-    struct timeval timeout;
-    timeout.tv_sec = SELECT_TIMEOUT_SEC;
-    timeout.tv_usec = SELECT_TIMEOUT_USEC;
+        // Stream and Get Request -- stream a file from the library and save it to the local library
+    } else if (strcmp(command, CMD_STREAM_AND_GET) == 0) {
+        kind = JOB_STREAM_AND_GET;
 
-    // numfd parameter in the select syscall is the value of the highest file descriptor in the set + 1.
-    int numfd;
-    if (sockfd > audio_out_fd && sockfd > file_dest_fd) {
-        numfd = sockfd + 1;
-    } else if (audio_out_fd > sockfd && audio_out_fd > file_dest_fd) {
-        numfd = audio_out_fd + 1;
-    } else {
-        numfd = file_dest_fd + 1;
-    }
+    } else if (strcmp(command, CMD_SEEK) == 0) {
+        kind = JOB_SEEK;
 
-    while (1) {
-        // Set up a copy of read_fds as select mutates the read_fds set.
-        // This ensures only a copy is being mutated and not the actual set
-        fd_set curr_read_fd_sets = read_fds;
+    } else if (strcmp(command, CMD_LISTEN) == 0) {
+        // Never ends on its own, so it must leave the shell free to cancel it
+        kind = JOB_LISTEN;
+        background = 1;
 
-        // Our select call does not use write_fds as write calls are not blocked as there is always something to read
-        // from the fixed buffer (as we select on the read_fds to ensure that read is never blocked.
-        if ((select(numfd, &curr_read_fd_sets, NULL, NULL, &timeout)) < 0) {
-            perror("select");
-            exit(1);
+    } else if (strcmp(command, CMD_USTREAM) == 0) {
+        // Runs in the foreground, the event loop waits for it
+        int file_index = _parse_file_index(command, &shell->library);
+        if (file_index != -1 && udp_stream_request(shell->port, shell->hostname, file_index) == -1) {
+            ERR_PRINT("Could not %s file %d\n", command, file_index);
         }
+        return 0;
 
-        if (FD_ISSET(sockfd, &curr_read_fd_sets)) {
-            int r;
-            if ((r = read(sockfd, fixed_buffer, sizeof(u_int8_t) * NETWORK_PRE_DYNAMIC_BUFF_SIZE)) < 0) {
-                // Read from socket to the fixed_buffer
-                // Using read instead of read_precisely is better in this case as it does not block
-                // until it has read NETWORK_PRE_DYNAMIC_BUFF_SIZE bytes (it reads as many as available)
-                perror("read");
-                exit(1);
-            }
+    } else if (strcmp(command, CMD_JOBS) == 0) {
+        _print_jobs(shell);
+        return 0;
 
-            dynamic_buffer = realloc(dynamic_buffer, dynamic_buffer_size + r);
-            u_int8_t *write_to_dynamic_buffer_from = dynamic_buffer + dynamic_buffer_size;
-            dynamic_buffer_size += r;
-            memcpy(write_to_dynamic_buffer_from, fixed_buffer, r);
-            bytes_to_read = bytes_to_read - r;
+    } else if (strcmp(command, CMD_CANCEL) == 0) {
+        char *job_id_str = strtok(NULL, " \n");
+        if (job_id_str == NULL) {
+            printf("Usage: cancel <job_id>\n");
+            return 0;
         }
+        Job *job = _find_job(shell, strtol(job_id_str, NULL, 10));
+        if (job == NULL) {
+            printf("No such job\n");
+            return 0;
+        }
+        _cancel_job(shell, job);
+        return 0;
 
-        int audio_bytes_written = 0;
-        int audio_bytes_to_write;
-        int file_bytes_written = 0;
-        int file_bytes_to_write;
+    } else if (strcmp(command, CMD_CACHE) == 0) {
+        cache_print_stats(shell->cache);
+        return 0;
 
-        if (audio_out_fd > -1 && file_dest_fd > -1 && dynamic_buffer != NULL) {
-            int written_differential_audio = audio_out_written_count - file_dest_written_count;
-            int written_differential_file = file_dest_written_count - audio_out_written_count;
-            if (written_differential_audio > 0) {
-                audio_read_start_idx = written_differential_audio;
-            }
-            if (written_differential_file > 0) {
-                file_read_start_idx = written_differential_file;
-            }
-            audio_bytes_to_write = dynamic_buffer_size - audio_read_start_idx;
-            if ((audio_bytes_written = write(audio_out_fd, dynamic_buffer + audio_read_start_idx, audio_bytes_to_write)) < 0) {
-                perror("write");
-                exit(1);
-            }
-            audio_out_written_count += audio_bytes_written;
-            file_bytes_to_write = dynamic_buffer_size - file_read_start_idx;
-            if ((file_bytes_written = write(file_dest_fd, dynamic_buffer + file_read_start_idx, file_bytes_to_write)) < 0) {
-                perror("write");
-                exit(1);
-            }
-            file_dest_written_count += file_bytes_written;
-        } else if (audio_out_fd > -1 && dynamic_buffer != NULL) {
-            audio_bytes_to_write = dynamic_buffer_size - audio_read_start_idx;
-            if ((audio_bytes_written = write(audio_out_fd, dynamic_buffer + audio_read_start_idx, audio_bytes_to_write)) < 0) {
-                perror("write");
-                exit(1);
-            }
-            audio_out_written_count += audio_bytes_written;
-        } else if (file_dest_fd > -1  && dynamic_buffer != NULL) {
-            file_bytes_to_write = dynamic_buffer_size - file_read_start_idx;
-            if ((file_bytes_written = write(file_dest_fd, dynamic_buffer + file_read_start_idx, file_bytes_to_write)) < 0) {
-                perror("write");
-                exit(1);
-            }
-            file_dest_written_count += file_bytes_written;
+    } else if (strcmp(command, CMD_STATS) == 0) {
+        int result = shell->multiplexed ? _mux_stats_request(shell)
+                                        : stats_request(shell->sockfd);
+        if (result == -1) {
+            ERR_PRINT("Could not get the server's statistics\n");
+            return -1;
         }
+        return 0;
 
-        int lowest_bytes_written = 0;
-        if (file_dest_fd > -1 && audio_out_fd > -1 && dynamic_buffer != NULL) {
-            if (file_read_start_idx + file_bytes_written < audio_read_start_idx + audio_bytes_written) {
-                lowest_bytes_written = file_read_start_idx + file_bytes_written;
-            } else {
-                lowest_bytes_written = audio_read_start_idx + audio_bytes_written;
-            }
-        } else if (file_dest_fd < 0 && dynamic_buffer != NULL) {
-            lowest_bytes_written = audio_bytes_written;
-        } else if (audio_out_fd < 0 && dynamic_buffer != NULL) {
-            lowest_bytes_written = file_bytes_written;
-        }
+    } else if (strcmp(command, CMD_SEARCH) == 0) {
+        return _search_command(shell);
 
-        if (dynamic_buffer != NULL) {
-            dynamic_buffer_size = dynamic_buffer_size - lowest_bytes_written;
-            u_int8_t dynamic_buffer_stack[dynamic_buffer_size];
-            memcpy(dynamic_buffer_stack, dynamic_buffer + lowest_bytes_written, dynamic_buffer_size);
-            dynamic_buffer = realloc(dynamic_buffer, sizeof(u_int8_t) * dynamic_buffer_size);
-            memset(dynamic_buffer, '\0', dynamic_buffer_size);
-            memcpy(dynamic_buffer, dynamic_buffer_stack, dynamic_buffer_size);
-        }
+    } else if (strcmp(command, CMD_BROWSE) == 0 || strcmp(command, CMD_MORE) == 0) {
+        return _browse_command(shell, strcmp(command, CMD_MORE) == 0);
 
-        if (bytes_to_read == 0 || file_dest_written_count >= file_size || audio_out_written_count >= file_size) {
-            break;
-        }
-    }
+    } else if (strcmp(command, CMD_WAVEFORM) == 0) {
+        return _waveform_command(shell, command);
 
-    if (bytes_to_read == 0) {
-        free(dynamic_buffer);
-        close(audio_out_fd);
-        close(file_dest_fd);
+    } else if (strcmp(command, CMD_HELP) == 0) {
+        _print_shell_help();
+        return 0;
+
+    } else if (strcmp(command, CMD_QUIT) == 0) {
+        printf("Quitting shell\n");
+        shell->quit = 1;
+        return 0;
+
+    } else {
+        printf("Invalid command\n");
+        return 0;
     }
 
+    int file_index = kind == JOB_LISTEN ? 0 : _parse_file_index(command, &shell->library);
+    if (file_index == -1) {
+        return 0;
+    }
+    int64_t seek_ms = kind == JOB_SEEK ? _parse_seek_time(command) : 0;
+    if (seek_ms == -1) {
+        return 0;
+    }
+    Job *job = _start_job(shell, kind, file_index, seek_ms, background);
+    if (job == NULL) {
+        ERR_PRINT("Could not %s file %d\n", command, file_index);
+        return 0;
+    }
+    if (background) {
+        printf("[%d] %s %d: %s\n", job->id, command, file_index, job->path);
+    } else if (!job->finished) {
+        shell->foreground_job = job->id;
+    }
     return 0;
 }
 
 
-static void _print_shell_help(){
-    printf("Commands:\n");
-    printf("  list: List the files in the library\n");
-    printf("  get <file_index>: Get a file from the library\n");
-    printf("  stream <file_index>: Stream a file from the library (without saving it)\n");
-    printf("  stream+ <file_index>: Stream a file from the library\n");
-    printf("                        and save it to the local library\n");
-    printf("  help: Display this help message\n");
-    printf("  quit: Quit the client\n");
+/*
+** Helper for: client_shell
+** Reads whatever is available on stdin into the shell's input buffer.
+*/
+static void _read_input(Shell *shell) {
+    int room = REQUEST_BUFFER_SIZE - 1 - shell->input_len;
+    if (room == 0) {
+        printf("Command too long\n");
+        shell->input_len = 0;
+        return;
+    }
+
+    int num = read(STDIN_FILENO, shell->input + shell->input_len, room);
+    if (num == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (num <= 0) {
+        if (num == -1) {
+            perror("client_shell");
+        }
+        // Still run a last command without a newline
+        if (shell->input_len > 0 && shell->input[shell->input_len - 1] != '\n') {
+            shell->input[shell->input_len++] = '\n';
+        }
+        shell->input_eof = 1;
+        return;
+    }
+    shell->input_len += num;
 }
 
 
@@ -571,116 +3057,152 @@ static void _print_shell_help(){
 ** - "get <file_index>" to get a file from the library
 ** - "stream <file_index>" to stream a file from the library (without saving it)
 ** - "stream+ <file_index>" to stream a file from the library and save it to the local library
+** - "ustream <file_index>" to stream a file over UDP, with lower latency but possible gaps
+** - "jobs" to list the transfers in progress
+** - "cancel <job_id>" to cancel a transfer
+** - "cache" to show the contents and hit rate of the track cache
 ** - "help" to display the help message
 ** - "quit" to quit the client
+**
+** The shell is an event loop over stdin, the jobs' connections and files, and
+** the audio players, so a get, stream or stream+ followed by & runs in the
+** background while the shell takes more commands. At the end of its input,
+** the shell waits for background jobs to finish; quit cancels them.
+**
+** When multiplexed, sockfd speaks protocol v2, and the jobs are streams on it
+** rather than connections of their own.
 */
-static int client_shell(int sockfd, const char *library_directory) {
-    char buffer[REQUEST_BUFFER_SIZE];
-    char *command;
-    int file_index;
-
-    Library library = {"client", library_directory, NULL, 0};
-
-    while (1) {
-        if (library.files == 0) {
-            printf("Server library is empty or not retrieved yet\n");
+static int client_shell(int sockfd, uint8_t multiplexed, int port, const char *hostname,
+                        const char *library_directory, TrackCache *cache) {
+    Shell shell;
+    memset(&shell, 0, sizeof(Shell));
+    shell.sockfd = sockfd;
+    shell.multiplexed = multiplexed;
+    shell.port = port;
+    shell.hostname = hostname;
+    shell.library = (Library){"client", library_directory, NULL, 0};
+    shell.cache = cache;
+    shell.player_fd = -1;
+    if (poller_init(&shell.poller) == -1) {
+        return -1;
+    }
+    if (multiplexed) {
+        if (line_reader_init(&shell.frames, V2_FRAME_HEADER_SIZE + V2_MAX_FRAME_PAYLOAD, 0) == -1) {
+            poller_destroy(&shell.poller);
+            return -1;
         }
-
-        printf("Enter a command: ");
-        if (fgets(buffer, REQUEST_BUFFER_SIZE, stdin) == NULL) {
-            perror("client_shell");
-            goto error;
+        poller_watch(&shell.poller, sockfd, POLLER_READ, NULL);
+    }
+    // Jobs notice players going away through EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    TRACE_INIT("as_client");
+
+    int result = 0;
+    uint8_t prompted = 0;
+    while (!shell.quit) {
+        // Run complete commands, unless a job holds the foreground
+        char *newline;
+        while (!shell.quit && !shell.foreground_job &&
+               (newline = memchr(shell.input, '\n', shell.input_len)) != NULL) {
+            *newline = '\0';
+            if (_run_command(&shell, shell.input) == -1) {
+                result = -1;
+                shell.quit = 1;
+            }
+            shell.input_len -= newline + 1 - shell.input;
+            memmove(shell.input, newline + 1, shell.input_len);
+            prompted = 0;
+            _reap_jobs(&shell);
         }
-
-        command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
+        if (shell.quit || (shell.input_eof && shell.jobs == NULL)) {
+            break;
         }
 
-        // List Request -- list the files in the library
-        if (strcmp(command, CMD_LIST) == 0) {
-            if (list_request(sockfd, &library) == -1) {
-                goto error;
-            }
-
-
-            // Get Request -- get a file from the library
-        } else if (strcmp(command, CMD_GET) == 0) {
-            char *file_index_str = strtok(NULL, " \n");
-            if (file_index_str == NULL) {
-                printf("Usage: get <file_index>\n");
-                continue;
-            }
-            file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files) {
-                printf("Invalid file index\n");
-                continue;
-            }
-
-            if (get_file_request(sockfd, file_index, &library) == -1) {
-                goto error;
-            }
-
-            // Stream Request -- stream a file from the library (without saving it)
-        } else if (strcmp(command, CMD_STREAM) == 0) {
-            char *file_index_str = strtok(NULL, " \n");
-            if (file_index_str == NULL) {
-                printf("Usage: stream <file_index>\n");
-                continue;
-            }
-            file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files) {
-                printf("Invalid file index\n");
-                continue;
-            }
-
-            if (stream_request(sockfd, file_index) == -1) {
-                goto error;
-            }
-
-            // Stream and Get Request -- stream a file from the library and save it to the local library
-        } else if (strcmp(command, CMD_STREAM_AND_GET) == 0) {
-            char *file_index_str = strtok(NULL, " \n");
-            if (file_index_str == NULL) {
-                printf("Usage: stream+ <file_index>\n");
-                continue;
-            }
-            file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files) {
-                printf("Invalid file index\n");
-                continue;
-            }
-
-            if (stream_and_get_request(sockfd, file_index, &library) == -1) {
-                goto error;
+        uint32_t stdin_events = 0;
+        if (!shell.foreground_job && !shell.input_eof) {
+            stdin_events = POLLER_READ;
+            if (!prompted) {
+                if (shell.library.files == 0) {
+                    printf("Server library is empty or not retrieved yet\n");
+                }
+                printf("Enter a command: ");
+                fflush(stdout);
+                prompted = 1;
             }
+        }
+        if (stdin_events != shell.stdin_events) {
+            poller_watch(&shell.poller, STDIN_FILENO, stdin_events, NULL);
+            shell.stdin_events = stdin_events;
+        }
+        _check_players(&shell);
 
-        } else if (strcmp(command, CMD_HELP) == 0) {
-            _print_shell_help();
-
-        } else if (strcmp(command, CMD_QUIT) == 0) {
-            printf("Quitting shell\n");
+        PollerEvent events[MAX_POLLER_EVENTS];
+        int num_events = poller_wait(&shell.poller, events, MAX_POLLER_EVENTS,
+                                     _next_timeout(&shell));
+        if (num_events == -1) {
+            result = -1;
             break;
+        }
 
-        } else {
-            printf("Invalid command\n");
+        for (int i = 0; i < num_events; i++) {
+            Job *job = events[i].data;
+            if (job == NULL && events[i].fd == STDIN_FILENO) {
+                _read_input(&shell);
+            } else if (job == NULL && shell.multiplexed && events[i].fd == shell.sockfd) {
+                if (_mux_read(&shell) == -1) {
+                    result = -1;
+                    shell.quit = 1;
+                }
+            } else if (job == NULL && events[i].fd == shell.player_fd) {
+                int num_ended = warm_audio_player_poll_track();
+                while (num_ended-- > 0) {
+                    _track_ended(&shell);
+                }
+            } else if (job != NULL && !job->finished) {
+                if (events[i].fd == job->src_fd && (events[i].events & POLLER_READ)) {
+                    _job_read(&shell, job);
+                } else if (events[i].fd == job->audio_out_fd && (events[i].events & POLLER_WRITE)) {
+                    _job_write(&shell, job);
+                }
+            }
         }
+        _check_players(&shell);
+        _reap_jobs(&shell);
     }
 
-    _free_library(&library);
-    return 0;
-    error:
-    _free_library(&library);
-    return -1;
+    for (Job *job = shell.jobs; job != NULL; job = job->next) {
+        if (!job->finished && !job->hidden) {
+            _cancel_job(&shell, job);
+        }
+        if (job->audio_player > 0) {
+            _wait_on_audio_player(job->audio_player);
+        }
+        job->finished = 1;
+    }
+    _reap_jobs(&shell);
+    stop_warm_audio_player();
+    poller_destroy(&shell.poller);
+    if (multiplexed) {
+        line_reader_free(&shell.frames);
+    }
+    _free_library(&shell.library);
+    return result;
 }
 
 
 static void print_usage() {
     printf("Usage: as_client [-h] [-a NETWORK_ADDRESS] [-p PORT] [-l LIBRARY_DIRECTORY]\n");
+    printf("                 [-c CACHE_DIRECTORY] [-C CACHE_MB] [-m]\n");
     printf("  -h: Print this help message\n");
     printf("  -a NETWORK_ADDRESS: Connect to server at NETWORK_ADDRESS (default 'localhost')\n");
     printf("  -p  Port to listen on (default: " XSTR(DEFAULT_PORT) ")\n");
     printf("  -l LIBRARY_DIRECTORY: Use LIBRARY_DIRECTORY as the library directory (default 'as-library')\n");
+    printf("  -c CACHE_DIRECTORY: Cache streamed tracks in CACHE_DIRECTORY (default '"
+           CACHE_DEFAULT_DIRECTORY "')\n");
+    printf("  -C CACHE_MB: Keep at most CACHE_MB MiB of tracks in the cache, 0 disables it"
+           " (default " XSTR(CACHE_DEFAULT_MAX_MB) ")\n");
+    printf("  -m: Multiplex all transfers over one connection with protocol v2, if the server"
+           " supports it\n");
 }
 
 
@@ -689,8 +3211,11 @@ int main(int argc, char * const *argv) {
     int port = DEFAULT_PORT;
     const char *hostname = "localhost";
     const char *library_directory = "saved";
+    const char *cache_directory = CACHE_DEFAULT_DIRECTORY;
+    long cache_mb = CACHE_DEFAULT_MAX_MB;
+    uint8_t multiplex = 0;
 
-    while ((opt = getopt(argc, argv, "ha:p:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "ha:p:l:c:C:m")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage();
@@ -708,21 +3233,54 @@ int main(int argc, char * const *argv) {
             case 'l':
                 library_directory = optarg;
                 break;
+            case 'c':
+                cache_directory = optarg;
+                break;
+            case 'C':
+                cache_mb = strtol(optarg, NULL, 10);
+                if (cache_mb < 0) {
+                    ERR_PRINT("Invalid cache size %ld\n", cache_mb);
+                    return 1;
+                }
+                break;
+            case 'm':
+                multiplex = 1;
+                break;
             default:
                 print_usage();
                 return 1;
         }
     }
 
+    TrackCache cache;
+    if (cache_open(&cache, cache_directory, (uint64_t)cache_mb * 1024 * 1024) == -1) {
+        return 1;
+    }
+
     printf("Connecting to server at %s:%d, using library in %s\n",
            hostname, port, library_directory);
 
     int sockfd = connect_to_server(port, hostname);
     if (sockfd == -1) {
+        cache_close(&cache);
         return -1;
     }
 
-    int result = client_shell(sockfd, library_directory);
+    if (multiplex) {
+        int negotiated = negotiate_v2(sockfd);
+        if (negotiated == -1) {
+            cache_close(&cache);
+            close(sockfd);
+            return -1;
+        }
+        if (negotiated == 0) {
+            printf("Server does not support protocol v2, using a connection per transfer\n");
+            multiplex = 0;
+        }
+    }
+
+    int result = client_shell(sockfd, multiplex, port, hostname, library_directory, &cache);
+    cache_close(&cache);
     if (result == -1) {
         close(sockfd);
         return -1;
@@ -731,3 +3289,4 @@ int main(int argc, char * const *argv) {
     close(sockfd);
     return 0;
 }
+#endif // AS_NO_MAIN
@@ -5,6 +5,18 @@
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
 #include "libas.h"
+#include "as_cache.h"
+#include "as_udp.h"
+#include "as_station.h"
+#include "as_clist.h"
+#include "as_search.h"
+#include "as_browse.h"
+#include "as_wave.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <time.h>
 
 /*
 ** The following constants are used to define a separate process that
@@ -20,10 +32,33 @@
 // uncomment to use the debug streamer
 //#define AUDIO_PLAYER "stream_debugger"
 //#define AUDIO_PLAYER_ARGS {AUDIO_PLAYER, "-c", "1024", "-f", "stream_dump.wav", NULL}
+// or to analyse streams as a real-time player would see them, in perf tests
+//#define AUDIO_PLAYER_ARGS {AUDIO_PLAYER, "-a", "-o", "stream_report.txt", NULL}
 
 // takes a while for mpv to start, make sure its ready
 #define AUDIO_PLAYER_BOOT_DELAY 2
 
+/*
+** Warm audio player
+** -----------------
+** When AUDIO_PLAYER_WARM is defined, the client keeps one long-lived mpv
+** around for the whole session instead of starting a new one per stream.
+** mpv is started idle with a JSON IPC socket; each track is handed to it
+** with a "loadfile" command naming a FIFO that the stream is then written to.
+** Readiness is detected by connecting to the IPC socket, so there is no fixed
+** AUDIO_PLAYER_BOOT_DELAY to pay. Comment it out to go back to one player
+** process per stream (needed for players without mpv's IPC, e.g. the debugger).
+*/
+#define AUDIO_PLAYER_WARM
+#define AUDIO_PLAYER_WARM_ARGS {AUDIO_PLAYER, "--idle=yes", "--no-terminal", \
+                                NULL /* --input-ipc-server=... */, NULL}
+#define AUDIO_PLAYER_IPC_FMT "/tmp/as_client.%d.sock"
+#define AUDIO_PLAYER_FIFO_FMT "/tmp/as_client.%d.%u.fifo"
+
+// How long to wait for the warm player to come up, or to open a track
+#define AUDIO_PLAYER_READY_TIMEOUT_MS 5000
+#define AUDIO_PLAYER_READY_POLL_MS 5
+
 #define SELECT_TIMEOUT_SEC 1
 #define SELECT_TIMEOUT_USEC 0
 
@@ -34,6 +69,32 @@
 // Student's don't need to change this
 #define BUFFER_BLEED_OFF 1
 
+// Audio each shell job holds for its player, and how often players started
+// per track are checked for having exited
+#define JOB_BUFFER_SIZE 65536
+#define JOB_POLL_INTERVAL_MS 100
+#define MAX_POLLER_EVENTS 64
+
+// How long a server gets to accept protocol v2, and the smallest window
+// update worth a frame
+#define V2_NEGOTIATE_TIMEOUT_MS 1000
+// How long a server from before RESPONSE_UNSUPPORTED gets to answer CLIST
+// before LIST is sent instead, over a new connection, and SEARCH, BROWSE and
+// WAVEFORM before they are given up on
+#define CLIST_NEGOTIATE_TIMEOUT_MS 1000
+#define V2_WINDOW_UPDATE_MIN 16384
+
+// What listen jobs show as their file
+#define STATION_JOB_PATH "station"
+// A SEEK request with its file index and time, the longest request of a job
+#define SEEK_REQUEST_SIZE 14
+// A WAVEFORM request with its file index and number of buckets
+#define WAVEFORM_REQUEST_SIZE 16
+// Buckets a waveform is drawn with unless the command says otherwise, and
+// the lines it is drawn in
+#define WAVEFORM_PLOT_BUCKETS 64
+#define WAVEFORM_PLOT_ROWS 8
+
 /*
 ** Client shell commands and constants**
 ** -----------------------------------
@@ -42,13 +103,43 @@
 #define CMD_GET "get"
 #define CMD_STREAM "stream"
 #define CMD_STREAM_AND_GET "stream+"
+#define CMD_USTREAM "ustream"
+#define CMD_LISTEN "listen"
+#define CMD_SEEK "seek"
+#define CMD_JOBS "jobs"
+#define CMD_CANCEL "cancel"
+#define CMD_CACHE "cache"
+#define CMD_STATS "stats"
+#define CMD_SEARCH "search"
+#define CMD_BROWSE "browse"
+#define CMD_MORE "more"
+#define CMD_WAVEFORM "waveform"
 #define CMD_QUIT "quit"
 #define CMD_HELP "help"
 
 
+// Whether list_request prints the library, cleared by servers that list
+// another's (see as_edge.h)
+extern uint8_t list_request_prints;
+
+
+/*
+** Connects to the server listening on port at hostname.
+**
+** returns the connected socket, -1 on error
+*/
+int connect_to_server(int port, const char *hostname);
+
 /*
 ** Sends a list request to the server and prints the list of files in the
 ** library. Also parses the list of files and stores it in the list parameter.
+** The list is asked for compactly (CLIST, see as_clist.h), unless a server
+** already did not know it, in which case it is asked for with LIST. A server
+** that answers CLIST with RESPONSE_UNSUPPORTED is asked with LIST straight
+** away. One from before RESPONSE_UNSUPPORTED that leaves CLIST unanswered for
+** CLIST_NEGOTIATE_TIMEOUT_MS is asked with LIST on a new connection to it,
+** which takes sockfd's place, so that a late answer to CLIST can't be taken
+** for LIST's.
 **
 ** The list of files is stored as a dynamic array of strings. Each string is
 ** a path to a file in the file library. The indexes of the array correspond
@@ -60,6 +151,83 @@
 */
 int list_request(int sockfd, Library *library);
 
+/*
+** Sends a stat request to the server for the file at file_index, and stores
+** the file's size and modification time in size and mtime.
+**
+** returns 0 on success, -1 on error
+*/
+int stat_request(int sockfd, uint32_t file_index, uint32_t *size, uint32_t *mtime);
+
+/*
+** Sends a stats request to the server, and prints the report it responds
+** with.
+**
+** returns 0 on success, -1 on error
+*/
+int stats_request(int sockfd);
+
+/*
+** Sends a search request to the server for up to limit files whose paths
+** match query in the given mode (see as_search.h), and prints them, best
+** first. A server that answers RESPONSE_UNSUPPORTED, or does not answer
+** within CLIST_NEGOTIATE_TIMEOUT_MS, is taken not to know SEARCH, and sockfd
+** reconnected to it as in list_request, lest it take the request's arguments
+** for a request.
+**
+** returns the number of matches on success, -2 if the server does not know
+** SEARCH, -1 on error
+*/
+int search_request(int sockfd, uint8_t mode, uint16_t limit, const char *query);
+
+/*
+** Sends a browse request to the server for up to count children of the
+** directory dir, after the child that token names (see as_browse.h), and
+** prints them. token is then replaced with the next page's, empty if there
+** is none, so it must have room for BROWSE_MAX_ARG bytes and the null
+** character. The files are stored in library at their indices, so they can
+** be streamed without a LIST. A server that answers RESPONSE_UNSUPPORTED, or
+** does not answer within CLIST_NEGOTIATE_TIMEOUT_MS, is taken not to know
+** BROWSE, and sockfd reconnected to it as for SEARCH.
+**
+** returns the number of children in the directory on success, -2 if the
+** server does not know BROWSE, -1 on error
+*/
+int browse_request(int sockfd, const char *dir, uint16_t count, char *token, Library *library);
+
+/*
+** Sends a waveform request to the server for the peak envelope of the file
+** at file_index in num_buckets buckets (see as_wave.h), and prints the file's
+** loudness and duration, then draws the envelope. A server that answers
+** RESPONSE_UNSUPPORTED, or does not answer within CLIST_NEGOTIATE_TIMEOUT_MS,
+** is taken not to know WAVEFORM, and sockfd reconnected to it as for SEARCH.
+**
+** returns 0 on success, -2 if the server does not know WAVEFORM, -1 on error
+*/
+int waveform_request(int sockfd, uint32_t file_index, uint16_t num_buckets);
+
+/*
+** Asks the server to switch the connection to protocol v2 (see as_server.h).
+** A server that answers RESPONSE_UNSUPPORTED only speaks v1, and sockfd goes
+** on with v1 straight away. One from before RESPONSE_UNSUPPORTED doesn't
+** answer: a server that does not answer within V2_NEGOTIATE_TIMEOUT_MS is
+** taken to only speak v1 too, and sockfd is reconnected to it as in
+** list_request, to go on with v1.
+**
+** returns 1 if the connection now speaks v2, 0 if it still speaks v1,
+** -1 on error
+*/
+int negotiate_v2(int sockfd);
+
+/*
+** Streams the file at file_index over UDP (see as_udp.h) to the audio player,
+** through a jitter buffer, and prints the stream's loss and latency counters.
+** The request is made on a new connection to the server at hostname:port.
+**
+** returns 0 on success, -1 on error
+*/
+int udp_stream_request(int port, const char *hostname, uint32_t file_index);
+
 /*
 ** Sends a stream request to the server and simply saves the file received
 ** from the server to the local library directory. The AUDIO_PLAYER is
@@ -86,6 +254,55 @@ int get_file_request(int sockfd, uint32_t file_index, const Library * library);
 */
 int start_audio_player_process(int *audio_out_fd);
 
+/*
+** Hands a new track to the warm audio player, starting the player first if it
+** is not running yet. The file descriptor to write the audio stream to is
+** returned in the audio_out_fd parameter; closing it ends the track.
+**
+** Only returns once the player has opened the track, so the first bytes
+** written are played immediately.
+**
+** returns 0 on success, -1 on error
+*/
+int warm_audio_player_open_track(int *audio_out_fd);
+
+/*
+** Blocks until the warm audio player reports that the last track handed to it
+** has finished playing, matching the end to the track by mpv's playlist
+** entry, so that the end of the track it replaced doesn't count.
+**
+** returns 0 on success, -1 on error or if the player could not play the track
+** (the player is stopped on a lost connection)
+*/
+int warm_audio_player_wait_track(void);
+
+/*
+** Non-blocking variant of warm_audio_player_wait_track for event loops: it
+** consumes whatever the player has sent, and should be called when the
+** descriptor returned by warm_audio_player_fd is readable.
+**
+** returns the number of tracks that finished playing, -1 on error
+*/
+int warm_audio_player_poll_track(void);
+
+/*
+** returns the descriptor the warm audio player reports events on, -1 if it
+** is not running
+*/
+int warm_audio_player_fd(void);
+
+/*
+** Asks the warm audio player to stop playing the current track early.
+**
+** returns 0 on success, -1 on error
+*/
+int warm_audio_player_stop_track(void);
+
+/*
+** Stops the warm audio player, if it is running.
+*/
+void stop_warm_audio_player(void);
+
 /*
 ** Sends a stream request to the server and starts the audio player process.
 **
@@ -98,6 +315,18 @@ int start_audio_player_process(int *audio_out_fd);
 */
 int stream_request(int sockfd, uint32_t file_index);
 
+/*
+** Plays the file at file_index like stream_request, but through the track cache.
+**
+** The file is first described with stat_request. If the cache holds a valid
+** copy, that copy is played and the file is not streamed. Otherwise the file
+** is streamed to the audio player and into the cache at the same time.
+**
+** returns 0 on success, -1 on error
+*/
+int cached_stream_request(int sockfd, uint32_t file_index, const Library *library,
+                          TrackCache *cache);
+
 /*
 ** Sends a stream request to the server, starts the audio player process and creates
 ** a file to store the incoming audio stream.
@@ -0,0 +1,201 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_clist.h"
+
+#define ADLER_MOD 65521
+#define ADLER_MAX_RUN 5552
+
+
+typedef struct clist_entry {
+    const char *path;
+    uint32_t index;
+} ClistEntry;
+
+
+static int _compare_entries(const void *a, const void *b) {
+    return strcmp(((const ClistEntry *)a)->path, ((const ClistEntry *)b)->path);
+}
+
+
+/*
+** returns the Adler-32 checksum of the len bytes of data
+*/
+static uint32_t _adler32(const uint8_t *data, size_t len) {
+    uint32_t a = 1, b = 0;
+    while (len > 0) {
+        // The most bytes that can be summed before b could overflow
+        size_t num = MIN(len, ADLER_MAX_RUN);
+        len -= num;
+        while (num-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return b << 16 | a;
+}
+
+
+uint8_t *clist_encode(const Library *library, uint8_t flags, uint32_t *len) {
+    uint32_t num_files = library->num_files;
+    ClistEntry *entries = malloc(MAX(num_files, 1) * sizeof(ClistEntry));
+    if (entries == NULL) {
+        perror("clist_encode");
+        return NULL;
+    }
+    // Enough for no prefix ever being shared
+    size_t capacity = sizeof(uint32_t) + VARINT_MAX_SIZE + 1;
+    for (uint32_t i = 0; i < num_files; i++) {
+        entries[i].path = library->files[i];
+        entries[i].index = i;
+        capacity += 3 * VARINT_MAX_SIZE + strlen(library->files[i]);
+    }
+    capacity += (num_files / CLIST_BLOCK_ENTRIES + 1) * sizeof(uint32_t);
+    // A scanned library is in path order already
+    uint32_t sorted = 1;
+    while (sorted < num_files && strcmp(entries[sorted - 1].path, entries[sorted].path) < 0) {
+        sorted++;
+    }
+    if (sorted < num_files) {
+        qsort(entries, num_files, sizeof(ClistEntry), _compare_entries);
+    }
+
+    uint8_t *response = malloc(capacity);
+    if (response == NULL) {
+        perror("clist_encode");
+        free(entries);
+        return NULL;
+    }
+    uint8_t *out = response + sizeof(uint32_t);
+    out = varint_put(out, num_files);
+    *out++ = flags;
+
+    uint8_t *block = out;
+    const char *prev_path = "";
+    uint32_t prev_index = 0;
+    for (uint32_t i = 0; i < num_files; i++) {
+        const char *path = entries[i].path;
+        uint32_t prefix_len = 0;
+        while (path[prefix_len] != '\0' && path[prefix_len] == prev_path[prefix_len]) {
+            prefix_len++;
+        }
+        uint32_t suffix_len = strlen(path + prefix_len);
+        int32_t delta = entries[i].index - prev_index;
+        out = varint_put(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+        out = varint_put(out, prefix_len);
+        out = varint_put(out, suffix_len);
+        memcpy(out, path + prefix_len, suffix_len);
+        out += suffix_len;
+        prev_path = path;
+        prev_index = entries[i].index;
+
+        if ((i + 1) % CLIST_BLOCK_ENTRIES == 0 || i + 1 == num_files) {
+            if (flags & CLIST_FLAG_CHECKSUM) {
+                uint32_t checksum = htonl(_adler32(block, out - block));
+                memcpy(out, &checksum, sizeof(uint32_t));
+                out += sizeof(uint32_t);
+            }
+            block = out;
+            prev_path = "";
+            prev_index = 0;
+        }
+    }
+    free(entries);
+
+    *len = out - response;
+    uint32_t body_len = htonl(*len - sizeof(uint32_t));
+    memcpy(response, &body_len, sizeof(uint32_t));
+    return response;
+}
+
+
+int clist_decode(const uint8_t *data, uint32_t len, Library *library) {
+    const uint8_t *in = data;
+    const uint8_t *end = data + len;
+    uint32_t num_files;
+    if (varint_get(&in, end, &num_files) == -1 || in == end) {
+        ERR_PRINT("clist_decode: Truncated header\n");
+        return -1;
+    }
+    uint8_t flags = *in++;
+    // Every file takes at least 3 bytes, so a bad count can't allocate much
+    if (num_files > (end - in) / 3) {
+        ERR_PRINT("clist_decode: %u files can't fit in %u bytes\n", num_files, len);
+        return -1;
+    }
+    char **files = calloc(MAX(num_files, 1), sizeof(char *));
+    if (files == NULL) {
+        perror("clist_decode: calloc");
+        return -1;
+    }
+
+    const uint8_t *block = in;
+    const char *prev_path = "";
+    uint32_t prev_len = 0;
+    uint32_t index = 0;
+    for (uint32_t i = 0; i < num_files; i++) {
+        uint32_t zigzag, prefix_len, suffix_len;
+        if (varint_get(&in, end, &zigzag) == -1 || varint_get(&in, end, &prefix_len) == -1 ||
+            varint_get(&in, end, &suffix_len) == -1 || suffix_len > end - in) {
+            ERR_PRINT("clist_decode: Truncated entry %u\n", i);
+            goto error;
+        }
+        index += (zigzag >> 1) ^ -(zigzag & 1);
+        if (index >= num_files || files[index] != NULL || prefix_len > prev_len) {
+            ERR_PRINT("clist_decode: Malformed entry %u\n", i);
+            goto error;
+        }
+        char *path = malloc(prefix_len + suffix_len + 1);
+        if (path == NULL) {
+            perror("clist_decode: malloc");
+            goto error;
+        }
+        memcpy(path, prev_path, prefix_len);
+        memcpy(path + prefix_len, in, suffix_len);
+        path[prefix_len + suffix_len] = '\0';
+        in += suffix_len;
+        files[index] = path;
+        prev_path = path;
+        prev_len = prefix_len + suffix_len;
+
+        if ((i + 1) % CLIST_BLOCK_ENTRIES == 0 || i + 1 == num_files) {
+            if (flags & CLIST_FLAG_CHECKSUM) {
+                uint32_t checksum;
+                if (end - in < sizeof(uint32_t)) {
+                    ERR_PRINT("clist_decode: Truncated checksum\n");
+                    goto error;
+                }
+                memcpy(&checksum, in, sizeof(uint32_t));
+                if (ntohl(checksum) != _adler32(block, in - block)) {
+                    ERR_PRINT("clist_decode: Bad checksum for block %u\n",
+                              i / CLIST_BLOCK_ENTRIES);
+                    goto error;
+                }
+                in += sizeof(uint32_t);
+            }
+            block = in;
+            prev_path = "";
+            prev_len = 0;
+            index = 0;
+        }
+    }
+    if (in != end) {
+        ERR_PRINT("clist_decode: %ld bytes left over\n", (long)(end - in));
+        goto error;
+    }
+
+    _free_library(library);
+    library->files = files;
+    library->num_files = num_files;
+    return num_files;
+
+error:
+    for (uint32_t i = 0; i < num_files; i++) {
+        free(files[i]);
+    }
+    free(files);
+    return -1;
+}
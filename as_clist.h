@@ -0,0 +1,50 @@
+#ifndef AS_CLIST_H_
+#define AS_CLIST_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Compact LIST
+** ------------
+** Library paths share long prefixes ("artist/album/..."), which a LIST
+** response repeats for every file. The response to a CLIST request holds the
+** same list sorted by path and front-coded instead: each path is sent as the
+** length of the prefix it shares with the path before it, and the rest. As
+** scan_library sorts the library by path, the indices mostly go up by one.
+**
+** Like a STATS response, it starts with the size of what follows as a 32-bit
+** integer in network byte order. Then, with every integer a varint (7 bits a
+** byte, least significant first, the top bit set on all bytes but the last):
+**                   <number of files> <flags byte> <blocks>
+** Blocks hold CLIST_BLOCK_ENTRIES files each, the last one the rest, as:
+**                   <index delta> <prefix length> <suffix length> <suffix>
+** The index delta is the file's index less the one before it, zigzag encoded
+** (0, -1, 1, -2... as 0, 1, 2, 3...). At the start of a block, both the index
+** and the path before are taken to be 0 and empty, so any block can be
+** decoded on its own. With CLIST_FLAG_CHECKSUM in the flags, each block is
+** followed by the Adler-32 checksum of its bytes, in network byte order.
+*/
+#define CLIST_BLOCK_ENTRIES 256
+#define CLIST_FLAG_CHECKSUM 0x1
+
+
+/*
+** Encodes the library's list of files, with the given flags.
+**
+** returns the heap-allocated response, size included, of *len bytes, NULL on
+** error
+*/
+uint8_t *clist_encode(const Library *library, uint8_t flags, uint32_t *len);
+
+/*
+** Decodes the len bytes of a response's body (without its size) into
+** library, replacing its files only if the whole of it is valid.
+**
+** returns the number of files on success, -1 on error
+*/
+int clist_decode(const uint8_t *data, uint32_t len, Library *library);
+
+#endif // AS_CLIST_H_
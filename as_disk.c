@@ -0,0 +1,256 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_disk.h"
+#include "as_stats.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+uint32_t disk_queue_depth = DISK_DEFAULT_QUEUE_DEPTH;
+
+
+static void *_work(void *arg) {
+    DiskWorker *worker = arg;
+    pthread_mutex_lock(&worker->lock);
+    while (1) {
+        while (worker->queue == NULL && !worker->stopping) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        if (worker->stopping) {
+            break;
+        }
+        // Off the queue, but still counted in its depth until it is done
+        DiskRead *read = worker->queue;
+        worker->queue = read->next;
+        if (worker->queue == NULL) {
+            worker->tail = NULL;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        TRACE_BEGIN("read");
+        ssize_t result = flight_read(read->reader, read->buf, read->size);
+        TRACE_END("read");
+        stats_device_done(worker->device, read->queued_us, result);
+
+        pthread_mutex_lock(&worker->lock);
+        read->result = result;
+        __atomic_store_n(&read->done, 1, __ATOMIC_RELEASE);
+        worker->depth--;
+        // For disk_cancel, waiting on a read being made
+        pthread_cond_broadcast(&worker->cond);
+        // The pipe only has to be readable, a full one already is
+        uint8_t byte = 1;
+        if (write(worker->notify_fd, &byte, 1) == -1 && errno != EAGAIN) {
+            perror("disk worker: write");
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+
+void disk_pool_init(DiskPool *pool) {
+    memset(pool, 0, sizeof(DiskPool));
+    pool->notify[0] = -1;
+    pool->notify[1] = -1;
+}
+
+
+/*
+** Helper for: disk_submit
+** returns the worker of device dev, started if it was not, NULL on error
+*/
+static DiskWorker *_worker_of(DiskPool *pool, uint64_t dev) {
+    for (int i = 0; i < pool->num_workers; i++) {
+        if (pool->workers[i]->dev == dev) {
+            return pool->workers[i];
+        }
+    }
+    if (pool->num_workers == DISK_MAX_DEVICES) {
+        return NULL;
+    }
+    if (pool->notify[0] == -1) {
+        if (pipe(pool->notify) == -1) {
+            perror("disk_submit: pipe");
+            pool->notify[0] = -1;
+            return NULL;
+        }
+        // Workers never wait on a full pipe, nor the connection on an empty one
+        for (int i = 0; i < 2; i++) {
+            fcntl(pool->notify[i], F_SETFL, O_NONBLOCK);
+            fcntl(pool->notify[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    DiskWorker *worker = calloc(1, sizeof(DiskWorker));
+    if (worker == NULL) {
+        perror("disk_submit: calloc");
+        return NULL;
+    }
+    worker->dev = dev;
+    worker->device = stats_device(dev, NULL);
+    worker->notify_fd = pool->notify[1];
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    int error = pthread_create(&worker->thread, NULL, _work, worker);
+    if (error != 0) {
+        ERR_PRINT("disk_submit: pthread_create: %s\n", strerror(error));
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cond);
+        free(worker);
+        return NULL;
+    }
+    pool->workers[pool->num_workers++] = worker;
+    return worker;
+}
+
+
+int disk_submit(DiskPool *pool, DiskRead *read) {
+    DiskWorker *worker = _worker_of(pool, read->reader->dev);
+    if (worker == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&worker->lock);
+    if (worker->depth >= disk_queue_depth) {
+        pthread_mutex_unlock(&worker->lock);
+        return 1;
+    }
+    read->result = 0;
+    read->done = 0;
+    read->queued_us = stats_now_us();
+    read->worker = worker;
+    read->next = NULL;
+    if (worker->tail != NULL) {
+        worker->tail->next = read;
+    } else {
+        worker->queue = read;
+    }
+    worker->tail = read;
+    worker->depth++;
+    stats_device_queued(worker->device);
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    return 0;
+}
+
+
+uint8_t disk_done(const DiskRead *read) {
+    return __atomic_load_n(&read->done, __ATOMIC_ACQUIRE);
+}
+
+
+void disk_cancel(DiskRead *read) {
+    DiskWorker *worker = read->worker;
+    pthread_mutex_lock(&worker->lock);
+    DiskRead **link = &worker->queue;
+    DiskRead *previous = NULL;
+    while (*link != NULL && *link != read) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    if (*link == read) {
+        *link = read->next;
+        if (worker->tail == read) {
+            worker->tail = previous;
+        }
+        worker->depth--;
+        stats_device_cancelled(worker->device);
+    } else {
+        // Being made, its buffer can't be freed before it is done
+        while (!read->done) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+
+int disk_pool_fd(const DiskPool *pool) {
+    return pool->notify[0];
+}
+
+
+void disk_pool_drain(DiskPool *pool) {
+    uint8_t discard[64];
+    while (pool->notify[0] != -1 && read(pool->notify[0], discard, sizeof(discard)) > 0) {
+    }
+}
+
+
+void disk_pool_stop(DiskPool *pool) {
+    for (int i = 0; i < pool->num_workers; i++) {
+        DiskWorker *worker = pool->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        worker->stopping = 1;
+        pthread_cond_broadcast(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cond);
+        free(worker);
+    }
+    if (pool->notify[0] != -1) {
+        close(pool->notify[0]);
+        close(pool->notify[1]);
+    }
+    disk_pool_init(pool);
+}
+
+
+int disk_map(DiskMap *map, int fd, size_t size, uint32_t max_span) {
+    memset(map, 0, sizeof(DiskMap));
+#ifdef __linux__
+    if (size == 0) {
+        return -1;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    map->pages = malloc(max_span / page_size + 2);
+    map->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->pages == NULL || map->map == MAP_FAILED) {
+        if (map->map != MAP_FAILED) {
+            munmap(map->map, size);
+        }
+        free(map->pages);
+        memset(map, 0, sizeof(DiskMap));
+        return -1;
+    }
+    map->size = size;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+uint8_t disk_cached(const DiskMap *map, uint64_t offset, uint32_t size) {
+#ifdef __linux__
+    if (map->map == NULL || size == 0 || offset >= map->size) {
+        return 0;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / page_size * page_size;
+    uint64_t end = MIN(offset + size, map->size);
+    size_t num_pages = (end - start + page_size - 1) / page_size;
+    if (mincore((uint8_t *)map->map + start, end - start, map->pages) == -1) {
+        return 0;
+    }
+    for (size_t i = 0; i < num_pages; i++) {
+        if (!(map->pages[i] & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+void disk_unmap(DiskMap *map) {
+    if (map->map != NULL) {
+        munmap(map->map, map->size);
+    }
+    free(map->pages);
+    memset(map, 0, sizeof(DiskMap));
+}
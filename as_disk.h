@@ -0,0 +1,163 @@
+#ifndef AS_DISK_H_
+#define AS_DISK_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_flight.h"
+
+#include <pthread.h>
+
+/*
+** Per-device reads
+** ----------------
+** A library can be spread over several disks (see scan_library), and a
+** protocol v2 connection streams files from any of them at once. If its
+** streams read their files themselves, one read waiting on a busy disk holds
+** up every other stream of the connection, whatever disk their files are on.
+** So reads that would wait on a disk are handed to a worker thread for the
+** file's device (st_dev), one per device in each client process, and the
+** connection carries on with its other streams until the read is done.
+**
+** A worker's queue holds at most disk_queue_depth reads, counting the one it
+** is making. When a device's queue is full, its streams wait their turn,
+** and streams on other devices carry on. Data already in the page cache
+** (mincore) is read at once, since handing it to a worker costs more than
+** reading it. Workers write a byte to the pool's pipe for each read they
+** finish, so the connection can poll for finished reads and its socket at
+** once.
+**
+** Every read through a queue is counted under its device in the server's
+** statistics (see as_stats.h): how many are queued now and at most, and how
+** long they took, from being queued to being read.
+*/
+#define DISK_MAX_DEVICES 16
+#define DISK_DEFAULT_QUEUE_DEPTH 4
+#define DISK_MAX_QUEUE_DEPTH 1024
+
+// Reads a device's worker may hold, 0 for streams to read their files alone
+extern uint32_t disk_queue_depth;
+
+
+/*
+** A read of up to size bytes of reader's file into buf, as by flight_read, on
+** the worker of the file's device.
+** result: what flight_read returned, once done.
+*/
+typedef struct disk_read {
+    FlightReader *reader;
+    uint8_t *buf;
+    uint32_t size;
+    ssize_t result;
+    uint8_t done;
+    long queued_us;
+    struct disk_worker *worker;
+    struct disk_read *next;
+} DiskRead;
+
+
+/*
+** queue: the reads waiting for the worker, oldest first, the last at tail.
+** depth: the reads queued and the one being made.
+** device: the device's slot in the server's statistics, -1 if it has none.
+*/
+typedef struct disk_worker {
+    uint64_t dev;
+    int device;
+    DiskRead *queue;
+    DiskRead *tail;
+    uint32_t depth;
+    uint8_t stopping;
+    int notify_fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DiskWorker;
+
+
+/*
+** A client process's workers, started as their devices are first read from.
+** notify: the pipe workers write a byte to for each read they finish.
+*/
+typedef struct disk_pool {
+    DiskWorker *workers[DISK_MAX_DEVICES];
+    int num_workers;
+    int notify[2];
+} DiskPool;
+
+
+/*
+** A file mapped only to ask which of its pages are in the page cache, never
+** read. pages: room for mincore's answer about max_span bytes.
+*/
+typedef struct disk_map {
+    void *map;
+    size_t size;
+    uint8_t *pages;
+} DiskMap;
+
+
+/*
+** Initializes an empty pool.
+*/
+void disk_pool_init(DiskPool *pool);
+
+/*
+** Queues read on the worker of its file's device, starting it if need be.
+** The read, and what it points to, must be left alone until it is done or
+** cancelled.
+**
+** returns 0 once queued, 1 if the device's queue is full, -1 if the read
+** can't be queued and should be made by the caller
+*/
+int disk_submit(DiskPool *pool, DiskRead *read);
+
+/*
+** returns whether the queued read is done, then with its result set
+*/
+uint8_t disk_done(const DiskRead *read);
+
+/*
+** Takes a queued read back before the worker makes it, or waits for it if it
+** is making it.
+*/
+void disk_cancel(DiskRead *read);
+
+/*
+** returns the end of the pool's pipe that becomes readable when a read is
+** done, -1 before any read was queued
+*/
+int disk_pool_fd(const DiskPool *pool);
+
+/*
+** Empties the pool's pipe, once the reads it signalled were looked at.
+*/
+void disk_pool_drain(DiskPool *pool);
+
+/*
+** Stops and frees the pool's workers. No read may be left queued.
+*/
+void disk_pool_stop(DiskPool *pool);
+
+/*
+** Maps the size bytes of the file open at fd, to ask about spans of up to
+** max_span bytes of it. The map does not take ownership of fd.
+**
+** returns 0 on success, -1 on error, leaving the map empty, so that no part
+** of the file counts as cached
+*/
+int disk_map(DiskMap *map, int fd, size_t size, uint32_t max_span);
+
+/*
+** returns whether the size bytes of the file from offset on are all in the
+** page cache, 0 if it can't tell
+*/
+uint8_t disk_cached(const DiskMap *map, uint64_t offset, uint32_t size);
+
+/*
+** Unmaps the file, leaving the map empty.
+*/
+void disk_unmap(DiskMap *map);
+
+#endif // AS_DISK_H_
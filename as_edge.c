@@ -0,0 +1,344 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_edge.h"
+#include "as_client.h"
+#include "as_stats.h"
+
+
+int edge_open(Edge *edge, const char *upstream, const char *directory, uint64_t max_bytes) {
+    memset(edge, 0, sizeof(Edge));
+    edge->upstream = -1;
+    edge->lock_fd = -1;
+    const char *colon = strrchr(upstream, ':');
+    long port = colon != NULL ? strtol(colon + 1, NULL, 10) : 0;
+    if (colon == NULL || colon == upstream || colon - upstream >= EDGE_HOST_MAX ||
+        port <= 0 || port > 65535) {
+        ERR_PRINT("edge_open: Invalid upstream %s, expected host:port\n", upstream);
+        return -1;
+    }
+    memcpy(edge->host, upstream, colon - upstream);
+    edge->port = port;
+    if (max_bytes == 0) {
+        ERR_PRINT("edge_open: An edge needs room to cache files\n");
+        return -1;
+    }
+    // Its own listing is of no use to the server's output
+    list_request_prints = 0;
+    return cache_open(&edge->cache, directory, max_bytes);
+}
+
+
+void edge_close(Edge *edge) {
+    if (edge->upstream != -1) {
+        close(edge->upstream);
+        edge->upstream = -1;
+    }
+    if (edge->lock_fd != -1) {
+        close(edge->lock_fd);
+        edge->lock_fd = -1;
+    }
+    cache_close(&edge->cache);
+}
+
+
+int edge_list(Edge *edge, Library *library) {
+    int sockfd = connect_to_server(edge->port, edge->host);
+    if (sockfd == -1) {
+        return -1;
+    }
+    Library listed = {0};
+    int result = list_request(sockfd, &listed);
+    close(sockfd);
+    if (result < 0) {
+        _free_library(&listed);
+        return -1;
+    }
+    _free_library(library);
+    library->files = listed.files;
+    library->num_files = listed.num_files;
+    return result;
+}
+
+
+int edge_stat(Edge *edge, uint32_t file_index, uint32_t *size, uint32_t *mtime) {
+    // The upstream may have dropped an idle connection, so one is tried again
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (edge->upstream == -1) {
+            edge->upstream = connect_to_server(edge->port, edge->host);
+        }
+        if (edge->upstream == -1) {
+            return -1;
+        }
+        if (stat_request(edge->upstream, file_index, size, mtime) == 0) {
+            return 0;
+        }
+        close(edge->upstream);
+        edge->upstream = -1;
+    }
+    return -1;
+}
+
+
+/*
+** Helper for: _lock, _unlock
+** returns the index file's stat, or a zeroed one if it has none yet
+*/
+static struct stat _index_stat(const Edge *edge) {
+    struct stat index_stat;
+    memset(&index_stat, 0, sizeof(index_stat));
+    char *index_path = _join_path(edge->cache.directory, CACHE_INDEX_FILENAME);
+    if (index_path != NULL) {
+        stat(index_path, &index_stat);
+        free(index_path);
+    }
+    return index_stat;
+}
+
+
+/*
+** Takes the lock on the cache, and loads its index again if another process
+** saved it since this one last did (see as_edge.h).
+**
+** returns 0 on success, -1 on error
+*/
+static int _lock(Edge *edge) {
+    if (edge->lock_fd == -1) {
+        char *lock_path = _join_path(edge->cache.directory, EDGE_LOCK_FILE);
+        if (lock_path == NULL) {
+            return -1;
+        }
+        edge->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        free(lock_path);
+        if (edge->lock_fd == -1) {
+            perror("edge: open");
+            return -1;
+        }
+    }
+    if (flock(edge->lock_fd, LOCK_EX) == -1) {
+        perror("edge: flock");
+        return -1;
+    }
+    // Saving the index renames a new file over it, so its inode tells
+    struct stat index_stat = _index_stat(edge);
+    if (index_stat.st_ino != edge->index_ino ||
+        index_stat.st_mtim.tv_sec != edge->index_mtime.tv_sec ||
+        index_stat.st_mtim.tv_nsec != edge->index_mtime.tv_nsec) {
+        if (cache_reload(&edge->cache) == -1) {
+            flock(edge->lock_fd, LOCK_UN);
+            return -1;
+        }
+        edge->index_ino = index_stat.st_ino;
+        edge->index_mtime = index_stat.st_mtim;
+    }
+    return 0;
+}
+
+
+/*
+** Releases the lock on the cache, having saved its index if saved is set, so
+** that this process does not load it again for its own changes.
+*/
+static void _unlock(Edge *edge, uint8_t saved) {
+    if (saved) {
+        struct stat index_stat = _index_stat(edge);
+        edge->index_ino = index_stat.st_ino;
+        edge->index_mtime = index_stat.st_mtim;
+    }
+    flock(edge->lock_fd, LOCK_UN);
+}
+
+
+/*
+** Helper for: edge_read, _follow
+** returns whether a fetcher still holds the lock on the partial copy at fd
+*/
+static uint8_t _is_fetching(int fd) {
+    if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+        flock(fd, LOCK_UN);
+        return 0;
+    }
+    return errno == EWOULDBLOCK;
+}
+
+
+/*
+** Helper for: edge_open_track
+** Opens the partial copy of the file at path, if a fetcher is fetching it.
+**
+** returns the open partial copy, -1 if the file is not being fetched
+*/
+static int _follow(Edge *edge, const char *path) {
+    int fd = cache_open_insert(&edge->cache, path);
+    if (fd != -1 && !_is_fetching(fd)) {
+        // Left behind by a fetcher that failed, the next fetch replaces it
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/*
+** Helper for: _fetch
+** Runs in the fetcher: fetches the file at file_index into the partial copy
+** open at fd, then commits it to the cache, or discards it if it is short.
+**
+** returns the fetcher's exit status
+*/
+static int _run_fetch(Edge *edge, const char *path, uint32_t file_index, uint32_t size,
+                      uint32_t mtime, int fd) {
+    // The lock is kept through the commit, after the copy is closed
+    int lock = dup(fd);
+    int result = -1;
+    int upstream = connect_to_server(edge->port, edge->host);
+    if (upstream != -1) {
+        result = send_and_process_stream_request(upstream, file_index, -1, fd);
+        close(upstream);
+    }
+    if (result == -1) {
+        close(fd);
+    }
+
+    // This process's lock file and connection are its parent's
+    edge->lock_fd = -1;
+    edge->upstream = -1;
+    if (_lock(edge) == -1) {
+        result = -1;
+    } else {
+        if (result == 0) {
+            result = cache_commit_insert(&edge->cache, path, size, mtime);
+        } else {
+            cache_abort_insert(&edge->cache, path);
+        }
+        _unlock(edge, 1);
+    }
+    close(lock);
+
+    if (result == 0) {
+        printf("Fetched %s from the upstream (%u bytes)\n", path, size);
+        stats_edge(STATS_EDGE_FETCHED, size);
+    } else {
+        ERR_PRINT("Could not fetch %s from the upstream\n", path);
+        stats_edge(STATS_EDGE_FAILED, 0);
+    }
+    return result == 0 ? 0 : 1;
+}
+
+
+/*
+** Helper for: edge_open_track
+** Starts a fetcher for the file at file_index, whose path is path, holding
+** the lock on its partial copy before anyone can follow it.
+**
+** returns the partial copy, open for reading, -1 on error
+*/
+static int _fetch(Edge *edge, const char *path, uint32_t file_index, uint32_t size,
+                  uint32_t mtime, int close_fd) {
+    int fd = cache_begin_insert(&edge->cache, path, size);
+    if (fd == -1) {
+        ERR_PRINT("edge: %s can't be cached\n", path);
+        return -1;
+    }
+    int read_fd = -1;
+    if (flock(fd, LOCK_EX) == -1 || (read_fd = cache_open_insert(&edge->cache, path)) == -1) {
+        perror("edge: flock");
+        close(fd);
+        cache_abort_insert(&edge->cache, path);
+        return -1;
+    }
+
+    // The fetcher is orphaned straight away, for init to reap, as the client
+    // process may be done with the file long before it is
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("edge: fork");
+        close(fd);
+        close(read_fd);
+        cache_abort_insert(&edge->cache, path);
+        return -1;
+    }
+    if (pid == 0) {
+        if (fork() != 0) {
+            _exit(0);
+        }
+        close(close_fd);
+        close(read_fd);
+        if (edge->upstream != -1) {
+            close(edge->upstream);
+        }
+        close(edge->lock_fd);
+        exit(_run_fetch(edge, path, file_index, size, mtime, fd));
+    }
+    // The fetcher holds the lock from now on
+    close(fd);
+    waitpid(pid, NULL, 0);
+    return read_fd;
+}
+
+
+int edge_open_track(Edge *edge, const Library *library, uint32_t file_index, int close_fd,
+                    EdgeTrack *track) {
+    memset(track, 0, sizeof(EdgeTrack));
+    track->fd = -1;
+    uint32_t mtime;
+    if (edge_stat(edge, file_index, &track->size, &mtime) == -1) {
+        return -1;
+    }
+    const char *path = library->files[file_index];
+    if (_lock(edge) == -1) {
+        return -1;
+    }
+
+    uint8_t saved = 0;
+    track->fd = cache_lookup(&edge->cache, path, track->size, mtime);
+    if (track->fd != -1) {
+        // For the least recently used to be evicted first
+        saved = cache_save(&edge->cache) == 0;
+        stats_edge(STATS_EDGE_HIT, 0);
+    } else if ((track->fd = _follow(edge, path)) != -1) {
+        track->fetching = 1;
+        stats_edge(STATS_EDGE_FOLLOW, 0);
+    } else if ((track->fd = _fetch(edge, path, file_index, track->size, mtime, close_fd)) != -1) {
+        track->fetching = 1;
+        stats_edge(STATS_EDGE_MISS, 0);
+    }
+    _unlock(edge, saved);
+    return track->fd != -1 ? 0 : -1;
+}
+
+
+ssize_t edge_read(EdgeTrack *track, uint8_t *buf, uint32_t count) {
+    count = MIN(count, track->size - track->offset);
+    while (count > 0) {
+        ssize_t num = pread(track->fd, buf, count, track->offset);
+        if (num == -1) {
+            perror("edge_read: pread");
+            return -1;
+        }
+        if (num > 0) {
+            track->offset += num;
+            return num;
+        }
+        if (!track->fetching) {
+            break;
+        }
+        // Done with the copy once the fetcher is, its last bytes read first
+        if (!_is_fetching(track->fd)) {
+            track->fetching = 0;
+            continue;
+        }
+        usleep(EDGE_FOLLOW_POLL_MS * 1000);
+    }
+    return 0;
+}
+
+
+void edge_close_track(EdgeTrack *track) {
+    if (track->fd != -1) {
+        close(track->fd);
+        track->fd = -1;
+    }
+}
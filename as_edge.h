@@ -0,0 +1,128 @@
+#ifndef AS_EDGE_H_
+#define AS_EDGE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_cache.h"
+
+#include <sys/file.h>
+
+/*
+** Edge proxy
+** ----------
+** A server started with -u host:port serves the library of the server there,
+** its upstream, instead of one of its own: an edge, near its clients, in
+** front of an origin far from them. It lists the upstream's library with
+** list_request when it starts and at every scan, and answers LIST, CLIST,
+** SEARCH, BROWSE and STATS from that list itself. STAT is passed on to the
+** upstream, over a connection each client process keeps to it.
+**
+** A STREAM is served from the edge's track cache (see as_cache.h) if it holds
+** the file as the upstream describes it. If not, a fetcher process fetches
+** the file into the cache with send_and_process_stream_request, and the
+** client is sent the cache's partial copy as it grows, rather than once the
+** whole file has arrived. A STREAM of a file being fetched, by any client
+** process, follows that fetch instead of starting another: a fetcher holds an
+** exclusive lock (flock) on its partial copy for as long as it runs, which
+** followers check for whenever they have caught up with it, every
+** EDGE_FOLLOW_POLL_MS. Once done, the fetcher commits the file to the cache,
+** evicting the least recently used files to stay within its size (-c).
+** Files larger than the whole cache can't be served.
+**
+** Client processes and fetchers share the cache's index, so it is only
+** looked at and changed holding an exclusive lock on EDGE_LOCK_FILE in the
+** cache's directory, and loaded again first if another process saved it.
+**
+** An edge streams files as they arrive, which protocol v2's rounds of frames
+** can't wait on, so it answers V2 with RESPONSE_UNSUPPORTED. SEEK,
+** WAVEFORM, USTREAM and STATION need the whole file at hand, and are answered
+** with RESPONSE_UNSUPPORTED too, once their arguments are read, the connection
+** going on with the next request.
+*/
+#define EDGE_DEFAULT_DIRECTORY ".as_edge"
+#define EDGE_DEFAULT_CACHE_MB 1024
+#define EDGE_LOCK_FILE "lock"
+#define EDGE_FOLLOW_POLL_MS 2
+#define EDGE_HOST_MAX 256
+
+
+/*
+** upstream: a client process's connection to the upstream, -1 until needed.
+** lock_fd: the open EDGE_LOCK_FILE, -1 until needed, as each process must
+** open it for itself for its locks to exclude the others'.
+** index_ino, index_mtime: of the index file as the cache last loaded or
+** saved it.
+*/
+typedef struct edge {
+    char host[EDGE_HOST_MAX];
+    int port;
+    TrackCache cache;
+    int upstream;
+    int lock_fd;
+    ino_t index_ino;
+    struct timespec index_mtime;
+} Edge;
+
+/*
+** A file being streamed from the cache, whole or still being fetched.
+** offset: where the next read starts.
+*/
+typedef struct edge_track {
+    int fd;
+    uint32_t size;
+    uint32_t offset;
+    uint8_t fetching;
+} EdgeTrack;
+
+
+/*
+** Opens the edge of the upstream at host:port, with its cache in directory,
+** holding up to max_bytes of files.
+**
+** returns 0 on success, -1 on error
+*/
+int edge_open(Edge *edge, const char *upstream, const char *directory, uint64_t max_bytes);
+
+/*
+** Closes the edge's connection to the upstream, and its cache.
+*/
+void edge_close(Edge *edge);
+
+/*
+** Lists the upstream's library into library, leaving it as it was on error.
+**
+** returns the number of files on success, -1 on error
+*/
+int edge_list(Edge *edge, Library *library);
+
+/*
+** Asks the upstream for the size and mtime of the file at file_index.
+**
+** returns 0 on success, -1 on error
+*/
+int edge_stat(Edge *edge, uint32_t file_index, uint32_t *size, uint32_t *mtime);
+
+/*
+** Opens the file at file_index of library, the upstream's, from the cache,
+** fetching it first if need be (see above). close_fd, the client's socket,
+** is closed in the fetcher.
+**
+** returns 0 on success, -1 on error
+*/
+int edge_open_track(Edge *edge, const Library *library, uint32_t file_index, int close_fd,
+                    EdgeTrack *track);
+
+/*
+** Reads up to count bytes of the track, waiting for them to be fetched if
+** need be.
+**
+** returns the number of bytes read, 0 if the fetch ended before they
+** arrived, -1 on error
+*/
+ssize_t edge_read(EdgeTrack *track, uint8_t *buf, uint32_t count);
+
+void edge_close_track(EdgeTrack *track);
+
+#endif // AS_EDGE_H_
@@ -0,0 +1,294 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_flight.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+
+
+static long _now_ms(void) {
+    // Monotonic time is the same in every process, unlike start times
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+** The table's lock is only ever held for a scan of the table, so waiters
+** yield rather than sleep. Flights' locks are only ever tried.
+*/
+static void _spin_lock(uint32_t *lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+
+static uint8_t _spin_trylock(uint32_t *lock) {
+    return !__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+
+static void _spin_unlock(uint32_t *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+
+static void _count(uint64_t *counter, uint64_t num) {
+    __atomic_fetch_add(counter, num, __ATOMIC_RELAXED);
+}
+
+
+FlightTable *flights_create(uint8_t coalesce) {
+    FlightTable *table = mmap(NULL, sizeof(FlightTable), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("flights_create: mmap");
+        return NULL;
+    }
+    table->coalesce = coalesce;
+    return table;
+}
+
+
+void flights_destroy(FlightTable *table) {
+    if (table != NULL) {
+        munmap(table, sizeof(FlightTable));
+    }
+}
+
+
+static uint8_t _is_flight_of(const Flight *flight, const struct stat *file_stat) {
+    return flight->dev == (uint64_t)file_stat->st_dev && flight->ino == (uint64_t)file_stat->st_ino
+           && flight->size == (uint32_t)file_stat->st_size
+           && flight->mtime == (uint64_t)file_stat->st_mtime;
+}
+
+
+void flight_open(FlightTable *table, FlightReader *reader, int fd, const struct stat *file_stat) {
+    memset(reader, 0, sizeof(FlightReader));
+    reader->table = table;
+    reader->fd = fd;
+    reader->dev = file_stat->st_dev;
+    reader->size = file_stat->st_size;
+    if (table == NULL) {
+        return;
+    }
+
+    _spin_lock(&table->lock);
+    long now = _now_ms();
+    Flight *free_flight = NULL;
+    Flight *idle_flight = NULL;
+    for (int i = 0; table->coalesce && i < FLIGHT_SLOTS; i++) {
+        Flight *flight = &table->flights[i];
+        long last_active_ms = __atomic_load_n(&flight->last_active_ms, __ATOMIC_RELAXED);
+        uint8_t idle = now - last_active_ms >= FLIGHT_IDLE_MS;
+        if (flight->members > 0 && !idle && _is_flight_of(flight, file_stat)) {
+            flight->members++;
+            reader->flight = flight;
+            _count(&table->followers, 1);
+            break;
+        }
+        if (flight->members == 0 && free_flight == NULL) {
+            free_flight = flight;
+        } else if (flight->members > 0 && idle && idle_flight == NULL) {
+            idle_flight = flight;
+        }
+    }
+    // Members that died without leaving only give their slot up when no
+    // other is free. The slot is only taken under its lock, which its last
+    // reader may still be holding while it reads a chunk.
+    if (free_flight == NULL) {
+        free_flight = idle_flight;
+    }
+    if (reader->flight == NULL && free_flight != NULL && table->coalesce &&
+        _spin_trylock(&free_flight->lock)) {
+        Flight *flight = free_flight;
+        __atomic_add_fetch(&flight->generation, 1, __ATOMIC_RELEASE);
+        flight->members = 1;
+        flight->dev = file_stat->st_dev;
+        flight->ino = file_stat->st_ino;
+        flight->mtime = file_stat->st_mtime;
+        flight->size = file_stat->st_size;
+        __atomic_store_n(&flight->filled, 0, __ATOMIC_RELEASE);
+        flight->last_active_ms = now;
+        _spin_unlock(&flight->lock);
+        reader->flight = flight;
+        _count(&table->leaders, 1);
+    } else if (reader->flight == NULL) {
+        _count(&table->solos, 1);
+    }
+    if (reader->flight != NULL) {
+        reader->generation = reader->flight->generation;
+    }
+    _spin_unlock(&table->lock);
+}
+
+
+/*
+** Helper for: flight_read
+** Reads from the reader's own file, outside of any flight.
+*/
+static ssize_t _read_alone(FlightReader *reader, void *buf, size_t count) {
+    ssize_t num = pread(reader->fd, buf, count, reader->position);
+    if (num == -1) {
+        perror("flight_read: pread");
+        return -1;
+    }
+    __atomic_fetch_add(&io_stats.read_calls, 1, __ATOMIC_RELAXED);
+    if (reader->table != NULL) {
+        _count(&reader->table->disk_reads, 1);
+        _count(&reader->table->disk_bytes, num);
+    }
+    reader->position += num;
+    return num;
+}
+
+
+/*
+** Helper for: flight_read
+** Reads the flight's next chunk into its window, unless another member got
+** there first.
+**
+** returns 0 on success, 1 if another member is reading it, -1 on error
+*/
+static int _read_next_chunk(FlightReader *reader, uint64_t filled) {
+    Flight *flight = reader->flight;
+    if (!_spin_trylock(&flight->lock)) {
+        return 1;
+    }
+
+    int result = 0;
+    if (__atomic_load_n(&flight->generation, __ATOMIC_RELAXED) == reader->generation &&
+        __atomic_load_n(&flight->filled, __ATOMIC_RELAXED) == filled) {
+        size_t offset = filled % FLIGHT_WINDOW_SIZE;
+        size_t count = MIN(FLIGHT_CHUNK_SIZE, MIN(flight->size - filled, FLIGHT_WINDOW_SIZE - offset));
+        ssize_t num = pread(reader->fd, flight->window + offset, count, filled);
+        __atomic_fetch_add(&io_stats.read_calls, 1, __ATOMIC_RELAXED);
+        if (num <= 0) {
+            if (num == -1) {
+                perror("flight_read: pread");
+            } else {
+                ERR_PRINT("File shrank while streaming\n");
+            }
+            result = -1;
+        } else {
+            _count(&reader->table->disk_reads, 1);
+            _count(&reader->table->disk_bytes, num);
+            // Only published if the flight is still the one the chunk was
+            // read for, and no other reader moved its front meanwhile
+            uint64_t expected = filled;
+            if (__atomic_load_n(&flight->generation, __ATOMIC_ACQUIRE) == reader->generation &&
+                __atomic_compare_exchange_n(&flight->filled, &expected, filled + num, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                // A leader alone in its flight is only ever at the front
+                __atomic_store_n(&flight->last_active_ms, _now_ms(), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    _spin_unlock(&flight->lock);
+    return result;
+}
+
+
+ssize_t flight_read(FlightReader *reader, void *buf, size_t count) {
+    count = MIN(count, reader->size - reader->position);
+    if (count == 0) {
+        return 0;
+    }
+
+    Flight *flight = reader->flight;
+    while (flight != NULL) {
+        if (__atomic_load_n(&flight->generation, __ATOMIC_ACQUIRE) != reader->generation) {
+            // The flight was reclaimed from under us
+            reader->flight = NULL;
+            break;
+        }
+
+        uint64_t filled = __atomic_load_n(&flight->filled, __ATOMIC_ACQUIRE);
+        if (reader->position >= filled) {
+            // At the front, the next chunk is ours to read. Rather than wait
+            // for another member reading it, read the part we need alone.
+            int result = _read_next_chunk(reader, filled);
+            if (result == -1) {
+                return -1;
+            }
+            if (result == 1) {
+                return _read_alone(reader, buf, count);
+            }
+            continue;
+        }
+        // The front may be reading up to FLIGHT_CHUNK_SIZE bytes past filled,
+        // over the oldest data in the window
+        if (filled - reader->position > FLIGHT_WINDOW_SIZE - FLIGHT_CHUNK_SIZE) {
+            return _read_alone(reader, buf, count);
+        }
+
+        size_t offset = reader->position % FLIGHT_WINDOW_SIZE;
+        size_t num = MIN(count, MIN(filled - reader->position, FLIGHT_WINDOW_SIZE - offset));
+        memcpy(buf, flight->window + offset, num);
+        // Only keep what the front did not overwrite while it was copied
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        filled = __atomic_load_n(&flight->filled, __ATOMIC_RELAXED);
+        if (filled - reader->position > FLIGHT_WINDOW_SIZE - FLIGHT_CHUNK_SIZE ||
+            __atomic_load_n(&flight->generation, __ATOMIC_RELAXED) != reader->generation) {
+            continue;
+        }
+
+        _count(&reader->table->shared_bytes, num);
+        __atomic_store_n(&flight->last_active_ms, _now_ms(), __ATOMIC_RELAXED);
+        reader->position += num;
+        return num;
+    }
+    return _read_alone(reader, buf, count);
+}
+
+
+uint32_t flight_next_read(const FlightReader *reader, size_t count, uint64_t *offset) {
+    count = MIN(count, reader->size - reader->position);
+    *offset = reader->position;
+    Flight *flight = reader->flight;
+    if (count == 0 || flight == NULL ||
+        __atomic_load_n(&flight->generation, __ATOMIC_ACQUIRE) != reader->generation) {
+        return count;
+    }
+    // As flight_read goes about it
+    uint64_t filled = __atomic_load_n(&flight->filled, __ATOMIC_ACQUIRE);
+    if (reader->position >= filled) {
+        *offset = filled;
+        return MIN(FLIGHT_CHUNK_SIZE, flight->size - filled);
+    }
+    if (filled - reader->position > FLIGHT_WINDOW_SIZE - FLIGHT_CHUNK_SIZE) {
+        return count;
+    }
+    return 0;
+}
+
+
+void flight_close(FlightReader *reader) {
+    Flight *flight = reader->flight;
+    if (flight == NULL) {
+        return;
+    }
+    _spin_lock(&reader->table->lock);
+    if (flight->generation == reader->generation && flight->members > 0) {
+        flight->members--;
+    }
+    _spin_unlock(&reader->table->lock);
+    reader->flight = NULL;
+}
+
+
+void flights_print_stats(const FlightTable *table) {
+    uint64_t streams = table->leaders + table->followers + table->solos;
+    uint64_t bytes = table->disk_bytes + table->shared_bytes;
+    printf("Coalesced streams: %llu led, %llu followed, %llu alone; "
+           "%llu KiB read from disk in %llu reads, %llu KiB shared (%.1f%% of %llu streams' data)\n",
+           (unsigned long long)table->leaders, (unsigned long long)table->followers,
+           (unsigned long long)table->solos, (unsigned long long)table->disk_bytes / 1024,
+           (unsigned long long)table->disk_reads, (unsigned long long)table->shared_bytes / 1024,
+           bytes ? 100.0 * table->shared_bytes / bytes : 0.0, (unsigned long long)streams);
+}
@@ -0,0 +1,141 @@
+#ifndef AS_FLIGHT_H_
+#define AS_FLIGHT_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** Coalesced file reads
+** --------------------
+** When many clients stream the same file at once, each client process would
+** read the whole file on its own. Instead, concurrent streams of a file share
+** a flight: a window of the file in shared memory, mapped before the server
+** forks. The request furthest into the file reads its next FLIGHT_CHUNK_SIZE
+** bytes into the window for everyone, and the others copy them out at their
+** own pace. The first request for a file leads, and later ones follow.
+**
+** As with the station's ring, filled counts the bytes of the file read into
+** the window, and byte p lives at window[p % FLIGHT_WINDOW_SIZE] until the
+** front comes round again. A request that falls further behind than the
+** window reads from the file itself until it catches up, so a slow client
+** never holds the others up.
+**
+** A flight is identified by the file's device, inode, size and mtime, so a
+** file replaced in the library gets a new one. It lasts while it has members.
+** One idle for FLIGHT_IDLE_MS, in case a member died without leaving, is only
+** taken over when no slot is free, and only under its lock, so never while a
+** member is reading a chunk into it. Its generation changes whenever the slot
+** is reused, so a member of a flight that was reclaimed notices, and reads on
+** its own from then on; a chunk read for the flight before is never counted
+** in the new one's filled.
+*/
+#define FLIGHT_SLOTS 32
+#define FLIGHT_WINDOW_SIZE (1 << 22)
+#define FLIGHT_CHUNK_SIZE 65536
+#define FLIGHT_IDLE_MS 10000
+
+
+typedef struct flight {
+    uint32_t lock;          // held while reading the next chunk
+    uint32_t generation;
+    uint32_t members;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t mtime;
+    uint32_t size;
+    uint64_t filled;
+    long last_active_ms;
+    uint8_t window[FLIGHT_WINDOW_SIZE];
+} Flight;
+
+
+/*
+** lock: held while joining or leaving a flight.
+** coalesce: 0 to read every file alone, only keeping count.
+** leaders, followers, solos: streams that started a flight, joined one, or
+**     read on their own.
+** disk_reads, disk_bytes: reads of the files, and the bytes they returned.
+** shared_bytes: bytes streams copied out of a window that another stream read.
+*/
+typedef struct flight_table {
+    uint32_t lock;
+    uint8_t coalesce;
+    uint64_t leaders;
+    uint64_t followers;
+    uint64_t solos;
+    uint64_t disk_reads;
+    uint64_t disk_bytes;
+    uint64_t shared_bytes;
+    Flight flights[FLIGHT_SLOTS];
+} FlightTable;
+
+
+/*
+** A stream's view of a file, read from position on through its flight, or
+** from fd alone when flight is NULL. dev: the device the file is on.
+*/
+typedef struct flight_reader {
+    FlightTable *table;
+    Flight *flight;
+    uint32_t generation;
+    int fd;
+    uint64_t dev;
+    uint32_t size;
+    uint64_t position;
+} FlightReader;
+
+
+/*
+** Maps an empty flight table shared with every process forked afterwards.
+** Unless coalesce is set, every stream reads alone, which is only useful to
+** compare the counters.
+**
+** returns the table, NULL on error
+*/
+FlightTable *flights_create(uint8_t coalesce);
+
+/*
+** Unmaps the table.
+*/
+void flights_destroy(FlightTable *table);
+
+/*
+** Starts reading the file open at fd, whose fstat is file_stat, from its
+** start, joining the flight for the file if there is one and starting one if
+** not. With a NULL table, a table that does not coalesce, or no free slot,
+** the file is read on its own.
+** The reader does not take ownership of fd.
+*/
+void flight_open(FlightTable *table, FlightReader *reader, int fd, const struct stat *file_stat);
+
+/*
+** Reads up to count of the next bytes of the file into buf.
+**
+** returns the number of bytes read, 0 at the end of the file, -1 on error
+*/
+ssize_t flight_read(FlightReader *reader, void *buf, size_t count);
+
+/*
+** Finds what the next read of up to count bytes would read from the file
+** rather than from the flight's window: the flight's next chunk at its front,
+** nothing behind it, and the bytes asked for when reading alone.
+**
+** returns the number of bytes it would read from *offset on, 0 if none
+*/
+uint32_t flight_next_read(const FlightReader *reader, size_t count, uint64_t *offset);
+
+/*
+** Leaves the reader's flight.
+*/
+void flight_close(FlightReader *reader);
+
+/*
+** Prints the table's counters.
+*/
+void flights_print_stats(const FlightTable *table);
+
+#endif // AS_FLIGHT_H_
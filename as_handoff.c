@@ -0,0 +1,113 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_handoff.h"
+
+
+int handoff_start(char * const *argv, pid_t *successor) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+        perror("handoff_start: socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("handoff_start: fork");
+        close(sockets[0]);
+        close(sockets[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sockets[0]);
+        char handoff_fd[16];
+        snprintf(handoff_fd, sizeof(handoff_fd), "%d", sockets[1]);
+        setenv(HANDOFF_ENV, handoff_fd, 1);
+        execvp(argv[0], argv);
+        perror("handoff_start: execvp");
+        _exit(1);
+    }
+
+    close(sockets[1]);
+    fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+    *successor = pid;
+    return sockets[0];
+}
+
+
+int handoff_send_listener(int handoff_fd, int listen_fd) {
+    char message;
+    int num = read(handoff_fd, &message, 1);
+    if (num == -1 && errno == EINTR) {
+        return 0;
+    }
+    if (num == -1) {
+        perror("handoff_send_listener: read");
+        return -1;
+    }
+    if (num == 0 || message != HANDOFF_READY) {
+        return -1;
+    }
+
+    char data = HANDOFF_LISTENER;
+    struct iovec iov = {&data, 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    if (sendmsg(handoff_fd, &msg, MSG_NOSIGNAL) != 1) {
+        perror("handoff_send_listener: sendmsg");
+        return -1;
+    }
+    return 1;
+}
+
+
+int handoff_receive_listener(int handoff_fd) {
+    char ready = HANDOFF_READY;
+    if (write_precisely(handoff_fd, &ready, 1) != 1) {
+        return -1;
+    }
+
+    char data;
+    struct iovec iov = {&data, 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    int num;
+    while ((num = recvmsg(handoff_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+    if (num == -1) {
+        perror("handoff_receive_listener: recvmsg");
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (num != 1 || data != HANDOFF_LISTENER || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        ERR_PRINT("handoff_receive_listener: No listening socket from the predecessor\n");
+        return -1;
+    }
+    int listen_fd;
+    memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    return listen_fd;
+}
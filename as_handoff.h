@@ -0,0 +1,56 @@
+#ifndef AS_HANDOFF_H_
+#define AS_HANDOFF_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Listening socket handoff
+** ------------------------
+** To upgrade without dropping a connection, a running server starts a
+** successor: the server binary, exec'd afresh, with a Unix socket to its
+** predecessor in the environment variable HANDOFF_ENV. The successor sets
+** itself up, scanning its library and all, while the predecessor keeps
+** accepting connections. Once ready it sends HANDOFF_READY, and the
+** predecessor answers with its listening socket, passed with SCM_RIGHTS.
+** From then on the successor accepts every connection, and the predecessor
+** only waits for its client processes to finish before it exits.
+**
+** Connections that arrive during the handoff wait in the listen queue, which
+** both processes share, so none are refused. If the successor fails before
+** it is ready, its end of the Unix socket closes, and the predecessor carries
+** on as if nothing happened.
+*/
+#define HANDOFF_ENV "AS_HANDOFF_FD"
+#define HANDOFF_READY 'R'
+#define HANDOFF_LISTENER 'L'
+
+
+/*
+** Starts the successor, running argv, whose first element is the binary.
+**
+** returns the predecessor's end of the Unix socket to the successor, with
+** *successor set to its pid, -1 on error
+*/
+int handoff_start(char * const *argv, pid_t *successor);
+
+/*
+** For the predecessor: reads what the successor sent on handoff_fd and, if
+** it is ready, sends it listen_fd.
+**
+** returns 1 if listen_fd was handed off, 0 if the successor isn't ready yet,
+** -1 if it failed
+*/
+int handoff_send_listener(int handoff_fd, int listen_fd);
+
+/*
+** For the successor: tells the predecessor it is ready, and receives the
+** listening socket.
+**
+** returns the listening socket, -1 on error
+*/
+int handoff_receive_listener(int handoff_fd);
+
+#endif // AS_HANDOFF_H_
@@ -0,0 +1,186 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_readahead.h"
+
+#include <time.h>
+
+uint32_t readahead_window = READAHEAD_DEFAULT_WINDOW;
+
+
+static long _now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+** Reads a batch of size bytes into buffer, hinting the kernel at the part of
+** the file after it first.
+**
+** returns size, -1 on error or if the file ended before size bytes, as a
+** stream never asks for more than the file had when it started
+*/
+static int _read_batch(ReadAhead *ahead, uint8_t *buffer, uint32_t size) {
+    FlightReader *reader = ahead->reader;
+    uint64_t end = reader->position + size;
+    // Hint a window at a time, once half of the last one was read
+    if (ahead->threaded && end + readahead_window / 2 > ahead->hinted) {
+        uint64_t start = MAX(ahead->hinted, reader->position);
+        posix_fadvise(reader->fd, start, end + readahead_window - start, POSIX_FADV_WILLNEED);
+        ahead->hinted = end + readahead_window;
+    }
+
+    TRACE_BEGIN("read");
+    uint32_t num = 0;
+    while (num < size) {
+        int bytes_read = flight_read(reader, buffer + num, size - num);
+        if (bytes_read == -1) {
+            TRACE_END("read");
+            return -1;
+        }
+        if (bytes_read == 0) {
+            TRACE_END("read");
+            ERR_PRINT("File shrank while streaming\n");
+            return -1;
+        }
+        num += bytes_read;
+    }
+    TRACE_END("read");
+    return num;
+}
+
+
+static void *_read_ahead(void *arg) {
+    ReadAhead *ahead = arg;
+    pthread_mutex_lock(&ahead->lock);
+    while (1) {
+        while (ahead->requested == 0 && !ahead->stopping) {
+            pthread_cond_wait(&ahead->cond, &ahead->lock);
+        }
+        if (ahead->stopping) {
+            break;
+        }
+        uint8_t *buffer = ahead->buffers[ahead->back];
+        uint32_t size = ahead->requested;
+        pthread_mutex_unlock(&ahead->lock);
+
+        int result = _read_batch(ahead, buffer, size);
+
+        pthread_mutex_lock(&ahead->lock);
+        ahead->result = result;
+        ahead->requested = 0;
+        ahead->done = 1;
+        pthread_cond_broadcast(&ahead->cond);
+    }
+    pthread_mutex_unlock(&ahead->lock);
+    return NULL;
+}
+
+
+/*
+** Starts the helper thread, which reads into the back buffer from now on.
+**
+** returns 0 on success, -1 on error, leaving the reads synchronous
+*/
+static int _start_helper(ReadAhead *ahead) {
+    ahead->buffers[1] = malloc(ahead->max_batch);
+    if (ahead->buffers[1] == NULL) {
+        perror("readahead: malloc");
+        return -1;
+    }
+    pthread_mutex_init(&ahead->lock, NULL);
+    pthread_cond_init(&ahead->cond, NULL);
+    int error = pthread_create(&ahead->thread, NULL, _read_ahead, ahead);
+    if (error != 0) {
+        ERR_PRINT("readahead: pthread_create: %s\n", strerror(error));
+        pthread_mutex_destroy(&ahead->lock);
+        pthread_cond_destroy(&ahead->cond);
+        free(ahead->buffers[1]);
+        ahead->buffers[1] = NULL;
+        return -1;
+    }
+    // The front buffer may still be being sent
+    ahead->back = 1;
+    ahead->threaded = 1;
+    // Also makes the kernel's own read-ahead more eager
+    posix_fadvise(ahead->reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+
+int readahead_start(ReadAhead *ahead, FlightReader *reader, uint32_t max_batch) {
+    memset(ahead, 0, sizeof(ReadAhead));
+    ahead->reader = reader;
+    ahead->max_batch = MAX(max_batch, 1);
+    ahead->buffers[0] = malloc(ahead->max_batch);
+    if (ahead->buffers[0] == NULL) {
+        perror("readahead_start");
+        return -1;
+    }
+    // Otherwise every part of the file counts as cold
+    if (readahead_window > 0) {
+        disk_map(&ahead->map, reader->fd, reader->size, ahead->max_batch);
+    }
+    return 0;
+}
+
+
+void readahead_request(ReadAhead *ahead, uint32_t size) {
+    if (!ahead->threaded) {
+        ahead->requested = size;
+        ahead->cold = readahead_window > 0 && size > 0 &&
+                      !disk_cached(&ahead->map, ahead->reader->position, size);
+        return;
+    }
+    pthread_mutex_lock(&ahead->lock);
+    // Nothing for the helper to do for an empty batch
+    ahead->requested = size;
+    ahead->result = 0;
+    ahead->done = size == 0;
+    pthread_cond_broadcast(&ahead->cond);
+    pthread_mutex_unlock(&ahead->lock);
+}
+
+
+int readahead_take(ReadAhead *ahead, uint8_t **data) {
+    if (!ahead->threaded) {
+        *data = ahead->buffers[0];
+        long start_us = _now_us();
+        int result = _read_batch(ahead, ahead->buffers[0], ahead->requested);
+        ahead->requested = 0;
+        // Streams only pay for the helper once the disk keeps them waiting
+        if (ahead->cold && _now_us() - start_us >= READAHEAD_SLOW_READ_US) {
+            _start_helper(ahead);
+        }
+        return result;
+    }
+    pthread_mutex_lock(&ahead->lock);
+    while (!ahead->done) {
+        pthread_cond_wait(&ahead->cond, &ahead->lock);
+    }
+    *data = ahead->buffers[ahead->back];
+    int result = ahead->result;
+    // The next batch goes into the buffer that was just sent
+    ahead->back = 1 - ahead->back;
+    ahead->done = 0;
+    pthread_mutex_unlock(&ahead->lock);
+    return result;
+}
+
+
+void readahead_stop(ReadAhead *ahead) {
+    if (ahead->threaded) {
+        pthread_mutex_lock(&ahead->lock);
+        ahead->stopping = 1;
+        pthread_cond_broadcast(&ahead->cond);
+        pthread_mutex_unlock(&ahead->lock);
+        pthread_join(ahead->thread, NULL);
+        pthread_mutex_destroy(&ahead->lock);
+        pthread_cond_destroy(&ahead->cond);
+    }
+    disk_unmap(&ahead->map);
+    free(ahead->buffers[0]);
+    free(ahead->buffers[1]);
+}
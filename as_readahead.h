@@ -0,0 +1,88 @@
+#ifndef AS_READAHEAD_H_
+#define AS_READAHEAD_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_flight.h"
+#include "as_disk.h"
+
+#include <pthread.h>
+
+/*
+** Read-ahead
+** ----------
+** A stream of a file that is not in the page cache would otherwise wait on
+** the disk for every batch it reads, then on the network while it sends it,
+** never both at once. With read-ahead, a helper thread reads the next batch
+** into a back buffer while the stream sends the front one, and the two swap
+** when the batch is sent. As it reads, the helper asks the kernel to start
+** reading the next readahead_window bytes of the file too (WILLNEED), so the
+** disk is busy ahead of the stream rather than behind it.
+**
+** Handing batches between threads costs more than it saves when the reads
+** don't wait on the disk, so a stream reads its batches itself until one that
+** was not in the page cache (mincore) takes READAHEAD_SLOW_READ_US or more,
+** and only starts the helper then. Cached files, and disks that answer that
+** fast, never need it.
+**
+** Reads go through the stream's flight reader, which only the helper touches
+** once it has started. With a readahead_window of 0, there is no helper, and
+** batches are read when they are taken.
+*/
+#define READAHEAD_DEFAULT_WINDOW (2 << 20)
+#define READAHEAD_SLOW_READ_US 1000
+
+// Bytes of a file to hint ahead of reads, 0 to read synchronously
+extern uint32_t readahead_window;
+
+
+typedef struct read_ahead {
+    FlightReader *reader;
+    uint8_t *buffers[2];
+    int back;               // buffer the next batch is read into
+    uint32_t requested;     // size of the next batch, 0 once it was read
+    int result;             // bytes of the batch read, -1 on error
+    uint8_t done;           // the batch was read
+    uint8_t stopping;
+    uint8_t threaded;
+    uint8_t cold;           // the batch asked for was not all cached
+    uint64_t hinted;        // the kernel was asked to read the file up to here
+    uint32_t max_batch;
+    DiskMap map;            // of the file, to ask which batches are cached
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ReadAhead;
+
+
+/*
+** Starts reading ahead of reader, in batches of up to max_batch bytes. The
+** reader must be left to read-ahead until readahead_stop.
+**
+** returns 0 on success, -1 on error
+*/
+int readahead_start(ReadAhead *ahead, FlightReader *reader, uint32_t max_batch);
+
+/*
+** Asks for the next batch of size bytes of the file, to be taken with
+** readahead_take. Only one batch may be asked for at a time.
+*/
+void readahead_request(ReadAhead *ahead, uint32_t size);
+
+/*
+** Waits for the batch asked for, and points *data at it. It stays valid until
+** the next batch is taken.
+**
+** returns the number of bytes in the batch, all those asked for, -1 on error,
+** a file that shrank included
+*/
+int readahead_take(ReadAhead *ahead, uint8_t **data);
+
+/*
+** Stops reading ahead and frees the buffers.
+*/
+void readahead_stop(ReadAhead *ahead);
+
+#endif // AS_READAHEAD_H_
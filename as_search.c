@@ -0,0 +1,424 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_search.h"
+
+
+static uint8_t _fold(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : (uint8_t)c;
+}
+
+
+static uint32_t _trigram(const char *p) {
+    return (uint32_t)_fold(p[0]) << 16 | (uint32_t)_fold(p[1]) << 8 | _fold(p[2]);
+}
+
+
+/*
+** returns the slot of trigram in the table, or the free slot it would take
+*/
+static SearchPosting *_slot(SearchPosting *postings, uint32_t num_slots, uint32_t trigram) {
+    uint32_t slot = (trigram * 2654435761u) & (num_slots - 1);
+    while (postings[slot].trigram != 0 && postings[slot].trigram != trigram) {
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    return &postings[slot];
+}
+
+
+/*
+** Doubles the trigram table, or makes the first one.
+**
+** returns 0 on success, -1 on error
+*/
+static int _grow_table(SearchIndex *index) {
+    uint32_t num_slots = index->num_slots == 0 ? SEARCH_INITIAL_SLOTS : 2 * index->num_slots;
+    SearchPosting *postings = calloc(num_slots, sizeof(SearchPosting));
+    if (postings == NULL) {
+        perror("search_index_update: calloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < index->num_slots; i++) {
+        if (index->postings[i].trigram != 0) {
+            *_slot(postings, num_slots, index->postings[i].trigram) = index->postings[i];
+        }
+    }
+    free(index->postings);
+    index->postings = postings;
+    index->num_slots = num_slots;
+    return 0;
+}
+
+
+static int _posting_add(SearchIndex *index, uint32_t trigram, uint32_t doc) {
+    // Keeps the table at most half full
+    if (2 * (index->num_trigrams + 1) > index->num_slots && _grow_table(index) == -1) {
+        return -1;
+    }
+    SearchPosting *posting = _slot(index->postings, index->num_slots, trigram);
+    if (posting->trigram == 0) {
+        posting->trigram = trigram;
+        index->num_trigrams++;
+    }
+    // A path with the same trigram twice adds its document once
+    if (posting->num_docs > 0 && posting->docs[posting->num_docs - 1] == doc) {
+        return 0;
+    }
+    if (posting->num_docs == posting->capacity) {
+        uint32_t capacity = posting->capacity == 0 ? 4 : 2 * posting->capacity;
+        uint32_t *docs = realloc(posting->docs, capacity * sizeof(uint32_t));
+        if (docs == NULL) {
+            perror("search_index_update: realloc");
+            return -1;
+        }
+        posting->docs = docs;
+        posting->capacity = capacity;
+    }
+    posting->docs[posting->num_docs++] = doc;
+    return 0;
+}
+
+
+/*
+** returns the new document for path, -1 on error
+*/
+static int _add_doc(SearchIndex *index, const char *path) {
+    if (index->num_docs == index->docs_capacity) {
+        uint32_t capacity = index->docs_capacity == 0 ? 1024 : 2 * index->docs_capacity;
+        SearchDoc *docs = realloc(index->docs, capacity * sizeof(SearchDoc));
+        if (docs == NULL) {
+            perror("search_index_update: realloc");
+            return -1;
+        }
+        index->docs = docs;
+        index->docs_capacity = capacity;
+    }
+    uint32_t doc = index->num_docs;
+    index->docs[doc].path = strdup(path);
+    if (index->docs[doc].path == NULL) {
+        perror("search_index_update: strdup");
+        return -1;
+    }
+    index->num_docs++;
+    for (const char *p = path; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++) {
+        if (_posting_add(index, _trigram(p), doc) == -1) {
+            return -1;
+        }
+    }
+    return doc;
+}
+
+
+void search_index_init(SearchIndex *index) {
+    memset(index, 0, sizeof(SearchIndex));
+}
+
+
+int search_index_update(SearchIndex *index, const Library *library) {
+    // Dead documents cost space and time in every list they are in
+    if (index->num_dead > index->num_docs / 2) {
+        search_index_free(index);
+    }
+    // The scratch of fuzzy queries is sized for the old documents
+    free(index->scores);
+    free(index->touched);
+    index->scores = NULL;
+    index->touched = NULL;
+
+    uint32_t *by_path = malloc(MAX(library->num_files, 1) * sizeof(uint32_t));
+    if (by_path == NULL) {
+        perror("search_index_update: malloc");
+        search_index_free(index);
+        return -1;
+    }
+    uint32_t old = 0;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        const char *path = library->files[i];
+        int order = 1;
+        // Paths before this one in the old library have left it
+        while (old < index->num_files &&
+               (order = strcmp(index->docs[index->by_path[old]].path, path)) < 0) {
+            SearchDoc *gone = &index->docs[index->by_path[old++]];
+            free(gone->path);
+            gone->path = NULL;
+            index->num_dead++;
+        }
+        int doc;
+        if (old < index->num_files && order == 0) {
+            doc = index->by_path[old++];
+        } else if ((doc = _add_doc(index, path)) == -1) {
+            free(by_path);
+            search_index_free(index);
+            return -1;
+        }
+        index->docs[doc].file_index = i;
+        by_path[i] = doc;
+    }
+    while (old < index->num_files) {
+        SearchDoc *gone = &index->docs[index->by_path[old++]];
+        free(gone->path);
+        gone->path = NULL;
+        index->num_dead++;
+    }
+    free(index->by_path);
+    index->by_path = by_path;
+    index->num_files = library->num_files;
+    return 0;
+}
+
+
+void search_index_free(SearchIndex *index) {
+    for (uint32_t i = 0; i < index->num_slots; i++) {
+        free(index->postings[i].docs);
+    }
+    for (uint32_t i = 0; i < index->num_docs; i++) {
+        free(index->docs[i].path);
+    }
+    free(index->postings);
+    free(index->docs);
+    free(index->by_path);
+    free(index->scores);
+    free(index->touched);
+    search_index_init(index);
+}
+
+
+/*
+** Helper for: search_index_query
+** Moves *cursor on to the first document of posting that is doc or after it,
+** skipping ahead in growing steps and then bisecting.
+**
+** returns whether doc is in posting
+*/
+static uint8_t _posting_has(const SearchPosting *posting, uint32_t *cursor, uint32_t doc) {
+    uint32_t low = *cursor, high = *cursor, step = 1;
+    while (high < posting->num_docs && posting->docs[high] < doc) {
+        low = high + 1;
+        high = low + step;
+        step *= 2;
+    }
+    high = MIN(high, posting->num_docs);
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (posting->docs[middle] < doc) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *cursor = low;
+    return low < posting->num_docs && posting->docs[low] == doc;
+}
+
+
+/*
+** Helper for: search_index_query
+** Finds the folded query in path, starting anywhere from from up to before
+** to, only at the start of a word if word_start is set.
+**
+** returns whether it is there
+*/
+static uint8_t _find(const char *path, const char *from, const char *to, const char *query,
+                     size_t query_len, uint8_t word_start) {
+    for (const char *p = from; p < to; p++) {
+        if (_fold(*p) != (uint8_t)query[0] ||
+            (word_start && p != path && strchr(SEARCH_WORD_SEPARATORS, p[-1]) == NULL)) {
+            continue;
+        }
+        // Stops at the end of the path, as the query has no null character
+        size_t i = 1;
+        while (i < query_len && _fold(p[i]) == (uint8_t)query[i]) {
+            i++;
+        }
+        if (i == query_len) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: search_index_query
+** Compares path with the folded query, in SEARCH_SUBSTRING or SEARCH_PREFIX
+** mode.
+**
+** returns whether it matches, with its rank in *rank
+*/
+static uint8_t _match(const char *path, const char *query, size_t query_len, uint8_t mode,
+                      uint32_t *rank) {
+    size_t path_len = strlen(path);
+    const char *end = path + path_len;
+    const char *name = end;
+    while (name > path && name[-1] != '/') {
+        name--;
+    }
+    path_len = MIN(path_len, INT32_MAX);
+    if (_find(path, name, end, query, query_len, mode == SEARCH_PREFIX)) {
+        *rank = path_len;
+        return 1;
+    }
+    // Matches that start in a directory, even if they run into the name
+    if (_find(path, path, name, query, query_len, mode == SEARCH_PREFIX)) {
+        *rank = 1u << 31 | path_len;
+        return 1;
+    }
+    return 0;
+}
+
+
+static uint8_t _worse(const SearchMatch *a, const SearchMatch *b) {
+    return a->rank > b->rank || (a->rank == b->rank && a->file_index > b->file_index);
+}
+
+
+/*
+** Helper for: search_index_query
+** Keeps the best limit matches offered in heap, worst on top.
+*/
+static void _offer(SearchMatch *heap, uint32_t *num, uint32_t limit, SearchMatch match) {
+    uint32_t i;
+    if (*num < limit) {
+        i = (*num)++;
+        while (i > 0 && _worse(&match, &heap[(i - 1) / 2])) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = match;
+        return;
+    }
+    if (limit == 0 || !_worse(&heap[0], &match)) {
+        return;
+    }
+    i = 0;
+    while (2 * i + 1 < *num) {
+        uint32_t child = 2 * i + 1;
+        if (child + 1 < *num && _worse(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!_worse(&heap[child], &match)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = match;
+}
+
+
+static int _compare_matches(const void *a, const void *b) {
+    return _worse(a, b) ? 1 : _worse(b, a) ? -1 : 0;
+}
+
+
+int search_index_query(SearchIndex *index, const char *query, uint8_t mode, uint32_t limit,
+                       SearchMatch *matches) {
+    char folded[SEARCH_MAX_QUERY + 1];
+    size_t query_len = MIN(strlen(query), SEARCH_MAX_QUERY);
+    for (size_t i = 0; i < query_len; i++) {
+        folded[i] = _fold(query[i]);
+    }
+    folded[query_len] = '\0';
+    if (query_len == 0) {
+        return 0;
+    }
+
+    // The query's trigrams, each once, and their postings, NULL if none
+    const SearchPosting *postings[SEARCH_MAX_QUERY];
+    uint32_t trigrams[SEARCH_MAX_QUERY];
+    uint32_t num_trigrams = 0;
+    for (size_t i = 0; i + 3 <= query_len; i++) {
+        uint32_t trigram = _trigram(folded + i);
+        uint32_t j = 0;
+        while (j < num_trigrams && trigrams[j] != trigram) {
+            j++;
+        }
+        if (j < num_trigrams) {
+            continue;
+        }
+        const SearchPosting *posting = NULL;
+        if (index->num_slots > 0) {
+            posting = _slot(index->postings, index->num_slots, trigram);
+            posting = posting->trigram == 0 ? NULL : posting;
+        }
+        if (posting == NULL && mode != SEARCH_FUZZY) {
+            // No path has all of the query
+            return 0;
+        }
+        trigrams[num_trigrams] = trigram;
+        postings[num_trigrams++] = posting;
+    }
+    uint32_t num_matches = 0;
+
+    if (mode == SEARCH_FUZZY && query_len >= 3) {
+        if (index->scores == NULL) {
+            index->scores = calloc(MAX(index->docs_capacity, 1), sizeof(uint16_t));
+            index->touched = malloc(MAX(index->docs_capacity, 1) * sizeof(uint32_t));
+            if (index->scores == NULL || index->touched == NULL) {
+                perror("search_index_query");
+                return -1;
+            }
+        }
+        // Only ever 0 outside of a query
+        uint32_t num_touched = 0;
+        for (uint32_t i = 0; i < num_trigrams; i++) {
+            for (uint32_t j = 0; postings[i] != NULL && j < postings[i]->num_docs; j++) {
+                uint32_t doc = postings[i]->docs[j];
+                if (index->scores[doc]++ == 0) {
+                    index->touched[num_touched++] = doc;
+                }
+            }
+        }
+        for (uint32_t i = 0; i < num_touched; i++) {
+            uint32_t doc = index->touched[i];
+            uint32_t shared = index->scores[doc];
+            index->scores[doc] = 0;
+            const char *path = index->docs[doc].path;
+            if (path == NULL || shared * SEARCH_FUZZY_SHARE < num_trigrams) {
+                continue;
+            }
+            SearchMatch match = {index->docs[doc].file_index,
+                                 (num_trigrams - shared) << 16 | MIN(strlen(path), 0xffff)};
+            _offer(matches, &num_matches, limit, match);
+        }
+
+    } else if (num_trigrams == 0) {
+        // Too short for a trigram, so every path is compared
+        for (uint32_t i = 0; i < index->num_files; i++) {
+            SearchMatch match = {i, 0};
+            if (_match(index->docs[index->by_path[i]].path, folded, query_len, mode, &match.rank)) {
+                _offer(matches, &num_matches, limit, match);
+            }
+        }
+
+    } else {
+        // Walk the shortest list, looking each document up in the others
+        for (uint32_t i = 1; i < num_trigrams; i++) {
+            if (postings[i]->num_docs < postings[0]->num_docs) {
+                const SearchPosting *shortest = postings[i];
+                postings[i] = postings[0];
+                postings[0] = shortest;
+            }
+        }
+        uint32_t cursors[SEARCH_MAX_QUERY] = {0};
+        for (uint32_t i = 0; i < postings[0]->num_docs; i++) {
+            uint32_t doc = postings[0]->docs[i];
+            uint32_t j = 1;
+            while (j < num_trigrams && _posting_has(postings[j], &cursors[j], doc)) {
+                j++;
+            }
+            const char *path = index->docs[doc].path;
+            if (j < num_trigrams || path == NULL) {
+                continue;
+            }
+            SearchMatch match = {index->docs[doc].file_index, 0};
+            if (_match(path, folded, query_len, mode, &match.rank)) {
+                _offer(matches, &num_matches, limit, match);
+            }
+        }
+    }
+
+    qsort(matches, num_matches, sizeof(SearchMatch), _compare_matches);
+    return num_matches;
+}
@@ -0,0 +1,124 @@
+#ifndef AS_SEARCH_H_
+#define AS_SEARCH_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+/*
+** Library search
+** --------------
+** A client looking for a track would otherwise have to LIST the whole
+** library and search it itself. Instead, the server keeps an inverted index
+** of the library's paths by trigram: for every 3 bytes that appear in a path,
+** ignoring ASCII case, the documents whose path has them. A query is looked up
+** by intersecting the lists of its own trigrams, and only the paths in all of
+** them are compared with it. Queries shorter than a trigram compare every
+** path.
+**
+** A document is a path the index has seen, numbered in the order it was
+** added, so every list stays sorted as documents are appended. The index is
+** brought up to date with each scan of the library by walking the old and new
+** paths side by side, which are both sorted: paths that stay keep their
+** document and only get their new file index, new paths are added, and the
+** documents of paths that left are only marked dead. Once more than half of
+** the documents are dead, the index is rebuilt from scratch.
+**
+** A SEARCH request is followed by SEARCH_HEADER_SIZE bytes: the mode, the
+** most matches wanted as a 16-bit integer in network byte order (0 for
+** SEARCH_DEFAULT_LIMIT), and the length of the query, which comes last.
+**
+** Modes:
+**   SEARCH_SUBSTRING: the query appears anywhere in the path.
+**   SEARCH_PREFIX: the query starts a word of the path, at its start or after
+**       one of SEARCH_WORD_SEPARATORS.
+**   SEARCH_FUZZY: the path has at least 1/SEARCH_FUZZY_SHARE of the query's
+**       trigrams, which allows for typos.
+** Matches in the file's name rank above those only in its directories, and
+** shorter paths above longer ones. Fuzzy matches rank by the trigrams they
+** share first.
+*/
+#define SEARCH_HEADER_SIZE 4
+#define SEARCH_SUBSTRING 0
+#define SEARCH_PREFIX 1
+#define SEARCH_FUZZY 2
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_LIMIT 1000
+#define SEARCH_MAX_QUERY 255
+#define SEARCH_FUZZY_SHARE 3
+#define SEARCH_WORD_SEPARATORS "/ _-."
+// Slots in a new trigram table, a power of 2
+#define SEARCH_INITIAL_SLOTS 4096
+
+
+/*
+** The documents that have a trigram, as its lowercase bytes, 0 for a free slot.
+*/
+typedef struct search_posting {
+    uint32_t trigram;
+    uint32_t num_docs;
+    uint32_t capacity;
+    uint32_t *docs;
+} SearchPosting;
+
+typedef struct search_doc {
+    char *path;             // NULL once the path left the library
+    uint32_t file_index;
+} SearchDoc;
+
+/*
+** postings: open-addressed table of num_slots, num_trigrams of them in use.
+** docs: every document added since the index was last built, num_dead of
+**     them dead.
+** by_path: the document of each of the library's num_files files.
+** scores, touched: scratch for fuzzy queries, allocated on the first.
+*/
+typedef struct search_index {
+    SearchPosting *postings;
+    uint32_t num_slots;
+    uint32_t num_trigrams;
+    SearchDoc *docs;
+    uint32_t num_docs;
+    uint32_t docs_capacity;
+    uint32_t num_dead;
+    uint32_t *by_path;
+    uint32_t num_files;
+    uint16_t *scores;
+    uint32_t *touched;
+} SearchIndex;
+
+typedef struct search_match {
+    uint32_t file_index;
+    uint32_t rank;          // lower is better
+} SearchMatch;
+
+
+/*
+** Initializes an empty index.
+*/
+void search_index_init(SearchIndex *index);
+
+/*
+** Brings the index up to date with library, whose files must be sorted by
+** path for paths that stay to keep their documents.
+**
+** returns 0 on success, -1 on error, leaving the index empty
+*/
+int search_index_update(SearchIndex *index, const Library *library);
+
+/*
+** Finds up to limit files whose paths match the query in the given mode, and
+** stores them in matches, best first.
+**
+** returns the number of matches, -1 on error
+*/
+int search_index_query(SearchIndex *index, const char *query, uint8_t mode, uint32_t limit,
+                       SearchMatch *matches);
+
+/*
+** Frees everything the index holds, leaving it empty.
+*/
+void search_index_free(SearchIndex *index);
+
+#endif // AS_SEARCH_H_
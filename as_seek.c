@@ -0,0 +1,1833 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_seek.h"
+
+#include <time.h>
+
+const char *seek_index_directory = SEEK_DEFAULT_DIRECTORY;
+
+#define SEEK_INITIAL_POINTS 64
+#define WAV_HEADER_SIZE 12
+#define MP3_HEADER_SIZE 4
+#define MP3_TOC_SIZE 100
+#define FLAC_MARKER_SIZE 4
+#define FLAC_STREAMINFO_SIZE 34
+#define FLAC_SEEKPOINT_SIZE 18
+#define FLAC_MAX_FRAME_HEADER 16
+#define OGG_PAGE_HEADER_SIZE 27
+#define M4A_BOX_HEADER_SIZE 8
+
+static const uint16_t mp3_bitrates[2][3][15] = {
+    // MPEG-1 layers I, II and III
+    {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+     {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+     {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}},
+    // MPEG-2 and 2.5 layers I, II and III
+    {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}},
+};
+static const uint32_t mp3_rates[3] = {44100, 48000, 32000};
+
+
+typedef struct seek_point {
+    uint32_t ms;
+    uint32_t position;
+} SeekPoint;
+
+// Points being collected for a table, at most one every SEEK_INTERVAL_MS
+typedef struct seek_points {
+    SeekPoint *points;
+    uint32_t num;
+    uint32_t capacity;
+    uint32_t next_ms;
+} SeekPoints;
+
+// A window of a file, refilled with a single pread where a peek leaves it
+typedef struct seek_reader {
+    int fd;
+    uint64_t size;
+    uint64_t start;
+    uint32_t len;
+    uint8_t buf[SEEK_READ_SIZE];
+} SeekReader;
+
+typedef struct ogg_info {
+    uint32_t serial;
+    uint32_t rate;
+    uint32_t preskip;
+    uint32_t header_end;
+} OggInfo;
+
+/*
+** Walks a file's frames (or Ogg's pages) one at a time, from offset on.
+** start_ms and samples: the time of the frame the walk started at, and the
+**     samples since then, for MP3, whose frames don't say when they start.
+** rate, block_size, expected: FLAC's sample rate and fixed block size, and
+**     the first sample of the next frame, UINT64_MAX if it is not known.
+** ogg, ms: the Ogg stream, and the time at the start of the next page.
+*/
+typedef struct seek_walker {
+    uint8_t format;
+    uint64_t offset;
+    uint32_t start_ms;
+    uint64_t samples;
+    uint32_t rate;
+    uint32_t block_size;
+    uint64_t expected;
+    OggInfo ogg;
+    uint32_t ms;
+} SeekWalker;
+
+// A growing buffer for a synthesized header, only checked once it is done
+typedef struct seek_out {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t capacity;
+    uint8_t failed;
+} SeekOut;
+
+typedef struct m4a_box {
+    const uint8_t *start;
+    uint32_t len;
+    const uint8_t *payload;
+    uint32_t payload_len;
+    char type[4];
+} M4aBox;
+
+// The audio track of an M4A file, with its sample tables
+typedef struct m4a_track {
+    M4aBox trak;
+    uint32_t movie_timescale;
+    uint32_t timescale;
+    uint64_t duration;
+    M4aBox stts, stsc, stsz, stco;
+    uint8_t co64;
+    uint32_t num_samples;
+    uint32_t num_chunks;
+} M4aTrack;
+
+
+static uint16_t _be16(const uint8_t *p) {
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t _be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t _be64(const uint8_t *p) {
+    return (uint64_t)_be32(p) << 32 | _be32(p + 4);
+}
+
+static uint16_t _le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t _le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t _le64(const uint8_t *p) {
+    return _le32(p) | (uint64_t)_le32(p + 4) << 32;
+}
+
+static void _put_be32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void _put_le32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+
+/*
+** returns a view of the count bytes of the file at offset, at most
+** SEEK_READ_SIZE of them and valid until the next peek, NULL if the file
+** ends before them or can't be read
+*/
+static const uint8_t *_peek(SeekReader *reader, uint64_t offset, uint32_t count) {
+    if (count > SEEK_READ_SIZE || offset + count > reader->size) {
+        return NULL;
+    }
+    if (offset < reader->start || offset + count > reader->start + reader->len) {
+        ssize_t num = pread(reader->fd, reader->buf, MIN(SEEK_READ_SIZE, reader->size - offset),
+                            offset);
+        if (num < (ssize_t)count) {
+            reader->len = 0;
+            return NULL;
+        }
+        reader->start = offset;
+        reader->len = num;
+    }
+    return reader->buf + (offset - reader->start);
+}
+
+
+/*
+** returns the len bytes of the file at offset, heap-allocated, NULL on error
+*/
+static uint8_t *_read_at(int fd, uint64_t offset, uint32_t len) {
+    uint8_t *data = malloc(MAX(len, 1));
+    if (data == NULL) {
+        perror("seek: malloc");
+        return NULL;
+    }
+    uint32_t num = 0;
+    while (num < len) {
+        ssize_t result = pread(fd, data + num, len - num, offset + num);
+        if (result <= 0) {
+            if (result == -1) {
+                perror("seek: pread");
+            }
+            free(data);
+            return NULL;
+        }
+        num += result;
+    }
+    return data;
+}
+
+
+/*
+** Helper for: the table builders
+** Adds a point, unless it is within SEEK_INTERVAL_MS of the last one or
+** would go back.
+**
+** returns 0 on success, -1 on error
+*/
+static int _add_point(SeekPoints *points, uint32_t ms, uint32_t position) {
+    if (points->num > 0 && (ms < points->next_ms ||
+                            position < points->points[points->num - 1].position)) {
+        return 0;
+    }
+    if (points->num == points->capacity) {
+        uint32_t capacity = MAX(2 * points->capacity, SEEK_INITIAL_POINTS);
+        SeekPoint *grown = realloc(points->points, capacity * sizeof(SeekPoint));
+        if (grown == NULL) {
+            perror("seek: realloc");
+            return -1;
+        }
+        points->points = grown;
+        points->capacity = capacity;
+    }
+    points->points[points->num++] = (SeekPoint){ms, position};
+    points->next_ms = (ms / SEEK_INTERVAL_MS + 1) * SEEK_INTERVAL_MS;
+    return 0;
+}
+
+
+/*
+** Encodes the points into the table, each less the one before it.
+**
+** returns 0 on success, -1 on error
+*/
+static int _set_points(SeekTable *table, const SeekPoints *points) {
+    table->points = malloc(MAX(points->num, 1) * 2 * VARINT_MAX_SIZE);
+    if (table->points == NULL) {
+        perror("seek: malloc");
+        return -1;
+    }
+    uint8_t *out = table->points;
+    SeekPoint last = {0, 0};
+    for (uint32_t i = 0; i < points->num; i++) {
+        out = varint_put(out, points->points[i].ms - last.ms);
+        out = varint_put(out, points->points[i].position - last.position);
+        last = points->points[i];
+    }
+    table->num_points = points->num;
+    table->points_len = out - table->points;
+    return 0;
+}
+
+
+/*
+** Finds the table's last point at or before ms, or its first one if they are
+** all after it.
+**
+** returns 0 on success, -1 if the table has no points
+*/
+static int _find_point(const SeekTable *table, uint32_t ms, SeekPoint *point) {
+    const uint8_t *in = table->points;
+    const uint8_t *end = table->points + table->points_len;
+    SeekPoint current = {0, 0};
+    *point = current;
+    for (uint32_t i = 0; i < table->num_points; i++) {
+        uint32_t ms_delta, position_delta;
+        if (varint_get(&in, end, &ms_delta) == -1 || varint_get(&in, end, &position_delta) == -1) {
+            break;
+        }
+        current.ms += ms_delta;
+        current.position += position_delta;
+        if (i > 0 && current.ms > ms) {
+            break;
+        }
+        *point = current;
+    }
+    return table->num_points > 0 ? 0 : -1;
+}
+
+
+/*
+** WAV
+** ---
+*/
+
+/*
+** Finds the format and data chunks of a WAV file.
+**
+** returns 0 on success, -1 if it is not a WAV file
+*/
+static int _wav_parse(SeekReader *reader, uint32_t *fmt, uint32_t *fmt_len, uint32_t *data,
+                      uint32_t *data_len) {
+    const uint8_t *header = _peek(reader, 0, WAV_HEADER_SIZE);
+    if (header == NULL || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        return -1;
+    }
+    *fmt = 0;
+    uint64_t at = WAV_HEADER_SIZE;
+    const uint8_t *chunk;
+    while ((chunk = _peek(reader, at, 8)) != NULL) {
+        uint32_t len = _le32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16) {
+            *fmt = at;
+            *fmt_len = len;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            *data = at + 8;
+            *data_len = MIN(len, reader->size - *data);
+            return *fmt == 0 ? -1 : 0;
+        }
+        at += 8 + len + (len & 1);
+    }
+    return -1;
+}
+
+
+static int _wav_prepare(SeekReader *reader, uint32_t ms, SeekStart *start) {
+    uint32_t fmt, fmt_len, data, data_len;
+    if (_wav_parse(reader, &fmt, &fmt_len, &data, &data_len) == -1 || fmt_len > SEEK_MAX_HEAD) {
+        return -1;
+    }
+    uint8_t *fmt_chunk = _read_at(reader->fd, fmt, 8 + fmt_len);
+    if (fmt_chunk == NULL) {
+        return -1;
+    }
+    uint32_t byte_rate = _le32(fmt_chunk + 16);
+    uint32_t block_align = MAX(_le16(fmt_chunk + 20), 1);
+    uint64_t skip = byte_rate == 0 ? 0 : (uint64_t)ms * byte_rate / 1000;
+    skip = MIN(skip / block_align * block_align, data_len / block_align * block_align);
+    start->offset = data + skip;
+    start->end = data + data_len;
+    start->ms = byte_rate == 0 ? 0 : skip * 1000 / byte_rate;
+
+    // A header of the format and of the samples left, without other chunks
+    start->head_len = WAV_HEADER_SIZE + 8 + fmt_len + (fmt_len & 1) + 8;
+    start->head = calloc(1, start->head_len);
+    if (start->head == NULL) {
+        perror("seek: calloc");
+        free(fmt_chunk);
+        return -1;
+    }
+    uint32_t samples_len = start->end - start->offset;
+    memcpy(start->head, "RIFF", 4);
+    _put_le32(start->head + 4, start->head_len - 8 + samples_len);
+    memcpy(start->head + 8, "WAVE", 4);
+    memcpy(start->head + WAV_HEADER_SIZE, fmt_chunk, 8 + fmt_len);
+    uint8_t *data_chunk = start->head + start->head_len - 8;
+    memcpy(data_chunk, "data", 4);
+    _put_le32(data_chunk + 4, samples_len);
+    free(fmt_chunk);
+    return 0;
+}
+
+
+/*
+** MP3
+** ---
+*/
+
+typedef struct mp3_frame {
+    uint32_t len;
+    uint32_t samples;
+    uint32_t rate;
+    uint32_t key;       // the fields every frame of the stream shares
+} Mp3Frame;
+
+
+/*
+** returns 0 if the 4 bytes at header are a valid frame header, parsed into
+** frame, -1 if not
+*/
+static int _mp3_parse(const uint8_t *header, Mp3Frame *frame) {
+    if (header[0] != 0xff || (header[1] & 0xe0) != 0xe0) {
+        return -1;
+    }
+    // 0 for MPEG-2.5, 2 for MPEG-2, 3 for MPEG-1, and layers 3 to 1 as 1 to 3
+    int version = (header[1] >> 3) & 3;
+    int layer = (header[1] >> 1) & 3;
+    int bitrate_index = header[2] >> 4;
+    int rate_index = (header[2] >> 2) & 3;
+    if (version == 1 || layer == 0 || bitrate_index == 0 || bitrate_index == 15 ||
+        rate_index == 3) {
+        return -1;
+    }
+    uint8_t lsf = version != 3;
+    int layer_index = 3 - layer;
+    uint32_t bitrate = mp3_bitrates[lsf][layer_index][bitrate_index] * 1000;
+    frame->rate = mp3_rates[rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+    uint32_t padding = (header[2] >> 1) & 1;
+    if (layer_index == 0) {
+        frame->samples = 384;
+        frame->len = (12 * bitrate / frame->rate + padding) * 4;
+    } else {
+        frame->samples = layer_index == 2 && lsf ? 576 : 1152;
+        frame->len = frame->samples / 8 * bitrate / frame->rate + padding;
+    }
+    frame->key = (header[1] & 0xfe) << 8 | (header[2] & 0x0c);
+    return 0;
+}
+
+
+/*
+** Helper for: _walk_next
+** Finds the next frame that the one after it, or the end of the file,
+** confirms.
+*/
+static int _mp3_next(SeekReader *reader, SeekWalker *walker, uint32_t *ms, uint64_t *offset) {
+    uint64_t at = walker->offset;
+    const uint8_t *header;
+    while ((header = _peek(reader, at, MP3_HEADER_SIZE)) != NULL) {
+        if (header[0] != 0xff) {
+            const uint8_t *sync = memchr(header, 0xff, reader->start + reader->len - at);
+            at = sync == NULL ? reader->start + reader->len : at + (sync - header);
+            continue;
+        }
+        Mp3Frame frame, next;
+        if (_mp3_parse(header, &frame) == -1) {
+            at++;
+            continue;
+        }
+        uint64_t next_at = at + frame.len;
+        const uint8_t *next_header = _peek(reader, next_at, MP3_HEADER_SIZE);
+        if (next_at > reader->size || (next_header == NULL && next_at + MP3_HEADER_SIZE <= reader->size) ||
+            (next_header != NULL && (_mp3_parse(next_header, &next) == -1 || next.key != frame.key))) {
+            at++;
+            continue;
+        }
+        *ms = walker->start_ms + walker->samples * 1000 / frame.rate;
+        *offset = at;
+        walker->samples += frame.samples;
+        walker->offset = next_at;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+** returns the offset of the first byte after an ID3v2 tag at the start of
+** the file, 0 without one
+*/
+static uint32_t _mp3_skip_id3(SeekReader *reader) {
+    const uint8_t *tag = _peek(reader, 0, 10);
+    if (tag == NULL || memcmp(tag, "ID3", 3) != 0) {
+        return 0;
+    }
+    // A syncsafe integer, with a footer of another 10 bytes if flagged
+    uint32_t size = (tag[6] & 0x7f) << 21 | (tag[7] & 0x7f) << 14 | (tag[8] & 0x7f) << 7 |
+                    (tag[9] & 0x7f);
+    return 10 + size + (tag[5] & 0x10 ? 10 : 0);
+}
+
+
+/*
+** Helper for: seek_table_build
+** Takes the points from the table of contents of the Xing or Info tag in the
+** first frame, at first_frame, if it has one.
+**
+** returns 1 if it had one, 0 if not, -1 on error
+*/
+static int _mp3_toc(SeekReader *reader, uint64_t first_frame, SeekPoints *points) {
+    const uint8_t *header = _peek(reader, first_frame, MP3_HEADER_SIZE);
+    Mp3Frame frame;
+    if (header == NULL || _mp3_parse(header, &frame) == -1) {
+        return 0;
+    }
+    // After the side information, which depends on the version and channels
+    uint8_t mono = (header[3] >> 6) == 3;
+    uint8_t lsf = ((header[1] >> 3) & 3) != 3;
+    uint32_t side_len = lsf ? (mono ? 9 : 17) : (mono ? 17 : 32);
+    const uint8_t *tag = _peek(reader, first_frame + MP3_HEADER_SIZE + side_len,
+                               8 + 8 + MP3_TOC_SIZE);
+    if (tag == NULL || (memcmp(tag, "Xing", 4) != 0 && memcmp(tag, "Info", 4) != 0)) {
+        return 0;
+    }
+    uint32_t flags = _be32(tag + 4);
+    if ((flags & 0x5) != 0x5) {
+        return 0;
+    }
+    const uint8_t *field = tag + 8;
+    uint32_t num_frames = _be32(field);
+    field += 4;
+    uint64_t num_bytes = reader->size - first_frame;
+    if (flags & 0x2) {
+        num_bytes = MIN(_be32(field), num_bytes);
+        field += 4;
+    }
+    uint8_t toc[MP3_TOC_SIZE];
+    memcpy(toc, field, MP3_TOC_SIZE);
+    uint64_t duration_ms = (uint64_t)num_frames * frame.samples * 1000 / frame.rate;
+    for (int i = 0; i < MP3_TOC_SIZE; i++) {
+        // Offsets within a frame are found again when seeking
+        uint32_t position = first_frame + toc[i] * num_bytes / 256;
+        if (_add_point(points, duration_ms * i / MP3_TOC_SIZE, position) == -1) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+
+/*
+** FLAC
+** ----
+*/
+
+static uint8_t _crc8(const uint8_t *data, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+
+/*
+** Parses the frame header at header, of at most len bytes.
+**
+** returns the header's length, with its first sample in *sample and its
+** number of samples in *block, 0 if it is not a valid header
+*/
+static uint32_t _flac_parse(const uint8_t *header, uint32_t len, const SeekWalker *walker,
+                            uint64_t *sample, uint32_t *block) {
+    if (len < 6 || header[0] != 0xff || (header[1] & 0xfe) != 0xf8) {
+        return 0;
+    }
+    uint8_t block_code = header[2] >> 4, rate_code = header[2] & 0xf;
+    uint8_t channels = header[3] >> 4, sample_size = (header[3] >> 1) & 7;
+    if (block_code == 0 || rate_code == 15 || channels >= 11 || sample_size == 3 ||
+        (header[3] & 1)) {
+        return 0;
+    }
+    // The frame or sample number, UTF-8 coded
+    uint32_t i = 4;
+    uint8_t first = header[i++];
+    int extra = first < 0x80 ? 0 : first < 0xc0 ? -1 : first < 0xe0 ? 1 : first < 0xf0 ? 2 :
+                first < 0xf8 ? 3 : first < 0xfc ? 4 : first < 0xfe ? 5 : first == 0xfe ? 6 : -1;
+    if (extra == -1 || i + extra + 4 > len) {
+        return 0;
+    }
+    uint64_t number = extra == 0 ? first : first & (0x3f >> extra);
+    for (int j = 0; j < extra; j++, i++) {
+        if ((header[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        number = number << 6 | (header[i] & 0x3f);
+    }
+    if (block_code == 1) {
+        *block = 192;
+    } else if (block_code <= 5) {
+        *block = 576 << (block_code - 2);
+    } else if (block_code == 6) {
+        *block = header[i++] + 1;
+    } else if (block_code == 7) {
+        *block = _be16(header + i) + 1;
+        i += 2;
+    } else {
+        *block = 256 << (block_code - 8);
+    }
+    i += rate_code == 12 ? 1 : rate_code == 13 || rate_code == 14 ? 2 : 0;
+    if (i >= len || _crc8(header, i) != header[i]) {
+        return 0;
+    }
+    // Fixed-blocksize streams number their frames instead of their samples
+    *sample = header[1] & 1 ? number : number * walker->block_size;
+    return i + 1;
+}
+
+
+/*
+** Helper for: _walk_next
+** Finds the next frame, which must start at the sample the last one ended at
+** if that is known.
+*/
+static int _flac_next(SeekReader *reader, SeekWalker *walker, uint32_t *ms, uint64_t *offset) {
+    uint64_t at = walker->offset;
+    while (at + 2 <= reader->size) {
+        uint32_t len = MIN(FLAC_MAX_FRAME_HEADER, reader->size - at);
+        const uint8_t *header = _peek(reader, at, len);
+        if (header == NULL) {
+            return 0;
+        }
+        if (header[0] != 0xff) {
+            const uint8_t *sync = memchr(header, 0xff, reader->start + reader->len - at);
+            at = sync == NULL ? reader->start + reader->len : at + (sync - header);
+            continue;
+        }
+        uint64_t sample;
+        uint32_t block;
+        uint32_t header_len = _flac_parse(header, len, walker, &sample, &block);
+        if (header_len == 0 || (walker->expected != UINT64_MAX && sample != walker->expected)) {
+            at++;
+            continue;
+        }
+        *ms = sample * 1000 / walker->rate;
+        *offset = at;
+        walker->expected = sample + block;
+        walker->offset = at + header_len;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+** Reads the STREAMINFO of a FLAC file into walker, and its first frame's
+** offset into *first_frame, and adds the points of its SEEKTABLE, if any, to
+** points.
+**
+** returns 0 on success, -1 if it is not a FLAC file
+*/
+static int _flac_parse_metadata(SeekReader *reader, SeekWalker *walker, uint64_t *first_frame,
+                                SeekPoints *points) {
+    const uint8_t *marker = _peek(reader, 0, FLAC_MARKER_SIZE);
+    if (marker == NULL || memcmp(marker, "fLaC", 4) != 0) {
+        return -1;
+    }
+    uint64_t at = FLAC_MARKER_SIZE;
+    uint8_t last = 0;
+    SeekPoint *seekpoints = NULL;
+    uint32_t num_seekpoints = 0;
+    walker->rate = 0;
+    while (!last) {
+        const uint8_t *block = _peek(reader, at, 4);
+        if (block == NULL) {
+            free(seekpoints);
+            return -1;
+        }
+        last = block[0] & 0x80;
+        uint8_t type = block[0] & 0x7f;
+        uint32_t len = block[1] << 16 | block[2] << 8 | block[3];
+        if (type == 0 && len >= FLAC_STREAMINFO_SIZE) {
+            const uint8_t *info = _peek(reader, at + 4, FLAC_STREAMINFO_SIZE);
+            if (info == NULL) {
+                free(seekpoints);
+                return -1;
+            }
+            walker->block_size = _be16(info + 2);
+            walker->rate = info[10] << 12 | info[11] << 4 | info[12] >> 4;
+        } else if (type == 3 && points != NULL && seekpoints == NULL) {
+            num_seekpoints = len / FLAC_SEEKPOINT_SIZE;
+            seekpoints = malloc(MAX(num_seekpoints, 1) * sizeof(SeekPoint));
+            uint8_t *table = _read_at(reader->fd, at + 4, num_seekpoints * FLAC_SEEKPOINT_SIZE);
+            if (seekpoints == NULL || table == NULL) {
+                free(seekpoints);
+                free(table);
+                return -1;
+            }
+            for (uint32_t i = 0; i < num_seekpoints; i++) {
+                // Sample numbers until the rate is known, placeholders as 0
+                uint64_t sample = _be64(table + i * FLAC_SEEKPOINT_SIZE);
+                uint64_t offset = _be64(table + i * FLAC_SEEKPOINT_SIZE + 8);
+                uint8_t placeholder = sample == UINT64_MAX || offset > UINT32_MAX;
+                seekpoints[i] = (SeekPoint){placeholder ? 0 : sample, placeholder ? 0 : offset};
+            }
+            free(table);
+        }
+        at += 4 + len;
+    }
+    *first_frame = at;
+    if (walker->rate == 0) {
+        free(seekpoints);
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_seekpoints; i++) {
+        if ((i > 0 && seekpoints[i].position == 0) || at + seekpoints[i].position > UINT32_MAX) {
+            continue;
+        }
+        if (_add_point(points, (uint64_t)seekpoints[i].ms * 1000 / walker->rate,
+                       at + seekpoints[i].position) == -1) {
+            free(seekpoints);
+            return -1;
+        }
+    }
+    free(seekpoints);
+    return 0;
+}
+
+
+/*
+** Ogg
+** ---
+*/
+
+typedef struct ogg_page {
+    uint64_t offset;
+    uint32_t len;
+    uint8_t flags;
+    int64_t granule;
+    uint32_t serial;
+    uint32_t packets_ended;
+} OggPage;
+
+
+/*
+** Parses the page at or after offset.
+**
+** returns 1 on success, 0 if there is none
+*/
+static int _ogg_page(SeekReader *reader, uint64_t offset, OggPage *page) {
+    const uint8_t *header;
+    while ((header = _peek(reader, offset, OGG_PAGE_HEADER_SIZE)) != NULL) {
+        if (memcmp(header, "OggS", 4) != 0 || header[4] != 0) {
+            const uint8_t *capture = memchr(header + 1, 'O', reader->start + reader->len - offset - 1);
+            offset = capture == NULL ? reader->start + reader->len : offset + (capture - header);
+            continue;
+        }
+        page->offset = offset;
+        page->flags = header[5];
+        page->granule = (int64_t)_le64(header + 6);
+        page->serial = _le32(header + 14);
+        uint8_t num_segments = header[26];
+        const uint8_t *segments = _peek(reader, offset + OGG_PAGE_HEADER_SIZE, num_segments);
+        if (segments == NULL) {
+            return 0;
+        }
+        page->len = OGG_PAGE_HEADER_SIZE + num_segments;
+        page->packets_ended = 0;
+        for (int i = 0; i < num_segments; i++) {
+            page->len += segments[i];
+            page->packets_ended += segments[i] < 255;
+        }
+        return offset + page->len <= reader->size;
+    }
+    return 0;
+}
+
+
+/*
+** Reads the first stream of an Ogg file's identification header, for Vorbis
+** or Opus, and finds the end of its header packets.
+**
+** returns 0 on success, -1 if it is not an Ogg Vorbis or Opus file
+*/
+static int _ogg_parse_headers(SeekReader *reader, OggInfo *info) {
+    OggPage page;
+    if (_ogg_page(reader, 0, &page) != 1 || page.offset != 0 || !(page.flags & 0x2)) {
+        return -1;
+    }
+    uint32_t body = OGG_PAGE_HEADER_SIZE + _peek(reader, 26, 1)[0];
+    const uint8_t *id = _peek(reader, body, 19);
+    if (id == NULL) {
+        return -1;
+    }
+    uint32_t num_headers;
+    info->serial = page.serial;
+    info->preskip = 0;
+    if (id[0] == 1 && memcmp(id + 1, "vorbis", 6) == 0) {
+        info->rate = _le32(id + 12);
+        num_headers = 3;
+    } else if (memcmp(id, "OpusHead", 8) == 0) {
+        // Opus granule positions always count at 48 kHz
+        info->rate = 48000;
+        info->preskip = _le16(id + 10);
+        num_headers = 2;
+    } else {
+        return -1;
+    }
+    if (info->rate == 0) {
+        return -1;
+    }
+    // The first audio packet starts a page of its own
+    uint32_t num_packets = 0;
+    uint64_t offset = 0;
+    while (num_packets < num_headers) {
+        if (_ogg_page(reader, offset, &page) != 1 || page.offset + page.len > SEEK_MAX_HEAD) {
+            return -1;
+        }
+        if (page.serial == info->serial) {
+            num_packets += page.packets_ended;
+        }
+        offset = page.offset + page.len;
+    }
+    info->header_end = offset;
+    return 0;
+}
+
+
+/*
+** Helper for: _walk_next
+** Finds the next page of the stream that starts a packet, with the time its
+** first sample plays at.
+*/
+static int _ogg_next(SeekReader *reader, SeekWalker *walker, uint32_t *ms, uint64_t *offset) {
+    OggPage page;
+    while (_ogg_page(reader, walker->offset, &page) == 1) {
+        uint32_t page_ms = walker->ms;
+        walker->offset = page.offset + page.len;
+        if (page.serial != walker->ogg.serial) {
+            continue;
+        }
+        // -1 on pages where no packet ends
+        if (page.granule >= 0) {
+            uint64_t samples = MAX(page.granule, walker->ogg.preskip) - walker->ogg.preskip;
+            walker->ms = samples * 1000 / walker->ogg.rate;
+        }
+        if (!(page.flags & 0x1)) {
+            *ms = page_ms;
+            *offset = page.offset;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Walking
+** -------
+*/
+
+/*
+** Finds the next frame the walker comes to, with the time it starts at.
+**
+** returns 1 if it found one, 0 at the end of the file
+*/
+static int _walk_next(SeekReader *reader, SeekWalker *walker, uint32_t *ms, uint64_t *offset) {
+    int result = 0;
+    if (walker->format == SEEK_MP3) {
+        result = _mp3_next(reader, walker, ms, offset);
+    } else if (walker->format == SEEK_FLAC) {
+        result = _flac_next(reader, walker, ms, offset);
+    } else if (walker->format == SEEK_OGG) {
+        result = _ogg_next(reader, walker, ms, offset);
+    }
+    // Offsets in tables and requests are 32-bit, like the files' sizes
+    return result == 1 && *offset <= UINT32_MAX;
+}
+
+
+/*
+** Helper for: seek_table_build
+** Adds a point for every SEEK_INTERVAL_MS of the rest of the file.
+**
+** returns 0 on success, -1 on error
+*/
+static int _walk_points(SeekReader *reader, SeekWalker *walker, SeekPoints *points) {
+    uint32_t ms;
+    uint64_t offset;
+    while (_walk_next(reader, walker, &ms, &offset)) {
+        if (_add_point(points, ms, offset) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: seek_prepare
+** Walks from the table's point before ms to the last frame that starts at
+** or before it, or the first frame after the point if there is none.
+**
+** returns 0 on success, -1 if there is no frame after the point
+*/
+static int _walk_to(const SeekTable *table, SeekReader *reader, SeekWalker *walker, uint32_t ms,
+                    SeekStart *start) {
+    SeekPoint point;
+    if (_find_point(table, ms, &point) == -1) {
+        return -1;
+    }
+    walker->offset = point.position;
+    walker->start_ms = walker->ms = point.ms;
+    walker->samples = 0;
+    walker->expected = UINT64_MAX;
+    uint32_t frame_ms;
+    uint64_t offset;
+    if (!_walk_next(reader, walker, &frame_ms, &offset)) {
+        return -1;
+    }
+    do {
+        start->offset = offset;
+        start->ms = frame_ms;
+    } while (_walk_next(reader, walker, &frame_ms, &offset) && frame_ms <= ms);
+    start->end = reader->size;
+    return 0;
+}
+
+
+/*
+** M4A
+** ---
+*/
+
+/*
+** Reads the box at the start of the len bytes of data.
+**
+** returns 0 on success, -1 if there is none
+*/
+static int _box_at(const uint8_t *data, uint64_t len, M4aBox *box) {
+    if (len < M4A_BOX_HEADER_SIZE) {
+        return -1;
+    }
+    uint64_t size = _be32(data);
+    uint32_t header_len = M4A_BOX_HEADER_SIZE;
+    if (size == 1) {
+        if (len < 16) {
+            return -1;
+        }
+        size = _be64(data + 8);
+        header_len = 16;
+    } else if (size == 0) {
+        size = len;
+    }
+    if (size < header_len || size > len) {
+        return -1;
+    }
+    box->start = data;
+    box->len = size;
+    box->payload = data + header_len;
+    box->payload_len = size - header_len;
+    memcpy(box->type, data + 4, 4);
+    return 0;
+}
+
+
+/*
+** Finds the first box of the given type among those in the len bytes of
+** data.
+**
+** returns 0 on success, -1 if there is none
+*/
+static int _box_find(const uint8_t *data, uint32_t len, const char *type, M4aBox *box) {
+    while (_box_at(data, len, box) == 0) {
+        if (memcmp(box->type, type, 4) == 0) {
+            return 0;
+        }
+        data += box->len;
+        len -= box->len;
+    }
+    return -1;
+}
+
+
+/*
+** Finds the box at the path of types, one inside the other, like
+** "mdia/minf/stbl", in the len bytes of data.
+**
+** returns 0 on success, -1 if there is none
+*/
+static int _box_path(const uint8_t *data, uint32_t len, const char *path, M4aBox *box) {
+    for (const char *type = path; ; type += 5) {
+        if (_box_find(data, len, type, box) == -1) {
+            return -1;
+        }
+        if (type[4] == '\0') {
+            return 0;
+        }
+        data = box->payload;
+        len = box->payload_len;
+    }
+}
+
+
+/*
+** Reads the ftyp and moov boxes of an M4A file.
+**
+** returns 0 on success, with both heap-allocated, -1 if it has none
+*/
+static int _m4a_read(SeekReader *reader, uint8_t **ftyp, uint32_t *ftyp_len, uint8_t **moov,
+                     uint32_t *moov_len) {
+    *ftyp = *moov = NULL;
+    uint64_t at = 0;
+    const uint8_t *header;
+    while ((*ftyp == NULL || *moov == NULL) &&
+           (header = _peek(reader, at, M4A_BOX_HEADER_SIZE)) != NULL) {
+        // Only the box's header is peeked, which may hold a 64-bit size
+        uint64_t size = _be32(header);
+        uint8_t **copy = memcmp(header + 4, "ftyp", 4) == 0 ? ftyp
+                         : memcmp(header + 4, "moov", 4) == 0 ? moov : NULL;
+        if (size == 1) {
+            header = _peek(reader, at, 16);
+            size = header == NULL ? 0 : _be64(header + 8);
+        } else if (size == 0) {
+            size = reader->size - at;
+        }
+        if (size < M4A_BOX_HEADER_SIZE || at + size > reader->size) {
+            break;
+        }
+        if (copy != NULL && *copy == NULL && size <= SEEK_MAX_HEAD) {
+            *copy = _read_at(reader->fd, at, size);
+            *(copy == ftyp ? ftyp_len : moov_len) = size;
+        }
+        at += size;
+    }
+    if (*ftyp == NULL || *moov == NULL) {
+        free(*ftyp);
+        free(*moov);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** returns whether an mvhd or mdhd box is long enough for its version's
+** timescale and duration
+*/
+static uint8_t _m4a_header_fits(const M4aBox *box) {
+    return box->payload_len >= 20 && (box->payload[0] != 1 || box->payload_len >= 32);
+}
+
+
+/*
+** Finds the first audio track in moov, and its sample tables.
+**
+** returns 0 on success, -1 if there is none
+*/
+static int _m4a_track(const uint8_t *moov, uint32_t moov_len, M4aTrack *track) {
+    M4aBox moov_box, mvhd;
+    if (_box_at(moov, moov_len, &moov_box) == -1 ||
+        _box_find(moov_box.payload, moov_box.payload_len, "mvhd", &mvhd) == -1 ||
+        !_m4a_header_fits(&mvhd)) {
+        return -1;
+    }
+    track->movie_timescale = _be32(mvhd.payload + (mvhd.payload[0] == 1 ? 20 : 12));
+
+    const uint8_t *data = moov_box.payload;
+    uint32_t len = moov_box.payload_len;
+    while (_box_find(data, len, "trak", &track->trak) == 0) {
+        data = track->trak.start + track->trak.len;
+        len = moov_box.payload + moov_box.payload_len - data;
+        M4aBox hdlr, mdhd, stbl;
+        if (_box_path(track->trak.payload, track->trak.payload_len, "mdia/hdlr", &hdlr) == -1 ||
+            hdlr.payload_len < 12 || memcmp(hdlr.payload + 8, "soun", 4) != 0) {
+            continue;
+        }
+        if (_box_path(track->trak.payload, track->trak.payload_len, "mdia/mdhd", &mdhd) == -1 ||
+            !_m4a_header_fits(&mdhd) ||
+            _box_path(track->trak.payload, track->trak.payload_len, "mdia/minf/stbl",
+                      &stbl) == -1 ||
+            _box_find(stbl.payload, stbl.payload_len, "stts", &track->stts) == -1 ||
+            _box_find(stbl.payload, stbl.payload_len, "stsc", &track->stsc) == -1 ||
+            _box_find(stbl.payload, stbl.payload_len, "stsz", &track->stsz) == -1) {
+            return -1;
+        }
+        uint8_t v1 = mdhd.payload[0] == 1;
+        track->timescale = _be32(mdhd.payload + (v1 ? 20 : 12));
+        track->duration = v1 ? _be64(mdhd.payload + 24) : _be32(mdhd.payload + 16);
+        track->co64 = _box_find(stbl.payload, stbl.payload_len, "stco", &track->stco) == -1;
+        if (track->co64 && _box_find(stbl.payload, stbl.payload_len, "co64", &track->stco) == -1) {
+            return -1;
+        }
+        // Every table's entries must fit in it
+        if (track->timescale == 0 || track->stts.payload_len < 8 ||
+            track->stsc.payload_len < 8 || track->stsz.payload_len < 12 ||
+            track->stco.payload_len < 8) {
+            return -1;
+        }
+        track->num_samples = _be32(track->stsz.payload + 8);
+        track->num_chunks = _be32(track->stco.payload + 4);
+        if ((uint64_t)_be32(track->stts.payload + 4) * 8 > track->stts.payload_len - 8 ||
+            (uint64_t)_be32(track->stsc.payload + 4) * 12 > track->stsc.payload_len - 8 ||
+            (_be32(track->stsz.payload + 4) == 0 &&
+             (uint64_t)track->num_samples * 4 > track->stsz.payload_len - 12) ||
+            (uint64_t)track->num_chunks * (track->co64 ? 8 : 4) > track->stco.payload_len - 8) {
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+
+static uint32_t _m4a_sample_size(const M4aTrack *track, uint32_t sample) {
+    uint32_t size = _be32(track->stsz.payload + 4);
+    return size != 0 ? size : _be32(track->stsz.payload + 12 + 4 * sample);
+}
+
+
+static uint64_t _m4a_chunk_offset(const M4aTrack *track, uint32_t chunk) {
+    const uint8_t *entries = track->stco.payload + 8;
+    return track->co64 ? _be64(entries + 8 * chunk) : _be32(entries + 4 * chunk);
+}
+
+
+/*
+** A walk over the chunks of a track from the first on, stepping through
+** stsc's runs of chunks with the same number of samples.
+*/
+typedef struct m4a_chunks {
+    const M4aTrack *track;
+    uint32_t entry;
+    uint32_t chunk;
+    uint32_t first_sample;
+} M4aChunks;
+
+/*
+** returns the number of samples of the chunk the walk is at, moving it to the
+** next, 0 once there are no more
+*/
+static uint32_t _m4a_next_chunk(M4aChunks *chunks, uint32_t *description) {
+    const M4aTrack *track = chunks->track;
+    uint32_t num_entries = _be32(track->stsc.payload + 4);
+    const uint8_t *entries = track->stsc.payload + 8;
+    if (chunks->chunk >= track->num_chunks || num_entries == 0) {
+        return 0;
+    }
+    // Chunk numbers in stsc start at 1
+    while (chunks->entry + 1 < num_entries &&
+           _be32(entries + 12 * (chunks->entry + 1)) <= chunks->chunk + 1) {
+        chunks->entry++;
+    }
+    uint32_t num_samples = _be32(entries + 12 * chunks->entry + 4);
+    *description = _be32(entries + 12 * chunks->entry + 8);
+    chunks->chunk++;
+    chunks->first_sample += num_samples;
+    return num_samples;
+}
+
+
+static void _out_put(SeekOut *out, const void *data, uint32_t len) {
+    if (out->failed) {
+        return;
+    }
+    if (out->len + len > out->capacity) {
+        uint32_t capacity = MAX(2 * out->capacity, out->len + len);
+        uint8_t *grown = capacity > SEEK_MAX_HEAD ? NULL : realloc(out->data, capacity);
+        if (grown == NULL) {
+            out->failed = 1;
+            return;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+
+static void _out_be32(SeekOut *out, uint32_t value) {
+    uint8_t bytes[4];
+    _put_be32(bytes, value);
+    _out_put(out, bytes, 4);
+}
+
+
+/*
+** Starts a box, whose size is filled in by _out_end.
+**
+** returns where it starts
+*/
+static uint32_t _out_box(SeekOut *out, const char *type) {
+    uint32_t start = out->len;
+    _out_be32(out, 0);
+    _out_put(out, type, 4);
+    return start;
+}
+
+
+static void _out_end(SeekOut *out, uint32_t start) {
+    if (!out->failed) {
+        _put_be32(out->data + start, out->len - start);
+    }
+}
+
+
+/*
+** Copies a box whose duration is at the given offsets of its payload in
+** versions 0 and 1, with the duration changed.
+*/
+static void _out_with_duration(SeekOut *out, const M4aBox *box, uint32_t v0_offset,
+                               uint32_t v1_offset, uint64_t duration) {
+    uint32_t start = out->len;
+    _out_put(out, box->start, box->len);
+    uint8_t v1 = box->payload[0] == 1;
+    uint32_t offset = (box->payload - box->start) + (v1 ? v1_offset : v0_offset);
+    if (out->failed || offset + (v1 ? 8 : 4) > box->len) {
+        return;
+    }
+    if (v1) {
+        _put_be32(out->data + start + offset, duration >> 32);
+        offset += 4;
+    }
+    _put_be32(out->data + start + offset, MIN(duration, UINT32_MAX));
+}
+
+
+/*
+** Builds the sample tables of an M4A file's track that starts at sample,
+** the chunk's part_samples-th sample, with room for the chunks' offsets,
+** which start at *offsets.
+*/
+static void _m4a_out_stbl(SeekOut *out, const M4aTrack *track, const M4aBox *stbl,
+                          uint32_t sample, uint32_t chunk, uint32_t part_samples,
+                          uint32_t *offsets) {
+    uint32_t stbl_start = _out_box(out, "stbl");
+    M4aBox stsd;
+    if (_box_find(stbl->payload, stbl->payload_len, "stsd", &stsd) == 0) {
+        _out_put(out, stsd.start, stsd.len);
+    }
+
+    // The runs of sample durations, the first one cut short
+    uint32_t num_stts = _be32(track->stts.payload + 4);
+    const uint8_t *stts = track->stts.payload + 8;
+    uint32_t skipped = 0, first_entry = 0;
+    while (first_entry < num_stts && skipped + _be32(stts + 8 * first_entry) <= sample) {
+        skipped += _be32(stts + 8 * first_entry++);
+    }
+    uint32_t start = _out_box(out, "stts");
+    _out_be32(out, 0);
+    _out_be32(out, num_stts - first_entry);
+    for (uint32_t i = first_entry; i < num_stts; i++) {
+        uint32_t count = _be32(stts + 8 * i);
+        _out_be32(out, i == first_entry ? count - (sample - skipped) : count);
+        _out_be32(out, _be32(stts + 8 * i + 4));
+    }
+    _out_end(out, start);
+
+    // The runs of chunks with as many samples, from the cut first chunk on
+    M4aChunks chunks = {track, 0, 0, 0};
+    uint32_t description, num_samples, last_samples = 0, last_description = 0;
+    uint32_t num_stsc = 0, num_stsc_at = 0;
+    start = _out_box(out, "stsc");
+    _out_be32(out, 0);
+    num_stsc_at = out->len;
+    _out_be32(out, 0);
+    while ((num_samples = _m4a_next_chunk(&chunks, &description)) > 0) {
+        uint32_t index = chunks.chunk - 1;
+        if (index < chunk) {
+            continue;
+        }
+        if (index == chunk) {
+            num_samples -= part_samples;
+        }
+        if (index == chunk || num_samples != last_samples || description != last_description) {
+            _out_be32(out, index - chunk + 1);
+            _out_be32(out, num_samples);
+            _out_be32(out, description);
+            num_stsc++;
+        }
+        last_samples = num_samples;
+        last_description = description;
+    }
+    if (!out->failed) {
+        _put_be32(out->data + num_stsc_at, num_stsc);
+    }
+    _out_end(out, start);
+
+    start = _out_box(out, "stsz");
+    _out_be32(out, 0);
+    uint32_t size = _be32(track->stsz.payload + 4);
+    _out_be32(out, size);
+    _out_be32(out, track->num_samples - sample);
+    if (size == 0) {
+        _out_put(out, track->stsz.payload + 12 + 4 * sample, 4 * (track->num_samples - sample));
+    }
+    _out_end(out, start);
+
+    start = _out_box(out, "stco");
+    _out_be32(out, 0);
+    _out_be32(out, track->num_chunks - chunk);
+    *offsets = out->len;
+    for (uint32_t i = chunk; i < track->num_chunks; i++) {
+        _out_be32(out, 0);
+    }
+    _out_end(out, start);
+    _out_end(out, stbl_start);
+}
+
+
+/*
+** Copies the children of a box of the track, rebuilding the boxes on the way
+** to its sample tables, and leaving out its edits and metadata.
+*/
+static void _m4a_out_children(SeekOut *out, const M4aTrack *track, const M4aBox *parent,
+                              uint32_t sample, uint32_t chunk, uint32_t part_samples,
+                              uint64_t media_duration, uint64_t movie_duration,
+                              uint32_t *offsets) {
+    const uint8_t *data = parent->payload;
+    uint32_t len = parent->payload_len;
+    M4aBox box;
+    while (_box_at(data, len, &box) == 0) {
+        data += box.len;
+        len -= box.len;
+        char type[5] = {0};
+        memcpy(type, box.type, 4);
+        if (strcmp(type, "mdia") == 0 || strcmp(type, "minf") == 0) {
+            uint32_t start = _out_box(out, type);
+            _m4a_out_children(out, track, &box, sample, chunk, part_samples, media_duration,
+                              movie_duration, offsets);
+            _out_end(out, start);
+        } else if (strcmp(type, "stbl") == 0) {
+            _m4a_out_stbl(out, track, &box, sample, chunk, part_samples, offsets);
+        } else if (strcmp(type, "tkhd") == 0) {
+            _out_with_duration(out, &box, 20, 28, movie_duration);
+        } else if (strcmp(type, "mdhd") == 0) {
+            _out_with_duration(out, &box, 16, 24, media_duration);
+        } else if (strcmp(type, "edts") != 0 && strcmp(type, "udta") != 0 &&
+                   strcmp(type, "meta") != 0 && strcmp(type, "tref") != 0) {
+            _out_put(out, box.start, box.len);
+        }
+    }
+}
+
+
+static int _m4a_prepare(SeekReader *reader, uint32_t ms, SeekStart *start) {
+    uint8_t *ftyp, *moov;
+    uint32_t ftyp_len, moov_len;
+    if (_m4a_read(reader, &ftyp, &ftyp_len, &moov, &moov_len) == -1) {
+        return -1;
+    }
+    int result = -1;
+    SeekOut out = {0};
+    M4aTrack track;
+    if (_m4a_track(moov, moov_len, &track) == -1 || track.num_samples == 0) {
+        goto done;
+    }
+
+    // The sample playing at ms, and the time it starts at
+    uint64_t target = (uint64_t)ms * track.timescale / 1000;
+    uint32_t num_stts = _be32(track.stts.payload + 4);
+    const uint8_t *stts = track.stts.payload + 8;
+    uint32_t sample = 0;
+    uint64_t time = 0;
+    for (uint32_t i = 0; i < num_stts && sample < track.num_samples; i++) {
+        uint32_t count = _be32(stts + 8 * i), delta = _be32(stts + 8 * i + 4);
+        uint32_t steps = delta == 0 ? count : MIN(count, (target - time) / delta);
+        if (steps < count || i + 1 == num_stts) {
+            sample += MIN(steps, count - 1);
+            time += (uint64_t)MIN(steps, count - 1) * delta;
+            break;
+        }
+        sample += count;
+        time += (uint64_t)count * delta;
+    }
+    sample = MIN(sample, track.num_samples - 1);
+
+    // Its chunk, and the bytes from it to the end of the last chunk
+    M4aChunks chunks = {&track, 0, 0, 0};
+    uint32_t description, num_samples, chunk = 0;
+    while ((num_samples = _m4a_next_chunk(&chunks, &description)) > 0 &&
+           chunks.first_sample <= sample) {
+    }
+    if (num_samples == 0) {
+        goto done;
+    }
+    chunk = chunks.chunk - 1;
+    uint32_t chunk_first = chunks.first_sample - num_samples;
+    uint64_t data_start = _m4a_chunk_offset(&track, chunk);
+    for (uint32_t i = chunk_first; i < sample; i++) {
+        data_start += _m4a_sample_size(&track, i);
+    }
+    uint64_t data_end = data_start;
+    chunks = (M4aChunks){&track, 0, 0, 0};
+    uint32_t next_sample = 0;
+    while ((num_samples = _m4a_next_chunk(&chunks, &description)) > 0) {
+        uint32_t index = chunks.chunk - 1;
+        uint64_t offset = _m4a_chunk_offset(&track, index);
+        for (uint32_t i = next_sample; i < next_sample + num_samples && i < track.num_samples; i++) {
+            if (index >= chunk) {
+                offset += _m4a_sample_size(&track, i);
+            }
+        }
+        next_sample += num_samples;
+        if (index > chunk && _m4a_chunk_offset(&track, index) < data_start) {
+            // Chunks out of order can't be cut down to one range
+            goto done;
+        }
+        if (index >= chunk) {
+            data_end = MAX(data_end, offset);
+        }
+    }
+    if (data_end > reader->size) {
+        goto done;
+    }
+
+    uint64_t media_duration = track.duration > time ? track.duration - time : 0;
+    uint64_t movie_duration = media_duration * track.movie_timescale / track.timescale;
+    _out_put(&out, ftyp, ftyp_len);
+    uint32_t moov_start = _out_box(&out, "moov");
+    M4aBox moov_box, mvhd;
+    _box_at(moov, moov_len, &moov_box);
+    _box_find(moov_box.payload, moov_box.payload_len, "mvhd", &mvhd);
+    _out_with_duration(&out, &mvhd, 16, 24, movie_duration);
+    uint32_t trak_start = _out_box(&out, "trak");
+    uint32_t offsets = 0;
+    _m4a_out_children(&out, &track, &track.trak, sample, chunk, sample - chunk_first,
+                      media_duration, movie_duration, &offsets);
+    _out_end(&out, trak_start);
+    _out_end(&out, moov_start);
+    uint32_t mdat_start = _out_box(&out, "mdat");
+    if (out.failed || offsets == 0 || data_end - data_start > UINT32_MAX - out.len) {
+        goto done;
+    }
+    _put_be32(out.data + mdat_start, M4A_BOX_HEADER_SIZE + (data_end - data_start));
+
+    // The chunks' data moves to just after the header
+    for (uint32_t i = chunk; i < track.num_chunks; i++) {
+        uint64_t offset = i == chunk ? data_start : _m4a_chunk_offset(&track, i);
+        _put_be32(out.data + offsets + 4 * (i - chunk), out.len + (offset - data_start));
+    }
+    start->head = out.data;
+    start->head_len = out.len;
+    start->offset = data_start;
+    start->end = data_end;
+    start->ms = time * 1000 / track.timescale;
+    out.data = NULL;
+    result = 0;
+
+done:
+    free(out.data);
+    free(ftyp);
+    free(moov);
+    return result;
+}
+
+
+/*
+** Tables
+** ------
+*/
+
+void seek_table_free(SeekTable *table) {
+    free(table->points);
+    table->points = NULL;
+    table->num_points = 0;
+    table->points_len = 0;
+}
+
+
+int seek_table_build(SeekTable *table, int fd, const struct stat *file_stat) {
+    seek_table_free(table);
+    table->size = file_stat->st_size;
+    table->mtime = file_stat->st_mtime;
+    table->format = SEEK_NONE;
+    table->built = 1;
+    SeekReader *reader = malloc(sizeof(SeekReader));
+    if (reader == NULL) {
+        perror("seek_table_build");
+        return -1;
+    }
+    reader->fd = fd;
+    reader->size = file_stat->st_size;
+    reader->start = reader->len = 0;
+
+    int result = -1;
+    SeekPoints points = {0};
+    SeekWalker walker = {0};
+    walker.expected = UINT64_MAX;
+    const uint8_t *magic = _peek(reader, 0, 12);
+    uint32_t fmt, fmt_len, data, data_len;
+    uint8_t *ftyp, *moov;
+    uint32_t ftyp_len, moov_len;
+    M4aTrack track;
+    uint64_t first_frame;
+    if (magic == NULL) {
+        result = 0;
+
+    } else if (memcmp(magic, "RIFF", 4) == 0) {
+        if (_wav_parse(reader, &fmt, &fmt_len, &data, &data_len) == 0) {
+            table->format = SEEK_WAV;
+        }
+        result = 0;
+
+    } else if (memcmp(magic + 4, "ftyp", 4) == 0) {
+        if (_m4a_read(reader, &ftyp, &ftyp_len, &moov, &moov_len) == 0) {
+            if (_m4a_track(moov, moov_len, &track) == 0) {
+                table->format = SEEK_M4A;
+            }
+            free(ftyp);
+            free(moov);
+        }
+        result = 0;
+
+    } else if (memcmp(magic, "fLaC", 4) == 0) {
+        walker.format = SEEK_FLAC;
+        if (_flac_parse_metadata(reader, &walker, &first_frame, &points) == -1) {
+            result = 0;
+        } else {
+            table->format = SEEK_FLAC;
+            // Without a SEEKTABLE, from the first frame, which starts at 0
+            walker.offset = first_frame;
+            walker.expected = 0;
+            result = points.num > 0 ? 0 : _walk_points(reader, &walker, &points);
+        }
+
+    } else if (memcmp(magic, "OggS", 4) == 0) {
+        walker.format = SEEK_OGG;
+        if (_ogg_parse_headers(reader, &walker.ogg) == -1) {
+            result = 0;
+        } else {
+            table->format = SEEK_OGG;
+            walker.offset = walker.ogg.header_end;
+            result = _walk_points(reader, &walker, &points);
+        }
+
+    } else {
+        walker.format = SEEK_MP3;
+        walker.offset = _mp3_skip_id3(reader);
+        uint32_t ms;
+        uint64_t offset;
+        if (!_walk_next(reader, &walker, &ms, &offset)) {
+            result = 0;
+        } else {
+            table->format = SEEK_MP3;
+            int toc = _mp3_toc(reader, offset, &points);
+            if (toc == 0) {
+                result = _add_point(&points, ms, offset) == -1 ? -1
+                         : _walk_points(reader, &walker, &points);
+            } else {
+                result = toc == -1 ? -1 : 0;
+            }
+        }
+    }
+
+    if (result == 0 && points.num > 0) {
+        result = _set_points(table, &points);
+    }
+    free(points.points);
+    free(reader);
+    return result;
+}
+
+
+int seek_prepare(const SeekTable *table, int fd, uint32_t size, uint32_t ms, SeekStart *start) {
+    memset(start, 0, sizeof(SeekStart));
+    SeekReader *reader = malloc(sizeof(SeekReader));
+    if (reader == NULL) {
+        perror("seek_prepare");
+        return -1;
+    }
+    reader->fd = fd;
+    reader->size = size;
+    reader->start = reader->len = 0;
+
+    int result = -1;
+    SeekWalker walker = {0};
+    walker.format = table->format;
+    uint64_t first_frame;
+    if (table->format == SEEK_WAV) {
+        result = _wav_prepare(reader, ms, start);
+
+    } else if (table->format == SEEK_M4A) {
+        result = _m4a_prepare(reader, ms, start);
+
+    } else if (table->format == SEEK_MP3) {
+        result = _walk_to(table, reader, &walker, ms, start);
+
+    } else if (table->format == SEEK_FLAC) {
+        // STREAMINFO alone, of an unknown number of samples and MD5 sum
+        if (_flac_parse_metadata(reader, &walker, &first_frame, NULL) == 0 &&
+            (start->head = _read_at(fd, 0, FLAC_MARKER_SIZE + 4 + FLAC_STREAMINFO_SIZE)) != NULL) {
+            start->head_len = FLAC_MARKER_SIZE + 4 + FLAC_STREAMINFO_SIZE;
+            uint8_t *info = start->head + FLAC_MARKER_SIZE;
+            info[0] = 0x80;
+            info[4 + 13] &= 0xf0;
+            memset(info + 4 + 14, 0, 4 + 16);
+            result = _walk_to(table, reader, &walker, ms, start);
+        }
+
+    } else if (table->format == SEEK_OGG) {
+        if (_ogg_parse_headers(reader, &walker.ogg) == 0 &&
+            (start->head = _read_at(fd, 0, walker.ogg.header_end)) != NULL) {
+            start->head_len = walker.ogg.header_end;
+            result = _walk_to(table, reader, &walker, ms, start);
+        }
+    }
+
+    free(reader);
+    if (result == -1) {
+        free(start->head);
+        memset(start, 0, sizeof(SeekStart));
+    }
+    return result;
+}
+
+
+/*
+** The index
+** ---------
+*/
+
+void seek_index_init(SeekIndex *index) {
+    memset(index, 0, sizeof(SeekIndex));
+}
+
+
+void seek_index_free(SeekIndex *index) {
+    for (uint32_t i = 0; i < index->num_tables; i++) {
+        seek_table_free(&index->tables[i]);
+        free(index->tables[i].path);
+    }
+    free(index->tables);
+    memset(index, 0, sizeof(SeekIndex));
+}
+
+
+/*
+** Helper for: seek_index_update
+** Loads the tables saved in the index file into index.
+**
+** returns 0 on success, -1 if there are none to load
+*/
+static int _load(SeekIndex *index) {
+    char *path = _join_path(seek_index_directory, SEEK_INDEX_FILE);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1 || file_stat.st_size > UINT32_MAX) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    uint8_t *data = _read_at(fd, 0, file_stat.st_size);
+    close(fd);
+    if (data == NULL) {
+        return -1;
+    }
+
+    const uint8_t *in = data, *end = data + file_stat.st_size;
+    uint32_t num_tables;
+    if (end - in < strlen(SEEK_INDEX_MAGIC) || memcmp(in, SEEK_INDEX_MAGIC, strlen(SEEK_INDEX_MAGIC)) != 0 ||
+        (in += strlen(SEEK_INDEX_MAGIC), varint_get(&in, end, &num_tables) == -1) ||
+        num_tables > (end - in) / 6) {
+        goto error;
+    }
+    index->tables = calloc(MAX(num_tables, 1), sizeof(SeekTable));
+    if (index->tables == NULL) {
+        perror("seek: calloc");
+        goto error;
+    }
+    for (uint32_t i = 0; i < num_tables; i++) {
+        SeekTable *table = &index->tables[i];
+        uint32_t path_len, format;
+        if (varint_get(&in, end, &path_len) == -1 || path_len > end - in) {
+            goto error;
+        }
+        table->path = strndup((const char *)in, path_len);
+        index->num_tables++;
+        in += path_len;
+        if (table->path == NULL || strlen(table->path) != path_len ||
+            (i > 0 && strcmp(index->tables[i - 1].path, table->path) >= 0) ||
+            varint_get(&in, end, &table->size) == -1 || varint_get(&in, end, &table->mtime) == -1 ||
+            varint_get(&in, end, &format) == -1 || format > SEEK_M4A ||
+            varint_get(&in, end, &table->num_points) == -1) {
+            goto error;
+        }
+        table->format = format;
+        table->built = 1;
+        // Each point is two varints
+        const uint8_t *points = in;
+        for (uint32_t j = 0; j < 2 * table->num_points; j++) {
+            uint32_t value;
+            if (varint_get(&in, end, &value) == -1) {
+                goto error;
+            }
+        }
+        table->points_len = in - points;
+        table->points = malloc(MAX(table->points_len, 1));
+        if (table->points == NULL) {
+            perror("seek: malloc");
+            goto error;
+        }
+        memcpy(table->points, points, table->points_len);
+    }
+    free(data);
+    return in == end ? 0 : (seek_index_free(index), -1);
+
+error:
+    ERR_PRINT("Ignoring the malformed seek index in %s\n", seek_index_directory);
+    free(data);
+    seek_index_free(index);
+    return -1;
+}
+
+
+/*
+** Helper for: seek_index_build
+** Saves the index's tables in the index file, replacing it.
+**
+** returns 0 on success, -1 on error
+*/
+static int _save(const SeekIndex *index) {
+    if (mkdir(seek_index_directory, 0755) == -1 && errno != EEXIST) {
+        perror("seek: mkdir");
+        return -1;
+    }
+    size_t capacity = strlen(SEEK_INDEX_MAGIC) + VARINT_MAX_SIZE;
+    for (uint32_t i = 0; i < index->num_tables; i++) {
+        capacity += 5 * VARINT_MAX_SIZE + strlen(index->tables[i].path) +
+                    index->tables[i].points_len;
+    }
+    uint8_t *data = malloc(capacity);
+    char *path = _join_path(seek_index_directory, SEEK_INDEX_FILE);
+    char *temp_path = path == NULL ? NULL : malloc(strlen(path) + 5);
+    if (data == NULL || temp_path == NULL) {
+        perror("seek: malloc");
+        free(data);
+        free(path);
+        return -1;
+    }
+    sprintf(temp_path, "%s.tmp", path);
+
+    uint8_t *out = data;
+    memcpy(out, SEEK_INDEX_MAGIC, strlen(SEEK_INDEX_MAGIC));
+    out += strlen(SEEK_INDEX_MAGIC);
+    out = varint_put(out, index->num_tables);
+    for (uint32_t i = 0; i < index->num_tables; i++) {
+        const SeekTable *table = &index->tables[i];
+        uint32_t path_len = strlen(table->path);
+        out = varint_put(out, path_len);
+        memcpy(out, table->path, path_len);
+        out += path_len;
+        // Tables that were never built are saved as files that can't seek
+        out = varint_put(out, table->built ? table->size : 0);
+        out = varint_put(out, table->built ? table->mtime : 0);
+        out = varint_put(out, table->format);
+        out = varint_put(out, table->num_points);
+        if (table->points_len > 0) {
+            memcpy(out, table->points, table->points_len);
+            out += table->points_len;
+        }
+    }
+
+    int result = -1;
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("seek: open");
+    } else if (write_precisely(fd, data, out - data) != out - data) {
+        perror("seek: write");
+        close(fd);
+        unlink(temp_path);
+    } else if (close(fd) == -1 || rename(temp_path, path) == -1) {
+        perror("seek: rename");
+        unlink(temp_path);
+    } else {
+        result = 0;
+    }
+    free(data);
+    free(path);
+    free(temp_path);
+    return result;
+}
+
+
+int seek_index_update(SeekIndex *index, const Library *library, uint8_t load) {
+    SeekIndex old = *index;
+    if (load) {
+        seek_index_free(&old);
+        if (_load(&old) == -1) {
+            seek_index_init(&old);
+        }
+    }
+    seek_index_init(index);
+    index->tables = calloc(MAX(library->num_files, 1), sizeof(SeekTable));
+    if (index->tables == NULL) {
+        perror("seek_index_update");
+        seek_index_free(&old);
+        return -1;
+    }
+    index->num_tables = library->num_files;
+    index->dirty = old.dirty;
+
+    // Both are sorted by path, so they are walked side by side
+    uint32_t i = 0;
+    for (uint32_t j = 0; j < library->num_files; j++) {
+        int order = -1;
+        while (i < old.num_tables && (order = strcmp(old.tables[i].path, library->files[j])) < 0) {
+            seek_table_free(&old.tables[i]);
+            free(old.tables[i++].path);
+            index->dirty = 1;
+        }
+        if (i < old.num_tables && order == 0) {
+            index->tables[j] = old.tables[i++];
+            index->tables[j].checked = 0;
+            continue;
+        }
+        index->tables[j].path = strdup(library->files[j]);
+        if (index->tables[j].path == NULL) {
+            perror("seek_index_update");
+            old.num_tables = i;
+            seek_index_free(&old);
+            seek_index_free(index);
+            return -1;
+        }
+    }
+    index->dirty |= i < old.num_tables;
+    for (; i < old.num_tables; i++) {
+        seek_table_free(&old.tables[i]);
+        free(old.tables[i].path);
+    }
+    free(old.tables);
+    return 0;
+}
+
+
+int seek_index_build(SeekIndex *index, const Library *library) {
+    while (index->next_build < index->num_tables) {
+        SeekTable *table = &index->tables[index->next_build++];
+        if (table->checked) {
+            continue;
+        }
+        table->checked = 1;
+        char *path = _library_file_path(library, index->next_build - 1);
+        if (path == NULL) {
+            return -1;
+        }
+        struct stat file_stat;
+        if (stat(path, &file_stat) == -1) {
+            free(path);
+            continue;
+        }
+        if (table->built && table->size == (uint32_t)file_stat.st_size &&
+            table->mtime == (uint32_t)file_stat.st_mtime) {
+            free(path);
+            continue;
+        }
+        int fd = open(path, O_RDONLY);
+        free(path);
+        if (fd == -1 || fstat(fd, &file_stat) == -1 || seek_table_build(table, fd, &file_stat) == -1) {
+            table->built = 0;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        index->dirty = 1;
+    }
+    if (!index->dirty) {
+        return 0;
+    }
+    // Not tried again until something changes, even if it failed
+    index->dirty = 0;
+    if (_save(index) == -1) {
+        ERR_PRINT("Could not save the seek index in %s\n", seek_index_directory);
+        return 0;
+    }
+    return 1;
+}
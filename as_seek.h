@@ -0,0 +1,169 @@
+#ifndef AS_SEEK_H_
+#define AS_SEEK_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <sys/stat.h>
+
+/*
+** Seeking by time
+** ---------------
+** A client that wants to start a track at minute 42 can't tell which byte
+** that is: MP3 and FLAC frames vary in size, and Ogg pages in duration. So
+** the server keeps a seek table for each file of the library: a point every
+** SEEK_INTERVAL_MS of audio, with the offset of the frame that starts there.
+**   MP3: from the Xing/Info tag's table of contents where the file has one,
+**       from a walk over its frames otherwise.
+**   FLAC: from its SEEKTABLE where it has one, from a walk over its frames
+**       otherwise.
+**   Ogg (Vorbis and Opus): from the granule positions of its pages.
+**   WAV and M4A need no points, as their headers (the byte rate, and the
+**       stts, stsc, stsz and stco boxes) map a time to a byte on their own.
+**
+** A SEEK request is followed by the file's index and the time to start at in
+** milliseconds, both as 32-bit integers in network byte order. The response
+** is that of a STREAM of a file made of a header where the format needs one,
+** then the file from the frame nearest before that time, found from the
+** table's point before it by walking the frames after it:
+**   WAV: the format chunk, and a data chunk of the rest of the samples.
+**   MP3: no header, every frame stands on its own.
+**   FLAC: the "fLaC" marker and STREAMINFO, of unknown length.
+**   Ogg: the pages of the stream's header packets.
+**   M4A: the file's ftyp, then a moov of the audio track with its sample
+**       tables cut down to the samples from there on, then an mdat around
+**       the rest of the file's sample data.
+**
+** Tables are built by the server's indexer, a helper process that walks
+** whole files without holding up connections, and saved in SEEK_INDEX_FILE in
+** seek_index_directory once they all are, for the server to load them, and to
+** load them again when it starts next. The directory is apart from the
+** library, which the server only ever reads, and is made if need be. A table
+** only counts for a file of the size and mtime it was built from; otherwise,
+** a SEEK builds the file's table for itself.
+**
+** The index file is SEEK_INDEX_MAGIC, then the number of tables, then for
+** each, in path order and with every integer a varint (see libas.h):
+**                   <path length> <path> <size> <mtime> <format> <number of
+**                   points> <points>
+** Each point is its time and offset less the point's before it.
+*/
+#define SEEK_NONE 0
+#define SEEK_WAV 1
+#define SEEK_MP3 2
+#define SEEK_FLAC 3
+#define SEEK_OGG 4
+#define SEEK_M4A 5
+
+#define SEEK_ARGS_SIZE 8
+#define SEEK_INTERVAL_MS 2000
+#define SEEK_DEFAULT_DIRECTORY ".as_index"
+#define SEEK_INDEX_FILE "seek"
+#define SEEK_INDEX_MAGIC "ASSEEK1\n"
+// Reads while walking a file
+#define SEEK_READ_SIZE 65536
+// The largest header a seek sends before the file: Ogg headers can hold
+// cover art, and an M4A's sample tables grow with its length
+#define SEEK_MAX_HEAD (16 << 20)
+
+
+// Where the index is saved, SEEK_DEFAULT_DIRECTORY unless the server is told
+extern const char *seek_index_directory;
+
+
+/*
+** A file's seek table.
+** points: num_points points encoded as in the index file, points_len bytes.
+** checked: the file was found to still be the one the table was built from.
+*/
+typedef struct seek_table {
+    char *path;
+    uint32_t size;
+    uint32_t mtime;
+    uint8_t format;
+    uint8_t built;
+    uint8_t checked;
+    uint32_t num_points;
+    uint8_t *points;
+    uint32_t points_len;
+} SeekTable;
+
+/*
+** tables: one for each of the library's num_tables files, in its order.
+** next_build: the first table that may still need to be built or checked.
+** dirty: some table changed since the index file was saved.
+*/
+typedef struct seek_index {
+    SeekTable *tables;
+    uint32_t num_tables;
+    uint32_t next_build;
+    uint8_t dirty;
+} SeekIndex;
+
+/*
+** Where a seek starts: the head_len bytes of head, then the file's bytes from
+** offset up to end. ms is the time it starts at.
+*/
+typedef struct seek_start {
+    uint8_t *head;
+    uint32_t head_len;
+    uint32_t offset;
+    uint32_t end;
+    uint32_t ms;
+} SeekStart;
+
+
+/*
+** Initializes an empty index.
+*/
+void seek_index_init(SeekIndex *index);
+
+/*
+** Brings the index in line with library, whose files must be sorted by path:
+** files that stay keep their tables, to be checked again, and new ones get
+** empty tables. With load set, the tables saved in the index file are taken
+** first.
+**
+** returns 0 on success, -1 on error, leaving the index empty
+*/
+int seek_index_update(SeekIndex *index, const Library *library, uint8_t load);
+
+/*
+** Builds or checks every table that needs it, and saves the index if any
+** changed. This reads whole files, so the server does it in its indexer.
+**
+** returns 1 if the index was saved, 0 if it didn't need to be or could not be,
+** -1 on error
+*/
+int seek_index_build(SeekIndex *index, const Library *library);
+
+/*
+** Frees everything the index holds, leaving it empty.
+*/
+void seek_index_free(SeekIndex *index);
+
+/*
+** Builds the table of the file open at fd, whose fstat is file_stat, after
+** freeing what it held.
+**
+** returns 0 on success, -1 on error
+*/
+int seek_table_build(SeekTable *table, int fd, const struct stat *file_stat);
+
+/*
+** Frees what the table holds.
+*/
+void seek_table_free(SeekTable *table);
+
+/*
+** Finds where to start the file open at fd, of size bytes and with the given
+** table, to play from ms milliseconds on, and builds the header to send
+** before it.
+**
+** returns 0 on success, -1 if the file can't be seeked
+*/
+int seek_prepare(const SeekTable *table, int fd, uint32_t size, uint32_t ms, SeekStart *start);
+
+#endif // AS_SEEK_H_
@@ -5,6 +5,55 @@
 #include "as_server.h"
 
 
+// Send large STREAM writes with MSG_ZEROCOPY, see -z
+static uint8_t use_zerocopy = 0;
+// Percentage of UDP datagrams not sent, to simulate loss, see -d
+static int udp_drop_percent = 0;
+// Playlist of the station, see -s, and the station once it is started
+static const char *station_playlist = NULL;
+static Station station;
+// Concurrent streams of a file share their reads, unless -C is given
+static uint8_t coalesce_streams = 1;
+static FlightTable *flights = NULL;
+// Counted by every client process, see as_stats.h
+static ServerStats *server_stats = NULL;
+// Limits on connections, streams and bandwidth, see -m, -a, -t and -r
+static AdmissionLimits admission_limits = {0, 0, 0, 0};
+static Admission *admission = NULL;
+// The server's arguments, to start a successor with, and the Unix socket to
+// the predecessor or to a starting successor, see as_handoff.h
+static char * const *server_argv = NULL;
+static int handoff_fd = -1;
+static pid_t successor = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+// Of the library, brought up to date by every scan and inherited by clients
+static SearchIndex search_index;
+// Of the library, built again after every scan as it points into its paths
+static BrowseTree browse_tree;
+// Of the library's files, and of its WAV files, built by the indexer process
+// and loaded once it saves them
+static SeekIndex seek_index;
+static WaveIndex wave_index;
+// The indexer, 0 while none runs, and whether the library was scanned since
+// the last one started
+static pid_t indexer = 0;
+static uint8_t index_wanted = 1;
+// Of a v2 client process, a reader for each device its streams read from
+static DiskPool disks;
+// The server whose library an edge serves, see -u, and the edge, caching its
+// files in the library directory, at most -c MiB of them
+static const char *upstream = NULL;
+static uint64_t edge_cache_mb = EDGE_DEFAULT_CACHE_MB;
+static Edge edge;
+
+
+// A client process, and the slot its connection was admitted in
+typedef struct client_process {
+    pid_t pid;
+    int slot;
+} ClientProcess;
+
+
 int init_server_addr(int port, struct sockaddr_in *addr){
     // Allow sockets across machines.
     addr->sin_family = AF_INET;
@@ -104,6 +153,35 @@ int countDigits(int number) {
     return count;
 }
 
+/*
+** Helper for: list_request_response, protocol v2 LIST streams
+** returns the heap-allocated response, of *len bytes (not null-terminated),
+** NULL on error
+*/
+static char *_build_list_response(const Library *library, int *len) {
+    int total_len = 0;
+    for (int i = 0; i < library->num_files; i++) {
+        // Index, colon, file name and network newline
+        total_len += countDigits(i) + 1 + strlen(library->files[i]) + 2;
+    }
+
+    int offset = 0;
+
+    // One more byte for the null character sprintf leaves behind
+    char *response = malloc(sizeof(char) * (total_len + 1));
+    if (response == NULL) {
+        perror("Memory allocation error");
+        return NULL;
+    }
+
+    for (int i = library->num_files - 1; i >= 0; i--) {
+        offset += sprintf(response + offset, "%d:%s\r\n", i, library->files[i]);
+    }
+    *len = offset;
+    return response;
+}
+
+
 /*
 ** List the files in the library. The list is returned as a single string
 ** with each file starting with an integer corresponding to it's index in
@@ -124,46 +202,22 @@ int countDigits(int number) {
 * - https://stackoverflow.com/questions/8257714/how-can-i-convert-an-int-to-a-string-in-c
 */
 int list_request_response(const ClientSocket * client, const Library *library) {
-    int total_len = 0;
-    int num_items = library->num_files;
-    for (int i = 0; i < num_items - 1; i++) {
-        // Adding length for index
-        total_len += countDigits(i);
-        // Adding length for colon
-        total_len++;
-        // Adding length for file name
-        total_len += LIBRARY_FILENAME_MAX;
-        // Adding length for network newline
-        total_len += 2;
-    }
-
-    int offset = 0;
-
-    char *response = malloc(sizeof(char) * total_len);
+    long phase_start = stats_now_us();
+    int len;
+    char *response = _build_list_response(library, &len);
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
     if (response == NULL) {
-        perror("Memory allocation error");
         return -1; // Return failure
     }
-
-    for (int i = library->num_files - 1; i >= 0; i--) {
-        // Convert index to string
-        char index_str[countDigits(i)]; // Assuming index will not exceed 10 digits
-        sprintf(index_str, "%d", i);
-        strcpy(response + offset, index_str); // Append index
-        offset += countDigits(i);
-        strcpy(response + offset, ":"); // Append colon
-        offset++;
-        strcpy(response + offset, library->files[i]); // Append file name
-        offset += strlen(library->files[i]);
-        strcpy(response + offset, "\r\n"); // Append newline
-        offset += 2;
-    }
     // Send the response to the client
-    if (write_precisely(client->socket, response, offset * sizeof(char)) < 0) {
+    phase_start = stats_now_us();
+    if (write_precisely(client->socket, response, len * sizeof(char)) < 0) {
         perror("write");
         free(response); // Free allocated memory before returning
         return -1; // Return failure
     }
+    stats_phase_done(STATS_PHASE_SEND, phase_start);
+    stats_bytes_sent(len);
     // Free allocated memory
     free(response);
 
@@ -171,23 +225,208 @@ int list_request_response(const ClientSocket * client, const Library *library) {
 }
 
 
-static int _load_file_size_into_buffer(FILE *file, uint8_t *buffer) {
-    if (fseek(file, 0, SEEK_END) < 0) {
-        ERR_PRINT("Error seeking to end of file\n");
+int clist_request_response(const ClientSocket * client, const Library *library) {
+    long phase_start = stats_now_us();
+    uint32_t len;
+    uint8_t *response = clist_encode(library, CLIST_FLAG_CHECKSUM, &len);
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+    if (response == NULL) {
+        return -1;
+    }
+    phase_start = stats_now_us();
+    int result = write_precisely(client->socket, response, len);
+    free(response);
+    if (result < 0) {
+        perror("write");
+        return -1;
+    }
+    stats_phase_done(STATS_PHASE_SEND, phase_start);
+    stats_bytes_sent(len);
+    return 0;
+}
+
+
+/*
+** Helper for: search_request_response, protocol v2 SEARCH streams
+** Builds the SEARCH response to the args_len bytes of args that follow the
+** request, see search_request_response.
+**
+** returns the heap-allocated response, of *len bytes, NULL on error with
+** *error set to the reason
+*/
+static uint8_t *_build_search_response(const Library *library, const uint8_t *args,
+                                       uint32_t args_len, uint32_t *len, const char **error) {
+    if (args_len < SEARCH_HEADER_SIZE || args_len != SEARCH_HEADER_SIZE + args[3]) {
+        *error = "Malformed search";
+        return NULL;
+    }
+    uint8_t mode = args[0];
+    uint32_t limit = args[1] << 8 | args[2];
+    if (mode > SEARCH_FUZZY) {
+        *error = "Unknown search mode";
+        return NULL;
+    }
+    limit = limit == 0 ? SEARCH_DEFAULT_LIMIT : MIN(limit, SEARCH_MAX_LIMIT);
+    char query[SEARCH_MAX_QUERY + 1];
+    memcpy(query, args + SEARCH_HEADER_SIZE, args[3]);
+    query[args[3]] = '\0';
+
+    SearchMatch matches[SEARCH_MAX_LIMIT];
+    int num_matches = search_index_query(&search_index, query, mode, limit, matches);
+    if (num_matches < 0) {
+        *error = "Out of memory";
+        return NULL;
+    }
+    uint32_t body_len = 0;
+    for (int i = 0; i < num_matches; i++) {
+        // Index, colon, file name and network newline
+        body_len += countDigits(matches[i].file_index) + 1 +
+                    strlen(library->files[matches[i].file_index]) + 2;
+    }
+    // One more byte for the null character sprintf leaves behind
+    uint8_t *response = malloc(sizeof(uint32_t) + body_len + 1);
+    if (response == NULL) {
+        perror("_build_search_response");
+        *error = "Out of memory";
+        return NULL;
+    }
+    uint32_t network_body_len = htonl(body_len);
+    memcpy(response, &network_body_len, sizeof(uint32_t));
+    char *body = (char *)response + sizeof(uint32_t);
+    for (int i = 0; i < num_matches; i++) {
+        body += sprintf(body, "%u:%s\r\n", matches[i].file_index,
+                        library->files[matches[i].file_index]);
+    }
+    *len = sizeof(uint32_t) + body_len;
+    return response;
+}
+
+
+/*
+** Helper for: search_request_response, browse_request_response,
+** seek_request_response, waveform_request_response
+** Takes count bytes that follow a request from reader, and the rest of them
+** from the client socket.
+**
+** returns 0 on success, -1 on error
+*/
+static int _take_request_args(const ClientSocket * client, LineReader *reader,
+                              uint8_t *args, size_t count) {
+    size_t num = line_reader_take(reader, args, count);
+    if (num < count && read_precisely(client->socket, args + num, count - num) != count - num) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+
+int search_request_response(const ClientSocket * client, const Library *library,
+                            LineReader *reader) {
+    long phase_start = stats_now_us();
+    uint8_t args[SEARCH_HEADER_SIZE + SEARCH_MAX_QUERY];
+    if (_take_request_args(client, reader, args, SEARCH_HEADER_SIZE) == -1 ||
+        _take_request_args(client, reader, args + SEARCH_HEADER_SIZE, args[3]) == -1) {
+        return -1;
+    }
+    uint32_t len;
+    const char *error;
+    uint8_t *response = _build_search_response(library, args, SEARCH_HEADER_SIZE + args[3],
+                                               &len, &error);
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+    if (response == NULL) {
+        ERR_PRINT("search_request_response: %s\n", error);
+        return -1;
+    }
+    phase_start = stats_now_us();
+    int result = write_precisely(client->socket, response, len);
+    free(response);
+    if (result < 0) {
+        perror("write");
+        return -1;
+    }
+    stats_phase_done(STATS_PHASE_SEND, phase_start);
+    stats_bytes_sent(len);
+    return 0;
+}
+
+
+/*
+** Helper for: browse_request_response, protocol v2 BROWSE streams
+** Builds the BROWSE response to the args_len bytes of args that follow the
+** request, see browse_request_response.
+**
+** returns the heap-allocated response, of *len bytes, NULL on error with
+** *error set to the reason
+*/
+static uint8_t *_build_browse_response(const Library *library, const uint8_t *args,
+                                       uint32_t args_len, uint32_t *len, const char **error) {
+    if (args_len < BROWSE_HEADER_SIZE) {
+        *error = "Malformed browse";
+        return NULL;
+    }
+    uint32_t offset;
+    memcpy(&offset, args, sizeof(uint32_t));
+    offset = ntohl(offset);
+    uint32_t count = args[4] << 8 | args[5];
+    uint32_t dir_len = args[6] << 8 | args[7];
+    uint32_t token_len = args[8] << 8 | args[9];
+    if (dir_len > BROWSE_MAX_ARG || token_len > BROWSE_MAX_ARG) {
+        *error = "Directory or token too long";
+        return NULL;
+    }
+    if (args_len != BROWSE_HEADER_SIZE + dir_len + token_len) {
+        *error = "Malformed browse";
+        return NULL;
+    }
+    count = count == 0 ? BROWSE_DEFAULT_COUNT : MIN(count, BROWSE_MAX_COUNT);
+    const char *dir = (const char *)args + BROWSE_HEADER_SIZE;
+    uint8_t *response = browse_page(&browse_tree, library, dir, dir_len, dir + dir_len,
+                                    token_len, offset, count, len);
+    if (response == NULL) {
+        *error = "Out of memory";
+    }
+    return response;
+}
+
+
+int browse_request_response(const ClientSocket * client, const Library *library,
+                            LineReader *reader) {
+    long phase_start = stats_now_us();
+    uint8_t args[BROWSE_HEADER_SIZE + 2 * BROWSE_MAX_ARG];
+    if (_take_request_args(client, reader, args, BROWSE_HEADER_SIZE) == -1) {
+        return -1;
+    }
+    uint32_t rest_len = (args[6] << 8 | args[7]) + (args[8] << 8 | args[9]);
+    if (rest_len > 2 * BROWSE_MAX_ARG) {
+        ERR_PRINT("browse_request_response: Malformed browse\n");
+        return -1;
+    }
+    if (_take_request_args(client, reader, args + BROWSE_HEADER_SIZE, rest_len) == -1) {
         return -1;
     }
-    uint32_t file_size = ftell(file);
-    if (fseek(file, 0, SEEK_SET) < 0) {
-        ERR_PRINT("Error seeking to start of file\n");
+    uint32_t len;
+    const char *error;
+    uint8_t *response = _build_browse_response(library, args, BROWSE_HEADER_SIZE + rest_len,
+                                               &len, &error);
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+    if (response == NULL) {
+        ERR_PRINT("browse_request_response: %s\n", error);
+        return -1;
+    }
+    phase_start = stats_now_us();
+    int result = write_precisely(client->socket, response, len);
+    free(response);
+    if (result < 0) {
+        perror("write");
         return -1;
     }
-    buffer[0] = (file_size >> 24) & 0xFF;
-    buffer[1] = (file_size >> 16) & 0xFF;
-    buffer[2] = (file_size >> 8) & 0xFF;
-    buffer[3] = file_size & 0xFF;
+    stats_phase_done(STATS_PHASE_SEND, phase_start);
+    stats_bytes_sent(len);
     return 0;
 }
 
+
 // Function to convert a 4-byte buffer to an integer
 /**
  * @brief Converts a 4-byte buffer to a 32-bit unsigned integer.
@@ -218,52 +457,52 @@ int min(int a, int b) {
     return (a < b) ? a : b;
 }
 
-/**
- * @brief Retrieves the size of a file.
- *
- * This function takes a file pointer and retrieves the size of the file associated with it.
- * It achieves this by seeking to the end of the file and then using ftell() to determine the current position,
- * which represents the size of the file. After retrieving the file size, it seeks back to the beginning of the file.
- *
- * @param file A pointer to the FILE structure representing the file for which the size is to be retrieved.
- * @return The size of the file in bytes if successful, or -1 if an error occurs.
- */
-int file_size_retrieve(FILE *file) {
-    // Retrieve the file size
-    if (fseek(file, 0, SEEK_END) < 0) {
-        ERR_PRINT("Error seeking to end of file\n");
+/*
+** Helper for: stream_request_response, seek_request_response, protocol v2
+** STREAM and SEEK streams
+** Opens the file at file_index to be streamed, joining the flight of any
+** concurrent stream of the same file in table (see as_flight.h), or on its
+** own with a NULL table.
+**
+** returns the file's size on success, -1 on error
+*/
+static int _open_stream_file(const Library *library, uint32_t file_index, FlightTable *table,
+                             FlightReader *reader) {
+    char *file_path = _library_file_path(library, file_index);
+    if (file_path == NULL) {
         return -1;
     }
-
-    int curr_size = ftell(file);
-    if (fseek(file, 0, SEEK_SET) < 0) {
-        ERR_PRINT("Error seeking to start of file\n");
+    // A single fstat gives the size, without seeking the file back and forth
+    int fd = open(file_path, O_RDONLY);
+    free(file_path);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        perror("open");
+        if (fd != -1) {
+            close(fd);
+        }
         return -1;
     }
+    flight_open(table, reader, fd, &file_stat);
+    return file_stat.st_size;
+}
 
-    return curr_size;
 
+static void _close_stream_file(FlightReader *reader) {
+    flight_close(reader);
+    close(reader->fd);
 }
 
+
 /*
-** Stream a file from the library to the client. The file is streamed in chunks
-** of a maximum of STREAM_CHUNK_SIZE bytes. The client will be able to request
-** a specific file by its index in the library.
-**
-** The 32-bit unsigned network byte-order integer file_index will be read
-** from the client_socket, but will consider num_pr_bytes (must be <= uint32_t)
-** from post_req first, then:
-**   The stream will be sent in the following format:
-**     - the first 4 bytes (32-bits) will be the file size in network byte-order
-**     - the rest of the stream will be the file's data written in chunks of
-**       STREAM_CHUNK_SIZE bytes, or less if write returns less than STREAM_CHUNK_SIZE,
-**       the file is less than STREAM_CHUNK_SIZE bytes, or the last remaining chunk is
-**       less than STREAM_CHUNK_SIZE bytes.
+** Helper for: stream_request_response, stat_request_response
+** Reads the 32-bit network byte-order file index that follows a request,
+** taking the first num_pr_bytes (<= 4) of it from post_req and the rest from
+** the client socket.
 **
-** If the file is successfully transported to the client over the client_socket,
-** return 0. Otherwise, return -1.
- */
-int stream_request_response(const ClientSocket * client, const Library *library,
+** returns the validated file index on success, -1 on error
+*/
+static int _read_file_index(const ClientSocket * client, const Library *library,
                             uint8_t *post_req, int num_pr_bytes) {
     if (num_pr_bytes > 4){
         fprintf(stderr, "Error: Invalid number of num_pr_bytes\n");
@@ -279,7 +518,7 @@ int stream_request_response(const ClientSocket * client, const Library *library,
         // If not all bytes of file_index are available, read from the socket
         memcpy(&file_index_buffer, post_req, num_pr_bytes);
         int remaining_bytes = 4 - num_pr_bytes;
-        int bytes_read = read_precisely(client->socket, &file_index_buffer + num_pr_bytes, remaining_bytes);
+        int bytes_read = read_precisely(client->socket, file_index_buffer + num_pr_bytes, remaining_bytes);
         if (bytes_read != remaining_bytes) {
             perror("read");
             return -1;
@@ -289,110 +528,616 @@ int stream_request_response(const ClientSocket * client, const Library *library,
     // Use ntohl instead of ntohs as we are converting a 32-bit int
     // Note that the file index needs to be in network byte order, i.e., big endian byte order.
 
-    int file_index = convert_buffer_to_int(file_index_buffer);
-//    file_index = ntohl(file_index);
+    uint32_t file_index = convert_buffer_to_int(file_index_buffer);
 
     // Validate File Index
     if (file_index >= library->num_files) {
         fprintf(stderr, "Invalid file index\n");
         return -1;
     }
+    return file_index;
+}
+
+
+/*
+** Helper for: stat_request_response, protocol v2 STAT streams
+** Builds the STAT response for the file at file_index in response.
+**
+** returns 0 on success, -1 on error
+*/
+static int _build_stat_response(const Library *library, uint32_t file_index,
+                                uint32_t response[2]) {
+    char *file_path = _library_file_path(library, file_index);
+    if (file_path == NULL) {
+        return -1;
+    }
+    struct stat file_stat;
+    if (stat(file_path, &file_stat) == -1) {
+        perror("stat_request_response: stat");
+        free(file_path);
+        return -1;
+    }
+    free(file_path);
+
+    response[0] = htonl((uint32_t)file_stat.st_size);
+    response[1] = htonl((uint32_t)file_stat.st_mtime);
+    return 0;
+}
 
-    // Open the requested file
-    char *file_path = _join_path(library->path, library->files[file_index]);
-    FILE *file = fopen(file_path, "rb");
-    if (file == NULL) {
-        perror("fopen");
+
+int stat_request_response(const ClientSocket * client, const Library *library,
+                          uint8_t *post_req, int num_pr_bytes) {
+    long phase_start = stats_now_us();
+    int file_index = _read_file_index(client, library, post_req, num_pr_bytes);
+    if (file_index < 0) {
         return -1;
     }
 
-    // Calculate the file size
-    uint8_t file_size_buffer[4];
-    if (_load_file_size_into_buffer(file, file_size_buffer) < 0) {
-        fclose(file);
+    uint32_t response[2];
+    if (upstream != NULL) {
+        // An edge may not have the file, its upstream does
+        if (edge_stat(&edge, file_index, &response[0], &response[1]) == -1) {
+            return -1;
+        }
+        response[0] = htonl(response[0]);
+        response[1] = htonl(response[1]);
+    } else if (_build_stat_response(library, file_index, response) == -1) {
         return -1;
     }
-    // Send file size to client
-    if ((write_precisely(client->socket, file_size_buffer, 4)) < 0) {
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+    if (write_precisely(client->socket, response, sizeof(response)) < 0) {
         perror("write");
-        fclose(file);
+        return -1;
+    }
+    stats_bytes_sent(sizeof(response));
+    return 0;
+}
+
+
+/*
+** Helper for: stream_request_response, seek_request_response
+** Sends the size of the stream, then the head_len bytes of head, then len
+** bytes of the file from the reader's position on, in writes sized to the
+** connection (see stream_request_response).
+**
+** returns 0 on success, -1 on error, as when the file ends before len bytes
+*/
+static int _send_stream(const ClientSocket * client, FlightReader *reader, const uint8_t *head,
+                        uint32_t head_len, uint32_t len) {
+    ReadAhead ahead;
+    if (readahead_start(&ahead, reader, MIN(len, SIZER_MAX_SIZE)) == -1) {
         return -1;
     }
 
-    int curr_size = file_size_retrieve(file);
-    uint8_t data_chunk_buffer[STREAM_CHUNK_SIZE];
-    int curr_read_size = STREAM_CHUNK_SIZE;
-    int bytes_read;
-    while ((bytes_read = fread(data_chunk_buffer, sizeof(uint8_t), curr_read_size, file)) > 0) {
-        if (write_precisely(client->socket, data_chunk_buffer, bytes_read) < 0) {
+    // The size and head are queued, and leave with the first chunks of data
+    Writer writer;
+    writer_init(&writer, client->socket);
+    if (use_zerocopy) {
+        writer_enable_zerocopy(&writer);
+    }
+    uint32_t network_size = htonl(head_len + len);
+    writer_add_copy(&writer, &network_size, sizeof(uint32_t));
+    if (head_len > 0) {
+        writer_add(&writer, head, head_len);
+    }
+
+    SendSizer sizer;
+    sizer_init(&sizer, client->socket);
+
+    int result = 0;
+    int curr_size = len;
+    readahead_request(&ahead, min(sizer_next(&sizer), curr_size));
+    do {
+        // Only the wait for the batch, as the helper reads it meanwhile
+        long phase_start = stats_now_us();
+        uint8_t *batch;
+        int batch_read = readahead_take(&ahead, &batch);
+        stats_phase_done(STATS_PHASE_READ, phase_start);
+        if (batch_read <= 0) {
+            // The file shrank or can't be read, so the size sent can't be kept
+            // to: the connection is dropped rather than left waiting
+            result = -1;
+            break;
+        }
+        writer_add(&writer, batch, batch_read);
+        curr_size -= batch_read;
+        // The next batch is read while this one is sent
+        if (curr_size > 0) {
+            readahead_request(&ahead, min(sizer_next(&sizer), curr_size));
+        }
+        admission_throttle(writer.pending);
+        phase_start = stats_now_us();
+        int bytes_written = writer_flush(&writer);
+        stats_phase_done(STATS_PHASE_SEND, phase_start);
+        if (bytes_written < 0) {
             perror("write");
-            fclose(file);
+            result = -1;
+            break;
+        }
+        sizer_sent(&sizer, bytes_written);
+        stats_bytes_sent(bytes_written);
+    } while (curr_size > 0);
+
+    readahead_stop(&ahead);
+    return result;
+}
+
+
+/*
+** Helper for: stream_request_response
+** Streams the file at file_index through the edge, see as_edge.h: from its
+** cache like any file if it is there, and as it is fetched otherwise, in
+** writes sized to the connection all the same.
+**
+** returns 0 on success, -1 on error
+*/
+static int _edge_stream(const ClientSocket * client, const Library *library,
+                        uint32_t file_index, long phase_start) {
+    EdgeTrack track;
+    TRACE_BEGIN("open");
+    int result = edge_open_track(&edge, library, file_index, client->socket, &track);
+    TRACE_END("open");
+    if (result == -1) {
+        return -1;
+    }
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+
+    if (!track.fetching) {
+        FlightReader reader;
+        struct stat file_stat;
+        if (fstat(track.fd, &file_stat) == -1) {
+            perror("fstat");
+            edge_close_track(&track);
             return -1;
         }
-        curr_size = curr_size - curr_read_size;
-        if (curr_size <= 0) {
+        flight_open(flights, &reader, track.fd, &file_stat);
+        result = _send_stream(client, &reader, NULL, 0, track.size);
+        flight_close(&reader);
+        edge_close_track(&track);
+        return result;
+    }
+
+    uint8_t *buf = malloc(SIZER_MAX_SIZE);
+    if (buf == NULL) {
+        perror("_edge_stream: malloc");
+        edge_close_track(&track);
+        return -1;
+    }
+    Writer writer;
+    writer_init(&writer, client->socket);
+    uint32_t network_size = htonl(track.size);
+    writer_add_copy(&writer, &network_size, sizeof(uint32_t));
+    SendSizer sizer;
+    sizer_init(&sizer, client->socket);
+
+    uint32_t left = track.size;
+    while (left > 0) {
+        // Waiting for the upstream counts as reading
+        phase_start = stats_now_us();
+        ssize_t num = edge_read(&track, buf, min(sizer_next(&sizer), left));
+        stats_phase_done(STATS_PHASE_READ, phase_start);
+        if (num <= 0) {
+            // The client sees a short stream
+            result = -1;
+            break;
+        }
+        writer_add(&writer, buf, num);
+        left -= num;
+        admission_throttle(writer.pending);
+        phase_start = stats_now_us();
+        int bytes_written = writer_flush(&writer);
+        stats_phase_done(STATS_PHASE_SEND, phase_start);
+        if (bytes_written < 0) {
+            perror("write");
+            result = -1;
             break;
         }
-        curr_read_size = min(STREAM_CHUNK_SIZE, curr_size);
+        sizer_sent(&sizer, bytes_written);
+        stats_bytes_sent(bytes_written);
     }
-    // Close the file and return success
-    fclose(file);
-    free(file_path);
+    // An empty file's size is all there is to send
+    if (writer.pending > 0 && result == 0 && writer_flush(&writer) < 0) {
+        perror("write");
+        result = -1;
+    }
+    free(buf);
+    edge_close_track(&track);
+    return result;
+}
+
+
+/*
+** Stream a file from the library to the client. The file is streamed in writes
+** sized to the connection, see as_sizer.h. The client will be able to request
+** a specific file by its index in the library.
+**
+** The 32-bit unsigned network byte-order integer file_index will be read
+** from the client_socket, but will consider num_pr_bytes (must be <= uint32_t)
+** from post_req first, then:
+**   The stream will be sent in the following format:
+**     - the first 4 bytes (32-bits) will be the file size in network byte-order
+**     - the rest of the stream will be the file's data, written in as many
+**       bytes at a time as the connection drains in SIZER_TARGET_MS, between
+**       SIZER_MIN_SIZE and SIZER_MAX_SIZE, or less when fewer remain.
+**
+** If the file is successfully transported to the client over the client_socket,
+** return 0. Otherwise, return -1.
+ */
+int stream_request_response(const ClientSocket * client, const Library *library,
+                            uint8_t *post_req, int num_pr_bytes) {
+    long phase_start = stats_now_us();
+    TRACE_BEGIN("parse");
+    int file_index = _read_file_index(client, library, post_req, num_pr_bytes);
+    TRACE_END("parse");
+    if (file_index < 0) {
+        return -1;
+    }
+
+    if (upstream != NULL) {
+        return _edge_stream(client, library, file_index, phase_start);
+    }
+
+    FlightReader reader;
+    TRACE_BEGIN("open");
+    int file_size = _open_stream_file(library, file_index, flights, &reader);
+    TRACE_END("open");
+    if (file_size < 0) {
+        return -1;
+    }
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+    int result = _send_stream(client, &reader, NULL, 0, file_size);
+    _close_stream_file(&reader);
+    return result;
+}
+
+
+/*
+** Helper for: seek_request_response, protocol v2 SEEK streams
+** Opens the file at the index in the SEEK_ARGS_SIZE bytes of args, and finds
+** where to start it for the time that follows, with the index's table of the
+** file if it is still of this very file, and with a table of its own if not.
+**
+** returns 0 on success, with the file open, -1 on error with *error set to
+** the reason
+*/
+static int _open_seek(const Library *library, const uint8_t *args, FlightReader *reader,
+                      SeekStart *start, const char **error) {
+    uint32_t file_index = convert_buffer_to_int((uint8_t *)args);
+    uint32_t ms = convert_buffer_to_int((uint8_t *)args + sizeof(uint32_t));
+    if (file_index >= library->num_files) {
+        *error = "Invalid file index";
+        return -1;
+    }
+    // Not through a flight: one far from the seek would be read up to it
+    int file_size = _open_stream_file(library, file_index, NULL, reader);
+    struct stat file_stat;
+    if (file_size < 0 || fstat(reader->fd, &file_stat) == -1) {
+        if (file_size >= 0) {
+            _close_stream_file(reader);
+        }
+        *error = "Cannot open file";
+        return -1;
+    }
+    SeekTable own = {0};
+    const SeekTable *table = file_index < seek_index.num_tables
+                             ? &seek_index.tables[file_index] : &own;
+    if (!table->built || table->size != (uint32_t)file_stat.st_size ||
+        table->mtime != (uint32_t)file_stat.st_mtime) {
+        table = &own;
+        seek_table_build(&own, reader->fd, &file_stat);
+    }
+    int result = seek_prepare(table, reader->fd, file_size, ms, start);
+    seek_table_free(&own);
+    if (result == -1) {
+        _close_stream_file(reader);
+        *error = "Cannot seek file";
+        return -1;
+    }
+    reader->position = start->offset;
+    return 0;
+}
+
+
+int seek_request_response(const ClientSocket * client, const Library *library,
+                          LineReader *line_reader) {
+    long phase_start = stats_now_us();
+    uint8_t args[SEEK_ARGS_SIZE];
+    if (_take_request_args(client, line_reader, args, SEEK_ARGS_SIZE) == -1) {
+        return -1;
+    }
+    FlightReader reader;
+    SeekStart start;
+    const char *error;
+    TRACE_BEGIN("open");
+    int result = _open_seek(library, args, &reader, &start, &error);
+    TRACE_END("open");
+    if (result == -1) {
+        ERR_PRINT("seek_request_response: %s\n", error);
+        return -1;
+    }
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+    result = _send_stream(client, &reader, start.head, start.head_len, start.end - start.offset);
+    free(start.head);
+    _close_stream_file(&reader);
+    return result;
+}
+
+
+/*
+** Helper for: waveform_request_response, protocol v2 WAVEFORM streams
+** Builds the WAVEFORM response to the args_len bytes of args that follow the
+** request, from the index's summary of the file if it is still of this very
+** file, and from a summary of its own if not.
+**
+** returns the heap-allocated response, of *len bytes, NULL on error with
+** *error set to the reason
+*/
+static uint8_t *_build_waveform_response(const Library *library, const uint8_t *args,
+                                         uint32_t args_len, uint32_t *len, const char **error) {
+    if (args_len != WAVE_ARGS_SIZE) {
+        *error = "Malformed waveform";
+        return NULL;
+    }
+    uint32_t file_index = convert_buffer_to_int((uint8_t *)args);
+    uint32_t num_buckets = args[4] << 8 | args[5];
+    if (file_index >= library->num_files) {
+        *error = "Invalid file index";
+        return NULL;
+    }
+    char *path = _library_file_path(library, file_index);
+    int fd = path == NULL ? -1 : open(path, O_RDONLY);
+    free(path);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        *error = "Cannot open file";
+        return NULL;
+    }
+    WaveSummary own = {0};
+    const WaveSummary *summary = file_index < wave_index.num_summaries
+                                 ? &wave_index.summaries[file_index] : &own;
+    if (!summary->built || summary->size != (uint32_t)file_stat.st_size ||
+        summary->mtime != (uint32_t)file_stat.st_mtime) {
+        summary = &own;
+        wave_analyze(&own, fd, &file_stat);
+    }
+    close(fd);
+    uint8_t *response = NULL;
+    if (!summary->built) {
+        *error = "Cannot analyze file";
+    } else if ((response = wave_response(summary, num_buckets, len)) == NULL) {
+        *error = "Out of memory";
+    }
+    wave_summary_free(&own);
+    return response;
+}
+
+
+int waveform_request_response(const ClientSocket * client, const Library *library,
+                              LineReader *reader) {
+    long phase_start = stats_now_us();
+    uint8_t args[WAVE_ARGS_SIZE];
+    if (_take_request_args(client, reader, args, WAVE_ARGS_SIZE) == -1) {
+        return -1;
+    }
+    uint32_t len;
+    const char *error;
+    uint8_t *response = _build_waveform_response(library, args, WAVE_ARGS_SIZE, &len, &error);
+    stats_phase_done(STATS_PHASE_PREPARE, phase_start);
+    if (response == NULL) {
+        ERR_PRINT("waveform_request_response: %s\n", error);
+        return -1;
+    }
+    phase_start = stats_now_us();
+    int result = write_precisely(client->socket, response, len);
+    free(response);
+    if (result < 0) {
+        perror("write");
+        return -1;
+    }
+    stats_phase_done(STATS_PHASE_SEND, phase_start);
+    stats_bytes_sent(len);
     return 0;
 }
 
 
-static Library make_library(const char *path){
+static Library make_library(const char **roots, int num_roots){
     Library library;
-    library.path = path;
+    library.path = roots[0];
     library.num_files = 0;
     library.files = NULL;
     library.name = "server";
+    library.roots = roots;
+    library.num_roots = num_roots;
+    library.file_roots = NULL;
 
     printf("Initializing library\n");
-    printf("Library path: %s\n", library.path);
+    for (int i = 0; i < num_roots; i++) {
+        printf("Library path: %s\n", roots[i]);
+    }
 
     return library;
 }
 
 
-static void _wait_for_children(pid_t **client_conn_pids, int *num_connected_clients, uint8_t immediate) {
+static void _wait_for_children(ClientProcess **clients, int *num_connected_clients, uint8_t immediate) {
     int status;
     for (int i = 0; i < *num_connected_clients; i++) {
         int options = immediate ? WNOHANG : 0;
-        if (waitpid((*client_conn_pids)[i], &status, options) > 0) {
+        if (waitpid((*clients)[i].pid, &status, options) > 0) {
             if (WIFEXITED(status)) {
-                printf("Client process %d terminated\n", (*client_conn_pids)[i]);
+                printf("Client process %d terminated\n", (*clients)[i].pid);
                 if (WEXITSTATUS(status) != 0) {
                     fprintf(stderr, "Client process %d exited with status %d\n",
-                            (*client_conn_pids)[i], WEXITSTATUS(status));
+                            (*clients)[i].pid, WEXITSTATUS(status));
                 }
             } else {
                 fprintf(stderr, "Client process %d terminated abnormally\n",
-                        (*client_conn_pids)[i]);
+                        (*clients)[i].pid);
             }
+            admission_release(admission, (*clients)[i].slot);
 
             for (int j = i; j < *num_connected_clients - 1; j++) {
-                (*client_conn_pids)[j] = (*client_conn_pids)[j + 1];
+                (*clients)[j] = (*clients)[j + 1];
             }
 
             (*num_connected_clients)--;
-            *client_conn_pids = (pid_t *)realloc(*client_conn_pids,
-                                                 (*num_connected_clients)
-                                                 * sizeof(pid_t));
+            *clients = (ClientProcess *)realloc(*clients,
+                                                (*num_connected_clients)
+                                                * sizeof(ClientProcess));
+            // The next client moved into this index
+            i--;
         }
     }
 }
 
+
 /*
-** Create a server socket and listen for connections
-**
-** port: the port number to listen on.
-** 
-** On success, returns the file descriptor of the socket.
-** On failure, return -1.
+** Starts an indexer, if the library was scanned since the last one started
+** and none is running: a helper process that builds the seek tables and
+** waveform summaries the library needs, and saves them. Walking and decoding
+** whole files would hold up connections if the server did it between them.
+** The indexer exits with INDEXER_SAVED_SEEK and INDEXER_SAVED_WAVE set for
+** the indexes it saved.
 */
-static int initialize_server_socket(int port) {
+static void _start_indexer(const Library *library, int incoming_connections) {
+    if (!index_wanted || indexer != 0 || upstream != NULL) {
+        return;
+    }
+    // Or what the server printed so far would be printed again at its exit
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("_start_indexer: fork");
+        return;
+    }
+    if (pid == 0) {
+        TRACE_FORKED();
+        signal(SIGHUP, SIG_DFL);
+        close(incoming_connections);
+        if (handoff_fd >= 0) {
+            close(handoff_fd);
+        }
+        int saved = 0;
+        if (seek_index_build(&seek_index, library) == 1) {
+            saved |= INDEXER_SAVED_SEEK;
+        }
+        if (wave_index_build(&wave_index, library) == 1) {
+            saved |= INDEXER_SAVED_WAVE;
+        }
+        exit(saved);
+    }
+    indexer = pid;
+    index_wanted = 0;
+}
+
+
+/*
+** Reaps the indexer if it exited, and loads the indexes it saved in place of
+** the server's. With stop set, it is stopped first, as what it didn't save
+** yet is only built again by the next one.
+*/
+static void _reap_indexer(const Library *library, uint8_t stop) {
+    int status;
+    if (indexer == 0) {
+        return;
+    }
+    if (stop) {
+        kill(indexer, SIGTERM);
+    }
+    if (waitpid(indexer, &status, stop ? 0 : WNOHANG) <= 0) {
+        return;
+    }
+    indexer = 0;
+    if (stop) {
+        return;
+    }
+    if (!WIFEXITED(status)) {
+        fprintf(stderr, "The indexer terminated abnormally\n");
+        return;
+    }
+    if ((WEXITSTATUS(status) & INDEXER_SAVED_SEEK) &&
+        seek_index_update(&seek_index, library, 1) < 0) {
+        ERR_PRINT("Could not load the seek index, seeks will build their own tables\n");
+    }
+    if ((WEXITSTATUS(status) & INDEXER_SAVED_WAVE) &&
+        wave_index_update(&wave_index, library, 1) < 0) {
+        ERR_PRINT("Could not load the waveform index, waveforms will be analyzed on request\n");
+    }
+}
+
+
+/*
+** Sends the client a RESPONSE_BUSY, without blocking, and stops reading from
+** it. Whatever it already sent is read and dropped, so that closing the socket
+** doesn't reset the connection before the response arrives.
+*/
+static void _send_busy(int socket) {
+    send(socket, RESPONSE_BUSY END_OF_MESSAGE_TOKEN, 6, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(socket, SHUT_WR);
+    char discard[REQUEST_BUFFER_SIZE];
+    while (recv(socket, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+}
+
+
+/*
+** Sends the client a RESPONSE_UNSUPPORTED, so that it needn't wait for a
+** response to a request it can't have.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_unsupported(int socket) {
+    if (write_precisely(socket, RESPONSE_UNSUPPORTED END_OF_MESSAGE_TOKEN, 6) != 6) {
+        perror("_send_unsupported");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+** SIGHUP handler, asking the server to hand its listening socket off to a
+** successor started with its own arguments (see as_handoff.h).
+*/
+static void _request_upgrade(int signal) {
+    upgrade_requested = 1;
+}
+
+
+/*
+** Starts a successor to take the listening socket over, see as_handoff.h. It
+** runs with the whitespace-separated arguments in args, or with the server's
+** own if there are none.
+*/
+static void _start_successor(char *args) {
+    if (handoff_fd >= 0) {
+        printf("Already starting a successor, process %d\n", successor);
+        return;
+    }
+    char *argv[SUCCESSOR_MAX_ARGS + 2] = {server_argv[0]};
+    int argc = 1;
+    char *arg = args != NULL ? strtok(args, " \t\n") : NULL;
+    while (arg != NULL && argc <= SUCCESSOR_MAX_ARGS) {
+        argv[argc++] = arg;
+        arg = strtok(NULL, " \t\n");
+    }
+    handoff_fd = handoff_start(argc > 1 ? argv : server_argv, &successor);
+    if (handoff_fd >= 0) {
+        printf("Started a successor, process %d\n", successor);
+    }
+}
+
+/*
+** Create a server socket and listen for connections
+**
+** port: the port number to listen on.
+** 
+** On success, returns the file descriptor of the socket.
+** On failure, return -1.
+*/
+static int initialize_server_socket(int port) {
     struct sockaddr_in server;
     init_server_addr(port, &server);
     int listen_soc = set_up_server_socket(&server, MAX_PENDING);
@@ -400,44 +1145,195 @@ static int initialize_server_socket(int port) {
 
 }
 
-int run_server(int port, const char *library_directory){
-    Library library = make_library(library_directory);
-    if (scan_library(&library) < 0) {
+int run_server(int port, const char **library_directories, int num_libraries){
+    Library library = make_library(library_directories, num_libraries);
+    if (upstream != NULL) {
+        if (edge_open(&edge, upstream, library.path, edge_cache_mb * 1048576) == -1 ||
+            edge_list(&edge, &library) < 0) {
+            ERR_PRINT("Error listing the library of %s\n", upstream);
+            return -1;
+        }
+        printf("Serving the %u files of %s\n", library.num_files, upstream);
+    } else if (scan_library(&library) < 0) {
         ERR_PRINT("Error scanning library\n");
         return -1;
     }
+    search_index_init(&search_index);
+    if (search_index_update(&search_index, &library) < 0) {
+        ERR_PRINT("Could not index the library, searches will find nothing\n");
+    }
+    if (browse_tree_build(&browse_tree, &library) < 0) {
+        ERR_PRINT("Could not build the library's tree, browsing will find nothing\n");
+    }
+    // With the tables saved by the last run, so only changed files are built.
+    // An edge has no files to build them from, nor serves SEEK or WAVEFORM
+    seek_index_init(&seek_index);
+    if (upstream == NULL && seek_index_update(&seek_index, &library, 1) < 0) {
+        ERR_PRINT("Could not index the library, seeks will build their own tables\n");
+    }
+    wave_index_init(&wave_index);
+    if (upstream == NULL && wave_index_update(&wave_index, &library, 1) < 0) {
+        ERR_PRINT("Could not index the library, waveforms will be analyzed on request\n");
+    }
 
-    int num_connected_clients = 0;
-    pid_t *client_conn_pids = NULL;
+    if (station_playlist != NULL &&
+        station_start(&station, library.path, station_playlist) < 0) {
+        ERR_PRINT("Error starting the station\n");
+        _free_library(&library);
+        return -1;
+    }
 
-	int incoming_connections = initialize_server_socket(port);
+    if ((flights = flights_create(coalesce_streams)) == NULL) {
+        station_stop(&station);
+        _free_library(&library);
+        return -1;
+    }
+    if ((server_stats = stats_create()) == NULL) {
+        flights_destroy(flights);
+        station_stop(&station);
+        _free_library(&library);
+        return -1;
+    }
+    if ((admission = admission_create(&admission_limits)) == NULL) {
+        stats_destroy(server_stats);
+        flights_destroy(flights);
+        station_stop(&station);
+        _free_library(&library);
+        return -1;
+    }
+    // The parent only counts the connections it refuses
+    stats_bind(server_stats);
+    // So the report says which directory is on which device
+    for (uint32_t i = 0; i < library.num_roots; i++) {
+        struct stat root_stat;
+        if (stat(library.roots[i], &root_stat) == 0) {
+            stats_device(root_stat.st_dev, library.roots[i]);
+        }
+    }
+
+    int num_connected_clients = 0;
+    ClientProcess *clients = NULL;
+
+    // Ready to serve, so a predecessor can hand its socket over
+    int incoming_connections = -1;
+    if (handoff_fd >= 0) {
+        incoming_connections = handoff_receive_listener(handoff_fd);
+        close(handoff_fd);
+        handoff_fd = -1;
+        if (incoming_connections >= 0) {
+            printf("Took the listening socket over from the predecessor\n");
+        }
+    }
+    if (incoming_connections == -1) {
+        incoming_connections = initialize_server_socket(port);
+    }
 	if (incoming_connections == -1) {
 		return -1;	
 	}
-	
+    // Successors get it over the handoff socket, not by inheritance
+    fcntl(incoming_connections, F_SETFD, FD_CLOEXEC);
+
+    struct sigaction upgrade_action;
+    memset(&upgrade_action, 0, sizeof(upgrade_action));
+    upgrade_action.sa_handler = _request_upgrade;
+    sigaction(SIGHUP, &upgrade_action, NULL);
+
     int maxfd = incoming_connections;
     fd_set incoming;
     SET_SERVER_FD_SET(incoming, incoming_connections);
     int num_intervals_without_scan = 0;
+    uint8_t handed_off = 0;
 
     while(1) {
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            _start_successor(NULL);
+            if (handoff_fd >= 0) {
+                FD_SET(handoff_fd, &incoming);
+                maxfd = MAX(incoming_connections, handoff_fd);
+            }
+        }
         if (num_intervals_without_scan >= LIBRARY_SCAN_INTERVAL) {
-            if (scan_library(&library) < 0) {
+            if (upstream != NULL) {
+                // The upstream may be away for a while, the edge serves what it had
+                if (edge_list(&edge, &library) < 0) {
+                    ERR_PRINT("Could not list the library of %s, keeping the last list\n",
+                              upstream);
+                }
+            } else if (scan_library(&library) < 0) {
                 fprintf(stderr, "Error scanning library\n");
                 return 1;
             }
+            if (search_index_update(&search_index, &library) < 0) {
+                ERR_PRINT("Could not index the library, searches will find nothing\n");
+            }
+            browse_tree_free(&browse_tree);
+            if (browse_tree_build(&browse_tree, &library) < 0) {
+                ERR_PRINT("Could not build the library's tree, browsing will find nothing\n");
+            }
+            if (upstream == NULL && seek_index_update(&seek_index, &library, 0) < 0) {
+                ERR_PRINT("Could not index the library, seeks will build their own tables\n");
+            }
+            if (upstream == NULL && wave_index_update(&wave_index, &library, 0) < 0) {
+                ERR_PRINT("Could not index the library, waveforms will be analyzed on request\n");
+            }
+            index_wanted = 1;
             num_intervals_without_scan = 0;
         }
 
+        _reap_indexer(&library, 0);
+        _start_indexer(&library, incoming_connections);
         struct timeval select_timeout = SELECT_TIMEOUT;
         if(select(maxfd + 1, &incoming, NULL, NULL, &select_timeout) < 0){
+            // A signal, such as a request for a trace dump
+            if (errno == EINTR) {
+                SET_SERVER_FD_SET(incoming, incoming_connections);
+                if (handoff_fd >= 0) {
+                    FD_SET(handoff_fd, &incoming);
+                }
+                continue;
+            }
             perror("run_server");
             exit(1);
         }
 
+        if (handoff_fd >= 0 && FD_ISSET(handoff_fd, &incoming)) {
+            int status = handoff_send_listener(handoff_fd, incoming_connections);
+            if (status == 1) {
+                printf("Handed the listening socket off to process %d\n", successor);
+                handed_off = 1;
+                break;
+            }
+            if (status == -1) {
+                ERR_PRINT("Successor %d failed, carrying on\n", successor);
+                close(handoff_fd);
+                handoff_fd = -1;
+                kill(successor, SIGTERM);
+                waitpid(successor, NULL, 0);
+            }
+        }
+
         if (FD_ISSET(incoming_connections, &incoming)) {
+            TRACE_BEGIN("accept");
             ClientSocket client_socket = accept_connection(incoming_connections);
 
+            const char *reason;
+            int slot = admission_admit(admission, client_socket.addr.sin_addr.s_addr, &reason);
+            if (slot == -1) {
+                // Connections that ended may not have been reaped yet
+                _wait_for_children(&clients, &num_connected_clients, 1);
+                slot = admission_admit(admission, client_socket.addr.sin_addr.s_addr, &reason);
+            }
+            if (slot == -1) {
+                printf("Refused the connection from %s: %s\n",
+                       inet_ntoa(client_socket.addr.sin_addr), reason);
+                _send_busy(client_socket.socket);
+                close(client_socket.socket);
+                stats_refused();
+                TRACE_END("accept");
+                goto next_interval;
+            }
+
             pid_t pid = fork();
             if(pid == -1){
                 perror("run_server");
@@ -445,34 +1341,84 @@ int run_server(int port, const char *library_directory){
             }
             // child process
             if(pid == 0){
+                TRACE_FORKED();
+                signal(SIGHUP, SIG_DFL);
                 close(incoming_connections);
-                free(client_conn_pids);
+                if (handoff_fd >= 0) {
+                    close(handoff_fd);
+                }
+                free(clients);
+                stats_bind(server_stats);
+                admission_bind(admission, slot);
                 int result = handle_client(&client_socket, &library);
                 _free_library(&library);
                 close(client_socket.socket);
                 return result;
             }
             close(client_socket.socket);
+            TRACE_END("accept");
             num_connected_clients++;
-            client_conn_pids = (pid_t *)realloc(client_conn_pids,
+            clients = (ClientProcess *)realloc(clients,
                                                (num_connected_clients)
-                                               * sizeof(pid_t));
-            client_conn_pids[num_connected_clients - 1] = pid;
+                                               * sizeof(ClientProcess));
+            clients[num_connected_clients - 1].pid = pid;
+            clients[num_connected_clients - 1].slot = slot;
         }
         if (FD_ISSET(STDIN_FILENO, &incoming)) {
-            if (getchar() == 'q') break;
+            int command = getchar();
+            if (command == 'q') break;
+            if (command == 's') {
+                stats_print(server_stats);
+            }
+            if (command == 'u') {
+                char args[REQUEST_BUFFER_SIZE];
+                _start_successor(fgets(args, sizeof(args), stdin));
+            }
         }
 
+next_interval:
         num_intervals_without_scan++;
         SET_SERVER_FD_SET(incoming, incoming_connections);
+        if (handoff_fd >= 0) {
+            FD_SET(handoff_fd, &incoming);
+            maxfd = MAX(incoming_connections, handoff_fd);
+        }
 
         // Immediate return wait for client processes
-        _wait_for_children(&client_conn_pids, &num_connected_clients, 1);
+        _wait_for_children(&clients, &num_connected_clients, 1);
     }
 
-    printf("Quitting server\n");
     close(incoming_connections);
-    _wait_for_children(&client_conn_pids, &num_connected_clients, 0);
+    _reap_indexer(&library, 1);
+    if (handoff_fd >= 0) {
+        // A successor still starting up listens on its own
+        close(handoff_fd);
+    }
+    if (handed_off) {
+        // The station's listeners would never finish, they can tune in again
+        station_stop(&station);
+        printf("Draining %d client processes\n", num_connected_clients);
+    } else {
+        printf("Quitting server\n");
+    }
+    _wait_for_children(&clients, &num_connected_clients, 0);
+    admission_destroy(admission);
+    station_stop(&station);
+    flights_print_stats(flights);
+    flights_destroy(flights);
+    stats_print(server_stats);
+    stats_destroy(server_stats);
+    struct rusage children_usage;
+    if (getrusage(RUSAGE_CHILDREN, &children_usage) == 0) {
+        printf("Client processes did %ld block reads\n", children_usage.ru_inblock);
+    }
+    search_index_free(&search_index);
+    browse_tree_free(&browse_tree);
+    seek_index_free(&seek_index);
+    wave_index_free(&wave_index);
+    if (upstream != NULL) {
+        edge_close(&edge);
+    }
     _free_library(&library);
     return 0;
 }
@@ -492,9 +1438,9 @@ static uint8_t _is_file_extension_supported(const char *filename){
 }
 
 
-static int _depth_scan_library(Library *library, char *current_path){
+static int _depth_scan_library(Library *library, uint32_t root, char *current_path){
 
-    char *path_in_lib = _join_path(library->path, current_path);
+    char *path_in_lib = _join_path(library->roots[root], current_path);
     if (path_in_lib == NULL) {
         return -1;
     }
@@ -513,7 +1459,10 @@ static int _depth_scan_library(Library *library, char *current_path){
             library->files = (char **)realloc(library->files,
                                               (library->num_files + 1)
                                               * sizeof(char *));
-            if (library->files == NULL) {
+            library->file_roots = (uint32_t *)realloc(library->file_roots,
+                                                      (library->num_files + 1)
+                                                      * sizeof(uint32_t));
+            if (library->files == NULL || library->file_roots == NULL) {
                 perror("_depth_scan_library");
                 return -1;
             }
@@ -523,6 +1472,7 @@ static int _depth_scan_library(Library *library, char *current_path){
                 perror("scan_library");
                 return -1;
             }
+            library->file_roots[library->num_files] = root;
             #ifdef DEBUG
             printf("Found file: %s\n", library->files[library->num_files]);
             #endif
@@ -542,7 +1492,7 @@ static int _depth_scan_library(Library *library, char *current_path){
             printf("Library scan descending into directory: %s\n", new_path);
             #endif
 
-            int ret_code = _depth_scan_library(library, new_path);
+            int ret_code = _depth_scan_library(library, root, new_path);
             free(new_path);
             if (ret_code < 0) {
                 return -1;
@@ -555,6 +1505,63 @@ static int _depth_scan_library(Library *library, char *current_path){
 }
 
 
+typedef struct library_entry {
+    char *file;
+    uint32_t root;
+} LibraryEntry;
+
+
+/*
+** Helper for: _merge_roots
+** Orders library entries by path, then by root, earlier roots first.
+*/
+static int _compare_entries(const void *a, const void *b) {
+    const LibraryEntry *entry_a = a;
+    const LibraryEntry *entry_b = b;
+    int result = strcmp(entry_a->file, entry_b->file);
+    if (result != 0) {
+        return result;
+    }
+    return (entry_a->root > entry_b->root) - (entry_a->root < entry_b->root);
+}
+
+
+/*
+** Helper for: scan_library
+** Sorts the files of every root by path, and drops those shadowed by the same
+** path in an earlier root.
+**
+** returns 0 on success, -1 on error
+*/
+static int _merge_roots(Library *library) {
+    LibraryEntry *entries = malloc(MAX(library->num_files, 1) * sizeof(LibraryEntry));
+    if (entries == NULL) {
+        perror("scan_library");
+        return -1;
+    }
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        entries[i] = (LibraryEntry){library->files[i], library->file_roots[i]};
+    }
+    qsort(entries, library->num_files, sizeof(LibraryEntry), _compare_entries);
+    uint32_t num_files = 0;
+    for (uint32_t i = 0; i < library->num_files; i++) {
+        if (num_files > 0 && strcmp(library->files[num_files - 1], entries[i].file) == 0) {
+            #ifdef DEBUG
+            printf("Shadowed file: %s%s\n", library->roots[entries[i].root], entries[i].file);
+            #endif
+            free(entries[i].file);
+            continue;
+        }
+        library->files[num_files] = entries[i].file;
+        library->file_roots[num_files] = entries[i].root;
+        num_files++;
+    }
+    library->num_files = num_files;
+    free(entries);
+    return 0;
+}
+
+
 // This function is implemented recursively and uses realloc to grow the files array
 // as it finds more files in the library. It ignores MAX_FILES.
 int scan_library(Library *library) {
@@ -569,7 +1576,24 @@ int scan_library(Library *library) {
     #ifdef DEBUG
     printf("Scanning library\n");
     #endif
-    int result = _depth_scan_library(library, "");
+    // A library made of its path alone, such as a benchmark's, has it as its root
+    const char *path_root[] = {library->path};
+    if (library->roots == NULL) {
+        library->roots = path_root;
+        library->num_roots = 1;
+    }
+    int result = 0;
+    for (uint32_t root = 0; root < library->num_roots && result == 0; root++) {
+        result = _depth_scan_library(library, root, "");
+    }
+    // In path order, which CLIST responses are sent in anyway
+    if (result == 0) {
+        result = _merge_roots(library);
+    }
+    if (library->roots == path_root) {
+        library->roots = NULL;
+        library->num_roots = 0;
+    }
     #ifdef DEBUG
     printf("vvvv ----------------------------------- vvvv\n");
     #endif
@@ -577,89 +1601,908 @@ int scan_library(Library *library) {
 }
 
 
+int ustream_request_response(const ClientSocket * client, const Library *library,
+                             uint8_t *post_req, int num_pr_bytes) {
+    uint8_t args[6];
+    if (num_pr_bytes > 6) {
+        fprintf(stderr, "Error: Invalid number of num_pr_bytes\n");
+        return -1;
+    }
+    memcpy(args, post_req, num_pr_bytes);
+    if (num_pr_bytes < 6 &&
+        read_precisely(client->socket, args + num_pr_bytes, 6 - num_pr_bytes) != 6 - num_pr_bytes) {
+        perror("read");
+        return -1;
+    }
+    int file_index = _read_file_index(client, library, args, 4);
+    if (file_index < 0) {
+        return -1;
+    }
+    uint16_t udp_port;
+    memcpy(&udp_port, args + 4, sizeof(uint16_t));
+
+    char *file_path = _library_file_path(library, file_index);
+    if (file_path == NULL) {
+        return -1;
+    }
+    int fd = open(file_path, O_RDONLY);
+    free(file_path);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        perror("ustream_request_response: open");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // Datagrams go from a socket of our own to the client's port
+    struct sockaddr_in udp_addr = client->addr;
+    udp_addr.sin_port = udp_port;
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_fd == -1 || connect(udp_fd, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) == -1) {
+        perror("ustream_request_response: socket");
+        if (udp_fd != -1) {
+            close(udp_fd);
+        }
+        close(fd);
+        return -1;
+    }
+
+    uint32_t byte_rate = udp_byte_rate(fd);
+    uint32_t response[2] = {htonl((uint32_t)file_stat.st_size), htonl(byte_rate)};
+    UdpStats stats;
+    memset(&stats, 0, sizeof(UdpStats));
+    int result = -1;
+    if (write_precisely(client->socket, response, sizeof(response)) >= 0) {
+        result = udp_send_file(udp_fd, fd, file_stat.st_size, byte_rate, udp_drop_percent, &stats);
+    }
+    printf("UDP stream of %s to %s:%d: %u datagrams sent, %u retransmitted, %u dropped\n",
+           library->files[file_index], inet_ntoa(udp_addr.sin_addr), ntohs(udp_port),
+           stats.sent, stats.retransmitted, stats.dropped);
+
+    close(udp_fd);
+    close(fd);
+    return result;
+}
+
+
+int station_request_response(const ClientSocket * client) {
+    uint32_t size = htonl(station.ring != NULL ? STATION_LIVE_SIZE : 0);
+    if (write_precisely(client->socket, &size, sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+    if (station.ring == NULL) {
+        return 0;
+    }
+
+    StationListenerStats stats;
+    memset(&stats, 0, sizeof(StationListenerStats));
+    int result = station_listen(&station, client->socket, &stats);
+    stats_bytes_sent(stats.bytes_sent);
+    printf("Station listener on %s:%d %s after %llu KiB, skipped forward %u times (%llu KiB)\n",
+           inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port),
+           stats.dropped ? "dropped for stalling" : "left",
+           (unsigned long long)stats.bytes_sent / 1024, stats.skips,
+           (unsigned long long)stats.bytes_skipped / 1024);
+    return result;
+}
+
+
+/*
+** Helper for: stats_request_response, protocol v2 STATS streams
+** Builds the STATS response, the report's size followed by the report.
+**
+** returns the heap-allocated response, of *len bytes, NULL on error
+*/
+static uint8_t *_build_stats_response(int *len) {
+    int report_len;
+    char *report = stats_format(server_stats, &report_len);
+    if (report == NULL) {
+        return NULL;
+    }
+    uint8_t *response = malloc(sizeof(uint32_t) + report_len);
+    if (response == NULL) {
+        perror("_build_stats_response");
+        free(report);
+        return NULL;
+    }
+    uint32_t network_report_len = htonl(report_len);
+    memcpy(response, &network_report_len, sizeof(uint32_t));
+    memcpy(response + sizeof(uint32_t), report, report_len);
+    free(report);
+    *len = sizeof(uint32_t) + report_len;
+    return response;
+}
+
+
+int stats_request_response(const ClientSocket * client) {
+    int len;
+    uint8_t *response = _build_stats_response(&len);
+    if (response == NULL) {
+        return -1;
+    }
+    int result = write_precisely(client->socket, response, len);
+    free(response);
+    if (result < 0) {
+        perror("write");
+        return -1;
+    }
+    stats_bytes_sent(len);
+    return 0;
+}
+
+
+/*
+** Protocol v2 streams
+** -------------------
+** Every request made over a v2 connection opens a stream, which is answered
+** with DATA frames carrying exactly the bytes the v1 response would have. The
+** start of the response is built up front in head: the whole LIST, CLIST,
+** SEARCH, BROWSE, WAVEFORM or STAT response, or the size of a STREAMed file,
+** whose data then follows from file, or the size and header of a SEEK, whose
+** file then follows from its start. Chunks of the file that are not cached
+** are read by the worker of its disk (see as_disk.h), and the stream waits
+** until they are, leaving the connection to the other streams.
+*/
+typedef struct v2_stream {
+    uint32_t id;
+    uint32_t window;
+    uint8_t *head;
+    uint32_t head_len;
+    uint32_t head_sent;
+    uint8_t has_file;
+    uint8_t admitted;   // counts as one of the address's streams
+    FlightReader file;
+    uint32_t file_remaining;
+    uint8_t *chunk;     // file data of the frame being sent
+    DiskMap map;        // of file, to tell whether chunks are cached
+    DiskRead read;      // of the next chunk, by its disk's worker
+    uint8_t reading;    // read is queued or being made
+    uint8_t waiting;    // on its disk, for read or room in its queue
+    StatsRequest request;
+    long started_us;
+    struct v2_stream *next;
+} V2Stream;
+
+
+static void _v2_free_stream(V2Stream *stream) {
+    if (stream->reading) {
+        disk_cancel(&stream->read);
+    }
+    if (stream->has_file) {
+        disk_unmap(&stream->map);
+        _close_stream_file(&stream->file);
+    }
+    if (stream->admitted) {
+        admission_stream_end();
+    }
+    free(stream->head);
+    free(stream->chunk);
+    free(stream);
+}
+
+
+static uint8_t _is_request(const uint8_t *name, size_t name_len, const char *request) {
+    return name_len == strlen(request) && memcmp(name, request, name_len) == 0;
+}
+
+
+/*
+** Helper for: handle_client_v2
+** Opens a stream for the v1 request in the len bytes of payload.
+**
+** returns the new stream, NULL on error with *error set to the reason
+*/
+static V2Stream *_v2_open_stream(const Library *library, uint32_t id, const uint8_t *payload,
+                                 uint32_t len, const char **error) {
+    V2Stream *stream = calloc(1, sizeof(V2Stream));
+    if (stream == NULL) {
+        perror("_v2_open_stream");
+        *error = "Out of memory";
+        return NULL;
+    }
+    stream->id = id;
+    stream->window = V2_INITIAL_WINDOW;
+    stream->request = STATS_UNKNOWN;
+    stream->started_us = stats_now_us();
+
+    const char *crlf = find_crlf((const char *)payload, len);
+    if (crlf == NULL) {
+        *error = "Malformed request";
+        goto error;
+    }
+    size_t name_len = (const uint8_t *)crlf - payload;
+    const uint8_t *args = payload + name_len + 2;
+    size_t args_len = len - name_len - 2;
+
+    if (_is_request(payload, name_len, REQUEST_LIST)) {
+        stream->request = STATS_LIST;
+        int head_len;
+        stream->head = (uint8_t *)_build_list_response(library, &head_len);
+        if (stream->head == NULL) {
+            *error = "Out of memory";
+            goto error;
+        }
+        stream->head_len = head_len;
+        goto opened;
+    }
+    if (_is_request(payload, name_len, REQUEST_CLIST)) {
+        stream->request = STATS_LIST;
+        uint32_t head_len;
+        stream->head = clist_encode(library, CLIST_FLAG_CHECKSUM, &head_len);
+        if (stream->head == NULL) {
+            *error = "Out of memory";
+            goto error;
+        }
+        stream->head_len = head_len;
+        goto opened;
+    }
+    if (_is_request(payload, name_len, REQUEST_SEARCH)) {
+        stream->request = STATS_SEARCH;
+        uint32_t head_len;
+        stream->head = _build_search_response(library, args, args_len, &head_len, error);
+        if (stream->head == NULL) {
+            goto error;
+        }
+        stream->head_len = head_len;
+        goto opened;
+    }
+    if (_is_request(payload, name_len, REQUEST_BROWSE)) {
+        stream->request = STATS_BROWSE;
+        uint32_t head_len;
+        stream->head = _build_browse_response(library, args, args_len, &head_len, error);
+        if (stream->head == NULL) {
+            goto error;
+        }
+        stream->head_len = head_len;
+        goto opened;
+    }
+    if (_is_request(payload, name_len, REQUEST_WAVEFORM)) {
+        stream->request = STATS_WAVEFORM;
+        uint32_t head_len;
+        stream->head = _build_waveform_response(library, args, args_len, &head_len, error);
+        if (stream->head == NULL) {
+            goto error;
+        }
+        stream->head_len = head_len;
+        goto opened;
+    }
+    if (_is_request(payload, name_len, REQUEST_STATS)) {
+        stream->request = STATS_STATS;
+        int head_len;
+        stream->head = _build_stats_response(&head_len);
+        if (stream->head == NULL) {
+            *error = "Out of memory";
+            goto error;
+        }
+        stream->head_len = head_len;
+        goto opened;
+    }
+
+    if (_is_request(payload, name_len, REQUEST_SEEK)) {
+        stream->request = STATS_SEEK;
+        if (args_len != SEEK_ARGS_SIZE) {
+            *error = "Malformed seek";
+            goto error;
+        }
+        if (admission_stream_begin() == -1) {
+            stats_refused();
+            *error = "Busy";
+            goto error;
+        }
+        stream->admitted = 1;
+        SeekStart start;
+        if (_open_seek(library, args, &stream->file, &start, error) == -1) {
+            goto error;
+        }
+        stream->has_file = 1;
+        disk_map(&stream->map, stream->file.fd, stream->file.size, FLIGHT_CHUNK_SIZE);
+        stream->head_len = sizeof(uint32_t) + start.head_len;
+        stream->head = malloc(stream->head_len);
+        stream->chunk = malloc(V2_MAX_FRAME_PAYLOAD);
+        if (stream->head == NULL || stream->chunk == NULL) {
+            free(start.head);
+            *error = "Out of memory";
+            goto error;
+        }
+        stream->file_remaining = start.end - start.offset;
+        uint32_t network_size = htonl(start.head_len + stream->file_remaining);
+        memcpy(stream->head, &network_size, sizeof(uint32_t));
+        if (start.head_len > 0) {
+            memcpy(stream->head + sizeof(uint32_t), start.head, start.head_len);
+        }
+        free(start.head);
+        goto opened;
+    }
+
+    uint8_t is_stat = _is_request(payload, name_len, REQUEST_STAT);
+    if (!is_stat && !_is_request(payload, name_len, REQUEST_STREAM)) {
+        *error = "Unknown request";
+        goto error;
+    }
+    stream->request = is_stat ? STATS_STAT : STATS_STREAM;
+    if (args_len != sizeof(uint32_t)) {
+        *error = "Missing file index";
+        goto error;
+    }
+    uint32_t file_index = convert_buffer_to_int((uint8_t *)args);
+    if (file_index >= library->num_files) {
+        *error = "Invalid file index";
+        goto error;
+    }
+
+    if (is_stat) {
+        stream->head = malloc(2 * sizeof(uint32_t));
+        if (stream->head == NULL ||
+            _build_stat_response(library, file_index, (uint32_t *)stream->head) == -1) {
+            *error = "Cannot stat file";
+            goto error;
+        }
+        stream->head_len = 2 * sizeof(uint32_t);
+        goto opened;
+    }
+
+    if (admission_stream_begin() == -1) {
+        stats_refused();
+        *error = "Busy";
+        goto error;
+    }
+    stream->admitted = 1;
+    int file_size = _open_stream_file(library, file_index, flights, &stream->file);
+    if (file_size < 0) {
+        *error = "Cannot open file";
+        goto error;
+    }
+    stream->has_file = 1;
+    disk_map(&stream->map, stream->file.fd, stream->file.size, FLIGHT_CHUNK_SIZE);
+    stream->head = malloc(sizeof(uint32_t));
+    stream->chunk = malloc(V2_MAX_FRAME_PAYLOAD);
+    if (stream->head == NULL || stream->chunk == NULL) {
+        *error = "Out of memory";
+        goto error;
+    }
+    uint32_t network_file_size = htonl(file_size);
+    memcpy(stream->head, &network_file_size, sizeof(uint32_t));
+    stream->head_len = sizeof(uint32_t);
+    stream->file_remaining = file_size;
+
+opened:
+    stats_phase_done(STATS_PHASE_PREPARE, stream->started_us);
+    return stream;
+
+error:
+    stats_request_done(stream->request, stream->started_us, -1);
+    _v2_free_stream(stream);
+    return NULL;
+}
+
+
+/*
+** Helper for: _v2_queue_frame
+** Reads up to size of the next bytes of the stream's file into its chunk: at
+** once if what it reads of the file is cached, or only its flight's window,
+** or if there is no worker to read it, and by the worker of the file's disk
+** if not, over as many calls as it takes.
+**
+** returns the number of bytes read, 0 while the stream waits on its disk, -1
+** on error
+*/
+static ssize_t _v2_read_chunk(V2Stream *stream, uint32_t size) {
+    ssize_t num;
+    stream->waiting = 0;
+    if (stream->reading) {
+        if (!disk_done(&stream->read)) {
+            stream->waiting = 1;
+            return 0;
+        }
+        stream->reading = 0;
+        num = stream->read.result;
+    } else {
+        uint64_t offset;
+        uint32_t span = flight_next_read(&stream->file, size, &offset);
+        if (disk_queue_depth > 0 && span > 0 && !disk_cached(&stream->map, offset, span)) {
+            stream->read.reader = &stream->file;
+            stream->read.buf = stream->chunk;
+            stream->read.size = size;
+            int status = disk_submit(&disks, &stream->read);
+            if (status != -1) {
+                stream->reading = status == 0;
+                stream->waiting = 1;
+                return 0;
+            }
+        }
+        long phase_start = stats_now_us();
+        TRACE_BEGIN("read");
+        num = flight_read(&stream->file, stream->chunk, size);
+        TRACE_END("read");
+        stats_phase_done(STATS_PHASE_READ, phase_start);
+    }
+    if (num == 0) {
+        ERR_PRINT("File shrank while streaming\n");
+        return -1;
+    }
+    return num;
+}
+
+
+/*
+** Helper for: handle_client_v2
+** Queues the stream's next DATA frame on writer, as long as its window allows,
+** unless it waits on its disk for the frame's data.
+**
+** returns 1 if that was the stream's last frame, 0 if not or if nothing was
+** queued, -1 on error
+*/
+static int _v2_queue_frame(Writer *writer, V2Stream *stream) {
+    uint32_t budget = MIN(stream->window, V2_MAX_FRAME_PAYLOAD);
+    const uint8_t *payload;
+    uint32_t len;
+    if (stream->head_sent < stream->head_len) {
+        len = MIN(budget, stream->head_len - stream->head_sent);
+        payload = stream->head + stream->head_sent;
+        stream->head_sent += len;
+    } else {
+        ssize_t num = _v2_read_chunk(stream, MIN(budget, stream->file_remaining));
+        if (num <= 0) {
+            return num;
+        }
+        len = num;
+        payload = stream->chunk;
+        stream->file_remaining -= len;
+    }
+    stream->window -= len;
+
+    uint8_t done = stream->head_sent == stream->head_len && stream->file_remaining == 0;
+    if (frame_add(writer, V2_FRAME_DATA, done ? V2_FLAG_END : 0, stream->id, payload, len) == -1) {
+        return -1;
+    }
+    return done;
+}
+
+
+static V2Stream **_v2_find_stream(V2Stream **streams, uint32_t id) {
+    V2Stream **link = streams;
+    while (*link != NULL && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+
+/*
+** Serves a client that switched to protocol v2, until it disconnects. Frames
+** already buffered in reader are handled first.
+**
+** Every round, each stream with an open window gets one DATA frame of up to
+** V2_MAX_FRAME_PAYLOAD bytes, and the whole round leaves in a single write, so
+** concurrent streams share the connection fairly. The client, and the disks
+** streams wait on, are only waited on when no stream can send.
+**
+** return 0 when the client disconnects, -1 on error
+*/
+static int handle_client_v2(const ClientSocket * client, const Library *library,
+                            LineReader *reader) {
+    if (write_precisely(client->socket, REQUEST_V2 END_OF_MESSAGE_TOKEN, 4) < 0) {
+        return -1;
+    }
+    stats_v2_connection();
+    disk_pool_init(&disks);
+
+    V2Stream *streams = NULL;
+    int num_streams = 0;
+    Writer writer;
+    writer_init(&writer, client->socket);
+    if (use_zerocopy) {
+        writer_enable_zerocopy(&writer);
+    }
+
+    // Any frame the protocol allows is taken whole, so that a request too
+    // long to make only fails its own stream
+    reader->max_capacity = V2_FRAME_HEADER_SIZE + V2_MAX_FRAME_PAYLOAD;
+
+    int result = 0;
+    while (1) {
+        FrameHeader header;
+        uint8_t *payload;
+        int ret;
+        while ((ret = frame_next(reader, &header, &payload, V2_MAX_FRAME_PAYLOAD)) == 1) {
+            V2Stream **link = _v2_find_stream(&streams, header.stream_id);
+            if (header.type == V2_FRAME_REQUEST) {
+                const char *error = "Too many streams";
+                V2Stream *stream = NULL;
+                if (*link != NULL) {
+                    error = "Stream already open";
+                } else if (header.length > V2_MAX_REQUEST_SIZE) {
+                    error = "Request too long";
+                } else if (num_streams < V2_MAX_STREAMS) {
+                    TRACE_BEGIN("open");
+                    stream = _v2_open_stream(library, header.stream_id, payload,
+                                             header.length, &error);
+                    TRACE_END("open");
+                }
+                if (stream == NULL) {
+                    frame_add(&writer, V2_FRAME_ERROR, V2_FLAG_END, header.stream_id,
+                              error, strlen(error));
+                    continue;
+                }
+                // Appended, so that streams are served in the order they were opened
+                *link = stream;
+                num_streams++;
+
+            } else if (header.type == V2_FRAME_WINDOW && *link != NULL
+                       && header.length == sizeof(uint32_t)) {
+                uint32_t increment;
+                memcpy(&increment, payload, sizeof(uint32_t));
+                (*link)->window += ntohl(increment);
+
+            } else if (header.type == V2_FRAME_CANCEL && *link != NULL) {
+                V2Stream *stream = *link;
+                *link = stream->next;
+                _v2_free_stream(stream);
+                num_streams--;
+            }
+        }
+        if (ret == -1) {
+            result = -1;
+            break;
+        }
+
+        // One frame from every stream that can send
+        V2Stream *done = NULL;
+        uint8_t sendable = 0;
+        uint8_t waiting = 0;
+        V2Stream **link = &streams;
+        while (*link != NULL) {
+            V2Stream *stream = *link;
+            if (stream->window == 0) {
+                link = &stream->next;
+                continue;
+            }
+            int status = _v2_queue_frame(&writer, stream);
+            if (status == -1) {
+                frame_add(&writer, V2_FRAME_ERROR, V2_FLAG_END, stream->id,
+                          "Read error", strlen("Read error"));
+            }
+            if (status != 0) {
+                stats_request_done(stream->request, stream->started_us, status);
+                // Freed once its last frame has been written
+                *link = stream->next;
+                stream->next = done;
+                done = stream;
+                num_streams--;
+            } else {
+                sendable |= stream->window > 0 && !stream->waiting;
+                waiting |= stream->waiting;
+                link = &stream->next;
+            }
+        }
+        if (writer.num_iov > 0) {
+            admission_throttle(writer.pending);
+            long phase_start = stats_now_us();
+            int bytes_written = writer_flush(&writer);
+            stats_phase_done(STATS_PHASE_SEND, phase_start);
+            if (bytes_written < 0) {
+                result = -1;
+            } else {
+                stats_bytes_sent(bytes_written);
+            }
+        }
+        while (done != NULL) {
+            V2Stream *next = done->next;
+            _v2_free_stream(done);
+            done = next;
+        }
+        if (result == -1) {
+            break;
+        }
+
+        // Only block on the client when there is nothing else to do
+        if (sendable) {
+            struct pollfd client_pollfd = {client->socket, POLLIN, 0};
+            if (poll(&client_pollfd, 1, 0) <= 0) {
+                continue;
+            }
+        } else if (waiting) {
+            // Or on a disk's worker finishing a read
+            struct pollfd pollfds[2] = {{client->socket, POLLIN, 0},
+                                        {disk_pool_fd(&disks), POLLIN, 0}};
+            if (poll(pollfds, 2, -1) == -1 && errno != EINTR) {
+                perror("handle_client_v2: poll");
+                result = -1;
+                break;
+            }
+            disk_pool_drain(&disks);
+            if (pollfds[0].revents == 0) {
+                continue;
+            }
+        }
+        int bytes_read = line_reader_fill(reader, client->socket);
+        if (bytes_read == 0) {
+            break;
+        }
+        if (bytes_read < 0) {
+            perror("handle_client_v2");
+            result = -1;
+            break;
+        }
+    }
+
+    while (streams != NULL) {
+        V2Stream *next = streams->next;
+        _v2_free_stream(streams);
+        streams = next;
+    }
+    disk_pool_stop(&disks);
+    return result;
+}
+
+
 int handle_client(const ClientSocket * client, Library *library) {
-    char *request = NULL;
-    uint8_t *request_buffer = (uint8_t *)malloc(REQUEST_BUFFER_SIZE);
-    if (request_buffer == NULL) {
-        perror("handle_client");
+    // Only count this client's I/O, not what the parent did before the fork
+    memset(&io_stats, 0, sizeof(IoStats));
+    stats_connection_opened();
+
+    LineReader reader;
+    if (line_reader_init(&reader, REQUEST_BUFFER_SIZE, REQUEST_BUFFER_SIZE) == -1) {
+        stats_connection_closed();
         return 1;
     }
-    uint8_t *buff_end = request_buffer;
 
     int bytes_read = 0;
-    int bytes_in_buf = 0;
-    while((bytes_read = read(client->socket, buff_end, REQUEST_BUFFER_SIZE - bytes_in_buf)) > 0){
+    while((bytes_read = line_reader_fill(&reader, client->socket)) > 0){
         #ifdef DEBUG
         printf("Read %d bytes from client\n", bytes_read);
         #endif
 
-        bytes_in_buf += bytes_read;
+        // Requests may arrive several to a read, handle every complete one
+        char *request;
+        while ((request = line_reader_next(&reader, NULL)) != NULL) {
+            long request_start = stats_now_us();
+            int result;
+            if (strcmp(request, REQUEST_LIST) == 0) {
+                TRACE_BEGIN("LIST");
+                result = list_request_response(client, library);
+                TRACE_END("LIST");
+                stats_request_done(STATS_LIST, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling LIST request\n");
+                    goto client_error;
+                }
 
-        request = find_network_newline((char *)request_buffer, &bytes_in_buf);
+            } else if (strcmp(request, REQUEST_CLIST) == 0) {
+                TRACE_BEGIN("CLIST");
+                result = clist_request_response(client, library);
+                TRACE_END("CLIST");
+                stats_request_done(STATS_LIST, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling CLIST request\n");
+                    goto client_error;
+                }
 
-        if (request && strcmp(request, REQUEST_LIST) == 0) {
-            if (list_request_response(client, library) < 0) {
-                ERR_PRINT("Error handling LIST request\n");
-                goto client_error;
-            }
+            } else if (strcmp(request, REQUEST_SEARCH) == 0) {
+                TRACE_BEGIN("SEARCH");
+                result = search_request_response(client, library, &reader);
+                TRACE_END("SEARCH");
+                stats_request_done(STATS_SEARCH, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling SEARCH request\n");
+                    goto client_error;
+                }
 
-        } else if (request && strcmp(request, REQUEST_STREAM) == 0) {
-            int num_pr_bytes = MIN(sizeof(uint32_t), (unsigned long)bytes_in_buf);
-            if (stream_request_response(client, library, request_buffer, num_pr_bytes) < 0) {
-                ERR_PRINT("Error handling STREAM request\n");
-                goto client_error;
-            }
-            bytes_in_buf -= num_pr_bytes;
-            memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
+            } else if (strcmp(request, REQUEST_BROWSE) == 0) {
+                TRACE_BEGIN("BROWSE");
+                result = browse_request_response(client, library, &reader);
+                TRACE_END("BROWSE");
+                stats_request_done(STATS_BROWSE, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling BROWSE request\n");
+                    goto client_error;
+                }
 
-        } else if (request) {
-            ERR_PRINT("Unknown request: %s\n", request);
-        }
+            } else if (upstream != NULL && strcmp(request, REQUEST_V2) == 0) {
+                // The connection goes on with v1, see as_edge.h
+                stats_request_done(STATS_UNKNOWN, request_start, -1);
+                if (_send_unsupported(client->socket) == -1) {
+                    goto client_error;
+                }
+
+            } else if (upstream != NULL && (strcmp(request, REQUEST_SEEK) == 0 ||
+                                            strcmp(request, REQUEST_WAVEFORM) == 0 ||
+                                            strcmp(request, REQUEST_USTREAM) == 0 ||
+                                            strcmp(request, REQUEST_STATION) == 0)) {
+                // Its arguments are taken, lest they be taken for the next
+                // request, and the connection goes on, see as_edge.h
+                uint8_t args[SEEK_ARGS_SIZE];
+                size_t num_args = strcmp(request, REQUEST_SEEK) == 0 ? SEEK_ARGS_SIZE
+                                : strcmp(request, REQUEST_WAVEFORM) == 0 ? WAVE_ARGS_SIZE
+                                : strcmp(request, REQUEST_USTREAM) == 0 ? 6 : 0;
+                stats_request_done(STATS_UNKNOWN, request_start, -1);
+                printf("An edge does not serve %s requests\n", request);
+                if (_take_request_args(client, &reader, args, num_args) == -1 ||
+                    _send_unsupported(client->socket) == -1) {
+                    goto client_error;
+                }
+
+            } else if (strcmp(request, REQUEST_WAVEFORM) == 0) {
+                TRACE_BEGIN("WAVEFORM");
+                result = waveform_request_response(client, library, &reader);
+                TRACE_END("WAVEFORM");
+                stats_request_done(STATS_WAVEFORM, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling WAVEFORM request\n");
+                    goto client_error;
+                }
 
-        free(request); request = NULL;
-        buff_end = request_buffer + bytes_in_buf;
+            } else if (strcmp(request, REQUEST_STAT) == 0) {
+                uint8_t post_req[sizeof(uint32_t)];
+                int num_pr_bytes = line_reader_take(&reader, post_req, sizeof(uint32_t));
+                TRACE_BEGIN("STAT");
+                result = stat_request_response(client, library, post_req, num_pr_bytes);
+                TRACE_END("STAT");
+                stats_request_done(STATS_STAT, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling STAT request\n");
+                    goto client_error;
+                }
+
+            } else if ((strcmp(request, REQUEST_STREAM) == 0 ||
+                        strcmp(request, REQUEST_SEEK) == 0 ||
+                        strcmp(request, REQUEST_USTREAM) == 0 ||
+                        strcmp(request, REQUEST_STATION) == 0) &&
+                       admission_stream_begin() == -1) {
+                printf("Refused a %s from %s: too many streams from the address\n",
+                       request, inet_ntoa(client->addr.sin_addr));
+                _send_busy(client->socket);
+                stats_refused();
+                goto client_done;
+
+            } else if (strcmp(request, REQUEST_SEEK) == 0) {
+                TRACE_BEGIN("SEEK");
+                result = seek_request_response(client, library, &reader);
+                TRACE_END("SEEK");
+                admission_stream_end();
+                stats_request_done(STATS_SEEK, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling SEEK request\n");
+                    goto client_error;
+                }
+
+            } else if (strcmp(request, REQUEST_STREAM) == 0) {
+                uint8_t post_req[sizeof(uint32_t)];
+                int num_pr_bytes = line_reader_take(&reader, post_req, sizeof(uint32_t));
+                TRACE_BEGIN("STREAM");
+                result = stream_request_response(client, library, post_req, num_pr_bytes);
+                TRACE_END("STREAM");
+                admission_stream_end();
+                stats_request_done(STATS_STREAM, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling STREAM request\n");
+                    goto client_error;
+                }
+
+            } else if (strcmp(request, REQUEST_USTREAM) == 0) {
+                uint8_t post_req[6];
+                int num_pr_bytes = line_reader_take(&reader, post_req, sizeof(post_req));
+                TRACE_BEGIN("USTREAM");
+                result = ustream_request_response(client, library, post_req, num_pr_bytes);
+                TRACE_END("USTREAM");
+                admission_stream_end();
+                stats_request_done(STATS_USTREAM, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling USTREAM request\n");
+                    goto client_error;
+                }
+
+            } else if (strcmp(request, REQUEST_STATS) == 0) {
+                TRACE_BEGIN("STATS");
+                result = stats_request_response(client);
+                TRACE_END("STATS");
+                stats_request_done(STATS_STATS, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling STATS request\n");
+                    goto client_error;
+                }
+
+            } else if (strcmp(request, REQUEST_STATION) == 0) {
+                // The station's stream never ends, so neither does the response
+                result = station_request_response(client);
+                admission_stream_end();
+                stats_request_done(STATS_STATION, request_start, result);
+                if (result < 0) {
+                    ERR_PRINT("Error handling STATION request\n");
+                    goto client_error;
+                }
+                goto client_done;
+
+            } else if (strcmp(request, REQUEST_V2) == 0) {
+                // The rest of the connection is framed
+                if (handle_client_v2(client, library, &reader) < 0) {
+                    ERR_PRINT("Error handling protocol v2 client\n");
+                    goto client_error;
+                }
+                goto client_done;
 
+            } else {
+                stats_request_done(STATS_UNKNOWN, request_start, -1);
+                ERR_PRINT("Unknown request: %s\n", request);
+                if (_send_unsupported(client->socket) == -1) {
+                    goto client_error;
+                }
+            }
+        }
     }
     if (bytes_read < 0) {
         perror("handle_client");
         goto client_error;
     }
 
-    printf("Client on %s:%d disconnected\n",
+client_done:
+    printf("Client on %s:%d disconnected (%llu reads, %llu writes, %llu bytes sent)\n",
            inet_ntoa(client->addr.sin_addr),
-           ntohs(client->addr.sin_port));
+           ntohs(client->addr.sin_port),
+           (unsigned long long)io_stats.read_calls,
+           (unsigned long long)io_stats.write_calls,
+           (unsigned long long)io_stats.bytes_written);
 
-    free(request_buffer);
-    if (request != NULL) {
-        free(request);
-    }
+    line_reader_free(&reader);
+    stats_connection_closed();
     return 0;
 client_error:
-    free(request_buffer);
-    if (request != NULL) {
-        free(request);
-    }
+    line_reader_free(&reader);
+    stats_connection_closed();
     return -1;
 }
 
 
+#ifndef AS_NO_MAIN
 static void print_usage(){
-    printf("Usage: as_server [-h] [-p port] [-l library_directory]\n");
+    printf("Usage: as_server [-h] [-z] [-d percent] [-s playlist] [-C] [-m connections]\n"
+           "                 [-a connections] [-t streams] [-r kib_per_sec] [-w kib]\n"
+           "                 [-q reads] [-u host:port] [-c mib] [-i index_directory]\n"
+           "                 [-p port] [-l library_directory]...\n");
     printf("  -h  Print this message\n");
     printf("  -p  Port to listen on (default: " XSTR(DEFAULT_PORT) ")\n");
-    printf("  -l  Directory containing the library (default: ./library/)\n");
+    printf("  -l  Directory containing the library (default: ./library/); given again,\n"
+           "      the directories are merged, the first one given winning any path\n"
+           "      they share. The library is only read\n");
+    printf("  -i  Directory to save the seek and waveform indexes in, made if need be,\n"
+           "      and which must be writable (default: ./" SEEK_DEFAULT_DIRECTORY "/)\n");
+    printf("  -z  Send large STREAM writes with MSG_ZEROCOPY, where supported\n");
+    printf("  -d  Drop this percentage of UDP datagrams, to test loss recovery\n");
+    printf("  -s  Run a station playing the library paths listed in this file\n");
+    printf("  -C  Don't coalesce concurrent STREAMs of the same file\n");
+    printf("  -m  Refuse connections beyond this many (default: no limit)\n");
+    printf("  -a  Refuse connections beyond this many per client address\n");
+    printf("  -t  Refuse streams beyond this many at once per client address\n");
+    printf("  -r  Send each client address at most this many KiB per second\n");
+    printf("  -w  Read this many KiB ahead of STREAMs, 0 to read as they go (default: %d)\n",
+           READAHEAD_DEFAULT_WINDOW / 1024);
+    printf("  -q  Queue this many reads per disk for each v2 client, 0 to read as they go\n"
+           "      (default: %d)\n", DISK_DEFAULT_QUEUE_DEPTH);
+    printf("  -u  Serve the library of the server at host:port, caching its files in the\n"
+           "      library directory (default: ./" EDGE_DEFAULT_DIRECTORY "/)\n");
+    printf("  -c  Cache at most this many MiB of files with -u (default: %d)\n",
+           EDGE_DEFAULT_CACHE_MB);
 }
 
 
 int main(int argc, char * const *argv){
     int opt;
     int port = DEFAULT_PORT;
-    const char *library_directory = "library";
+    const char *library_directories[LIBRARY_MAX_ROOTS] = {"library"};
+    int num_libraries = 0;
+    server_argv = argv;
+    const char *handoff = getenv(HANDOFF_ENV);
+    if (handoff != NULL) {
+        handoff_fd = strtol(handoff, NULL, 10);
+        unsetenv(HANDOFF_ENV);
+    }
 
     // Check out man 3 getopt for how to use this function
     // The short version: it parses command line options
     // Note that optarg is a global variable declared in getopt.h
-    while ((opt = getopt(argc, argv, "hp:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "hzCd:s:m:a:t:r:w:q:u:c:i:p:l:")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage();
@@ -668,16 +2511,109 @@ int main(int argc, char * const *argv){
                 port = atoi(optarg);
                 break;
             case 'l':
-                library_directory = optarg;
+                if (num_libraries == LIBRARY_MAX_ROOTS) {
+                    ERR_PRINT("At most %d library directories can be given\n", LIBRARY_MAX_ROOTS);
+                    return 1;
+                }
+                library_directories[num_libraries++] = optarg;
+                break;
+            case 'z':
+                use_zerocopy = 1;
+                break;
+            case 'd':
+                udp_drop_percent = strtol(optarg, NULL, 10);
+                if (udp_drop_percent < 0 || udp_drop_percent > 100) {
+                    ERR_PRINT("Invalid drop percentage %d\n", udp_drop_percent);
+                    return 1;
+                }
+                srand(time(NULL));
                 break;
+            case 's':
+                station_playlist = optarg;
+                break;
+            case 'C':
+                coalesce_streams = 0;
+                break;
+            case 'w': {
+                long window = strtol(optarg, NULL, 10);
+                if (window < 0 || window > UINT32_MAX / 1024) {
+                    ERR_PRINT("Invalid read-ahead window %s\n", optarg);
+                    return 1;
+                }
+                readahead_window = window * 1024;
+                break;
+            }
+            case 'q': {
+                long depth = strtol(optarg, NULL, 10);
+                if (depth < 0 || depth > DISK_MAX_QUEUE_DEPTH) {
+                    ERR_PRINT("Invalid queue depth %s\n", optarg);
+                    return 1;
+                }
+                disk_queue_depth = depth;
+                break;
+            }
+            case 'i':
+                seek_index_directory = optarg;
+                wave_index_directory = optarg;
+                break;
+            case 'u':
+                upstream = optarg;
+                break;
+            case 'c': {
+                long cache_mb = strtol(optarg, NULL, 10);
+                if (cache_mb <= 0) {
+                    ERR_PRINT("Invalid cache size %s\n", optarg);
+                    return 1;
+                }
+                edge_cache_mb = cache_mb;
+                break;
+            }
+            case 'm':
+            case 'a':
+            case 't':
+            case 'r': {
+                long limit = strtol(optarg, NULL, 10);
+                if (limit < 0) {
+                    ERR_PRINT("Invalid limit %s\n", optarg);
+                    return 1;
+                }
+                if (opt == 'm') {
+                    admission_limits.max_connections = limit;
+                } else if (opt == 'a') {
+                    admission_limits.max_connections_per_address = limit;
+                } else if (opt == 't') {
+                    admission_limits.max_streams_per_address = limit;
+                } else {
+                    admission_limits.byte_rate_per_address = (uint64_t)limit * 1024;
+                }
+                break;
+            }
             default:
                 print_usage();
                 return 1;
         }
     }
 
-    printf("Starting server on port %d, serving library in %s\n",
-           port, library_directory);
+    if (upstream != NULL && (num_libraries > 1 || station_playlist != NULL)) {
+        ERR_PRINT("An edge caches in a single directory, and has no station\n");
+        return 1;
+    }
+    if (upstream != NULL && num_libraries == 0) {
+        library_directories[0] = EDGE_DEFAULT_DIRECTORY;
+    }
+    num_libraries = MAX(num_libraries, 1);
+    if (upstream != NULL) {
+        printf("Starting server on port %d, serving the library of %s cached in %s\n",
+               port, upstream, library_directories[0]);
+    } else {
+        printf("Starting server on port %d, serving library in %s", port, library_directories[0]);
+        for (int i = 1; i < num_libraries; i++) {
+            printf(", %s", library_directories[i]);
+        }
+        printf("\n");
+    }
+    TRACE_INIT("as_server");
 
-    return run_server(port, library_directory);
+    return run_server(port, library_directories, num_libraries);
 }
+#endif // AS_NO_MAIN
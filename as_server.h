@@ -5,20 +5,53 @@
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
 #include "libas.h"
+#include "as_udp.h"
+#include "as_station.h"
+#include "as_flight.h"
+#include "as_stats.h"
+#include "as_admission.h"
+#include "as_handoff.h"
+#include "as_sizer.h"
+#include "as_readahead.h"
+#include "as_clist.h"
+#include "as_search.h"
+#include "as_browse.h"
+#include "as_seek.h"
+#include "as_wave.h"
+#include "as_disk.h"
+#include "as_edge.h"
+
+#include <signal.h>
+#include <sys/resource.h>
 
 /*
 ** Constants
 ** ---------
 */
 #define MAX_PENDING 10
-#define STREAM_CHUNK_SIZE 1024
 
 #define SELECT_TIMEOUT_SEC 1
 #define SELECT_TIMEOUT_USEC 0
 #define SELECT_TIMEOUT {SELECT_TIMEOUT_SEC, SELECT_TIMEOUT_USEC}
 
+// Requests a protocol v2 client may have in flight at once
+#define V2_MAX_STREAMS 64
+// The longest v1 request a REQUEST frame may carry, a BROWSE's with both its
+// directory and token as long as they can be
+#define V2_MAX_REQUEST_SIZE (sizeof(REQUEST_BROWSE END_OF_MESSAGE_TOKEN) - 1 + \
+                             BROWSE_HEADER_SIZE + 2 * BROWSE_MAX_ARG)
+
 #define LIBRARY_FILENAME_MAX 256
 #define LIBRARY_SCAN_INTERVAL 60
+// Directories a library can be merged from, see scan_library
+#define LIBRARY_MAX_ROOTS 16
+
+// The indexer's exit status, with a bit for each index it saved
+#define INDEXER_SAVED_SEEK 0x1
+#define INDEXER_SAVED_WAVE 0x2
+
+// Arguments that can be given to a successor, see run_server
+#define SUCCESSOR_MAX_ARGS 16
 
 
 /*
@@ -30,8 +63,9 @@
 ** to handle this client, and will terminate when the client disconnects.
 **
 ** The server will maintain a library of audio files. The library will be a
-** directory on the server's file system. The server will scan the library
-** directory at regular intervals to keep the library up to date.
+** directory on the server's file system, or several merged into one, say on
+** different disks. The server will scan the library directories at regular
+** intervals to keep the library up to date.
 **
 ** Once a client connects, it can make requests.
 ** The server will respond to the following requests:
@@ -50,6 +84,109 @@
 **     - the file's size followed by the file's data.
 **       - see stream_request_response for more information
 **
+** 3) "STAT" to describe a file in the library without streaming it
+**   - The string REQUEST_STAT will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars) and the file index, as for STREAM.
+**   - The server will respond with the file's size and modification time.
+**     - see stat_request_response for more information
+**
+** 4) "V2" to switch the connection to protocol v2
+**   - The string REQUEST_V2 will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - The server will answer with the same 4 bytes, after which both sides
+**     only send frames (see the frames in libas.h). A server that only
+**     speaks v1 answers RESPONSE_UNSUPPORTED instead, or, from before there
+**     was one, ignores the request, so a client that gets either can carry
+**     on with v1.
+**   - The client opens a stream per request with a REQUEST frame, under a
+**     stream id of its choosing, whose payload is the v1 request, e.g.
+**     "STREAM\r\n" followed by the file index. The server answers with
+**     DATA frames holding the v1 response, the last one flagged V2_FLAG_END,
+**     or with an ERROR frame. A request longer than V2_MAX_REQUEST_SIZE gets
+**     an ERROR frame, as does one that can't be made.
+**   - Streams are interleaved frame by frame, so a LIST made during a STREAM
+**     is answered right away. The server only sends a stream as many bytes
+**     as its window, which starts at V2_INITIAL_WINDOW and grows with each
+**     WINDOW frame from the client. A CANCEL frame ends a stream early;
+**     frames for it that were already sent still arrive.
+**
+** 5) "USTREAM" to stream a file from the library over UDP
+**   - The string REQUEST_USTREAM will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars), the file index as for STREAM, and
+**     the client's UDP port as a 16-bit integer in network byte order.
+**   - The server will respond with the file's size and byte rate, then send
+**     the file to that port as datagrams.
+**     - see as_udp.h for more information
+**
+** 6) "STATION" to tune in to the server's station
+**   - The string REQUEST_STATION will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - The server will respond like to a STREAM, with STATION_LIVE_SIZE as
+**     the size, followed by the station's stream for as long as the client
+**     listens. A server without a station responds with a size of 0.
+**     - see as_station.h for more information
+**
+** 7) "STATS" to see what the server has been doing
+**   - The string REQUEST_STATS will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - The server will respond like to a STREAM, with the size of a report
+**     of its statistics followed by the report, as text.
+**     - see as_stats.h for more information
+**
+** 8) "CLIST" to list the files in the library compactly
+**   - The string REQUEST_CLIST will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars).
+**   - The server will respond with the same list as for LIST, sorted and
+**     front-coded, see as_clist.h. A server that does not know CLIST answers
+**     RESPONSE_UNSUPPORTED, or, from before there was one, does not answer,
+**     so a client that gets either can send LIST instead.
+**     - see clist_request_response for more information
+**
+** 9) "SEARCH" to find files in the library
+**   - The string REQUEST_SEARCH will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars), the search mode, the most matches
+**     wanted and the query, see as_search.h.
+**   - The server will respond like to a STATS, with the size of the matches
+**     followed by them, best first, each in the form of a LIST entry.
+**     - see search_request_response for more information
+**
+** 10) "BROWSE" to list a directory of the library a page at a time
+**   - The string REQUEST_BROWSE will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars), the page wanted, the directory and
+**     the continuation token of the page before, see as_browse.h.
+**   - The server will respond like to a STATS, with the size of the page
+**     followed by it: the directory's number of children and the next
+**     page's continuation token, then its subdirectories and files.
+**     - see browse_request_response for more information
+**
+** 11) "SEEK" to stream a file from a point in time
+**   - The string REQUEST_SEEK will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars), the file index and the time in
+**     milliseconds, see as_seek.h.
+**   - The server will respond like to a STREAM, with the size of the stream
+**     followed by a header for the file's format, then the file from the
+**     frame nearest before that time.
+**     - see seek_request_response for more information
+**
+** 12) "WAVEFORM" to get a file's peak envelope and loudness
+**   - The string REQUEST_WAVEFORM will be sent to the server, followed by the
+**     network newline "\r\n" (2 chars), the file index and the number of
+**     buckets wanted, see as_wave.h.
+**   - The server will respond like to a STATS, with the size of the summary
+**     followed by it: the file's integrated loudness and duration, then the
+**     lowest and highest sample of each bucket. A file that isn't PCM WAV
+**     has an empty summary.
+**     - see waveform_request_response for more information
+**
+** When the server has no room for a connection, or for another stream from
+** the client's address, it sends RESPONSE_BUSY followed by the network
+** newline "\r\n" (2 chars) instead of a response, and closes the connection.
+** A v2 stream is refused with an ERROR frame instead. See as_admission.h.
+**
+** A request the server does not know gets RESPONSE_UNSUPPORTED followed by the
+** network newline "\r\n" (2 chars) instead of a response, and the connection
+** stays open.
+**
 ** The client-server connection code is nearly identical to T10, so be sure to take a crack
 ** at that lab before starting this assignment.
 */
@@ -122,10 +259,54 @@ ClientSocket accept_connection(int listenfd);
 */
 int list_request_response(const ClientSocket * client, const Library *library);
 
+/*
+** List the files in the library as for list_request_response, but sorted by
+** path and front-coded, in blocks each followed by a checksum. See as_clist.h
+** for the format.
+**
+** return 0 on success, -1 on error
+*/
+int clist_request_response(const ClientSocket * client, const Library *library);
+
+
+/*
+** Finds the files in the library whose paths match a query, with the server's
+** search index (see as_search.h). The request's SEARCH_HEADER_SIZE bytes and
+** query are taken from reader first, then from the client socket.
+**
+** The response starts with its size as a 32-bit integer in network byte
+** order, followed by the matches, best first, as in a LIST response:
+** "12:artist/album/file.wav\r\n3:artist/file.wav\r\n"
+**
+** return 0 on success, -1 on error
+*/
+int search_request_response(const ClientSocket * client, const Library *library,
+                            LineReader *reader);
+
+
+/*
+** Lists a page of the children of a directory in the library, with the
+** server's tree of the library (see as_browse.h). The request's
+** BROWSE_HEADER_SIZE bytes, directory and continuation token are taken from
+** reader first, then from the client socket.
+**
+** For example, for the files "artist/album/file1.wav" and "artist/file2.wav"
+** at indices 0 and 1, a page of the directory "artist" with room for a
+** single child is:
+** "2:album/\r\n1:album/\r\n"
+** and the page after it, with the continuation token "album/", is:
+** "2:\r\n1:file2.wav\r\n"
+** each after its size as a 32-bit integer in network byte order.
+**
+** return 0 on success, -1 on error
+*/
+int browse_request_response(const ClientSocket * client, const Library *library,
+                            LineReader *reader);
+
 
 /*
-** Stream a file from the library to the client. The file is streamed in chunks
-** of a maximum of STREAM_CHUNK_SIZE bytes. The client will be able to request
+** Stream a file from the library to the client. The file is streamed in writes
+** sized to the connection, see as_sizer.h. The client will be able to request
 ** a specific file by its index in the library.
 **
 ** The 32-bit unsigned network byte-order integer file_index will be read
@@ -133,10 +314,12 @@ int list_request_response(const ClientSocket * client, const Library *library);
 ** from post_req first, then:
 **   The stream will be sent in the following format:
 **     - the first 4 bytes (32-bits) will be the file size in network byte-order
-**     - the rest of the stream will be the file's data written in chunks of
-**       STREAM_CHUNK_SIZE bytes, or less if write returns less than STREAM_CHUNK_SIZE,
-**       the file is less than STREAM_CHUNK_SIZE bytes, or the last remaining chunk is
-**       less than STREAM_CHUNK_SIZE bytes.
+**     - the rest of the stream will be the file's data, written in as many
+**       bytes at a time as the connection drains in SIZER_TARGET_MS, between
+**       SIZER_MIN_SIZE and SIZER_MAX_SIZE, or less when fewer remain.
+**   The size leaves with the first of the file's data, in a vectored write.
+**   The file is read a batch ahead of what is sent, see as_readahead.h.
+**   Concurrent streams of the same file share their reads of it, see as_flight.h.
 **
 ** If the file is successfully transported to the client over the client_socket,
 ** return 0. Otherwise, return -1.
@@ -145,13 +328,102 @@ int stream_request_response(const ClientSocket * client, const Library *library,
                             uint8_t *post_req, int num_pr_bytes);
 
 
+/*
+** Streams a file of the library from a point in time, with the server's seek
+** table of the file (see as_seek.h). The request's file index and time are
+** taken from reader first, then from the client socket.
+**
+** The stream is sent like a STREAM's, in writes sized to the connection:
+**     - the first 4 bytes (32-bits) will be the size of the rest in network
+**       byte-order
+**     - then the header the file's format needs to start there, if any
+**     - then the file's data from the frame nearest before the time, up to
+**       the end of its audio
+**
+** return 0 on success, -1 on error
+*/
+int seek_request_response(const ClientSocket * client, const Library *library,
+                          LineReader *reader);
+
+/*
+** Sends the peak envelope and integrated loudness of the file at the request's
+** index, at the number of buckets asked for, from the summary the server made
+** of it, or from one made for the request if the file changed since (see
+** as_wave.h). The request's file index and number of buckets are taken from
+** reader first, then from the client socket.
+**
+** The response is sent as:
+**     - the first 4 bytes (32-bits) will be the size of the rest in network
+**       byte-order
+**     - then the loudness, the duration and the number of buckets
+**     - then the lowest and highest sample of each bucket
+**
+** A file that isn't PCM WAV is sent as a size of 0 alone.
+**
+** return 0 on success, -1 on error
+*/
+int waveform_request_response(const ClientSocket * client, const Library *library,
+                              LineReader *reader);
+
+
+/*
+** Describe a file from the library to the client, so that it can validate a
+** local copy without streaming the file again. The file index is read exactly
+** as for stream_request_response.
+**
+** The response is 8 bytes: the file size followed by the file's modification
+** time in seconds since the epoch, each a 32-bit integer in network byte-order.
+**
+** return 0 on success, -1 on error
+*/
+int stat_request_response(const ClientSocket * client, const Library *library,
+                          uint8_t *post_req, int num_pr_bytes);
+
+
+/*
+** Stream a file from the library to the client over UDP, as described in
+** as_udp.h. The file index and the client's UDP port are read like the file
+** index of stream_request_response, considering num_pr_bytes (<= 6) from
+** post_req first. The datagrams go to that port on the client's address.
+**
+** Only returns once the client is done with the stream.
+**
+** return 0 on success, -1 on error
+*/
+int ustream_request_response(const ClientSocket * client, const Library *library,
+                             uint8_t *post_req, int num_pr_bytes);
+
+
+/*
+** Tune the client in to the server's station, if it has one (see -s), and
+** send it the station's stream until it disconnects. The connection can't be
+** used for other requests afterwards.
+**
+** return 0 on success, -1 on error
+*/
+int station_request_response(const ClientSocket * client);
+
+
+/*
+** Send the client a report of the server's statistics, added up from every
+** client process, see as_stats.h.
+**
+** return 0 on success, -1 on error
+*/
+int stats_request_response(const ClientSocket * client);
+
+
 // Library functions
 /*
 ** Scan the library directory and (re-)populate the library structure. The library
 ** structure will be populated with the name of the library, the path to the library,
 ** and a list of files in the library.
 **
-** Only SUPPORTED_FILE_EXTS files will be added to the library.
+** Only SUPPORTED_FILE_EXTS files will be added to the library, sorted by path.
+**
+** A library with roots is merged from each of them: a file's path is relative to
+** its root, which file_roots records, and a path found in several roots is only
+** kept from the first. The station plays tracks from the first root alone.
 **
 ** If the library is successfully populated, return 0. Otherwise, return -1.
 */
@@ -172,10 +444,18 @@ int handle_client(const ClientSocket * client, Library *library);
 
 
 /*
-** Run the server using the specified port and library directory. The server
+** Run the server using the specified port and the num_libraries library
+** directories, merged into one library, see scan_library. The server
 ** will listen for incoming connections and respond to requests from clients in
 ** an infinite loop. The loop will terminate if an error occurs or the user types
-** q + enter in the server's terminal.
+** q + enter in the server's terminal. s + enter prints the server's statistics.
+**
+** SIGHUP, or u + enter, upgrades the server without dropping a connection: a
+** successor is started with the same arguments, or with those typed after the
+** u, and takes the listening socket over once ready, see as_handoff.h. The
+** server then stops accepting connections, and returns once its client
+** processes are done. A station is stopped straight away, as its listeners
+** never are.
 **
 ** All new connections will be accepted and handled in a child process that will
 ** exclusively run the handle_client function. The server will continue to listen
@@ -184,6 +464,6 @@ int handle_client(const ClientSocket * client, Library *library);
 ** If the server is successfully set up and running, this function will never
 ** return. If any errors occur, the server will terminate with an error message.
 */
-int run_server(int port, const char *library_directory);
+int run_server(int port, const char **library_directories, int num_libraries);
 
 #endif // AS_SERVER_H_
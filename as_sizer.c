@@ -0,0 +1,108 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_sizer.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#endif
+
+
+static long _now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+** returns the bytes in fd's send queue, sent or not, -1 if it can't tell
+*/
+static int _queued(int fd) {
+#ifdef __linux__
+    int num;
+    if (ioctl(fd, SIOCOUTQ, &num) == 0) {
+        return num;
+    }
+#endif
+    return -1;
+}
+
+
+/*
+** returns the bytes in fd's send queue that were not sent yet, -1 if it
+** can't tell
+*/
+static int _not_sent(int fd) {
+#ifdef __linux__
+    int num;
+    if (ioctl(fd, SIOCOUTQNSD, &num) == 0) {
+        return num;
+    }
+#endif
+    return -1;
+}
+
+
+void sizer_init(SendSizer *sizer, int fd) {
+    sizer->fd = fd;
+    sizer->size = SIZER_INITIAL_SIZE;
+    sizer->rate = 0;
+    sizer->queued = MAX(_queued(fd), 0);
+    sizer->drained = 0;
+    sizer->sample_us = _now_us();
+#ifdef __linux__
+    // Fails on sockets that aren't TCP, which is fine
+    int lowat = SIZER_NOTSENT_LOWAT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+}
+
+
+uint32_t sizer_next(SendSizer *sizer) {
+    // Until the rate is known, writes grow as long as the queue keeps up
+    uint64_t target = sizer->rate > 0 ? sizer->rate * SIZER_TARGET_MS / 1000 : SIZER_MAX_SIZE;
+    // Bursts into empty buffers overstate the rate, so grow step by step
+    target = MIN(target, 2 * (uint64_t)sizer->size);
+    uint32_t size = MAX(MIN(target, SIZER_MAX_SIZE), SIZER_MIN_SIZE);
+    if (_not_sent(sizer->fd) > SIZER_NOTSENT_LOWAT) {
+        size = MAX(MIN(size, sizer->size) / 2, SIZER_MIN_SIZE);
+    }
+    sizer->size = size;
+    return size;
+}
+
+
+void sizer_sent(SendSizer *sizer, uint32_t num) {
+    long now = _now_us();
+    int queued = _queued(sizer->fd);
+    if (queued < 0) {
+        return;
+    }
+
+    // What left the queue since the last write
+    uint64_t before = (uint64_t)sizer->queued + num;
+    sizer->drained += before > (uint64_t)queued ? before - queued : 0;
+    sizer->queued = queued;
+    long elapsed_us = now - sizer->sample_us;
+    if (elapsed_us < SIZER_SAMPLE_MS * 1000) {
+        return;
+    }
+    uint64_t sample = sizer->drained * 1000000 / elapsed_us;
+    sizer->drained = 0;
+    sizer->sample_us = now;
+
+    if (sizer->rate == 0) {
+        sizer->rate = sample;
+    } else if (sample > sizer->rate) {
+        sizer->rate += (sample - sizer->rate) / SIZER_RATE_WEIGHT;
+    } else if (queued > 0) {
+        // Slowing down matters more, so it counts double. An empty queue
+        // waited on the stream, so it only shows a lower bound.
+        sizer->rate -= 2 * (sizer->rate - sample) / SIZER_RATE_WEIGHT;
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef AS_SIZER_H_
+#define AS_SIZER_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** Adaptive send sizing
+** --------------------
+** How much a stream should write at once depends on the connection: a client
+** on the same LAN drains megabytes in a few milliseconds, and small writes
+** only cost it syscalls, while on a slow or congested path a big write just
+** sits in the kernel's send queue. So a stream sizes each write to
+** SIZER_TARGET_MS of the rate its connection has been draining at, measured
+** from how much leaves the send queue (SIOCOUTQ) over SIZER_SAMPLE_MS, as
+** acknowledgements come in bursts. Until then, writes double from
+** SIZER_INITIAL_SIZE, and they only ever grow to twice the last one at a
+** time, as the first ones land in empty buffers and overstate the rate.
+**
+** The socket's TCP_NOTSENT_LOWAT is set to SIZER_NOTSENT_LOWAT, so a write
+** blocks while more than that is waiting to be sent, rather than filling
+** the whole send buffer. When the bytes not yet sent (SIOCOUTQNSD) are over
+** it anyway, the queue is backed up and the next write is halved instead.
+**
+** Where the socket can't tell (not Linux, or not TCP), the measured rate is
+** all there is to go on.
+*/
+#define SIZER_MIN_SIZE 4096
+#define SIZER_MAX_SIZE (1 << 20)
+#define SIZER_INITIAL_SIZE 65536
+#define SIZER_TARGET_MS 10
+#define SIZER_SAMPLE_MS 20
+#define SIZER_NOTSENT_LOWAT 131072
+// The measured rate moves 1/SIZER_RATE_WEIGHT of the way up to each sample,
+// and twice that down
+#define SIZER_RATE_WEIGHT 4
+
+
+typedef struct send_sizer {
+    int fd;
+    uint32_t size;          // of the next write
+    uint64_t rate;          // bytes per second the connection drains, 0 until known
+    uint32_t queued;        // in the send queue after the last write
+    uint64_t drained;       // bytes that left the queue since sample_us
+    long sample_us;
+} SendSizer;
+
+
+/*
+** Starts sizing the writes to fd, setting its TCP_NOTSENT_LOWAT.
+*/
+void sizer_init(SendSizer *sizer, int fd);
+
+/*
+** returns how many bytes to write next, at most SIZER_MAX_SIZE
+*/
+uint32_t sizer_next(SendSizer *sizer);
+
+/*
+** Accounts for a write of num bytes that just ended.
+*/
+void sizer_sent(SendSizer *sizer, uint32_t num);
+
+#endif // AS_SIZER_H_
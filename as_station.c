@@ -0,0 +1,283 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_station.h"
+#include "as_udp.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+// The most a listener copies out of the ring and sends at once
+#define STATION_SEND_SIZE 65536
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+static long _elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+           + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+
+static void _sleep_ms(long ms) {
+    struct timespec duration = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&duration, NULL);
+}
+
+
+static void _free_playlist(Station *station) {
+    for (int i = 0; i < station->num_tracks; i++) {
+        free(station->playlist[i]);
+    }
+    free(station->playlist);
+    station->playlist = NULL;
+    station->num_tracks = 0;
+}
+
+
+static int _load_playlist(Station *station, const char *playlist_path) {
+    FILE *playlist = fopen(playlist_path, "r");
+    if (playlist == NULL) {
+        perror("station_start: fopen");
+        return -1;
+    }
+
+    char line[MAX_PATH];
+    while (fgets(line, sizeof(line), playlist) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        char **tracks = realloc(station->playlist, (station->num_tracks + 1) * sizeof(char *));
+        if (tracks == NULL) {
+            perror("station_start: realloc");
+            fclose(playlist);
+            return -1;
+        }
+        station->playlist = tracks;
+        station->playlist[station->num_tracks] = strdup(line);
+        if (station->playlist[station->num_tracks] == NULL) {
+            perror("station_start: strdup");
+            fclose(playlist);
+            return -1;
+        }
+        station->num_tracks++;
+    }
+    fclose(playlist);
+
+    if (station->num_tracks == 0) {
+        ERR_PRINT("Playlist %s has no tracks\n", playlist_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: _station_produce
+** Appends the track open at fd to the ring, at the rate it plays at.
+**
+** returns 0 once the whole track is in the ring, -1 on error
+*/
+static int _produce_track(StationRing *ring, int fd, uint32_t byte_rate) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t written = 0;
+    while (1) {
+        uint64_t due = (uint64_t)_elapsed_ms(&start) * byte_rate / 1000;
+        if (written >= due) {
+            _sleep_ms(STATION_TICK_MS);
+            continue;
+        }
+
+        // Only the producer writes head, so it can read it plainly
+        uint64_t head = ring->head;
+        size_t offset = head % STATION_RING_SIZE;
+        size_t count = MIN(due - written, MIN(STATION_WRITE_MAX, STATION_RING_SIZE - offset));
+        ssize_t num = read(fd, ring->data + offset, count);
+        if (num == -1 && errno == EINTR) {
+            continue;
+        }
+        if (num <= 0) {
+            if (num == -1) {
+                perror("station: read");
+            }
+            return num;
+        }
+        __atomic_store_n(&ring->head, head + num, __ATOMIC_RELEASE);
+        written += num;
+    }
+}
+
+
+/*
+** Runs in the producer process: plays the playlist in a loop, skipping the
+** tracks that can't be opened, until none can.
+*/
+static void _station_produce(Station *station) {
+    StationRing *ring = station->ring;
+    int num_failed = 0;
+    for (int track = 0; num_failed < station->num_tracks; track = (track + 1) % station->num_tracks) {
+        char *path = _join_path(station->library_path, station->playlist[track]);
+        int fd = path == NULL ? -1 : open(path, O_RDONLY);
+        free(path);
+        if (fd == -1) {
+            ERR_PRINT("Station can't play %s\n", station->playlist[track]);
+            num_failed++;
+            continue;
+        }
+        num_failed = 0;
+
+        uint32_t byte_rate = udp_byte_rate(fd);
+        __atomic_store_n(&ring->byte_rate, byte_rate, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->track, track, __ATOMIC_RELAXED);
+        printf("Station now playing %s\n", station->playlist[track]);
+        int result = _produce_track(ring, fd, byte_rate);
+        close(fd);
+        if (result == -1) {
+            num_failed++;
+        }
+    }
+    ERR_PRINT("Station has no playable tracks left\n");
+    __atomic_store_n(&ring->running, 0, __ATOMIC_RELEASE);
+}
+
+
+int station_start(Station *station, const char *library_path, const char *playlist_path) {
+    memset(station, 0, sizeof(Station));
+    station->library_path = library_path;
+    if (_load_playlist(station, playlist_path) == -1) {
+        _free_playlist(station);
+        return -1;
+    }
+
+    StationRing *ring = mmap(NULL, sizeof(StationRing), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("station_start: mmap");
+        _free_playlist(station);
+        return -1;
+    }
+    ring->running = 1;
+    station->ring = ring;
+
+    fflush(stdout);
+    station->producer = fork();
+    if (station->producer == -1) {
+        perror("station_start: fork");
+        station_stop(station);
+        return -1;
+    }
+    if (station->producer == 0) {
+#ifdef __linux__
+        // Don't outlive a server that exits without stopping the station
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        _station_produce(station);
+        _exit(1);
+    }
+
+    printf("Station started with %d tracks\n", station->num_tracks);
+    return 0;
+}
+
+
+void station_stop(Station *station) {
+    if (station->producer > 0) {
+        kill(station->producer, SIGTERM);
+        waitpid(station->producer, NULL, 0);
+        station->producer = 0;
+    }
+    if (station->ring != NULL) {
+        munmap(station->ring, sizeof(StationRing));
+        station->ring = NULL;
+    }
+    _free_playlist(station);
+}
+
+
+/*
+** Helper for: station_listen
+** returns the position STATION_PREFILL_MS behind the live edge at head.
+*/
+static uint64_t _tune_in_position(const StationRing *ring, uint64_t head) {
+    uint64_t prefill = (uint64_t)__atomic_load_n(&ring->byte_rate, __ATOMIC_RELAXED)
+                       * STATION_PREFILL_MS / 1000;
+    return head - MIN(head, prefill);
+}
+
+
+int station_listen(const Station *station, int sockfd, StationListenerStats *stats) {
+    StationRing *ring = station->ring;
+    // A send that blocks this long means the listener has stalled
+    struct timeval stall = {STATION_STALL_MS / 1000, (STATION_STALL_MS % 1000) * 1000};
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall)) == -1) {
+        perror("station_listen: setsockopt");
+        return -1;
+    }
+    uint8_t *buf = malloc(STATION_SEND_SIZE);
+    if (buf == NULL) {
+        perror("station_listen: malloc");
+        return -1;
+    }
+
+    int result = 0;
+    uint64_t position = _tune_in_position(ring, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+    while (1) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        // The producer may be writing up to STATION_WRITE_MAX bytes past head,
+        // over the oldest data in the ring
+        if (head - position > STATION_RING_SIZE - STATION_WRITE_MAX) {
+            uint64_t live = _tune_in_position(ring, head);
+            stats->skips++;
+            stats->bytes_skipped += live - position;
+            position = live;
+            continue;
+        }
+        if (head == position) {
+            if (!__atomic_load_n(&ring->running, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            _sleep_ms(STATION_TICK_MS);
+            continue;
+        }
+
+        size_t offset = position % STATION_RING_SIZE;
+        size_t count = MIN(head - position, MIN(STATION_SEND_SIZE, STATION_RING_SIZE - offset));
+        memcpy(buf, ring->data + offset, count);
+        // Only send what the producer did not overwrite while it was copied
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        if (head - position > STATION_RING_SIZE - STATION_WRITE_MAX) {
+            continue;
+        }
+
+        ssize_t num = send(sockfd, buf, count, MSG_NOSIGNAL);
+        __atomic_fetch_add(&io_stats.write_calls, 1, __ATOMIC_RELAXED);
+        if (num == -1 && errno == EINTR) {
+            continue;
+        }
+        if (num == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stats->dropped = 1;
+            } else if (errno != EPIPE && errno != ECONNRESET) {
+                perror("station_listen: send");
+                result = -1;
+            }
+            break;
+        }
+        __atomic_fetch_add(&io_stats.bytes_written, num, __ATOMIC_RELAXED);
+        stats->bytes_sent += num;
+        position += num;
+    }
+    free(buf);
+    return result;
+}
@@ -0,0 +1,108 @@
+#ifndef AS_STATION_H_
+#define AS_STATION_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** Station
+** -------
+** A radio-style channel: one producer process reads the tracks of a playlist
+** from the library, one after the other and at the rate they play at, into a
+** ring buffer in shared memory. Every client process that tunes in sends
+** what the producer wrote from the ring, so the files are read from disk once
+** however many listeners there are.
+**
+** The ring is mapped before the server forks, so the producer and every
+** client process share it. The producer only ever appends: head counts every
+** byte written since the station started, and the byte at position p lives at
+** data[p % STATION_RING_SIZE] until the producer comes round again. Listeners
+** never hold the producer up; each keeps its own position, and checks after
+** copying data out that the producer has not overwritten it meanwhile.
+**
+** A new listener starts STATION_PREFILL_MS behind the live edge. One that
+** falls so far behind that its position is about to be overwritten skips
+** forward to the same place, and one whose connection takes no data for
+** STATION_STALL_MS is dropped.
+**
+** The station's stream is the tracks' bytes back to back, with nothing in
+** between, so a playlist should hold tracks of a single format that players
+** can join mid-stream, such as MP3.
+*/
+#define STATION_RING_SIZE (1 << 21)
+// The most the producer writes at once, so listeners know how much past the
+// head may already be changing
+#define STATION_WRITE_MAX 16384
+#define STATION_TICK_MS 20
+#define STATION_PREFILL_MS 500
+#define STATION_STALL_MS 5000
+// Size announced to listeners, as the stream has no end
+#define STATION_LIVE_SIZE UINT32_MAX
+
+
+/*
+** Shared between the producer and the listeners. head is only written by the
+** producer, and read by the listeners with atomic loads.
+*/
+typedef struct station_ring {
+    uint64_t head;
+    uint32_t byte_rate;     // of the track being played
+    uint32_t track;         // its position in the playlist
+    uint8_t running;        // cleared when the producer stops
+    uint8_t data[STATION_RING_SIZE];
+} StationRing;
+
+
+/*
+** ring: the shared ring, NULL when there is no station.
+** producer: pid of the producer process.
+** playlist: paths in the library of the num_tracks tracks, played in a loop.
+*/
+typedef struct station {
+    StationRing *ring;
+    pid_t producer;
+    const char *library_path;
+    char **playlist;
+    int num_tracks;
+} Station;
+
+
+/*
+** What a listener was sent, and how often it had to skip forward.
+*/
+typedef struct station_listener_stats {
+    uint64_t bytes_sent;
+    uint32_t skips;
+    uint64_t bytes_skipped;
+    uint8_t dropped;
+} StationListenerStats;
+
+
+/*
+** Reads the playlist at playlist_path, one library path per line, maps the
+** ring and forks the producer, which then plays the playlist in a loop until
+** station_stop. The paths are relative to library_path.
+**
+** returns 0 on success, -1 on error
+*/
+int station_start(Station *station, const char *library_path, const char *playlist_path);
+
+/*
+** Stops the producer, unmaps the ring and frees the playlist.
+*/
+void station_stop(Station *station);
+
+/*
+** Sends the station's stream to the connected socket sockfd from
+** STATION_PREFILL_MS behind the live edge, until the client disconnects, is
+** dropped for stalling, or the producer stops.
+**
+** returns 0 once the client is gone, -1 on error
+*/
+int station_listen(const Station *station, int sockfd, StationListenerStats *stats);
+
+#endif // AS_STATION_H_
@@ -0,0 +1,388 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_stats.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+// Room for the report's lines
+#define STATS_REPORT_SIZE 8192
+
+static const char *request_names[] = {"LIST", "STAT", "STREAM", "USTREAM", "STATION",
+                                      "STATS", "SEARCH", "BROWSE", "SEEK", "WAVEFORM",
+                                      "other"};
+static const char *phase_names[] = {"prepare", "read", "send"};
+
+// The shard the process counts in, see stats_bind
+static StatsShard *shard = NULL;
+// The statistics it is bound to, for its devices
+static ServerStats *bound = NULL;
+
+
+static void _count(uint64_t *counter, uint64_t num) {
+    __atomic_fetch_add(counter, num, __ATOMIC_RELAXED);
+}
+
+
+static uint64_t _load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+long stats_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+ServerStats *stats_create(void) {
+    ServerStats *stats = mmap(NULL, sizeof(ServerStats), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("stats_create: mmap");
+        return NULL;
+    }
+    stats->started_us = stats_now_us();
+    return stats;
+}
+
+
+void stats_destroy(ServerStats *stats) {
+    if (stats != NULL) {
+        munmap(stats, sizeof(ServerStats));
+    }
+}
+
+
+void stats_bind(ServerStats *stats) {
+    shard = stats != NULL ? &stats->shards[getpid() % STATS_SHARDS] : NULL;
+    bound = stats;
+}
+
+
+void stats_connection_opened(void) {
+    if (shard != NULL) {
+        _count(&shard->connections, 1);
+        __atomic_fetch_add(&shard->active, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+void stats_connection_closed(void) {
+    if (shard != NULL) {
+        __atomic_fetch_sub(&shard->active, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+void stats_v2_connection(void) {
+    if (shard != NULL) {
+        _count(&shard->v2_connections, 1);
+    }
+}
+
+
+void stats_refused(void) {
+    if (shard != NULL) {
+        _count(&shard->refused, 1);
+    }
+}
+
+
+/*
+** returns the histogram bucket of value, see as_stats.h
+*/
+static int _bucket_of(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > STATS_MAX_EXPONENT) {
+        return STATS_BUCKETS - 1;
+    }
+    int sub_bucket = (value >> (exponent - STATS_SUB_BUCKET_BITS)) - STATS_SUB_BUCKETS;
+    return (exponent - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub_bucket;
+}
+
+
+/*
+** returns the largest value in the histogram bucket
+*/
+static uint64_t _bucket_max(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = bucket / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (exponent - STATS_SUB_BUCKET_BITS);
+    return (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) * width + width - 1;
+}
+
+
+void stats_request_done(StatsRequest request, long start_us, int result) {
+    if (shard == NULL) {
+        return;
+    }
+    long elapsed_us = stats_now_us() - start_us;
+    _count(&shard->requests[request], 1);
+    if (result < 0) {
+        _count(&shard->errors[request], 1);
+    }
+    _count(&shard->latency_us[request][_bucket_of(MAX(elapsed_us, 0))], 1);
+}
+
+
+void stats_phase_done(StatsPhase phase, long start_us) {
+    if (shard != NULL) {
+        _count(&shard->phase_us[phase], stats_now_us() - start_us);
+    }
+}
+
+
+void stats_bytes_sent(uint64_t num) {
+    if (shard != NULL) {
+        _count(&shard->bytes_sent, num);
+    }
+}
+
+
+void stats_edge(StatsEdge event, uint64_t num) {
+    if (shard != NULL) {
+        _count(&shard->edge[event], 1);
+        _count(&shard->edge_bytes_fetched, num);
+    }
+}
+
+
+int stats_device(uint64_t dev, const char *name) {
+    if (bound == NULL) {
+        return -1;
+    }
+    // Slots are claimed in order and never given back
+    int device;
+    for (device = 0; device < STATS_MAX_DEVICES; device++) {
+        StatsDevice *slot = &bound->devices[device];
+        if (!__atomic_load_n(&slot->claimed, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (slot->dev == dev) {
+            return device;
+        }
+    }
+    // Another process may claim it meanwhile, so look again holding the lock
+    while (__atomic_exchange_n(&bound->devices_lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    for (; device < STATS_MAX_DEVICES; device++) {
+        StatsDevice *slot = &bound->devices[device];
+        if (!__atomic_load_n(&slot->claimed, __ATOMIC_ACQUIRE)) {
+            slot->dev = dev;
+            if (name != NULL) {
+                snprintf(slot->name, sizeof(slot->name), "%s", name);
+            }
+            __atomic_store_n(&slot->claimed, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        if (slot->dev == dev) {
+            break;
+        }
+    }
+    __atomic_store_n(&bound->devices_lock, 0, __ATOMIC_RELEASE);
+    return device < STATS_MAX_DEVICES ? device : -1;
+}
+
+
+void stats_device_queued(int device) {
+    if (bound == NULL || device < 0) {
+        return;
+    }
+    StatsDevice *slot = &bound->devices[device];
+    int64_t depth = __atomic_add_fetch(&slot->depth, 1, __ATOMIC_RELAXED);
+    int64_t max_depth = __atomic_load_n(&slot->max_depth, __ATOMIC_RELAXED);
+    while (depth > max_depth &&
+           !__atomic_compare_exchange_n(&slot->max_depth, &max_depth, depth, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+void stats_device_done(int device, long queued_us, ssize_t result) {
+    if (bound == NULL || device < 0) {
+        return;
+    }
+    StatsDevice *slot = &bound->devices[device];
+    long elapsed_us = stats_now_us() - queued_us;
+    __atomic_fetch_sub(&slot->depth, 1, __ATOMIC_RELAXED);
+    _count(&slot->reads, 1);
+    if (result < 0) {
+        _count(&slot->errors, 1);
+    } else {
+        _count(&slot->bytes, result);
+    }
+    _count(&slot->latency_us[_bucket_of(MAX(elapsed_us, 0))], 1);
+}
+
+
+void stats_device_cancelled(int device) {
+    if (bound != NULL && device >= 0) {
+        __atomic_fetch_sub(&bound->devices[device].depth, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+** Helper for: stats_format
+** returns the p-th quantile of the histogram of num values, in milliseconds,
+** 0 for an empty one
+*/
+static double _percentile_ms(const uint64_t *histogram, uint64_t num, double p) {
+    if (num == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * num + 0.999999);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += histogram[bucket];
+        if (seen >= MAX(rank, 1)) {
+            return _bucket_max(bucket) / 1000.0;
+        }
+    }
+    return _bucket_max(STATS_BUCKETS - 1) / 1000.0;
+}
+
+
+char *stats_format(const ServerStats *stats, int *len) {
+    // Add the shards up first, so each counter is only read once
+    uint64_t connections = 0, v2_connections = 0, refused = 0, bytes_sent = 0;
+    int64_t active = 0;
+    uint64_t requests[STATS_NUM_REQUESTS] = {0}, errors[STATS_NUM_REQUESTS] = {0};
+    uint64_t phase_us[STATS_NUM_PHASES] = {0};
+    uint64_t edge[STATS_NUM_EDGE] = {0}, edge_bytes_fetched = 0;
+    uint64_t (*latency_us)[STATS_BUCKETS] = calloc(STATS_NUM_REQUESTS, sizeof(*latency_us));
+    char *report = malloc(STATS_REPORT_SIZE);
+    if (latency_us == NULL || report == NULL) {
+        perror("stats_format");
+        free(latency_us);
+        free(report);
+        return NULL;
+    }
+
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        const StatsShard *s = &stats->shards[i];
+        connections += _load(&s->connections);
+        active += __atomic_load_n(&s->active, __ATOMIC_RELAXED);
+        v2_connections += _load(&s->v2_connections);
+        refused += _load(&s->refused);
+        bytes_sent += _load(&s->bytes_sent);
+        for (int request = 0; request < STATS_NUM_REQUESTS; request++) {
+            requests[request] += _load(&s->requests[request]);
+            errors[request] += _load(&s->errors[request]);
+            for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+                latency_us[request][bucket] += _load(&s->latency_us[request][bucket]);
+            }
+        }
+        for (int phase = 0; phase < STATS_NUM_PHASES; phase++) {
+            phase_us[phase] += _load(&s->phase_us[phase]);
+        }
+        for (int event = 0; event < STATS_NUM_EDGE; event++) {
+            edge[event] += _load(&s->edge[event]);
+        }
+        edge_bytes_fetched += _load(&s->edge_bytes_fetched);
+    }
+
+    int offset = snprintf(report, STATS_REPORT_SIZE,
+                          "Up %.1f s: %llu connections (%lld active, %llu v2), %llu refused busy, "
+                          "%llu KiB sent\n"
+                          "%-8s %10s %8s %10s %10s %10s %10s\n",
+                          (stats_now_us() - stats->started_us) / 1e6,
+                          (unsigned long long)connections, (long long)MAX(active, 0),
+                          (unsigned long long)v2_connections, (unsigned long long)refused,
+                          (unsigned long long)bytes_sent / 1024,
+                          "request", "count", "errors", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int request = 0; request < STATS_NUM_REQUESTS; request++) {
+        uint64_t num = 0;
+        for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+            num += latency_us[request][bucket];
+        }
+        if (requests[request] == 0 && num == 0) {
+            continue;
+        }
+        offset += snprintf(report + offset, STATS_REPORT_SIZE - offset,
+                           "%-8s %10llu %8llu %10.3f %10.3f %10.3f %10.3f\n",
+                           request_names[request], (unsigned long long)requests[request],
+                           (unsigned long long)errors[request],
+                           _percentile_ms(latency_us[request], num, 0.5),
+                           _percentile_ms(latency_us[request], num, 0.99),
+                           _percentile_ms(latency_us[request], num, 0.999),
+                           _percentile_ms(latency_us[request], num, 1));
+    }
+    offset += snprintf(report + offset, STATS_REPORT_SIZE - offset, "Time spent:");
+    for (int phase = 0; phase < STATS_NUM_PHASES; phase++) {
+        offset += snprintf(report + offset, STATS_REPORT_SIZE - offset, " %s %.3f s%s",
+                           phase_names[phase], phase_us[phase] / 1e6,
+                           phase + 1 < STATS_NUM_PHASES ? "," : "\n");
+    }
+
+    if (edge[STATS_EDGE_HIT] + edge[STATS_EDGE_MISS] + edge[STATS_EDGE_FOLLOW] > 0) {
+        offset += snprintf(report + offset, STATS_REPORT_SIZE - offset,
+                           "Edge: %llu hits, %llu misses, %llu followed fetches, "
+                           "%llu fetched (%llu KiB), %llu failed\n",
+                           (unsigned long long)edge[STATS_EDGE_HIT],
+                           (unsigned long long)edge[STATS_EDGE_MISS],
+                           (unsigned long long)edge[STATS_EDGE_FOLLOW],
+                           (unsigned long long)edge[STATS_EDGE_FETCHED],
+                           (unsigned long long)edge_bytes_fetched / 1024,
+                           (unsigned long long)edge[STATS_EDGE_FAILED]);
+    }
+
+    // Devices' histograms are not sharded, they are read as they are
+    uint8_t header = 0;
+    for (int device = 0; device < STATS_MAX_DEVICES; device++) {
+        const StatsDevice *slot = &stats->devices[device];
+        if (!__atomic_load_n(&slot->claimed, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (!header) {
+            offset += snprintf(report + offset, STATS_REPORT_SIZE - offset,
+                               "%-8s %-24s %6s %6s %10s %8s %8s %10s %10s %10s\n",
+                               "device", "library", "queued", "max", "reads", "errors",
+                               "MiB", "p50 ms", "p99 ms", "max ms");
+            header = 1;
+        }
+        uint64_t num = 0;
+        for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+            num += _load(&slot->latency_us[bucket]);
+        }
+        char dev[16];
+        snprintf(dev, sizeof(dev), "%u:%u", major(slot->dev), minor(slot->dev));
+        offset += snprintf(report + offset, STATS_REPORT_SIZE - offset,
+                           "%-8s %-24.24s %6lld %6lld %10llu %8llu %8.1f %10.3f %10.3f %10.3f\n",
+                           dev, slot->name[0] != '\0' ? slot->name : "-",
+                           (long long)MAX(__atomic_load_n(&slot->depth, __ATOMIC_RELAXED), 0),
+                           (long long)__atomic_load_n(&slot->max_depth, __ATOMIC_RELAXED),
+                           (unsigned long long)_load(&slot->reads),
+                           (unsigned long long)_load(&slot->errors),
+                           _load(&slot->bytes) / 1048576.0,
+                           _percentile_ms(slot->latency_us, num, 0.5),
+                           _percentile_ms(slot->latency_us, num, 0.99),
+                           _percentile_ms(slot->latency_us, num, 1));
+    }
+
+    free(latency_us);
+    *len = offset;
+    return report;
+}
+
+
+void stats_print(const ServerStats *stats) {
+    int len;
+    char *report = stats_format(stats, &len);
+    if (report != NULL) {
+        fputs(report, stdout);
+        fflush(stdout);
+        free(report);
+    }
+}
@@ -0,0 +1,205 @@
+#ifndef AS_STATS_H_
+#define AS_STATS_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** Server statistics
+** -----------------
+** Every client process counts what it does in shared memory, mapped before
+** the server forks: connections, requests and errors by type, bytes sent,
+** the time spent in each phase of a request, and a latency histogram per
+** type of request. Counters are only ever added to, with relaxed atomics and
+** no locks, so counting costs a few instructions on the hot path.
+**
+** To keep processes off each other's cache lines, the counters are split in
+** STATS_SHARDS shards, and each process counts in the shard of its pid. A
+** report adds up the shards; it is not a snapshot of a single instant, but
+** every counter in it is exact.
+**
+** The histograms are log-linear like HDR histograms: values under
+** STATS_SUB_BUCKETS microseconds get a bucket each, and every power of two
+** above that is split in STATS_SUB_BUCKETS buckets, so a percentile is within
+** 1/STATS_SUB_BUCKETS (12.5%) of the real value, up to 2^STATS_MAX_EXPONENT us.
+**
+** Reads queued on a device's worker (see as_disk.h) are counted apart, under
+** the device, in one of STATS_MAX_DEVICES slots that processes claim as they
+** first read from it: their number, the bytes they returned, how many are
+** queued now and at most, and a histogram of their latency. The server
+** claims the devices of its library directories before it forks, so the
+** report names the directory on each.
+**
+** An edge (see as_edge.h) also counts how its STREAMs were served: from its
+** cache, by fetching the file from its upstream, or by following a fetch
+** already under way, and how many fetches were done, or failed.
+*/
+#define STATS_SHARDS 16
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_MAX_EXPONENT 35
+#define STATS_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BUCKET_BITS + 2) * STATS_SUB_BUCKETS)
+#define STATS_MAX_DEVICES 16
+#define STATS_DEVICE_NAME_SIZE 48
+
+
+typedef enum {
+    STATS_LIST,
+    STATS_STAT,
+    STATS_STREAM,
+    STATS_USTREAM,
+    STATS_STATION,
+    STATS_STATS,
+    STATS_SEARCH,
+    STATS_BROWSE,
+    STATS_SEEK,
+    STATS_WAVEFORM,
+    STATS_UNKNOWN,
+    STATS_NUM_REQUESTS
+} StatsRequest;
+
+
+/*
+** prepare: parsing a request, opening its file and building its response.
+** read: reading files to stream.
+** send: writing responses to clients.
+*/
+typedef enum {STATS_PHASE_PREPARE, STATS_PHASE_READ, STATS_PHASE_SEND, STATS_NUM_PHASES} StatsPhase;
+
+
+typedef enum {
+    STATS_EDGE_HIT,
+    STATS_EDGE_MISS,
+    STATS_EDGE_FOLLOW,
+    STATS_EDGE_FETCHED,
+    STATS_EDGE_FAILED,
+    STATS_NUM_EDGE
+} StatsEdge;
+
+
+typedef struct stats_shard {
+    uint64_t connections;
+    int64_t active;         // opened minus closed, may be negative in a shard
+    uint64_t v2_connections;
+    uint64_t refused;       // connections and streams shed as busy
+    uint64_t bytes_sent;
+    uint64_t requests[STATS_NUM_REQUESTS];
+    uint64_t errors[STATS_NUM_REQUESTS];
+    uint64_t phase_us[STATS_NUM_PHASES];
+    uint64_t edge[STATS_NUM_EDGE];
+    uint64_t edge_bytes_fetched;
+    uint64_t latency_us[STATS_NUM_REQUESTS][STATS_BUCKETS];
+} __attribute__((aligned(64))) StatsShard;
+
+
+/*
+** claimed: set once dev and name are, by the process that claimed the slot.
+** name: the library directory on the device, empty if none is.
+** depth: reads queued now, max_depth: at most.
+*/
+typedef struct stats_device {
+    uint32_t claimed;
+    uint64_t dev;
+    char name[STATS_DEVICE_NAME_SIZE];
+    int64_t depth;
+    int64_t max_depth;
+    uint64_t reads;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t latency_us[STATS_BUCKETS];
+} __attribute__((aligned(64))) StatsDevice;
+
+
+/*
+** devices_lock: held while claiming a device's slot.
+*/
+typedef struct server_stats {
+    long started_us;
+    StatsShard shards[STATS_SHARDS];
+    uint32_t devices_lock;
+    StatsDevice devices[STATS_MAX_DEVICES];
+} ServerStats;
+
+
+/*
+** Maps zeroed statistics shared with every process forked afterwards.
+**
+** returns the statistics, NULL on error
+*/
+ServerStats *stats_create(void);
+
+/*
+** Unmaps the statistics.
+*/
+void stats_destroy(ServerStats *stats);
+
+/*
+** Makes the calling process count in its shard of stats from now on. Until
+** a process is bound, or when stats is NULL, counting does nothing.
+*/
+void stats_bind(ServerStats *stats);
+
+/*
+** returns the monotonic time in microseconds, to time requests and phases
+*/
+long stats_now_us(void);
+
+void stats_connection_opened(void);
+void stats_connection_closed(void);
+void stats_v2_connection(void);
+void stats_refused(void);
+
+/*
+** Counts a request of type request that started at start_us, and an error
+** if result is negative.
+*/
+void stats_request_done(StatsRequest request, long start_us, int result);
+
+/*
+** Counts the time since start_us as spent in phase.
+*/
+void stats_phase_done(StatsPhase phase, long start_us);
+
+void stats_bytes_sent(uint64_t num);
+
+/*
+** Counts an edge's event, with the num bytes fetched for STATS_EDGE_FETCHED.
+*/
+void stats_edge(StatsEdge event, uint64_t num);
+
+/*
+** Finds the slot of device dev, claiming a free one under name, which may be
+** NULL, if it has none.
+**
+** returns the device's slot, -1 if there is no free one or the process is
+** not bound
+*/
+int stats_device(uint64_t dev, const char *name);
+
+/*
+** Counts a read queued on device, then either done at result, as by
+** flight_read, having been queued at queued_us, or cancelled before it was
+** made. A device of -1 counts nothing.
+*/
+void stats_device_queued(int device);
+void stats_device_done(int device, long queued_us, ssize_t result);
+void stats_device_cancelled(int device);
+
+/*
+** Adds up the shards of stats into a report.
+**
+** returns the heap-allocated report, of *len bytes and null-terminated, NULL
+** on error
+*/
+char *stats_format(const ServerStats *stats, int *len);
+
+/*
+** Prints the report of stats.
+*/
+void stats_print(const ServerStats *stats);
+
+#endif // AS_STATS_H_
@@ -0,0 +1,482 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_udp.h"
+
+#include <poll.h>
+
+// Datagrams the jitter buffer may have written out but not yet taken by the player
+#define UDP_OUTPUT_DATAGRAMS 64
+// How long to wait for the first datagram before giving up on the server
+#define UDP_FIRST_DATAGRAM_TIMEOUT_MS 2000
+
+
+void udp_encode_header(uint8_t *buf, const UdpHeader *header) {
+    uint32_t seq = htonl(header->seq);
+    uint32_t timestamp = htonl(header->timestamp);
+    uint16_t length = htons(header->length);
+    memcpy(buf, &seq, sizeof(uint32_t));
+    memcpy(buf + 4, &timestamp, sizeof(uint32_t));
+    memcpy(buf + 8, &length, sizeof(uint16_t));
+    buf[10] = header->flags;
+    buf[11] = 0;
+}
+
+
+void udp_decode_header(const uint8_t *buf, UdpHeader *header) {
+    uint32_t seq, timestamp;
+    uint16_t length;
+    memcpy(&seq, buf, sizeof(uint32_t));
+    memcpy(&timestamp, buf + 4, sizeof(uint32_t));
+    memcpy(&length, buf + 8, sizeof(uint16_t));
+    header->seq = ntohl(seq);
+    header->timestamp = ntohl(timestamp);
+    header->length = ntohs(length);
+    header->flags = buf[10];
+}
+
+
+uint32_t udp_byte_rate(int fd) {
+    // The canonical 44 byte header: "RIFF" <size> "WAVE" "fmt " ... with the
+    // byte rate as a little-endian 32-bit integer at offset 28
+    uint8_t header[44];
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        return UDP_DEFAULT_BYTE_RATE;
+    }
+    uint32_t byte_rate = header[28] | header[29] << 8 | header[30] << 16
+                         | (uint32_t)header[31] << 24;
+    return byte_rate > 0 ? byte_rate : UDP_DEFAULT_BYTE_RATE;
+}
+
+
+static long _elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+           + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+
+/*
+** Returns when the data of datagram seq is due, in milliseconds since the
+** start of the stream, at byte_rate.
+*/
+static long _schedule_ms(uint32_t seq, uint32_t byte_rate) {
+    return (long)((uint64_t)seq * UDP_PAYLOAD_SIZE * 1000 / byte_rate);
+}
+
+
+/*
+** Helper for: udp_send_file
+** Sends datagram seq, unless it is picked to be dropped.
+**
+** returns 0 on success, -1 on error
+*/
+static int _send_datagram(int udp_fd, int fd, uint32_t seq, uint32_t file_size, uint8_t flags,
+                          long now, int drop_percent, UdpStats *stats) {
+    uint8_t datagram[UDP_HEADER_SIZE + UDP_PAYLOAD_SIZE];
+    off_t offset = (off_t)seq * UDP_PAYLOAD_SIZE;
+    uint16_t length = MIN(UDP_PAYLOAD_SIZE, file_size - offset);
+    if (pread(fd, datagram + UDP_HEADER_SIZE, length, offset) != length) {
+        perror("udp_send_file: pread");
+        return -1;
+    }
+    if (offset + length == file_size) {
+        flags |= UDP_FLAG_END;
+    }
+    UdpHeader header = {seq, now, length, flags};
+    udp_encode_header(datagram, &header);
+
+    if (drop_percent > 0 && rand() % 100 < drop_percent) {
+        stats->dropped++;
+        return 0;
+    }
+    if (send(udp_fd, datagram, UDP_HEADER_SIZE + length, 0) == -1) {
+        perror("udp_send_file: send");
+        return -1;
+    }
+    stats->sent++;
+    if (flags & UDP_FLAG_RETRANSMIT) {
+        stats->retransmitted++;
+    }
+    return 0;
+}
+
+
+int udp_send_file(int udp_fd, int fd, uint32_t file_size, uint32_t byte_rate,
+                  int drop_percent, UdpStats *stats) {
+    uint32_t num_datagrams = (file_size + UDP_PAYLOAD_SIZE - 1) / UDP_PAYLOAD_SIZE;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t next_seq = 0;
+    long last_activity = 0;
+    while (1) {
+        long now = _elapsed_ms(&start);
+        // The first UDP_PREFILL_MS of audio leaves right away, the rest on schedule
+        while (next_seq < num_datagrams &&
+               _schedule_ms(next_seq, byte_rate) <= now + UDP_PREFILL_MS) {
+            if (_send_datagram(udp_fd, fd, next_seq, file_size, 0, now, drop_percent, stats) == -1) {
+                return -1;
+            }
+            next_seq++;
+            last_activity = now;
+        }
+
+        long timeout;
+        if (next_seq < num_datagrams) {
+            timeout = _schedule_ms(next_seq, byte_rate) - UDP_PREFILL_MS - now;
+        } else {
+            timeout = last_activity + UDP_LINGER_MS - now;
+            if (timeout <= 0) {
+                break;
+            }
+        }
+
+        struct pollfd udp_pollfd = {udp_fd, POLLIN, 0};
+        int ready = poll(&udp_pollfd, 1, MAX(timeout, 0));
+        if (ready == -1 && errno != EINTR) {
+            perror("udp_send_file: poll");
+            return -1;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        uint8_t datagram[UDP_HEADER_SIZE + UDP_MAX_NACK_SEQS * sizeof(uint32_t)];
+        ssize_t num = recv(udp_fd, datagram, sizeof(datagram), 0);
+        if (num < UDP_HEADER_SIZE) {
+            if (num == -1 && errno != EINTR) {
+                perror("udp_send_file: recv");
+                return -1;
+            }
+            continue;
+        }
+        UdpHeader header;
+        udp_decode_header(datagram, &header);
+        now = _elapsed_ms(&start);
+        last_activity = now;
+        if (header.flags & UDP_FLAG_DONE) {
+            break;
+        }
+        if (!(header.flags & UDP_FLAG_NACK)) {
+            continue;
+        }
+
+        int num_seqs = MIN(header.length, num - UDP_HEADER_SIZE) / sizeof(uint32_t);
+        for (int i = 0; i < num_seqs; i++) {
+            uint32_t seq;
+            memcpy(&seq, datagram + UDP_HEADER_SIZE + i * sizeof(uint32_t), sizeof(uint32_t));
+            seq = ntohl(seq);
+            if (seq < next_seq &&
+                _send_datagram(udp_fd, fd, seq, file_size, UDP_FLAG_RETRANSMIT, now,
+                               drop_percent, stats) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+** The jitter buffer holds the datagrams from next_seq on, each in the slot
+** of its sequence number modulo UDP_JITTER_SLOTS.
+*/
+typedef enum {SLOT_EMPTY, SLOT_MISSING, SLOT_PRESENT} SlotState;
+
+typedef struct jitter_slot {
+    SlotState state;
+    uint32_t seq;
+    uint16_t length;
+    uint8_t nacks;
+    long nacked_at;
+    long arrived_at;
+    uint8_t data[UDP_PAYLOAD_SIZE];
+} JitterSlot;
+
+typedef struct jitter_buffer {
+    int udp_fd;
+    uint32_t file_size;
+    uint32_t byte_rate;
+    uint32_t num_datagrams;
+    JitterSlot *slots;
+    uint32_t next_seq;      // next datagram to hand to the player
+    uint32_t end_seq;       // one past the latest datagram received
+    // local time of the start of the server's schedule, once known
+    uint8_t has_clock;
+    long clock_ms;
+    long last_transit;
+
+    uint8_t *out;
+    int out_start;
+    int out_end;
+    UdpStats *stats;
+} JitterBuffer;
+
+
+/*
+** Returns when datagram seq must be played, in the receiver's clock.
+*/
+static long _deadline_ms(const JitterBuffer *jb, uint32_t seq) {
+    return jb->clock_ms + _schedule_ms(seq, jb->byte_rate) + (long)jb->stats->target_delay_ms;
+}
+
+
+static void _jitter_receive(JitterBuffer *jb, const uint8_t *datagram, ssize_t num, long now) {
+    UdpStats *stats = jb->stats;
+    if (num < UDP_HEADER_SIZE) {
+        return;
+    }
+    UdpHeader header;
+    udp_decode_header(datagram, &header);
+    if (header.seq >= jb->num_datagrams || header.length > UDP_PAYLOAD_SIZE ||
+        num != UDP_HEADER_SIZE + header.length) {
+        return;
+    }
+    stats->received++;
+    if (stats->received == 1) {
+        stats->first_datagram_ms = now;
+    }
+
+    // Retransmits are off schedule, only first transmissions time the network
+    if (!(header.flags & UDP_FLAG_RETRANSMIT)) {
+        long transit = now - header.timestamp;
+        if (stats->received > 1) {
+            long delta = labs(transit - jb->last_transit);
+            stats->jitter_ms += (delta - stats->jitter_ms) / 16;
+        }
+        jb->last_transit = transit;
+
+        stats->target_delay_ms = MIN(UDP_JITTER_MAX_MS, UDP_JITTER_MIN_MS + 4 * stats->jitter_ms);
+        // The server's schedule starts when it sends the first datagram, which
+        // is the fastest transit seen after its timestamp of 0
+        if (!jb->has_clock || transit < jb->clock_ms) {
+            jb->clock_ms = transit;
+            jb->has_clock = 1;
+        }
+    }
+
+    if (header.seq < jb->next_seq) {
+        stats->late++;
+        return;
+    }
+    if (header.seq >= jb->next_seq + UDP_JITTER_SLOTS) {
+        // No room yet, it is NACKed again once there is
+        return;
+    }
+
+    JitterSlot *slot = &jb->slots[header.seq % UDP_JITTER_SLOTS];
+    if (slot->state == SLOT_PRESENT) {
+        stats->duplicates++;
+        return;
+    }
+    if (slot->state == SLOT_MISSING) {
+        stats->recovered++;
+    }
+    if (header.seq < jb->end_seq && !(header.flags & UDP_FLAG_RETRANSMIT)) {
+        stats->reordered++;
+    }
+    slot->state = SLOT_PRESENT;
+    slot->seq = header.seq;
+    slot->length = header.length;
+    slot->arrived_at = now;
+    memcpy(slot->data, datagram + UDP_HEADER_SIZE, header.length);
+
+    // Everything skipped over is missing, and NACKed right away
+    for (uint32_t seq = jb->end_seq; seq < header.seq; seq++) {
+        JitterSlot *gap = &jb->slots[seq % UDP_JITTER_SLOTS];
+        if (seq >= jb->next_seq && gap->state == SLOT_EMPTY) {
+            gap->state = SLOT_MISSING;
+            gap->seq = seq;
+            gap->nacks = 0;
+            gap->nacked_at = now - UDP_NACK_RETRY_MS;
+        }
+    }
+    jb->end_seq = MAX(jb->end_seq, header.seq + 1);
+}
+
+
+/*
+** Sends one NACK for every missing datagram due for one.
+**
+** returns the time until the next NACK is due, -1 if there is none
+*/
+static long _jitter_send_nacks(JitterBuffer *jb, long now) {
+    uint8_t datagram[UDP_HEADER_SIZE + UDP_MAX_NACK_SEQS * sizeof(uint32_t)];
+    int num_seqs = 0;
+    long next_due = -1;
+    for (uint32_t seq = jb->next_seq; seq < jb->end_seq; seq++) {
+        JitterSlot *slot = &jb->slots[seq % UDP_JITTER_SLOTS];
+        if (slot->state != SLOT_MISSING || slot->nacks >= UDP_MAX_NACKS) {
+            continue;
+        }
+        long due = slot->nacked_at + UDP_NACK_RETRY_MS - now;
+        if (due > 0 || num_seqs == UDP_MAX_NACK_SEQS) {
+            next_due = next_due == -1 ? MAX(due, 1) : MIN(next_due, MAX(due, 1));
+            continue;
+        }
+        uint32_t network_seq = htonl(seq);
+        memcpy(datagram + UDP_HEADER_SIZE + num_seqs * sizeof(uint32_t), &network_seq,
+               sizeof(uint32_t));
+        num_seqs++;
+        slot->nacks++;
+        slot->nacked_at = now;
+        if (slot->nacks < UDP_MAX_NACKS) {
+            next_due = next_due == -1 ? UDP_NACK_RETRY_MS : MIN(next_due, UDP_NACK_RETRY_MS);
+        }
+    }
+
+    if (num_seqs > 0) {
+        UdpHeader header = {0, now, num_seqs * sizeof(uint32_t), UDP_FLAG_NACK};
+        udp_encode_header(datagram, &header);
+        if (send(jb->udp_fd, datagram, UDP_HEADER_SIZE + header.length, 0) == -1) {
+            perror("udp_receive_file: send");
+        }
+        jb->stats->nacks_sent += num_seqs;
+    }
+    return next_due;
+}
+
+
+/*
+** Moves datagrams that are in order, or whose deadline passed, to the output.
+**
+** returns the time until the deadline of the missing datagram the buffer is
+** waiting on, -1 if it is not waiting on one
+*/
+static long _jitter_release(JitterBuffer *jb, long now) {
+    while (jb->next_seq < jb->num_datagrams &&
+           UDP_OUTPUT_DATAGRAMS * UDP_PAYLOAD_SIZE - jb->out_end >= UDP_PAYLOAD_SIZE) {
+        JitterSlot *slot = &jb->slots[jb->next_seq % UDP_JITTER_SLOTS];
+        if (slot->state == SLOT_PRESENT && slot->seq == jb->next_seq) {
+            memcpy(jb->out + jb->out_end, slot->data, slot->length);
+            jb->out_end += slot->length;
+            long waited = now - slot->arrived_at;
+            jb->stats->buffer_delay_ms += waited;
+            jb->stats->max_buffer_delay_ms = MAX(jb->stats->max_buffer_delay_ms, waited);
+        } else if (!jb->has_clock) {
+            return -1;
+        } else if (now >= _deadline_ms(jb, jb->next_seq)) {
+            // Too late to wait any longer, play silence in its place
+            off_t offset = (off_t)jb->next_seq * UDP_PAYLOAD_SIZE;
+            int length = MIN(UDP_PAYLOAD_SIZE, jb->file_size - offset);
+            memset(jb->out + jb->out_end, 0, length);
+            jb->out_end += length;
+            jb->stats->lost++;
+        } else {
+            return _deadline_ms(jb, jb->next_seq) - now;
+        }
+        slot->state = SLOT_EMPTY;
+        jb->next_seq++;
+    }
+    return -1;
+}
+
+
+int udp_receive_file(int udp_fd, uint32_t file_size, uint32_t byte_rate, int audio_out_fd,
+                     const struct timespec *request_start, UdpStats *stats) {
+    JitterBuffer jb;
+    memset(&jb, 0, sizeof(JitterBuffer));
+    jb.udp_fd = udp_fd;
+    jb.file_size = file_size;
+    jb.byte_rate = byte_rate > 0 ? byte_rate : UDP_DEFAULT_BYTE_RATE;
+    jb.num_datagrams = (file_size + UDP_PAYLOAD_SIZE - 1) / UDP_PAYLOAD_SIZE;
+    jb.stats = stats;
+    stats->target_delay_ms = UDP_JITTER_MIN_MS;
+    jb.slots = calloc(UDP_JITTER_SLOTS, sizeof(JitterSlot));
+    jb.out = malloc(UDP_OUTPUT_DATAGRAMS * UDP_PAYLOAD_SIZE);
+    if (jb.slots == NULL || jb.out == NULL) {
+        perror("udp_receive_file");
+        free(jb.slots);
+        free(jb.out);
+        return -1;
+    }
+
+    int result = 0;
+    while (jb.next_seq < jb.num_datagrams || jb.out_end > jb.out_start) {
+        long now = _elapsed_ms(request_start);
+        if (!jb.has_clock && now > UDP_FIRST_DATAGRAM_TIMEOUT_MS) {
+            ERR_PRINT("No datagrams from the server\n");
+            result = -1;
+            break;
+        }
+
+        long timeout = _jitter_release(&jb, now);
+        long nack_due = _jitter_send_nacks(&jb, now);
+        if (nack_due != -1 && (timeout == -1 || nack_due < timeout)) {
+            timeout = nack_due;
+        }
+        if (!jb.has_clock) {
+            timeout = UDP_FIRST_DATAGRAM_TIMEOUT_MS - now + 1;
+        }
+
+        struct pollfd fds[2] = {{udp_fd, POLLIN, 0}, {audio_out_fd, 0, 0}};
+        if (jb.out_end > jb.out_start) {
+            fds[1].events = POLLOUT;
+        }
+        if (poll(fds, 2, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("udp_receive_file: poll");
+            result = -1;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint8_t datagram[UDP_HEADER_SIZE + UDP_PAYLOAD_SIZE];
+            ssize_t num;
+            now = _elapsed_ms(request_start);
+            while ((num = recv(udp_fd, datagram, sizeof(datagram), MSG_DONTWAIT)) >= 0) {
+                _jitter_receive(&jb, datagram, num, now);
+            }
+        }
+
+        if (fds[1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+            int num = write(audio_out_fd, jb.out + jb.out_start, jb.out_end - jb.out_start);
+            if (num == -1 && errno != EAGAIN && errno != EINTR) {
+                if (errno != EPIPE) {
+                    perror("udp_receive_file: write");
+                }
+                result = -1;
+                break;
+            }
+            if (num > 0) {
+                jb.out_start += num;
+            }
+            if (jb.out_start == jb.out_end) {
+                jb.out_start = jb.out_end = 0;
+            } else if (jb.out_start > 0) {
+                memmove(jb.out, jb.out + jb.out_start, jb.out_end - jb.out_start);
+                jb.out_end -= jb.out_start;
+                jb.out_start = 0;
+            }
+        }
+    }
+
+    // Lets the server stop waiting for NACKs
+    uint8_t done[UDP_HEADER_SIZE];
+    UdpHeader header = {0, _elapsed_ms(request_start), 0, UDP_FLAG_DONE};
+    udp_encode_header(done, &header);
+    send(udp_fd, done, sizeof(done), 0);
+
+    free(jb.slots);
+    free(jb.out);
+    return result;
+}
+
+
+void udp_print_stats(const UdpStats *stats) {
+    printf("Received %u datagrams (%u reordered, %u duplicates, %u late)\n",
+           stats->received, stats->reordered, stats->duplicates, stats->late);
+    printf("NACKed %u, recovered %u, lost %u (played as silence)\n",
+           stats->nacks_sent, stats->recovered, stats->lost);
+    uint32_t played = stats->received - stats->duplicates - stats->late;
+    printf("First datagram after %ld ms, jitter %.1f ms, target delay %.0f ms, "
+           "buffer delay %.1f ms avg / %ld ms max\n",
+           stats->first_datagram_ms, stats->jitter_ms, stats->target_delay_ms,
+           played > 0 ? stats->buffer_delay_ms / played : 0.0, stats->max_buffer_delay_ms);
+}
@@ -0,0 +1,144 @@
+#ifndef AS_UDP_H_
+#define AS_UDP_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <time.h>
+
+/*
+** UDP streaming
+** -------------
+** For live monitoring, a file can be streamed as UDP datagrams instead of
+** over the TCP connection, so a lost packet costs a short gap in the audio
+** rather than a stall of everything behind it.
+**
+** The client binds a UDP socket, then sends REQUEST_USTREAM followed by the
+** network newline, the file index and the client's UDP port (32 and 16 bits,
+** network byte order) over TCP. The server answers over TCP with the file's
+** size and the rate it will send at, in bytes per second (32 bits each),
+** then sends the file from a UDP socket of its own, one datagram per
+** UDP_PAYLOAD_SIZE bytes:
+**          <seq: 32><timestamp: 32><length: 16><flags: 8><unused: 8><data>
+** Datagram seq holds the bytes from seq * UDP_PAYLOAD_SIZE on, and timestamp
+** is when it was sent, in milliseconds since the start of the session.
+**
+** Datagrams are paced at the audio's byte rate (from its WAV header, or
+** UDP_DEFAULT_BYTE_RATE), the first UDP_PREFILL_MS of it in a burst. The
+** client asks for lost datagrams again by sending a UDP_FLAG_NACK datagram
+** whose data lists their sequence numbers, and says it is done with a
+** UDP_FLAG_DONE datagram. The server keeps answering NACKs until then, or
+** until it has heard nothing for UDP_LINGER_MS after the last datagram.
+*/
+#define UDP_HEADER_SIZE 12
+#define UDP_PAYLOAD_SIZE 1200
+#define UDP_DEFAULT_BYTE_RATE 40000     // 320 kbit/s, for compressed files
+#define UDP_PREFILL_MS 40
+#define UDP_LINGER_MS 1000
+#define UDP_MAX_NACK_SEQS 64
+
+#define UDP_FLAG_END 0x1            // last datagram of the file
+#define UDP_FLAG_RETRANSMIT 0x2     // sent again after a NACK
+#define UDP_FLAG_NACK 0x4
+#define UDP_FLAG_DONE 0x8
+
+/*
+** Client jitter buffer
+** --------------------
+** Datagrams are handed to the player as soon as they are in order. When one
+** is missing, it is NACKed, and the buffer waits for it until the playout
+** deadline of its place in the stream, which is the target delay after its
+** place in the server's schedule. The target delay adapts to the measured
+** jitter, between UDP_JITTER_MIN_MS and UDP_JITTER_MAX_MS; a datagram that
+** misses its deadline is replaced by silence.
+*/
+#define UDP_JITTER_SLOTS 1024
+#define UDP_JITTER_MIN_MS 20
+#define UDP_JITTER_MAX_MS 200
+#define UDP_NACK_RETRY_MS 30
+#define UDP_MAX_NACKS 3
+
+
+typedef struct udp_header {
+    uint32_t seq;
+    uint32_t timestamp;
+    uint16_t length;
+    uint8_t flags;
+} UdpHeader;
+
+
+/*
+** Counters of a UDP stream, as seen by the sender or the receiver.
+**
+** sent, retransmitted, dropped: datagrams sent, sent again after a NACK, and
+**     (with simulated loss) not sent on purpose.
+** received, duplicates, reordered: datagrams received, received more than
+**     once, and received after a later one.
+** nacks_sent, recovered, lost, late: sequence numbers NACKed, missing ones
+**     that arrived in time, replaced with silence, and arriving too late.
+** jitter_ms: interarrival jitter, as in RFC 3550.
+** target_delay_ms: the jitter buffer's delay at the end of the stream.
+** first_datagram_ms: from the request to the first datagram.
+** buffer_delay_ms: total time datagrams waited in the jitter buffer, and
+**     max_buffer_delay_ms the longest wait.
+*/
+typedef struct udp_stats {
+    uint32_t sent;
+    uint32_t retransmitted;
+    uint32_t dropped;
+
+    uint32_t received;
+    uint32_t duplicates;
+    uint32_t reordered;
+    uint32_t nacks_sent;
+    uint32_t recovered;
+    uint32_t lost;
+    uint32_t late;
+    double jitter_ms;
+    double target_delay_ms;
+    long first_datagram_ms;
+    double buffer_delay_ms;
+    long max_buffer_delay_ms;
+} UdpStats;
+
+
+/*
+** Writes header to the first UDP_HEADER_SIZE bytes of buf, and reads it back.
+*/
+void udp_encode_header(uint8_t *buf, const UdpHeader *header);
+void udp_decode_header(const uint8_t *buf, UdpHeader *header);
+
+/*
+** Returns the byte rate to pace the file open at fd with: the one in its WAV
+** header, or UDP_DEFAULT_BYTE_RATE.
+*/
+uint32_t udp_byte_rate(int fd);
+
+/*
+** Sends the file_size bytes of the file open at fd over the connected UDP
+** socket udp_fd, as described above, and answers NACKs until the client is
+** done. drop_percent of the datagrams are not sent, to simulate loss.
+**
+** returns 0 on success, -1 on error
+*/
+int udp_send_file(int udp_fd, int fd, uint32_t file_size, uint32_t byte_rate,
+                  int drop_percent, UdpStats *stats);
+
+/*
+** Receives a file_size byte stream sent at byte_rate on udp_fd through the
+** jitter buffer, and writes it to audio_out_fd (which should be non-blocking).
+** request_start is when the stream was requested.
+**
+** returns 0 on success, -1 on error
+*/
+int udp_receive_file(int udp_fd, uint32_t file_size, uint32_t byte_rate, int audio_out_fd,
+                     const struct timespec *request_start, UdpStats *stats);
+
+/*
+** Prints the receiver's counters.
+*/
+void udp_print_stats(const UdpStats *stats);
+
+#endif // AS_UDP_H_
@@ -0,0 +1,1074 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_wave.h"
+
+#include <math.h>
+#include <time.h>
+
+const char *wave_index_directory = WAVE_DEFAULT_DIRECTORY;
+
+#define WAV_HEADER_SIZE 12
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+// Of the extensible format's fmt chunk, up to its subformat's format
+#define WAV_FMT_SIZE 26
+// The K-weighting pre-filter's shelf is at 1.7kHz
+#define WAVE_MIN_RATE 8000
+#define WAVE_INITIAL_BLOCKS 1024
+
+// Speakers of the extensible format's channel mask
+#define SPEAKER_LFE 0x8
+#define SPEAKER_SURROUNDS 0x630
+
+// BS.1770's offset, and its gates as energies: -70 LUFS, and a tenth
+#define LOUDNESS_OFFSET -0.691
+#define ABSOLUTE_GATE 1.1724653045822963e-07
+#define RELATIVE_GATE 0.1
+
+
+/*
+** A biquad of the K-weighting filter, in direct form II transposed:
+** a[0] is 1, and state holds each channel's two delays.
+*/
+typedef struct biquad {
+    double b[3];
+    double a[3];
+    double state[WAVE_MAX_CHANNELS][2];
+} Biquad;
+
+/*
+** The format of a WAV file's samples, and where they are.
+*/
+typedef struct wav_format {
+    uint16_t format;
+    uint16_t channels;
+    uint32_t rate;
+    uint16_t bits;
+    uint32_t channel_mask;
+    uint32_t data;
+    uint32_t data_len;
+} WavFormat;
+
+struct wave_analysis {
+    WaveSummary *summary;
+    int fd;
+    WavFormat wav;
+    uint32_t frame_size;
+    uint32_t position;
+    uint32_t end;
+    uint64_t num_frames;
+    uint64_t frame;
+    uint8_t failed;
+    // Peaks of the bucket being filled, which ends at frame bucket_end
+    uint32_t bucket;
+    uint64_t bucket_end;
+    float bucket_min;
+    float bucket_max;
+    // Mean squares of the 100ms blocks so far, and sums of the one being
+    // filled
+    Biquad shelf;
+    Biquad high_pass;
+    double weights[WAVE_MAX_CHANNELS];
+    double sums[WAVE_MAX_CHANNELS];
+    uint32_t block_frames;
+    uint32_t block_filled;
+    double *blocks;
+    uint32_t num_blocks;
+    uint32_t blocks_capacity;
+    uint8_t *raw;
+    float *samples;
+};
+
+
+static uint64_t _cpu_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint16_t _le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t _le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+/*
+** Kernels
+** -------
+** Helpers for: _convert, _peaks, _weigh
+** The vector conversions widen 8 or 16 samples to 32 bits, sign and all,
+** before converting them to float. The vector peaks keep 4 or 8 running
+** minimums and maximums, folded into one at the end; a NaN sample is passed
+** over, as the running value is the operand taken when either is NaN.
+**
+** The K-weighting filters feed each output back into the next, so they wait
+** on the latency of their arithmetic; the vector ones filter two channels at
+** once, one in each half of the registers, and keep their state in them.
+*/
+static void _s16_to_float_scalar(const int16_t *in, float *out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = in[i] * (1.0f / 32768);
+    }
+}
+
+static void _min_max_scalar(const float *in, size_t count, float *min, float *max) {
+    for (size_t i = 0; i < count; i++) {
+        if (in[i] < *min) {
+            *min = in[i];
+        }
+        if (in[i] > *max) {
+            *max = in[i];
+        }
+    }
+}
+
+/*
+** K-weights channels c and c + 1 of the num_frames frames of samples, and
+** adds the sums of their squares to their blocks'.
+*/
+static void _weigh_pair_scalar(WaveAnalysis *analysis, const float *samples,
+                               uint32_t num_frames, uint16_t c) {
+    uint16_t channels = analysis->wav.channels;
+    const Biquad *shelf = &analysis->shelf;
+    const Biquad *high_pass = &analysis->high_pass;
+    for (uint16_t end = c + 2; c < end; c++) {
+        // In locals, so the state stays in registers
+        double s0 = shelf->state[c][0], s1 = shelf->state[c][1];
+        double t0 = high_pass->state[c][0], t1 = high_pass->state[c][1];
+        double sum = 0;
+        const float *sample = samples + c;
+        for (uint32_t f = 0; f < num_frames; f++, sample += channels) {
+            double x = *sample;
+            double y = shelf->b[0] * x + s0;
+            s0 = shelf->b[1] * x - shelf->a[1] * y + s1;
+            s1 = shelf->b[2] * x - shelf->a[2] * y;
+            // The high-pass's numerator is 1, -2, 1
+            x = y;
+            y = x + t0;
+            t0 = -2.0 * x - high_pass->a[1] * y + t1;
+            t1 = x - high_pass->a[2] * y;
+            sum += y * y;
+        }
+        analysis->shelf.state[c][0] = s0;
+        analysis->shelf.state[c][1] = s1;
+        analysis->high_pass.state[c][0] = t0;
+        analysis->high_pass.state[c][1] = t1;
+        analysis->sums[c] += sum;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void _s16_to_float_sse2(const int16_t *in, float *out, size_t count) {
+    const __m128 scale = _mm_set1_ps(1.0f / 32768);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+    _s16_to_float_scalar(in + i, out + i, count - i);
+}
+
+/*
+** Folds the 4 running minimums and maximums into *min and *max.
+*/
+__attribute__((target("sse2")))
+static void _fold_sse2(__m128 low, __m128 high, float *min, float *max) {
+    low = _mm_min_ps(low, _mm_shuffle_ps(low, low, _MM_SHUFFLE(1, 0, 3, 2)));
+    low = _mm_min_ps(low, _mm_shuffle_ps(low, low, _MM_SHUFFLE(2, 3, 0, 1)));
+    high = _mm_max_ps(high, _mm_shuffle_ps(high, high, _MM_SHUFFLE(1, 0, 3, 2)));
+    high = _mm_max_ps(high, _mm_shuffle_ps(high, high, _MM_SHUFFLE(2, 3, 0, 1)));
+    *min = _mm_cvtss_f32(low);
+    *max = _mm_cvtss_f32(high);
+}
+
+__attribute__((target("sse2")))
+static void _min_max_sse2(const float *in, size_t count, float *min, float *max) {
+    __m128 low = _mm_set1_ps(*min);
+    __m128 high = _mm_set1_ps(*max);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 samples = _mm_loadu_ps(in + i);
+        low = _mm_min_ps(samples, low);
+        high = _mm_max_ps(samples, high);
+    }
+    _fold_sse2(low, high, min, max);
+    _min_max_scalar(in + i, count - i, min, max);
+}
+
+__attribute__((target("sse2")))
+static void _weigh_pair_sse2(WaveAnalysis *analysis, const float *samples,
+                             uint32_t num_frames, uint16_t c) {
+    uint16_t channels = analysis->wav.channels;
+    const Biquad *shelf = &analysis->shelf;
+    const Biquad *high_pass = &analysis->high_pass;
+    const __m128d b0 = _mm_set1_pd(shelf->b[0]), b1 = _mm_set1_pd(shelf->b[1]);
+    const __m128d b2 = _mm_set1_pd(shelf->b[2]);
+    const __m128d a1 = _mm_set1_pd(shelf->a[1]), a2 = _mm_set1_pd(shelf->a[2]);
+    const __m128d c1 = _mm_set1_pd(high_pass->a[1]), c2 = _mm_set1_pd(high_pass->a[2]);
+    const __m128d minus_two = _mm_set1_pd(-2.0);
+    __m128d s0 = _mm_set_pd(shelf->state[c + 1][0], shelf->state[c][0]);
+    __m128d s1 = _mm_set_pd(shelf->state[c + 1][1], shelf->state[c][1]);
+    __m128d t0 = _mm_set_pd(high_pass->state[c + 1][0], high_pass->state[c][0]);
+    __m128d t1 = _mm_set_pd(high_pass->state[c + 1][1], high_pass->state[c][1]);
+    __m128d sum = _mm_setzero_pd();
+    const float *sample = samples + c;
+    for (uint32_t f = 0; f < num_frames; f++, sample += channels) {
+        // The pair's two floats, as one 64-bit load
+        __m128d x = _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double *)sample)));
+        __m128d y = _mm_add_pd(_mm_mul_pd(b0, x), s0);
+        s0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x), _mm_mul_pd(a1, y)), s1);
+        s1 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+        x = y;
+        y = _mm_add_pd(x, t0);
+        t0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(minus_two, x), _mm_mul_pd(c1, y)), t1);
+        t1 = _mm_sub_pd(x, _mm_mul_pd(c2, y));
+        sum = _mm_add_pd(sum, _mm_mul_pd(y, y));
+    }
+    double lanes[2];
+    _mm_storel_pd(&analysis->shelf.state[c][0], s0);
+    _mm_storeh_pd(&analysis->shelf.state[c + 1][0], s0);
+    _mm_storel_pd(&analysis->shelf.state[c][1], s1);
+    _mm_storeh_pd(&analysis->shelf.state[c + 1][1], s1);
+    _mm_storel_pd(&analysis->high_pass.state[c][0], t0);
+    _mm_storeh_pd(&analysis->high_pass.state[c + 1][0], t0);
+    _mm_storel_pd(&analysis->high_pass.state[c][1], t1);
+    _mm_storeh_pd(&analysis->high_pass.state[c + 1][1], t1);
+    _mm_storeu_pd(lanes, sum);
+    analysis->sums[c] += lanes[0];
+    analysis->sums[c + 1] += lanes[1];
+}
+
+__attribute__((target("avx2")))
+static void _s16_to_float_avx2(const int16_t *in, float *out, size_t count) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i samples = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i low = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(samples));
+        __m256i high = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(samples, 1));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(low), scale));
+        _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(high), scale));
+    }
+    _s16_to_float_sse2(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void _min_max_avx2(const float *in, size_t count, float *min, float *max) {
+    __m256 low = _mm256_set1_ps(*min);
+    __m256 high = _mm256_set1_ps(*max);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 samples = _mm256_loadu_ps(in + i);
+        low = _mm256_min_ps(samples, low);
+        high = _mm256_max_ps(samples, high);
+    }
+    // Halved to the SSE2 fold's 4
+    _fold_sse2(_mm_min_ps(_mm256_castps256_ps128(low), _mm256_extractf128_ps(low, 1)),
+               _mm_max_ps(_mm256_castps256_ps128(high), _mm256_extractf128_ps(high, 1)),
+               min, max);
+    _min_max_sse2(in + i, count - i, min, max);
+}
+#endif
+
+
+typedef struct wave_kernels {
+    void (*s16_to_float)(const int16_t *in, float *out, size_t count);
+    void (*min_max)(const float *in, size_t count, float *min, float *max);
+    void (*weigh_pair)(WaveAnalysis *analysis, const float *samples, uint32_t num_frames,
+                       uint16_t c);
+} WaveKernels;
+
+static const WaveKernels *_kernels(void) {
+    static const WaveKernels scalar = {_s16_to_float_scalar, _min_max_scalar,
+                                       _weigh_pair_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+    // Two lanes of doubles are all a pair needs, so AVX2 filters with SSE2
+    static const WaveKernels sse2 = {_s16_to_float_sse2, _min_max_sse2, _weigh_pair_sse2};
+    static const WaveKernels avx2 = {_s16_to_float_avx2, _min_max_avx2, _weigh_pair_sse2};
+    static const WaveKernels *kernels = NULL;
+    if (kernels == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernels = &avx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            kernels = &sse2;
+        } else {
+            kernels = &scalar;
+        }
+    }
+    return kernels;
+#else
+    return &scalar;
+#endif
+}
+
+
+/*
+** Analysis
+** --------
+*/
+
+/*
+** Helper for: wave_analysis_start
+** Finds the format and data chunks of a WAV file, and checks that its
+** samples are PCM ones it can analyze.
+**
+** returns 0 on success, -1 if it is not such a file
+*/
+static int _wav_parse(int fd, uint32_t size, WavFormat *wav) {
+    uint8_t header[WAV_FMT_SIZE];
+    if (pread(fd, header, WAV_HEADER_SIZE, 0) != WAV_HEADER_SIZE ||
+        memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        return -1;
+    }
+    uint8_t has_format = 0;
+    uint64_t at = WAV_HEADER_SIZE;
+    while (at + 8 <= size && pread(fd, header, 8, at) == 8) {
+        uint32_t len = _le32(header + 4);
+        if (memcmp(header, "data", 4) == 0) {
+            wav->data = at + 8;
+            wav->data_len = MIN(len, size - wav->data);
+            break;
+        }
+        if (memcmp(header, "fmt ", 4) == 0 && len >= 16) {
+            uint32_t fmt_len = MIN(len, WAV_FMT_SIZE);
+            if (pread(fd, header, fmt_len, at + 8) != fmt_len) {
+                return -1;
+            }
+            wav->format = _le16(header);
+            wav->channels = _le16(header + 2);
+            wav->rate = _le32(header + 4);
+            wav->bits = _le16(header + 14);
+            wav->channel_mask = 0;
+            if (wav->format == WAV_FORMAT_EXTENSIBLE) {
+                if (fmt_len < WAV_FMT_SIZE) {
+                    return -1;
+                }
+                wav->channel_mask = _le32(header + 20);
+                wav->format = _le16(header + 24);
+            }
+            has_format = 1;
+        }
+        at += 8 + (uint64_t)len + (len & 1);
+    }
+    if (!has_format || at + 8 > size) {
+        return -1;
+    }
+    uint8_t pcm = wav->format == WAV_FORMAT_PCM &&
+                  (wav->bits == 8 || wav->bits == 16 || wav->bits == 24 || wav->bits == 32);
+    uint8_t ieee_float = wav->format == WAV_FORMAT_FLOAT && wav->bits == 32;
+    if ((!pcm && !ieee_float) || wav->channels == 0 || wav->channels > WAVE_MAX_CHANNELS ||
+        wav->rate < WAVE_MIN_RATE) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: wave_analysis_start
+** Sets the K-weighting filter up for the file's rate, with the pre-filter's
+** shelf and the RLB high-pass of BS.1770 as libebur128 derives them for
+** rates other than 48kHz, and the weight of each channel.
+*/
+static void _k_weighting(WaveAnalysis *analysis) {
+    double rate = analysis->wav.rate;
+    double k = tan(M_PI * 1681.974450955533 / rate);
+    double q = 0.7071752369554196;
+    double gain = pow(10.0, 3.999843853973347 / 20.0);
+    double band = pow(gain, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    Biquad *shelf = &analysis->shelf;
+    shelf->b[0] = (gain + band * k / q + k * k) / a0;
+    shelf->b[1] = 2.0 * (k * k - gain) / a0;
+    shelf->b[2] = (gain - band * k / q + k * k) / a0;
+    shelf->a[1] = 2.0 * (k * k - 1.0) / a0;
+    shelf->a[2] = (1.0 - k / q + k * k) / a0;
+
+    k = tan(M_PI * 38.13547087602444 / rate);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+    Biquad *high_pass = &analysis->high_pass;
+    high_pass->b[0] = 1.0;
+    high_pass->b[1] = -2.0;
+    high_pass->b[2] = 1.0;
+    high_pass->a[1] = 2.0 * (k * k - 1.0) / a0;
+    high_pass->a[2] = (1.0 - k / q + k * k) / a0;
+
+    // By the channel mask where there is one, or else as L R C LFE Ls Rs
+    uint32_t mask = analysis->wav.channel_mask;
+    uint32_t speaker = 1;
+    for (uint16_t c = 0; c < analysis->wav.channels; c++) {
+        analysis->weights[c] = 1.0;
+        if (mask != 0) {
+            while (speaker != 0 && !(mask & speaker)) {
+                speaker <<= 1;
+            }
+            if (speaker & SPEAKER_LFE) {
+                analysis->weights[c] = 0.0;
+            } else if (speaker & SPEAKER_SURROUNDS) {
+                analysis->weights[c] = 1.41;
+            }
+            speaker <<= 1;
+        } else if (analysis->wav.channels >= 6 && c == 3) {
+            analysis->weights[c] = 0.0;
+        } else if (analysis->wav.channels >= 6 && (c == 4 || c == 5)) {
+            analysis->weights[c] = 1.41;
+        }
+    }
+}
+
+
+WaveAnalysis *wave_analysis_start(WaveSummary *summary, int fd, const struct stat *file_stat) {
+    wave_summary_free(summary);
+    summary->size = file_stat->st_size;
+    summary->mtime = file_stat->st_mtime;
+    // Only built once it is finished, so it isn't taken for one until then
+    summary->built = 0;
+    summary->pcm = 0;
+    summary->loudness = WAVE_SILENT;
+    summary->duration_ms = 0;
+
+    WavFormat wav;
+    if (file_stat->st_size > UINT32_MAX || _wav_parse(fd, file_stat->st_size, &wav) == -1) {
+        summary->built = 1;
+        return NULL;
+    }
+    WaveAnalysis *analysis = calloc(1, sizeof(WaveAnalysis));
+    if (analysis == NULL) {
+        perror("wave_analysis_start");
+        return NULL;
+    }
+    analysis->summary = summary;
+    analysis->fd = fd;
+    analysis->wav = wav;
+    analysis->frame_size = wav.channels * (wav.bits / 8);
+    analysis->num_frames = wav.data_len / analysis->frame_size;
+    analysis->position = wav.data;
+    analysis->end = wav.data + analysis->num_frames * analysis->frame_size;
+    analysis->block_frames = wav.rate / 10;
+    _k_weighting(analysis);
+
+    summary->num_buckets = MIN(WAVE_MAX_BUCKETS, analysis->num_frames);
+    analysis->bucket_end = analysis->num_frames / MAX(summary->num_buckets, 1);
+    analysis->bucket_min = INFINITY;
+    analysis->bucket_max = -INFINITY;
+    // A whole number of frames is read at a time
+    uint32_t read_size = WAVE_READ_SIZE - WAVE_READ_SIZE % analysis->frame_size;
+    analysis->raw = malloc(read_size);
+    analysis->samples = calloc(read_size / (wav.bits / 8) + 1, sizeof(float));
+    summary->peaks = malloc(MAX(2 * summary->num_buckets, 1));
+    analysis->blocks_capacity = WAVE_INITIAL_BLOCKS;
+    analysis->blocks = malloc(analysis->blocks_capacity * sizeof(double));
+    if (analysis->raw == NULL || analysis->samples == NULL || summary->peaks == NULL ||
+        analysis->blocks == NULL) {
+        perror("wave_analysis_start");
+        wave_analysis_finish(analysis);
+        return NULL;
+    }
+    return analysis;
+}
+
+
+/*
+** Helper for: wave_analysis_step
+** Converts count samples from raw to floats of full scale 1.
+*/
+static void _convert(const WaveAnalysis *analysis, uint32_t count) {
+    const uint8_t *raw = analysis->raw;
+    float *samples = analysis->samples;
+    if (analysis->wav.format == WAV_FORMAT_FLOAT) {
+        memcpy(samples, raw, count * sizeof(float));
+    } else if (analysis->wav.bits == 16) {
+        _kernels()->s16_to_float((const int16_t *)raw, samples, count);
+    } else if (analysis->wav.bits == 8) {
+        for (uint32_t i = 0; i < count; i++) {
+            samples[i] = (raw[i] - 128) * (1.0f / 128);
+        }
+    } else if (analysis->wav.bits == 24) {
+        for (uint32_t i = 0; i < count; i++, raw += 3) {
+            int32_t sample = (int32_t)(raw[0] << 8 | raw[1] << 16 | (uint32_t)raw[2] << 24) >> 8;
+            samples[i] = sample * (1.0f / 8388608);
+        }
+    } else {
+        for (uint32_t i = 0; i < count; i++, raw += 4) {
+            samples[i] = (int32_t)_le32(raw) * (1.0f / 2147483648.0f);
+        }
+    }
+}
+
+
+static int8_t _quantize(float value) {
+    return value < -127 ? -127 : value > 127 ? 127 : value;
+}
+
+
+/*
+** Helper for: wave_analysis_step
+** Adds the peaks of the num_frames frames of samples to the buckets they
+** fall in.
+*/
+static void _peaks(WaveAnalysis *analysis, uint32_t num_frames) {
+    WaveSummary *summary = analysis->summary;
+    uint16_t channels = analysis->wav.channels;
+    const float *samples = analysis->samples;
+    uint64_t frame = analysis->frame;
+    uint64_t end = frame + num_frames;
+    while (frame < end) {
+        uint64_t count = MIN(end, analysis->bucket_end) - frame;
+        _kernels()->min_max(samples, count * channels, &analysis->bucket_min,
+                            &analysis->bucket_max);
+        samples += count * channels;
+        frame += count;
+        if (frame < analysis->bucket_end) {
+            break;
+        }
+        // Rounded outwards, so the envelope never falls short of a sample;
+        // a bucket of nothing but NaNs is silent
+        int8_t *peak = summary->peaks + 2 * analysis->bucket;
+        peak[0] = peak[1] = 0;
+        if (analysis->bucket_min <= analysis->bucket_max) {
+            peak[0] = _quantize(floorf(analysis->bucket_min * 127));
+            peak[1] = _quantize(ceilf(analysis->bucket_max * 127));
+        }
+        analysis->bucket++;
+        analysis->bucket_end = (analysis->bucket + 1) * analysis->num_frames /
+                               summary->num_buckets;
+        analysis->bucket_min = INFINITY;
+        analysis->bucket_max = -INFINITY;
+    }
+}
+
+
+/*
+** Helper for: wave_analysis_step
+** K-weights the num_frames frames of samples, and sums their squares into
+** 100ms blocks, each kept as its channels' weighted mean squares. The frames
+** are taken up to the end of a block at a time, two channels at a time; the
+** samples buffer has room past a mono file's so it can be read as a pair.
+**
+** returns 0 on success, -1 on error
+*/
+static int _weigh(WaveAnalysis *analysis, uint32_t num_frames) {
+    uint16_t channels = analysis->wav.channels;
+    const float *samples = analysis->samples;
+    while (num_frames > 0) {
+        uint32_t count = MIN(num_frames, analysis->block_frames - analysis->block_filled);
+        for (uint16_t c = 0; c < channels; c += 2) {
+            _kernels()->weigh_pair(analysis, samples, count, c);
+        }
+        samples += count * channels;
+        num_frames -= count;
+        analysis->block_filled += count;
+        if (analysis->block_filled < analysis->block_frames) {
+            break;
+        }
+        if (analysis->num_blocks == analysis->blocks_capacity) {
+            double *blocks = realloc(analysis->blocks,
+                                     2 * analysis->blocks_capacity * sizeof(double));
+            if (blocks == NULL) {
+                perror("wave: realloc");
+                return -1;
+            }
+            analysis->blocks = blocks;
+            analysis->blocks_capacity *= 2;
+        }
+        double energy = 0;
+        for (uint16_t c = 0; c < channels; c++) {
+            energy += analysis->weights[c] * analysis->sums[c];
+            analysis->sums[c] = 0;
+        }
+        analysis->blocks[analysis->num_blocks++] = energy / analysis->block_frames;
+        analysis->block_filled = 0;
+    }
+    return 0;
+}
+
+
+int wave_analysis_step(WaveAnalysis *analysis, uint64_t *bytes) {
+    uint32_t len = MIN(analysis->end - analysis->position,
+                       WAVE_READ_SIZE - WAVE_READ_SIZE % analysis->frame_size);
+    if (len == 0) {
+        return 1;
+    }
+    uint32_t num = 0;
+    while (num < len) {
+        ssize_t result = pread(analysis->fd, analysis->raw + num, len - num,
+                               analysis->position + num);
+        if (result <= 0) {
+            if (result == -1) {
+                perror("wave: pread");
+            }
+            analysis->failed = 1;
+            return -1;
+        }
+        num += result;
+    }
+    uint32_t num_frames = len / analysis->frame_size;
+    _convert(analysis, num_frames * analysis->wav.channels);
+    _peaks(analysis, num_frames);
+    if (_weigh(analysis, num_frames) == -1) {
+        analysis->failed = 1;
+        return -1;
+    }
+    analysis->frame += num_frames;
+    analysis->position += len;
+    *bytes += len;
+    return analysis->position == analysis->end;
+}
+
+
+/*
+** Helper for: wave_analysis_finish
+** Gates the 400ms blocks, each the mean of 4 100ms ones in a row, first at
+** -70 LUFS, then at a tenth of the mean energy of the blocks left.
+**
+** returns the integrated loudness in hundredths of LUFS, WAVE_SILENT if no
+** block passes
+*/
+static int32_t _integrated_loudness(const WaveAnalysis *analysis) {
+    double threshold = ABSOLUTE_GATE;
+    double sum = 0;
+    uint32_t count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        sum = 0;
+        count = 0;
+        for (uint32_t i = 0; i + 4 <= analysis->num_blocks; i++) {
+            const double *blocks = analysis->blocks + i;
+            double energy = (blocks[0] + blocks[1] + blocks[2] + blocks[3]) / 4;
+            if (energy > threshold) {
+                sum += energy;
+                count++;
+            }
+        }
+        if (count == 0) {
+            return WAVE_SILENT;
+        }
+        threshold = MAX(ABSOLUTE_GATE, sum / count * RELATIVE_GATE);
+    }
+    return lround(100 * (LOUDNESS_OFFSET + 10 * log10(sum / count)));
+}
+
+
+int wave_analysis_finish(WaveAnalysis *analysis) {
+    WaveSummary *summary = analysis->summary;
+    int result = -1;
+    if (summary->peaks != NULL && !analysis->failed && analysis->frame == analysis->num_frames) {
+        summary->built = 1;
+        summary->pcm = 1;
+        summary->loudness = _integrated_loudness(analysis);
+        summary->duration_ms = analysis->num_frames * 1000 / analysis->wav.rate;
+        result = 0;
+    } else {
+        wave_summary_free(summary);
+    }
+    free(analysis->raw);
+    free(analysis->samples);
+    free(analysis->blocks);
+    free(analysis);
+    return result;
+}
+
+
+int wave_analyze(WaveSummary *summary, int fd, const struct stat *file_stat) {
+    WaveAnalysis *analysis = wave_analysis_start(summary, fd, file_stat);
+    if (analysis == NULL) {
+        return summary->built ? 0 : -1;
+    }
+    uint64_t bytes = 0;
+    while (wave_analysis_step(analysis, &bytes) == 0) {
+    }
+    return wave_analysis_finish(analysis);
+}
+
+
+void wave_summary_free(WaveSummary *summary) {
+    free(summary->peaks);
+    summary->peaks = NULL;
+    summary->num_buckets = 0;
+}
+
+
+uint8_t *wave_response(const WaveSummary *summary, uint32_t num_buckets, uint32_t *len) {
+    if (!summary->pcm) {
+        uint8_t *response = calloc(1, sizeof(uint32_t));
+        if (response == NULL) {
+            perror("wave_response");
+            return NULL;
+        }
+        *len = sizeof(uint32_t);
+        return response;
+    }
+    num_buckets = num_buckets == 0 ? WAVE_DEFAULT_BUCKETS : num_buckets;
+    num_buckets = MIN(num_buckets, summary->num_buckets);
+    uint32_t body_len = WAVE_RESPONSE_HEADER_SIZE + 2 * num_buckets;
+    uint8_t *response = malloc(sizeof(uint32_t) + body_len);
+    if (response == NULL) {
+        perror("wave_response");
+        return NULL;
+    }
+    uint32_t values[3] = {htonl(body_len), htonl(summary->loudness), htonl(summary->duration_ms)};
+    uint16_t network_num_buckets = htons(num_buckets);
+    memcpy(response, values, sizeof(values));
+    memcpy(response + sizeof(values), &network_num_buckets, sizeof(uint16_t));
+
+    // Each bucket merges the summary's that fall in it
+    int8_t *peak = (int8_t *)response + sizeof(values) + sizeof(uint16_t);
+    for (uint32_t i = 0; i < num_buckets; i++, peak += 2) {
+        uint32_t first = (uint64_t)i * summary->num_buckets / num_buckets;
+        uint32_t last = (uint64_t)(i + 1) * summary->num_buckets / num_buckets;
+        peak[0] = summary->peaks[2 * first];
+        peak[1] = summary->peaks[2 * first + 1];
+        for (uint32_t j = first + 1; j < last; j++) {
+            peak[0] = MIN(peak[0], summary->peaks[2 * j]);
+            peak[1] = MAX(peak[1], summary->peaks[2 * j + 1]);
+        }
+    }
+    *len = sizeof(uint32_t) + body_len;
+    return response;
+}
+
+
+/*
+** The index
+** ---------
+*/
+
+void wave_index_init(WaveIndex *index) {
+    memset(index, 0, sizeof(WaveIndex));
+    index->analysis_fd = -1;
+}
+
+
+/*
+** Helper for: wave_index_update, wave_index_free
+** Drops the analysis in progress, leaving its summary to be made again.
+*/
+static void _drop_analysis(WaveIndex *index) {
+    if (index->analysis != NULL) {
+        wave_analysis_finish(index->analysis);
+        close(index->analysis_fd);
+        index->analysis = NULL;
+        index->analysis_fd = -1;
+    }
+}
+
+
+void wave_index_free(WaveIndex *index) {
+    _drop_analysis(index);
+    for (uint32_t i = 0; i < index->num_summaries; i++) {
+        wave_summary_free(&index->summaries[i]);
+        free(index->summaries[i].path);
+    }
+    free(index->summaries);
+    wave_index_init(index);
+}
+
+
+/*
+** Helper for: wave_index_update
+** Loads the summaries saved in the index file into index.
+**
+** returns 0 on success, -1 if there are none to load
+*/
+static int _load(WaveIndex *index) {
+    char *path = _join_path(wave_index_directory, WAVE_INDEX_FILE);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1 || file_stat.st_size > UINT32_MAX) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    uint8_t *data = malloc(MAX(file_stat.st_size, 1));
+    if (data == NULL || read_precisely(fd, data, file_stat.st_size) != file_stat.st_size) {
+        close(fd);
+        free(data);
+        return -1;
+    }
+    close(fd);
+
+    const uint8_t *in = data, *end = data + file_stat.st_size;
+    uint32_t num_summaries;
+    if (end - in < strlen(WAVE_INDEX_MAGIC) ||
+        memcmp(in, WAVE_INDEX_MAGIC, strlen(WAVE_INDEX_MAGIC)) != 0 ||
+        (in += strlen(WAVE_INDEX_MAGIC), varint_get(&in, end, &num_summaries) == -1) ||
+        num_summaries > (end - in) / 8) {
+        goto error;
+    }
+    index->summaries = calloc(MAX(num_summaries, 1), sizeof(WaveSummary));
+    if (index->summaries == NULL) {
+        perror("wave: calloc");
+        goto error;
+    }
+    for (uint32_t i = 0; i < num_summaries; i++) {
+        WaveSummary *summary = &index->summaries[i];
+        uint32_t path_len, pcm, loudness;
+        if (varint_get(&in, end, &path_len) == -1 || path_len > end - in) {
+            goto error;
+        }
+        summary->path = strndup((const char *)in, path_len);
+        index->num_summaries++;
+        in += path_len;
+        if (summary->path == NULL || strlen(summary->path) != path_len ||
+            (i > 0 && strcmp(index->summaries[i - 1].path, summary->path) >= 0) ||
+            varint_get(&in, end, &summary->size) == -1 ||
+            varint_get(&in, end, &summary->mtime) == -1 ||
+            varint_get(&in, end, &pcm) == -1 || pcm > 1 ||
+            varint_get(&in, end, &loudness) == -1 ||
+            varint_get(&in, end, &summary->duration_ms) == -1 ||
+            varint_get(&in, end, &summary->num_buckets) == -1 ||
+            summary->num_buckets > WAVE_MAX_BUCKETS || 2 * summary->num_buckets > end - in) {
+            goto error;
+        }
+        summary->pcm = pcm;
+        summary->loudness = (int32_t)loudness;
+        summary->built = 1;
+        summary->peaks = malloc(MAX(2 * summary->num_buckets, 1));
+        if (summary->peaks == NULL) {
+            perror("wave: malloc");
+            goto error;
+        }
+        memcpy(summary->peaks, in, 2 * summary->num_buckets);
+        in += 2 * summary->num_buckets;
+    }
+    free(data);
+    return in == end ? 0 : (wave_index_free(index), -1);
+
+error:
+    ERR_PRINT("Ignoring the malformed waveform index in %s\n", wave_index_directory);
+    free(data);
+    wave_index_free(index);
+    return -1;
+}
+
+
+/*
+** Helper for: wave_index_build
+** Saves the index's summaries in the index file, replacing it.
+**
+** returns 0 on success, -1 on error
+*/
+static int _save(const WaveIndex *index) {
+    if (mkdir(wave_index_directory, 0755) == -1 && errno != EEXIST) {
+        perror("wave: mkdir");
+        return -1;
+    }
+    size_t capacity = strlen(WAVE_INDEX_MAGIC) + VARINT_MAX_SIZE;
+    for (uint32_t i = 0; i < index->num_summaries; i++) {
+        capacity += 8 * VARINT_MAX_SIZE + strlen(index->summaries[i].path) +
+                    2 * index->summaries[i].num_buckets;
+    }
+    uint8_t *data = malloc(capacity);
+    char *path = _join_path(wave_index_directory, WAVE_INDEX_FILE);
+    char *temp_path = path == NULL ? NULL : malloc(strlen(path) + 5);
+    if (data == NULL || temp_path == NULL) {
+        perror("wave: malloc");
+        free(data);
+        free(path);
+        return -1;
+    }
+    sprintf(temp_path, "%s.tmp", path);
+
+    uint8_t *out = data;
+    memcpy(out, WAVE_INDEX_MAGIC, strlen(WAVE_INDEX_MAGIC));
+    out += strlen(WAVE_INDEX_MAGIC);
+    out = varint_put(out, index->num_summaries);
+    for (uint32_t i = 0; i < index->num_summaries; i++) {
+        const WaveSummary *summary = &index->summaries[i];
+        uint32_t path_len = strlen(summary->path);
+        out = varint_put(out, path_len);
+        memcpy(out, summary->path, path_len);
+        out += path_len;
+        // Summaries that were never made are saved as files that aren't PCM
+        out = varint_put(out, summary->built ? summary->size : 0);
+        out = varint_put(out, summary->built ? summary->mtime : 0);
+        out = varint_put(out, summary->pcm);
+        out = varint_put(out, (uint32_t)summary->loudness);
+        out = varint_put(out, summary->duration_ms);
+        out = varint_put(out, summary->num_buckets);
+        if (summary->num_buckets > 0) {
+            memcpy(out, summary->peaks, 2 * summary->num_buckets);
+            out += 2 * summary->num_buckets;
+        }
+    }
+
+    int result = -1;
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("wave: open");
+    } else if (write_precisely(fd, data, out - data) != out - data) {
+        perror("wave: write");
+        close(fd);
+        unlink(temp_path);
+    } else if (close(fd) == -1 || rename(temp_path, path) == -1) {
+        perror("wave: rename");
+        unlink(temp_path);
+    } else {
+        result = 0;
+    }
+    free(data);
+    free(path);
+    free(temp_path);
+    return result;
+}
+
+
+int wave_index_update(WaveIndex *index, const Library *library, uint8_t load) {
+    // Its summary may not be there after the update, it starts over
+    _drop_analysis(index);
+    WaveIndex old = *index;
+    if (load) {
+        wave_index_free(&old);
+        if (_load(&old) == -1) {
+            wave_index_init(&old);
+        }
+    }
+    uint64_t bytes = index->bytes;
+    uint64_t cpu_ns = index->cpu_ns;
+    uint32_t num_analyzed = index->num_analyzed;
+    wave_index_init(index);
+    index->bytes = bytes;
+    index->cpu_ns = cpu_ns;
+    index->num_analyzed = num_analyzed;
+    index->summaries = calloc(MAX(library->num_files, 1), sizeof(WaveSummary));
+    if (index->summaries == NULL) {
+        perror("wave_index_update");
+        wave_index_free(&old);
+        return -1;
+    }
+    index->num_summaries = library->num_files;
+    index->dirty = old.dirty;
+
+    // Both are sorted by path, so they are walked side by side
+    uint32_t i = 0;
+    for (uint32_t j = 0; j < library->num_files; j++) {
+        int order = -1;
+        while (i < old.num_summaries &&
+               (order = strcmp(old.summaries[i].path, library->files[j])) < 0) {
+            wave_summary_free(&old.summaries[i]);
+            free(old.summaries[i++].path);
+            index->dirty = 1;
+        }
+        if (i < old.num_summaries && order == 0) {
+            index->summaries[j] = old.summaries[i++];
+            index->summaries[j].checked = 0;
+            continue;
+        }
+        index->summaries[j].path = strdup(library->files[j]);
+        if (index->summaries[j].path == NULL) {
+            perror("wave_index_update");
+            old.num_summaries = i;
+            wave_index_free(&old);
+            wave_index_free(index);
+            return -1;
+        }
+    }
+    index->dirty |= i < old.num_summaries;
+    for (; i < old.num_summaries; i++) {
+        wave_summary_free(&old.summaries[i]);
+        free(old.summaries[i].path);
+    }
+    free(old.summaries);
+    return 0;
+}
+
+
+/*
+** Helper for: wave_index_build
+** Starts analyzing the summary's file if it is not the one it was made from.
+*/
+static void _start_summary(WaveIndex *index, const Library *library, WaveSummary *summary) {
+    summary->checked = 1;
+    char *path = _library_file_path(library, summary - index->summaries);
+    if (path == NULL) {
+        return;
+    }
+    struct stat file_stat;
+    if (stat(path, &file_stat) == -1 ||
+        (summary->built && summary->size == (uint32_t)file_stat.st_size &&
+         summary->mtime == (uint32_t)file_stat.st_mtime)) {
+        free(path);
+        return;
+    }
+    index->dirty = 1;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        summary->built = 0;
+    } else if ((index->analysis = wave_analysis_start(summary, fd, &file_stat)) != NULL) {
+        index->analysis_fd = fd;
+        return;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+
+int wave_index_build(WaveIndex *index, const Library *library) {
+    uint64_t start_ns = _cpu_ns();
+    while (1) {
+        if (index->analysis != NULL) {
+            int result = wave_analysis_step(index->analysis, &index->bytes);
+            if (result == 0) {
+                continue;
+            }
+            if (result == -1) {
+                // Not done, so its summary is left to be made again
+                _drop_analysis(index);
+                continue;
+            }
+            wave_analysis_finish(index->analysis);
+            close(index->analysis_fd);
+            index->analysis = NULL;
+            index->analysis_fd = -1;
+            index->num_analyzed++;
+            continue;
+        }
+        if (index->next_build >= index->num_summaries) {
+            break;
+        }
+        WaveSummary *summary = &index->summaries[index->next_build++];
+        if (!summary->checked) {
+            _start_summary(index, library, summary);
+        }
+    }
+    index->cpu_ns += _cpu_ns() - start_ns;
+    if (index->num_analyzed > 0) {
+        double mb = index->bytes / 1e6;
+        double cpu_s = MAX(index->cpu_ns, 1) / 1e9;
+        printf("Analyzed %u files, %.1f MB in %.2f s of CPU: %.1f MB/s per core\n",
+               index->num_analyzed, mb, cpu_s, mb / cpu_s);
+    }
+    index->bytes = 0;
+    index->cpu_ns = 0;
+    index->num_analyzed = 0;
+    if (!index->dirty) {
+        return 0;
+    }
+    // Not tried again until something changes, even if it failed
+    index->dirty = 0;
+    if (_save(index) == -1) {
+        ERR_PRINT("Could not save the waveform index in %s\n", wave_index_directory);
+        return 0;
+    }
+    return 1;
+}
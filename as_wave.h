@@ -0,0 +1,196 @@
+#ifndef AS_WAVE_H_
+#define AS_WAVE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <sys/stat.h>
+
+/*
+** Waveforms and loudness
+** ----------------------
+** To draw a track's waveform, or to play tracks at the same loudness, a client
+** would have to fetch and decode each of them whole. So the server analyzes
+** the PCM WAV files of its library (8, 16, 24 and 32-bit integer samples, or
+** 32-bit float) once, between its other work, into a summary of each:
+**   Its peak envelope: the file cut into WAVE_MAX_BUCKETS buckets of equal
+**       length (fewer if it has fewer sample frames), with the lowest and
+**       highest sample of any channel in each, scaled from full scale to
+**       -127..127, the lowest rounded down and the highest up. Envelopes of
+**       fewer buckets are merged from these, so the one summary serves every
+**       resolution.
+**   Its integrated loudness, as EBU R128 (ITU-R BS.1770-4) defines it: the
+**       channels are K-weighted, their mean squares taken over 400ms blocks
+**       every 100ms and summed (surround channels weighed 1.41, LFE not at
+**       all), then gated at -70 LUFS and at 10 LU below the loudness of the
+**       blocks left. It is kept in hundredths of LUFS, WAVE_SILENT if no
+**       block passes the gates.
+** Samples are converted to float and their peaks found with SSE2 or AVX2,
+** whichever the CPU has, and in plain C otherwise. The K-weighting filters
+** feed each sample back into the next, so they stay scalar.
+**
+** A WAVEFORM request is followed by the file's index, as a 32-bit integer,
+** and the number of buckets wanted, as a 16-bit one, both in network byte
+** order; 0 asks for WAVE_DEFAULT_BUCKETS. The response is its size as a
+** 32-bit integer, then, all in network byte order:
+**                   <loudness: 32 bits, signed> <duration in ms: 32 bits>
+**                   <number of buckets: 16 bits> <buckets>
+** with each bucket its lowest and highest sample as signed bytes. There are
+** as many buckets as were asked for, or as the summary has if it has fewer.
+** A file that is not a PCM WAV file is answered with a size of 0 alone.
+**
+** Summaries are analyzed WAVE_READ_SIZE bytes at a time by the server's
+** indexer, the helper process that builds seek tables too, and saved in
+** WAVE_INDEX_FILE in wave_index_directory once they all are, for the server
+** to load them, and to load them again when it starts next. Like seek tables (see as_seek.h), summaries
+** are saved apart from the library, and a summary only counts for a file of
+** the size and mtime it was made from; otherwise, a WAVEFORM analyzes the
+** file for itself.
+**
+** The index file is WAVE_INDEX_MAGIC, then the number of summaries, then for
+** each, in path order and with every integer a varint (see libas.h):
+**                   <path length> <path> <size> <mtime> <is PCM> <loudness>
+**                   <duration in ms> <number of buckets> <buckets>
+** with the loudness's two's complement as the varint, and the buckets as in
+** the response.
+*/
+#define WAVE_MAX_BUCKETS 1024
+#define WAVE_DEFAULT_BUCKETS 256
+#define WAVE_SILENT INT32_MIN
+#define WAVE_ARGS_SIZE 6
+#define WAVE_RESPONSE_HEADER_SIZE 10
+#define WAVE_MAX_CHANNELS 8
+#define WAVE_READ_SIZE 262144
+// The seek index's, see as_seek.h
+#define WAVE_DEFAULT_DIRECTORY ".as_index"
+#define WAVE_INDEX_FILE "wave"
+#define WAVE_INDEX_MAGIC "ASWAVE1\n"
+
+
+// Where the index is saved, WAVE_DEFAULT_DIRECTORY unless the server is told
+extern const char *wave_index_directory;
+
+
+/*
+** A file's summary.
+** peaks: num_buckets pairs of the lowest and highest sample in the bucket.
+** checked: the file was found to still be the one the summary was made from.
+*/
+typedef struct wave_summary {
+    char *path;
+    uint32_t size;
+    uint32_t mtime;
+    uint8_t built;
+    uint8_t checked;
+    uint8_t pcm;
+    int32_t loudness;
+    uint32_t duration_ms;
+    uint32_t num_buckets;
+    int8_t *peaks;
+} WaveSummary;
+
+/*
+** A file being analyzed, a step at a time, see wave_analysis_step. Its
+** fields are its own.
+*/
+typedef struct wave_analysis WaveAnalysis;
+
+/*
+** summaries: one for each of the library's num_summaries files, in its order.
+** next_build: the first summary that may still need to be made or checked.
+** analysis: of the file of summary next_build - 1, open at analysis_fd, NULL
+** between files.
+** bytes, cpu_ns: the sample data analyzed so far, and the CPU time it took.
+** dirty: some summary changed since the index file was saved.
+*/
+typedef struct wave_index {
+    WaveSummary *summaries;
+    uint32_t num_summaries;
+    uint32_t next_build;
+    WaveAnalysis *analysis;
+    int analysis_fd;
+    uint64_t bytes;
+    uint64_t cpu_ns;
+    uint32_t num_analyzed;
+    uint8_t dirty;
+} WaveIndex;
+
+
+/*
+** Initializes an empty index.
+*/
+void wave_index_init(WaveIndex *index);
+
+/*
+** Brings the index in line with library, whose files must be sorted by path:
+** files that stay keep their summaries, to be checked again, and new ones
+** get empty summaries. With load set, the summaries saved in the index file
+** are taken first.
+**
+** returns 0 on success, -1 on error, leaving the index empty
+*/
+int wave_index_update(WaveIndex *index, const Library *library, uint8_t load);
+
+/*
+** Makes or checks every summary that needs it, prints how fast its files
+** were analyzed, and saves the index if any changed. This decodes whole
+** files, so the server does it in its indexer.
+**
+** returns 1 if the index was saved, 0 if it didn't need to be or could not be
+*/
+int wave_index_build(WaveIndex *index, const Library *library);
+
+/*
+** Frees everything the index holds, leaving it empty.
+*/
+void wave_index_free(WaveIndex *index);
+
+/*
+** Starts analyzing the file open at fd, whose fstat is file_stat, into
+** summary, after freeing what it held. The file is left open.
+**
+** returns the analysis, NULL if the file is not a PCM WAV file, which
+** summary then records, or on error, which leaves summary unbuilt
+*/
+WaveAnalysis *wave_analysis_start(WaveSummary *summary, int fd, const struct stat *file_stat);
+
+/*
+** Analyzes the next WAVE_READ_SIZE bytes of the file at most, and adds their
+** size to *bytes.
+**
+** returns 1 once the whole file is, 0 if some is left, -1 on error
+*/
+int wave_analysis_step(WaveAnalysis *analysis, uint64_t *bytes);
+
+/*
+** Ends the analysis, completing its summary if it was done, and frees it.
+**
+** returns 0 if it was done, -1 if it was not or failed, which leaves the
+** summary unbuilt
+*/
+int wave_analysis_finish(WaveAnalysis *analysis);
+
+/*
+** Analyzes the whole file open at fd, whose fstat is file_stat, into summary.
+**
+** returns 0 on success, -1 on error; a file that is not a PCM WAV file is
+** not an error
+*/
+int wave_analyze(WaveSummary *summary, int fd, const struct stat *file_stat);
+
+/*
+** Frees what the summary holds.
+*/
+void wave_summary_free(WaveSummary *summary);
+
+/*
+** Builds the WAVEFORM response of summary at num_buckets buckets, see above,
+** or the empty one of a file that is not a PCM WAV file.
+**
+** returns the heap-allocated response, of *len bytes, NULL on error
+*/
+uint8_t *wave_response(const WaveSummary *summary, uint32_t num_buckets, uint32_t *len);
+
+#endif // AS_WAVE_H_
@@ -4,6 +4,19 @@
 /*****************************************************************************/
 #include "libas.h"
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+#ifdef AS_TRACE
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+IoStats io_stats;
+
 
 void _free_library(Library *library){
     if (library == NULL) return;
@@ -15,6 +28,17 @@ void _free_library(Library *library){
     }
     library->files = NULL;
     library->num_files = 0;
+    free(library->file_roots);
+    library->file_roots = NULL;
+}
+
+
+char *_library_file_path(const Library *library, uint32_t file_index) {
+    const char *root = library->path;
+    if (library->roots != NULL && library->file_roots != NULL) {
+        root = library->roots[library->file_roots[file_index]];
+    }
+    return _join_path(root, library->files[file_index]);
 }
 
 
@@ -38,63 +62,883 @@ char *_join_path(const char *path1, const char *path2) {
 }
 
 
+/*
+** Helpers for: find_crlf
+** The vector scans compare 16 or 32 bytes against \r, and the same bytes
+** shifted by one against \n, so every bit set in the mask is a \r\n.
+*/
+static const char *_find_crlf_scalar(const char *buf, size_t len) {
+    const char *end = buf + len;
+    const char *cr = buf;
+    while ((cr = memchr(cr, '\r', end - cr)) != NULL) {
+        if (cr + 1 < end && cr[1] == '\n') {
+            return cr;
+        }
+        cr++;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static const char *_find_crlf_sse2(const char *buf, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 17 <= len; i += 16) {
+        __m128i here = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i next = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(here, cr),
+                                                   _mm_cmpeq_epi8(next, lf)));
+        if (mask != 0) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+    return _find_crlf_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *_find_crlf_avx2(const char *buf, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 33 <= len; i += 32) {
+        __m256i here = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i next = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(here, cr),
+                                                                  _mm256_cmpeq_epi8(next, lf)));
+        if (mask != 0) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+    return _find_crlf_sse2(buf + i, len - i);
+}
+#endif
+
+
+const char *find_crlf(const char *buf, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const char *(*scan)(const char *, size_t) = NULL;
+    if (scan == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            scan = _find_crlf_avx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            scan = _find_crlf_sse2;
+        } else {
+            scan = _find_crlf_scalar;
+        }
+    }
+    return scan(buf, len);
+#else
+    return _find_crlf_scalar(buf, len);
+#endif
+}
+
+
 char *find_network_newline(char *buf, int *inbuf) {
-    for (int i = 0; i < *inbuf - 1; i++) {
-        if (buf[i] == '\r' && buf[i + 1] == '\n') {
-            buf[i] = '\0';
-            char *ret = strdup(buf);
-            if (ret == NULL) {
-                perror("find_network_newline: strdup");
-                exit(-1);
+    char *crlf = (char *)find_crlf(buf, *inbuf);
+    if (crlf == NULL) {
+        return NULL;
+    }
+    int i = crlf - buf;
+    buf[i] = '\0';
+    char *ret = strdup(buf);
+    if (ret == NULL) {
+        perror("find_network_newline: strdup");
+        exit(-1);
+    }
+    *inbuf -= i + 2;
+    memmove(buf, buf + i + 2, *inbuf);
+    return ret;
+}
+
+
+int line_reader_init(LineReader *reader, size_t initial_capacity, size_t max_capacity) {
+    memset(reader, 0, sizeof(LineReader));
+    reader->buf = malloc(initial_capacity);
+    if (reader->buf == NULL) {
+        perror("line_reader_init");
+        return -1;
+    }
+    reader->capacity = initial_capacity;
+    reader->max_capacity = max_capacity;
+    return 0;
+}
+
+
+void line_reader_free(LineReader *reader) {
+    free(reader->buf);
+    memset(reader, 0, sizeof(LineReader));
+}
+
+
+/*
+** Helper for: line_reader_fill, line_reader_feed
+** Makes room for at least room more bytes at the end of the buffer.
+*/
+static int _line_reader_make_room(LineReader *reader, size_t room) {
+    while (reader->capacity - reader->end < room) {
+        uint8_t at_max = reader->max_capacity && reader->capacity >= reader->max_capacity;
+        if (reader->start > 0 && (at_max || reader->start >= reader->capacity / 2)) {
+            // Reclaim what has been consumed, now that it is worth a move
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        } else if (at_max) {
+            errno = ENOBUFS;
+            return -1;
+        } else {
+            size_t capacity = reader->capacity * 2;
+            if (reader->max_capacity && capacity > reader->max_capacity) {
+                capacity = reader->max_capacity;
             }
-            *inbuf -= i + 2;
-            memmove(buf, buf + i + 2, *inbuf);
-            return ret;
+            char *buf = realloc(reader->buf, capacity);
+            if (buf == NULL) {
+                perror("line_reader_fill");
+                return -1;
+            }
+            reader->buf = buf;
+            reader->capacity = capacity;
         }
     }
-    return NULL;
+    return 0;
+}
+
+
+int line_reader_fill(LineReader *reader, int fd) {
+    if (reader->end == reader->capacity && _line_reader_make_room(reader, 1) == -1) {
+        return -1;
+    }
+
+    int ret;
+    do {
+        ret = read(fd, reader->buf + reader->end, reader->capacity - reader->end);
+        __atomic_fetch_add(&io_stats.read_calls, 1, __ATOMIC_RELAXED);
+    } while (ret == -1 && errno == EINTR);
+    if (ret > 0) {
+        reader->end += ret;
+        __atomic_fetch_add(&io_stats.bytes_read, ret, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+
+char *line_reader_next(LineReader *reader, size_t *len) {
+    char *line = reader->buf + reader->start;
+    size_t available = reader->end - reader->start;
+    // Back up one byte in case the \r was the last byte scanned
+    size_t skip = reader->scanned > 0 ? reader->scanned - 1 : 0;
+
+    const char *crlf = find_crlf(line + skip, available - skip);
+    if (crlf == NULL) {
+        reader->scanned = available;
+        return NULL;
+    }
+
+    size_t line_len = crlf - line;
+    line[line_len] = '\0';
+    reader->start += line_len + 2;
+    reader->scanned = 0;
+    if (len != NULL) {
+        *len = line_len;
+    }
+    return line;
+}
+
+
+size_t line_reader_take(LineReader *reader, void *dest, size_t count) {
+    size_t num = MIN(count, reader->end - reader->start);
+    memcpy(dest, reader->buf + reader->start, num);
+    reader->start += num;
+    reader->scanned = 0;
+    return num;
+}
+
+
+int line_reader_feed(LineReader *reader, const void *data, size_t len) {
+    if (_line_reader_make_room(reader, len) == -1) {
+        return -1;
+    }
+    memcpy(reader->buf + reader->end, data, len);
+    reader->end += len;
+    return 0;
+}
+
+
+int frame_add(Writer *writer, uint8_t type, uint8_t flags, uint32_t stream_id,
+              const void *payload, uint32_t length) {
+    uint8_t header[V2_FRAME_HEADER_SIZE];
+    uint32_t network_length = htonl(length);
+    uint32_t network_stream_id = htonl(stream_id);
+    memcpy(header, &network_length, sizeof(uint32_t));
+    memcpy(header + 4, &network_stream_id, sizeof(uint32_t));
+    header[8] = type;
+    header[9] = flags;
+    if (writer_add_copy(writer, header, V2_FRAME_HEADER_SIZE) == -1) {
+        return -1;
+    }
+    return writer_add(writer, payload, length);
+}
+
+
+int frame_next(LineReader *reader, FrameHeader *header, uint8_t **payload,
+               uint32_t max_payload) {
+    size_t available = reader->end - reader->start;
+    if (available < V2_FRAME_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint8_t *frame = (uint8_t *)reader->buf + reader->start;
+    uint32_t network_length, network_stream_id;
+    memcpy(&network_length, frame, sizeof(uint32_t));
+    memcpy(&network_stream_id, frame + 4, sizeof(uint32_t));
+    header->length = ntohl(network_length);
+    header->stream_id = ntohl(network_stream_id);
+    header->type = frame[8];
+    header->flags = frame[9];
+    if (header->length > max_payload) {
+        ERR_PRINT("frame_next: %u byte payload is too long\n", header->length);
+        return -1;
+    }
+    if (available < V2_FRAME_HEADER_SIZE + header->length) {
+        return 0;
+    }
+
+    *payload = frame + V2_FRAME_HEADER_SIZE;
+    reader->start += V2_FRAME_HEADER_SIZE + header->length;
+    reader->scanned = 0;
+    return 1;
 }
 
 
 int read_precisely(int fd, void *buf, size_t count) {
+    TRACE_BEGIN("read_precisely");
     int bytes_read = 0;
     while (bytes_read < count) {
         int ret = read(fd, buf + bytes_read, count - bytes_read);
+        __atomic_fetch_add(&io_stats.read_calls, 1, __ATOMIC_RELAXED);
         if (ret == -1) {
             if (errno == EINTR) {
                 continue;
             }
             ERR_PRINT("read_precisely: read");
+            TRACE_END("read_precisely");
             return -1;
         }
         if (ret == 0) {
             ERR_PRINT("read_precisely: read: Unexpected EOF");
+            TRACE_END("read_precisely");
             return -1;
         }
         bytes_read += ret;
+        __atomic_fetch_add(&io_stats.bytes_read, ret, __ATOMIC_RELAXED);
     }
-    #ifdef DEBUG
-    printf("read_precisely: read %d bytes\n", bytes_read);
-    #endif
+    TRACE_END("read_precisely");
     return bytes_read;
 }
 
 
 int write_precisely(int fd, const void *buf, size_t count) {
+    TRACE_BEGIN("write_precisely");
     int bytes_written = 0;
     while (bytes_written < count) {
         int ret = write(fd, buf + bytes_written, count - bytes_written);
+        __atomic_fetch_add(&io_stats.write_calls, 1, __ATOMIC_RELAXED);
         if (ret == -1) {
             if (errno == EINTR) {
                 continue;
             }
             ERR_PRINT("write_precisely: write");
+            TRACE_END("write_precisely");
+            return -1;
+        }
+        bytes_written += ret;
+        __atomic_fetch_add(&io_stats.bytes_written, ret, __ATOMIC_RELAXED);
+    }
+    TRACE_END("write_precisely");
+    return bytes_written;
+}
+
+
+uint8_t *varint_put(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = value | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+
+int varint_get(const uint8_t **in, const uint8_t *end, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 7 * VARINT_MAX_SIZE && *in < end; shift += 7) {
+        uint8_t byte = *(*in)++;
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+
+void writer_init(Writer *writer, int fd) {
+    memset(writer, 0, sizeof(Writer));
+    writer->fd = fd;
+}
+
+
+int writer_enable_zerocopy(Writer *writer) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    int on = 1;
+    if (setsockopt(writer->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+        writer->zerocopy = 1;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+
+int writer_add(Writer *writer, const void *buf, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (writer->num_iov == WRITER_MAX_IOV && writer_flush(writer) < 0) {
+        return -1;
+    }
+    writer->iov[writer->num_iov].iov_base = (void *)buf;
+    writer->iov[writer->num_iov].iov_len = len;
+    writer->num_iov++;
+    writer->pending += len;
+    return 0;
+}
+
+
+int writer_add_copy(Writer *writer, const void *buf, size_t len) {
+    if (len > WRITER_SCRATCH_SIZE) {
+        ERR_PRINT("writer_add_copy: %zu bytes is too large to copy\n", len);
+        return -1;
+    }
+    // Flush first if either the copy or its iovec would not fit
+    if ((writer->scratch_used + len > WRITER_SCRATCH_SIZE || writer->num_iov == WRITER_MAX_IOV)
+        && writer_flush(writer) < 0) {
+        return -1;
+    }
+    uint8_t *copy = writer->scratch + writer->scratch_used;
+    memcpy(copy, buf, len);
+    writer->scratch_used += len;
+    return writer_add(writer, copy, len);
+}
+
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+/*
+** Helper for: writer_flush
+** Waits until the kernel reports it is done with every zero-copy send, through
+** the socket's error queue, so the caller may reuse its buffers.
+*/
+static int _writer_wait_zerocopy(Writer *writer) {
+    while (writer->zerocopy_outstanding > 0) {
+        struct pollfd pfd = {writer->fd, 0, 0};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("writer_flush: poll");
+            return -1;
+        }
+
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(writer->fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            perror("writer_flush: recvmsg");
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                // ee_info..ee_data is the range of sends that completed, counted
+                // per socket; every earlier flush on it has already completed
+                writer->zerocopy_outstanding -= MIN(writer->zerocopy_outstanding,
+                                                    err->ee_data - err->ee_info + 1);
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+
+int writer_flush(Writer *writer) {
+    TRACE_BEGIN("writer_flush");
+    int bytes_written = 0;
+    struct iovec *iov = writer->iov;
+    int num_iov = writer->num_iov;
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    int flags = writer->zerocopy && writer->pending >= WRITER_ZEROCOPY_MIN ? MSG_ZEROCOPY : 0;
+#endif
+    while (num_iov > 0) {
+        int ret;
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+        if (flags) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = num_iov;
+            ret = sendmsg(writer->fd, &msg, flags);
+            if (ret >= 0) {
+                writer->zerocopy_outstanding++;
+            }
+        } else
+#endif
+        ret = writev(writer->fd, iov, num_iov);
+        __atomic_fetch_add(&io_stats.write_calls, 1, __ATOMIC_RELAXED);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_PRINT("writer_flush: writev");
+            TRACE_END("writer_flush");
             return -1;
         }
         bytes_written += ret;
+        __atomic_fetch_add(&io_stats.bytes_written, ret, __ATOMIC_RELAXED);
+
+        // Skip what was written, which may end partway through an iovec
+        while (num_iov > 0 && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            num_iov--;
+        }
+        if (num_iov > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (flags && _writer_wait_zerocopy(writer) == -1) {
+        TRACE_END("writer_flush");
+        return -1;
     }
-    #ifdef DEBUG
-    printf("write_precisely: wrote %d bytes\n", bytes_written);
-    #endif
+#endif
+    TRACE_END("writer_flush");
+    writer->num_iov = 0;
+    writer->pending = 0;
+    writer->scratch_used = 0;
     return bytes_written;
 }
+
+
+/*
+** Helpers for: the Poller
+*/
+static int _poller_find(const Poller *poller, int fd) {
+    for (int i = 0; i < poller->num_fds; i++) {
+        if (poller->fds[i].fd == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static int _poller_set_data(Poller *poller, int fd, void *data) {
+    if (fd >= poller->data_size) {
+        int data_size = fd + 64;
+        void **data_ptrs = realloc(poller->data, data_size * sizeof(void *));
+        if (data_ptrs == NULL) {
+            perror("poller_watch");
+            return -1;
+        }
+        memset(data_ptrs + poller->data_size, 0,
+               (data_size - poller->data_size) * sizeof(void *));
+        poller->data = data_ptrs;
+        poller->data_size = data_size;
+    }
+    poller->data[fd] = data;
+    return 0;
+}
+
+
+static int _poller_list_watch(Poller *poller, int fd, uint32_t events) {
+    int i = _poller_find(poller, fd);
+    if (events == 0) {
+        if (i != -1) {
+            poller->fds[i] = poller->fds[--poller->num_fds];
+        }
+        return 0;
+    }
+
+    if (i == -1) {
+        struct pollfd *fds = realloc(poller->fds, (poller->num_fds + 1) * sizeof(struct pollfd));
+        if (fds == NULL) {
+            perror("poller_watch");
+            return -1;
+        }
+        poller->fds = fds;
+        i = poller->num_fds++;
+    }
+    poller->fds[i].fd = fd;
+    poller->fds[i].events = ((events & POLLER_READ) ? POLLIN : 0)
+                            | ((events & POLLER_WRITE) ? POLLOUT : 0);
+    poller->fds[i].revents = 0;
+    return 0;
+}
+
+
+#ifndef __linux__
+static uint32_t _poller_list_events(const struct pollfd *pfd) {
+    uint32_t events = 0;
+    if (pfd->revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+        events |= POLLER_READ;
+    }
+    if (pfd->revents & (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) {
+        events |= POLLER_WRITE;
+    }
+    return events;
+}
+#endif
+
+
+int poller_init(Poller *poller) {
+    memset(poller, 0, sizeof(Poller));
+    poller->epoll_fd = -1;
+#ifdef __linux__
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epoll_fd == -1) {
+        perror("poller_init: epoll_create1");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+
+int poller_watch(Poller *poller, int fd, uint32_t events, void *data) {
+    if (_poller_set_data(poller, fd, events ? data : NULL) == -1) {
+        return -1;
+    }
+#ifdef __linux__
+    // Descriptors that epoll refused stay in the list
+    if (_poller_find(poller, fd) != -1) {
+        return _poller_list_watch(poller, fd, events);
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = ((events & POLLER_READ) ? EPOLLIN : 0)
+                   | ((events & POLLER_WRITE) ? EPOLLOUT : 0);
+    event.data.fd = fd;
+
+    if (events == 0) {
+        if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1
+            && errno != ENOENT && errno != EBADF) {
+            perror("poller_watch: epoll_ctl");
+            return -1;
+        }
+        return 0;
+    }
+    if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) {
+        return 0;
+    }
+    if (errno == ENOENT && epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0) {
+        return 0;
+    }
+    if (errno == EPERM) {
+        return _poller_list_watch(poller, fd, events);
+    }
+    perror("poller_watch: epoll_ctl");
+    return -1;
+#else
+    return _poller_list_watch(poller, fd, events);
+#endif
+}
+
+
+int poller_wait(Poller *poller, PollerEvent *events, int max_events, int timeout_ms) {
+    int num_events = 0;
+#ifdef __linux__
+    // Regular files are always ready, report them without blocking
+    for (int i = 0; i < poller->num_fds && num_events < max_events; i++) {
+        events[num_events].fd = poller->fds[i].fd;
+        events[num_events].events = poller->fds[i].events & POLLIN ? POLLER_READ : 0;
+        events[num_events].events |= poller->fds[i].events & POLLOUT ? POLLER_WRITE : 0;
+        events[num_events].data = poller->data[poller->fds[i].fd];
+        num_events++;
+    }
+    if (num_events == max_events) {
+        return num_events;
+    }
+
+    struct epoll_event epoll_events[max_events - num_events];
+    int ret;
+    do {
+        ret = epoll_wait(poller->epoll_fd, epoll_events, max_events - num_events,
+                         num_events ? 0 : timeout_ms);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        perror("poller_wait: epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < ret; i++) {
+        uint32_t ready = epoll_events[i].events;
+        PollerEvent *event = &events[num_events++];
+        event->fd = epoll_events[i].data.fd;
+        event->events = 0;
+        if (ready & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            event->events |= POLLER_READ;
+        }
+        if (ready & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            event->events |= POLLER_WRITE;
+        }
+        event->data = poller->data[event->fd];
+    }
+#else
+    int ret;
+    do {
+        ret = poll(poller->fds, poller->num_fds, timeout_ms);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        perror("poller_wait: poll");
+        return -1;
+    }
+
+    for (int i = 0; i < poller->num_fds && num_events < max_events; i++) {
+        if (poller->fds[i].revents == 0) {
+            continue;
+        }
+        events[num_events].fd = poller->fds[i].fd;
+        events[num_events].events = _poller_list_events(&poller->fds[i]);
+        events[num_events].data = poller->data[poller->fds[i].fd];
+        num_events++;
+    }
+#endif
+    return num_events;
+}
+
+
+void poller_destroy(Poller *poller) {
+    if (poller->epoll_fd != -1) {
+        close(poller->epoll_fd);
+    }
+    free(poller->fds);
+    free(poller->data);
+    memset(poller, 0, sizeof(Poller));
+    poller->epoll_fd = -1;
+}
+
+
+#ifdef AS_TRACE
+typedef struct trace_record {
+    const char *name;
+    uint64_t ts_ns;
+    char phase;
+} TraceRecord;
+
+typedef struct trace_ring {
+    uint64_t head;      // events ever recorded, the next goes at head % TRACE_RING_SIZE
+    int tid;
+    struct trace_ring *next;
+    TraceRecord records[TRACE_RING_SIZE];
+} TraceRing;
+
+// Every thread's ring, newest first, and the calling thread's
+static TraceRing *trace_rings = NULL;
+static __thread TraceRing *thread_ring = NULL;
+static const char *trace_process_name = "as";
+
+// Room for the dump's lines between writes
+#define TRACE_DUMP_BUFFER_SIZE 8192
+
+
+static int _trace_tid(void) {
+#ifdef __linux__
+    return syscall(SYS_gettid);
+#else
+    return getpid();
+#endif
+}
+
+
+/*
+** Helper for: trace_event
+** returns the calling thread's ring, made and published on its first event,
+** NULL if there is no memory for it
+*/
+static TraceRing *_trace_ring(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->tid = _trace_tid();
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+
+void trace_event(const char *name, char phase) {
+    TraceRing *ring = _trace_ring();
+    if (ring == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // Only this thread writes its ring, the release is for the dump
+    uint64_t head = ring->head;
+    TraceRecord *record = &ring->records[head % TRACE_RING_SIZE];
+    record->name = name;
+    record->ts_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+void trace_forked(void) {
+    for (TraceRing *ring = trace_rings; ring != NULL; ring = ring->next) {
+        ring->head = 0;
+    }
+    if (thread_ring != NULL) {
+        thread_ring->tid = _trace_tid();
+    }
+}
+
+
+/*
+** The dump runs in a signal handler, so it formats the events itself rather
+** than with stdio, which is not async-signal-safe.
+*/
+typedef struct trace_dump {
+    int fd;
+    char buf[TRACE_DUMP_BUFFER_SIZE];
+    size_t len;
+} TraceDump;
+
+
+static void _dump_flush(TraceDump *dump) {
+    size_t written = 0;
+    while (written < dump->len) {
+        ssize_t ret = write(dump->fd, dump->buf + written, dump->len - written);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        written += ret;
+    }
+    dump->len = 0;
+}
+
+
+static void _dump_str(TraceDump *dump, const char *str) {
+    for (; *str != '\0'; str++) {
+        if (dump->len == TRACE_DUMP_BUFFER_SIZE) {
+            _dump_flush(dump);
+        }
+        dump->buf[dump->len++] = *str;
+    }
+}
+
+
+static void _dump_uint(TraceDump *dump, uint64_t value, int min_digits) {
+    char digits[24];
+    int num = 0;
+    do {
+        digits[num++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0 || num < min_digits);
+    char str[25];
+    for (int i = 0; i < num; i++) {
+        str[i] = digits[num - 1 - i];
+    }
+    str[num] = '\0';
+    _dump_str(dump, str);
+}
+
+
+static void _trace_dump(int signum) {
+    int saved_errno = errno;
+    TraceDump dump;
+    dump.len = 0;
+    pid_t pid = getpid();
+
+    _dump_str(&dump, TRACE_DIR "/as_trace.");
+    _dump_uint(&dump, pid, 1);
+    _dump_str(&dump, ".json");
+    dump.buf[dump.len] = '\0';
+    dump.fd = open(dump.buf, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dump.len = 0;
+    if (dump.fd == -1) {
+        errno = saved_errno;
+        return;
+    }
+
+    _dump_str(&dump, "[\n");
+    for (TraceRing *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        // Another thread may be recording over its oldest event right now
+        uint64_t first = head > TRACE_RING_SIZE - 1 ? head - (TRACE_RING_SIZE - 1) : 0;
+        for (uint64_t i = first; i < head; i++) {
+            const TraceRecord *record = &ring->records[i % TRACE_RING_SIZE];
+            char phase[2] = {record->phase, '\0'};
+            _dump_str(&dump, "{\"name\":\"");
+            _dump_str(&dump, record->name);
+            _dump_str(&dump, "\",\"ph\":\"");
+            _dump_str(&dump, phase);
+            // Chrome wants microseconds
+            _dump_str(&dump, "\",\"ts\":");
+            _dump_uint(&dump, record->ts_ns / 1000, 1);
+            _dump_str(&dump, ".");
+            _dump_uint(&dump, record->ts_ns % 1000, 3);
+            _dump_str(&dump, ",\"pid\":");
+            _dump_uint(&dump, pid, 1);
+            _dump_str(&dump, ",\"tid\":");
+            _dump_uint(&dump, ring->tid, 1);
+            _dump_str(&dump, "},\n");
+        }
+    }
+    _dump_str(&dump, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+    _dump_uint(&dump, pid, 1);
+    _dump_str(&dump, ",\"args\":{\"name\":\"");
+    _dump_str(&dump, trace_process_name);
+    _dump_str(&dump, "\"}}\n]\n");
+    _dump_flush(&dump);
+    close(dump.fd);
+    errno = saved_errno;
+}
+
+
+void trace_init(const char *process_name) {
+    trace_process_name = process_name;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _trace_dump;
+    // Blocking calls carry on after a dump, rather than fail with EINTR
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) == -1) {
+        perror("trace_init: sigaction");
+    }
+}
+#endif
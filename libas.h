@@ -17,6 +17,7 @@
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <sys/socket.h>
+#include <sys/uio.h>       /* writev */
 
 // File and directory stuff
 #include <fcntl.h>
@@ -25,7 +26,11 @@
 
 // system stuff
 #include <errno.h>
+#include <poll.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
     fprintf(stderr, __VA_ARGS__);
@@ -57,10 +62,26 @@
 #define REQUEST_BUFFER_SIZE 128
 #define REQUEST_LIST "LIST"
 #define REQUEST_STREAM "STREAM"
+#define REQUEST_STAT "STAT"
+#define REQUEST_V2 "V2"
+#define REQUEST_USTREAM "USTREAM"
+#define REQUEST_STATION "STATION"
+#define REQUEST_STATS "STATS"
+#define REQUEST_CLIST "CLIST"
+#define REQUEST_SEARCH "SEARCH"
+#define REQUEST_BROWSE "BROWSE"
+#define REQUEST_SEEK "SEEK"
+#define REQUEST_WAVEFORM "WAVEFORM"
+// Sent instead of a response when the server sheds the connection
+#define RESPONSE_BUSY "BUSY"
+// Sent instead of a response to a request the server does not serve, on a
+// connection it keeps open
+#define RESPONSE_UNSUPPORTED "NACK"
 
 #define RESPONSE_BUFFER_SIZE 4 * MAX_FILE_NAME
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define END_OF_MESSAGE_TOKEN "\r\n"
 
@@ -76,17 +97,32 @@
 **        relative to the library's path without a leading slash (heap-allocated).
 **        (e.g. "file1.wav", "artist/file2.wav", "artist/album/file3.wav", etc)
 ** num_files: number of files in the library, and the size of the files array.
+** roots: on the server, the num_roots directories the library is merged
+**        from, see scan_library; path is the first. NULL for path alone.
+** file_roots: the index in roots of the directory each file is in, NULL
+**             when there are no roots (heap-allocated).
  */
 typedef struct library {
     char *name;
     const char *path;
     char **files;
     uint32_t num_files;
+    const char **roots;
+    uint32_t num_roots;
+    uint32_t *file_roots;
 } Library;
 
 
 void _free_library(Library *library);
 
+/*
+** Joins the path of the directory the library's file at file_index is in,
+** its root or path, with the file's.
+**
+** Returns a heap-allocated string with the file's path, or NULL on error.
+*/
+char *_library_file_path(const Library *library, uint32_t file_index);
+
 
 /*
 ** Joins two paths together, adding a / between them if necessary.
@@ -104,6 +140,209 @@ char *_join_path(const char *path1, const char *path2);
 */
 char *find_network_newline(char *buf, int *inbuf);
 
+/*
+** Finds the first \r\n in the len bytes of buf, scanning 16 or 32 bytes at a
+** time with SSE2 or AVX2 where the CPU has them.
+**
+** Returns a pointer to the \r, or NULL if there is no \r\n in buf.
+*/
+const char *find_crlf(const char *buf, size_t len);
+
+/*
+** I/O statistics
+** --------------
+** Per-process counts of the system calls made by the libas I/O helpers, and of
+** the bytes they moved, to see how well writes are being coalesced. Files are
+** also read and written on helper threads (see as_readahead.h and
+** as_disk.h), so every count is made with atomics.
+*/
+typedef struct io_stats {
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+} IoStats;
+
+extern IoStats io_stats;
+
+/*
+** Vectored writer
+** ---------------
+** Queues buffers as iovecs and writes them out with as few writev (or
+** sendmsg) calls as possible, so that a header and the data following it
+** leave in the same system call and TCP segment. Like write_precisely, a flush
+** only returns once everything queued is written, retrying partial writes and
+** writes interrupted by signals.
+**
+** Queued buffers are referenced, not copied, and must stay valid until the
+** next flush; small buffers such as headers can be copied into the writer with
+** writer_add_copy instead. The writer flushes on its own when it runs out of
+** iovecs.
+**
+** With zero-copy enabled (Linux only), flushes of at least WRITER_ZEROCOPY_MIN
+** bytes are sent with MSG_ZEROCOPY, and wait for the kernel to release the
+** buffers before returning.
+*/
+#define WRITER_MAX_IOV 32
+#define WRITER_SCRATCH_SIZE 256
+#define WRITER_ZEROCOPY_MIN 65536
+
+typedef struct writer {
+    int fd;
+    struct iovec iov[WRITER_MAX_IOV];
+    int num_iov;
+    size_t pending;
+    uint8_t scratch[WRITER_SCRATCH_SIZE];
+    size_t scratch_used;
+    uint8_t zerocopy;
+    uint32_t zerocopy_outstanding;
+} Writer;
+
+/*
+** Initializes writer to write to fd.
+*/
+void writer_init(Writer *writer, int fd);
+
+/*
+** Sends large flushes with MSG_ZEROCOPY from now on, if the platform and the
+** socket support it.
+**
+** returns 0 on success, -1 if zero-copy is not available
+*/
+int writer_enable_zerocopy(Writer *writer);
+
+/*
+** Queues len bytes of buf, which must stay valid until the next flush.
+**
+** returns 0 on success, -1 on error (if a flush was needed and failed)
+*/
+int writer_add(Writer *writer, const void *buf, size_t len);
+
+/*
+** Queues a copy of len bytes of buf, with len at most WRITER_SCRATCH_SIZE.
+**
+** returns 0 on success, -1 on error
+*/
+int writer_add_copy(Writer *writer, const void *buf, size_t len);
+
+/*
+** Writes everything queued.
+**
+** Returns the number of bytes written, or -1 on error.
+*/
+int writer_flush(Writer *writer);
+
+/*
+** Line reader
+** -----------
+** Buffered reader for network newline terminated messages. Lines are returned
+** as views into the reader's buffer, in which the \r\n is replaced by a null
+** character, instead of being copied out. Consumed bytes are only reclaimed
+** when the buffer runs out of room, and the buffer grows as needed up to
+** max_capacity bytes (0 for no limit), so a long run of lines costs linear
+** time however it is split across reads.
+*/
+typedef struct line_reader {
+    char *buf;
+    size_t capacity;
+    size_t max_capacity;
+    size_t start;       // first unconsumed byte
+    size_t end;         // end of the buffered data
+    size_t scanned;     // bytes from start known not to hold a \r\n
+} LineReader;
+
+/*
+** Initializes reader with a buffer of initial_capacity bytes.
+**
+** returns 0 on success, -1 on error
+*/
+int line_reader_init(LineReader *reader, size_t initial_capacity, size_t max_capacity);
+
+/*
+** Frees the reader's buffer.
+*/
+void line_reader_free(LineReader *reader);
+
+/*
+** Reads whatever is available from fd (a single read call) into the reader.
+** Views previously returned by line_reader_next are invalidated.
+**
+** returns the number of bytes read, 0 on EOF, -1 on error (errno is ENOBUFS
+** if the buffer is full at max_capacity without a complete line)
+*/
+int line_reader_fill(LineReader *reader, int fd);
+
+/*
+** Returns the next complete line in the reader, without its \r\n, or NULL if
+** no complete line is buffered. The length of the line is stored in len if it
+** is not NULL. The line stays valid until the next call to line_reader_fill.
+*/
+char *line_reader_next(LineReader *reader, size_t *len);
+
+/*
+** Takes up to count buffered bytes that are not part of a line (for example
+** binary arguments following a request) and copies them to dest.
+**
+** returns the number of bytes copied
+*/
+size_t line_reader_take(LineReader *reader, void *dest, size_t count);
+
+/*
+** Appends len bytes of data to the reader, as if they had been read from a
+** descriptor.
+**
+** returns 0 on success, -1 on error (errno is ENOBUFS if they don't fit)
+*/
+int line_reader_feed(LineReader *reader, const void *data, size_t len);
+
+/*
+** Protocol v2 frames
+** ------------------
+** Once a connection has switched to protocol v2 (see as_server.h), everything
+** sent either way is a frame: a V2_FRAME_HEADER_SIZE byte header followed by
+** a payload of up to V2_MAX_FRAME_PAYLOAD bytes. The header holds, in network
+** byte order:
+**          <payload length: 32 bits><stream id: 32 bits><type: 8><flags: 8>
+*/
+#define V2_FRAME_HEADER_SIZE 10
+#define V2_MAX_FRAME_PAYLOAD 16384
+// Bytes of response a stream may be sent before the client grants more
+#define V2_INITIAL_WINDOW 65536
+
+#define V2_FRAME_REQUEST 1  // client: opens the stream, the payload is a v1 request
+#define V2_FRAME_DATA 2     // server: the next bytes of the stream's v1 response
+#define V2_FRAME_WINDOW 3   // client: the payload is a 32-bit window increment
+#define V2_FRAME_CANCEL 4   // client: the stream's response is no longer wanted
+#define V2_FRAME_ERROR 5    // server: the request failed, the payload says why
+
+#define V2_FLAG_END 0x1     // last frame of the stream
+
+typedef struct frame_header {
+    uint32_t length;
+    uint32_t stream_id;
+    uint8_t type;
+    uint8_t flags;
+} FrameHeader;
+
+/*
+** Queues a frame with the given header fields and payload on writer. The
+** payload is referenced, as with writer_add.
+**
+** returns 0 on success, -1 on error
+*/
+int frame_add(Writer *writer, uint8_t type, uint8_t flags, uint32_t stream_id,
+              const void *payload, uint32_t length);
+
+/*
+** Takes the next complete frame buffered in reader. The payload points into
+** the reader's buffer, and stays valid until the next call to line_reader_fill.
+**
+** returns 1 if a frame was taken, 0 if more data is needed, -1 if the frame's
+** payload is longer than max_payload
+*/
+int frame_next(LineReader *reader, FrameHeader *header, uint8_t **payload,
+               uint32_t max_payload);
+
 /*
 ** Blocking read from the file descriptor *exactly* count bytes into the buffer.
 ** Using as many calls to read as necessary, only returns when count bytes have
@@ -122,4 +361,130 @@ int read_precisely(int fd, void *buf, size_t count);
 */
 int write_precisely(int fd, const void *buf, size_t count);
 
+/*
+** Varints: integers 7 bits a byte, least significant first, with the top bit
+** set on all bytes but the last.
+*/
+#define VARINT_MAX_SIZE 5
+
+/*
+** Writes value to out as a varint.
+**
+** returns the byte after it
+*/
+uint8_t *varint_put(uint8_t *out, uint32_t value);
+
+/*
+** Reads a varint from *in, which it moves past it, without going past end.
+**
+** returns 0 on success, -1 if it is truncated or too long
+*/
+int varint_get(const uint8_t **in, const uint8_t *end, uint32_t *value);
+
+
+/*
+** Poller
+** ------
+** Readiness notification for event loops that multiplex many descriptors:
+** epoll on Linux, poll(2) elsewhere. Each watched descriptor carries a data
+** pointer that is handed back with its events.
+**
+** Regular files are always ready, and epoll refuses them, so the poller keeps
+** them aside and reports them as ready on every wait.
+*/
+#define POLLER_READ 0x1
+#define POLLER_WRITE 0x2
+
+typedef struct poller_event {
+    int fd;
+    uint32_t events;
+    void *data;
+} PollerEvent;
+
+typedef struct poller {
+    int epoll_fd;
+    // data pointers of the watched descriptors, indexed by descriptor
+    void **data;
+    int data_size;
+    // watched descriptors for poll(2), or the always-ready ones with epoll
+    struct pollfd *fds;
+    int num_fds;
+} Poller;
+
+/*
+** Creates a new poller.
+**
+** returns 0 on success, -1 on error
+*/
+int poller_init(Poller *poller);
+
+/*
+** Watches fd for events (POLLER_READ and/or POLLER_WRITE), adding it to the
+** poller if it is not watched yet. Watching for no events removes fd.
+** Errors and hang-ups are always reported, as both read and write readiness.
+**
+** returns 0 on success, -1 on error
+*/
+int poller_watch(Poller *poller, int fd, uint32_t events, void *data);
+
+/*
+** Waits up to timeout_ms milliseconds (-1 for no limit) for events, and stores
+** at most max_events of them in events.
+**
+** returns the number of events stored, -1 on error
+*/
+int poller_wait(Poller *poller, PollerEvent *events, int max_events, int timeout_ms);
+
+/*
+** Frees the poller. Watched descriptors are not closed.
+*/
+void poller_destroy(Poller *poller);
+
+
+/*
+** Tracing
+** -------
+** Built with AS_TRACE (make trace), the TRACE_BEGIN and TRACE_END macros
+** record timestamped events around the hot paths, and otherwise compile to
+** nothing. Each thread records into a ring of its own, so recording takes no
+** lock: a clock read and a few stores. The ring keeps the last
+** TRACE_RING_SIZE events of its thread.
+**
+** TRACE_INIT makes SIGUSR1 dump the process's rings to
+** TRACE_DIR/as_trace.<pid>.json, in Chrome's trace_event format, for
+** chrome://tracing or Perfetto. Every process dumps to a file of its own, so
+** the server's client processes can be dumped at once with pkill -USR1.
+** Events are named with string literals, which outlive the process's rings.
+** A forked child calls TRACE_FORKED to drop the events its parent recorded.
+*/
+#define TRACE_RING_SIZE 65536
+#define TRACE_DIR "/tmp"
+
+#ifdef AS_TRACE
+#define TRACE_INIT(process_name) trace_init(process_name)
+#define TRACE_FORKED() trace_forked()
+#define TRACE_BEGIN(name) trace_event(name, 'B')
+#define TRACE_END(name) trace_event(name, 'E')
+
+/*
+** Makes SIGUSR1 dump the traces of the process, named process_name in them.
+*/
+void trace_init(const char *process_name);
+
+/*
+** Drops the events recorded before the process was forked.
+*/
+void trace_forked(void);
+
+/*
+** Records an event of the calling thread: 'B' to begin a span, 'E' to end it.
+*/
+void trace_event(const char *name, char phase);
+#else
+#define TRACE_INIT(process_name) do {} while (0)
+#define TRACE_FORKED() do {} while (0)
+#define TRACE_BEGIN(name) do {} while (0)
+#define TRACE_END(name) do {} while (0)
+#endif
+
 #endif // LIBAS_H_
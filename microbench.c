@@ -0,0 +1,1175 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+#include "as_server.h"
+
+#include <math.h>
+#include <time.h>
+
+/*
+** Microbenchmarks for the libas helpers and the server's request handlers,
+** run with: make bench
+**
+** Each benchmark is an operation run over and over: first for
+** BENCH_WARMUP_SEC, which also sizes the batches, then in BENCH_REPETITIONS
+** batches of about BENCH_BATCH_SEC each. The median batch is reported in
+** ns/op, with the fastest for reference, and for operations that move data
+** the bytes each moves and the rate it moves them at.
+**
+** The output has one line per benchmark, in a fixed order and with fixed
+** columns, so two runs can be compared with diff. Only the benchmarks whose
+** names start with one of the arguments run, if any are given:
+**   ./microbench socket/ handler/list
+*/
+#define BENCH_WARMUP_SEC 0.2
+#define BENCH_BATCH_SEC 0.1
+#define BENCH_REPETITIONS 7
+
+#define BENCH_LIST_ENTRIES 100000
+#define BENCH_TRANSFER_SIZE 65536
+#define BENCH_STREAM_FILE_SIZE (4 << 20)
+// A tree BENCH_TREE_DEPTH directories deep, each with BENCH_TREE_FANOUT
+// subdirectories and BENCH_TREE_FILES files, half of them audio
+#define BENCH_TREE_DEPTH 8
+#define BENCH_TREE_FANOUT 2
+#define BENCH_TREE_FILES 8
+// An MPEG-1 layer III file of BENCH_MP3_FRAMES frames at 128 kb/s and
+// 44.1 kHz, about 10 minutes, without a Xing tag so tables walk every frame
+#define BENCH_MP3_FRAMES 23000
+#define BENCH_MP3_FRAME_SIZE 417
+// Stereo WAV files of BENCH_WAV_FRAMES frames at 44.1 kHz, a minute, of a
+// tone with noise so the filters never settle on zeros
+#define BENCH_WAV_FRAMES (60 * 44100)
+
+// Runs the operation once, returning the bytes it moved or scanned
+typedef size_t (*BenchOp)(void *arg);
+
+
+static double _now_sec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static int _compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static int _argc;
+static char * const *_argv;
+
+/*
+** returns 1 if the benchmark called name was asked for on the command line
+*/
+static uint8_t _selected(const char *name) {
+    if (_argc <= 1) {
+        return 1;
+    }
+    for (int i = 1; i < _argc; i++) {
+        if (strncmp(name, _argv[i], strlen(_argv[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Runs the benchmark called name, see the top of the file.
+*/
+static void _run(const char *name, BenchOp op, void *arg) {
+    size_t ops = 0, bytes = 0;
+    double start = _now_sec(), elapsed;
+    do {
+        bytes += op(arg);
+        ops++;
+    } while ((elapsed = _now_sec() - start) < BENCH_WARMUP_SEC);
+    size_t batch = MAX(1, (size_t)(ops * BENCH_BATCH_SEC / elapsed));
+    size_t bytes_per_op = bytes / ops;
+
+    double ns_per_op[BENCH_REPETITIONS];
+    for (int rep = 0; rep < BENCH_REPETITIONS; rep++) {
+        start = _now_sec();
+        for (size_t i = 0; i < batch; i++) {
+            op(arg);
+        }
+        ns_per_op[rep] = (_now_sec() - start) * 1e9 / batch;
+    }
+    qsort(ns_per_op, BENCH_REPETITIONS, sizeof(double), _compare_doubles);
+
+    double median = ns_per_op[BENCH_REPETITIONS / 2];
+    printf("%-40s %14.1f ns/op %14.1f min", name, median, ns_per_op[0]);
+    if (bytes_per_op > 0) {
+        printf(" %12zu B/op %10.1f MB/s", bytes_per_op, bytes_per_op * 1e3 / median);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+
+/*
+** A LIST response for a library of num_entries files, in the server's order.
+*/
+static char *_make_list_payload(int num_entries, size_t *len) {
+    size_t capacity = (size_t)num_entries * 64;
+    char *payload = malloc(capacity);
+    if (payload == NULL) {
+        perror("_make_list_payload");
+        exit(1);
+    }
+    *len = 0;
+    for (int i = num_entries - 1; i >= 0; i--) {
+        *len += snprintf(payload + *len, capacity - *len,
+                         "%d:artist_%03d/album_%02d/track_%07d.wav\r\n",
+                         i, i % 997, i % 13, i);
+    }
+    return payload;
+}
+
+
+static int _compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/*
+** Fills library with the files of the LIST response from _make_list_payload,
+** sorted by path as scan_library leaves them.
+**
+** returns the length of that response
+*/
+static uint32_t _make_list_library(Library *library) {
+    library->path = "library/";
+    library->num_files = BENCH_LIST_ENTRIES;
+    library->files = malloc(BENCH_LIST_ENTRIES * sizeof(char *));
+    if (library->files == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint32_t len = 0;
+    for (int i = 0; i < BENCH_LIST_ENTRIES; i++) {
+        char name[MAX_FILE_NAME];
+        snprintf(name, sizeof(name), "artist_%03d/album_%02d/track_%07d.wav",
+                 i % 997, i % 13, i);
+        library->files[i] = strdup(name);
+        len += snprintf(NULL, 0, "%d:%s\r\n", i, name);
+    }
+    qsort(library->files, BENCH_LIST_ENTRIES, sizeof(char *), _compare_paths);
+    return len;
+}
+
+
+/*
+** Feeds the payload to a pipe from a child process, as a server would.
+*/
+static int _pipe_payload(const char *payload, size_t len) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        write_precisely(fds[1], payload, len);
+        _exit(0);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+
+/*
+** Forks a child that reads everything written to the returned socket, or
+** that writes to it until it is closed if source is set.
+*/
+static int _socket_peer(uint8_t source, pid_t *pid) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    fflush(stdout);
+    *pid = fork();
+    if (*pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (*pid == 0) {
+        close(fds[0]);
+        static uint8_t buf[BENCH_TRANSFER_SIZE];
+        ssize_t num;
+        do {
+            num = source ? write(fds[1], buf, sizeof(buf)) : read(fds[1], buf, sizeof(buf));
+        } while (num > 0);
+        _exit(0);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+
+static void _close_socket_peer(int fd, pid_t pid) {
+    close(fd);
+    waitpid(pid, NULL, 0);
+}
+
+
+typedef struct payload {
+    const char *data;
+    size_t len;
+} Payload;
+
+
+static size_t _count_lines_bytewise(void *arg) {
+    const Payload *payload = arg;
+    size_t num_lines = 0;
+    for (size_t i = 0; i + 1 < payload->len; i++) {
+        if (payload->data[i] == '\r' && payload->data[i + 1] == '\n') {
+            num_lines++;
+        }
+    }
+    if (num_lines != BENCH_LIST_ENTRIES) {
+        ERR_PRINT("Counted %zu lines, expected %d\n", num_lines, BENCH_LIST_ENTRIES);
+    }
+    return payload->len;
+}
+
+
+static size_t _count_lines_find_crlf(void *arg) {
+    const Payload *payload = arg;
+    size_t num_lines = 0;
+    const char *buf = payload->data;
+    const char *end = buf + payload->len;
+    const char *crlf;
+    while ((crlf = find_crlf(buf, end - buf)) != NULL) {
+        num_lines++;
+        buf = crlf + 2;
+    }
+    if (num_lines != BENCH_LIST_ENTRIES) {
+        ERR_PRINT("Counted %zu lines, expected %d\n", num_lines, BENCH_LIST_ENTRIES);
+    }
+    return payload->len;
+}
+
+
+static size_t _parse_line_reader(void *arg) {
+    const Payload *payload = arg;
+    int fd = _pipe_payload(payload->data, payload->len);
+    LineReader reader;
+    line_reader_init(&reader, RESPONSE_BUFFER_SIZE, 0);
+    size_t num_lines = 0;
+    while (1) {
+        char *line;
+        while ((line = line_reader_next(&reader, NULL)) != NULL) {
+            num_lines++;
+        }
+        if (line_reader_fill(&reader, fd) <= 0) {
+            break;
+        }
+    }
+    line_reader_free(&reader);
+    close(fd);
+    wait(NULL);
+    if (num_lines != BENCH_LIST_ENTRIES) {
+        ERR_PRINT("Parsed %zu lines, expected %d\n", num_lines, BENCH_LIST_ENTRIES);
+    }
+    return payload->len;
+}
+
+
+/*
+** How the client takes a LIST response, into its catalog.
+*/
+static size_t _parse_list_catalog(void *arg) {
+    const Payload *payload = arg;
+    int fd = _pipe_payload(payload->data, payload->len);
+    LineReader reader;
+    line_reader_init(&reader, RESPONSE_BUFFER_SIZE, 0);
+    Library library = {0};
+    library.files = calloc(BENCH_LIST_ENTRIES, sizeof(char *));
+    while (1) {
+        char *line;
+        while ((line = line_reader_next(&reader, NULL)) != NULL) {
+            char *colon = strchr(line, ':');
+            int index = strtol(line, NULL, 10);
+            if (colon == NULL || index < 0 || index >= BENCH_LIST_ENTRIES) {
+                ERR_PRINT("Malformed entry %s\n", line);
+                exit(1);
+            }
+            library.files[index] = strdup(colon + 1);
+            library.num_files++;
+        }
+        if (line_reader_fill(&reader, fd) <= 0) {
+            break;
+        }
+    }
+    line_reader_free(&reader);
+    close(fd);
+    wait(NULL);
+    if (library.num_files != BENCH_LIST_ENTRIES) {
+        ERR_PRINT("Parsed %u files, expected %d\n", library.num_files, BENCH_LIST_ENTRIES);
+    }
+    _free_library(&library);
+    return payload->len;
+}
+
+
+/*
+** How the client takes a CLIST response, into its catalog.
+*/
+static size_t _parse_clist_decode(void *arg) {
+    const Payload *payload = arg;
+    int fd = _pipe_payload(payload->data, payload->len);
+    uint32_t len;
+    read_precisely(fd, &len, sizeof(uint32_t));
+    len = ntohl(len);
+    uint8_t *body = malloc(len);
+    if (body == NULL || read_precisely(fd, body, len) != len) {
+        perror("_parse_clist_decode");
+        exit(1);
+    }
+    close(fd);
+    wait(NULL);
+    Library library = {0};
+    if (clist_decode(body, len, &library) != BENCH_LIST_ENTRIES) {
+        ERR_PRINT("Decoded %u files, expected %d\n", library.num_files, BENCH_LIST_ENTRIES);
+    }
+    free(body);
+    _free_library(&library);
+    return payload->len;
+}
+
+
+/*
+** How the client parsed a LIST before the line reader.
+*/
+static size_t _parse_find_network_newline(void *arg) {
+    const Payload *payload = arg;
+    int fd = _pipe_payload(payload->data, payload->len);
+    char buf[RESPONSE_BUFFER_SIZE];
+    int bytes_in_buffer = 0;
+    size_t num_lines = 0;
+    while (1) {
+        char *line;
+        while ((line = find_network_newline(buf, &bytes_in_buffer)) != NULL) {
+            num_lines++;
+            free(line);
+        }
+        int num = read(fd, buf + bytes_in_buffer, RESPONSE_BUFFER_SIZE - bytes_in_buffer);
+        if (num <= 0) {
+            break;
+        }
+        bytes_in_buffer += num;
+    }
+    close(fd);
+    wait(NULL);
+    if (num_lines != BENCH_LIST_ENTRIES) {
+        ERR_PRINT("Parsed %zu lines, expected %d\n", num_lines, BENCH_LIST_ENTRIES);
+    }
+    return payload->len;
+}
+
+
+static void bench_list_parsing(void) {
+    Payload payload;
+    payload.data = _make_list_payload(BENCH_LIST_ENTRIES, &payload.len);
+    if (_selected("crlf/bytewise")) {
+        _run("crlf/bytewise", _count_lines_bytewise, &payload);
+    }
+    if (_selected("crlf/find_crlf")) {
+        _run("crlf/find_crlf", _count_lines_find_crlf, &payload);
+    }
+    if (_selected("parse/find_network_newline")) {
+        _run("parse/find_network_newline", _parse_find_network_newline, &payload);
+    }
+    if (_selected("parse/line_reader")) {
+        _run("parse/line_reader", _parse_line_reader, &payload);
+    }
+    if (_selected("parse/list_catalog")) {
+        _run("parse/list_catalog", _parse_list_catalog, &payload);
+    }
+    free((char *)payload.data);
+    if (_selected("parse/clist_decode")) {
+        Library library = {0};
+        _make_list_library(&library);
+        uint32_t len;
+        payload.data = (char *)clist_encode(&library, CLIST_FLAG_CHECKSUM, &len);
+        payload.len = len;
+        _free_library(&library);
+        _run("parse/clist_decode", _parse_clist_decode, &payload);
+        free((char *)payload.data);
+    }
+}
+
+
+static size_t _join_path_op(void *arg) {
+    char *path = _join_path("library/", "artist_001/album_02/track_0000001.wav");
+    size_t len = strlen(path);
+    free(path);
+    return len;
+}
+
+
+static void bench_paths(void) {
+    if (_selected("path/_join_path")) {
+        _run("path/_join_path", _join_path_op, NULL);
+    }
+}
+
+
+typedef struct transfer {
+    int fd;
+    uint8_t buf[BENCH_TRANSFER_SIZE];
+} Transfer;
+
+
+static size_t _write_precisely_op(void *arg) {
+    Transfer *transfer = arg;
+    return write_precisely(transfer->fd, transfer->buf, sizeof(transfer->buf));
+}
+
+
+static size_t _read_precisely_op(void *arg) {
+    Transfer *transfer = arg;
+    return read_precisely(transfer->fd, transfer->buf, sizeof(transfer->buf));
+}
+
+
+static void bench_socket_transfers(void) {
+    static Transfer transfer;
+    pid_t pid;
+    if (_selected("socket/write_precisely")) {
+        transfer.fd = _socket_peer(0, &pid);
+        _run("socket/write_precisely", _write_precisely_op, &transfer);
+        _close_socket_peer(transfer.fd, pid);
+    }
+    if (_selected("socket/read_precisely")) {
+        transfer.fd = _socket_peer(1, &pid);
+        _run("socket/read_precisely", _read_precisely_op, &transfer);
+        _close_socket_peer(transfer.fd, pid);
+    }
+}
+
+
+typedef struct handler_bench {
+    ClientSocket client;
+    Library library;
+    uint32_t response_len;
+    int file_fd;            // of the file streamed cold
+} HandlerBench;
+
+
+static size_t _list_request_response_op(void *arg) {
+    HandlerBench *bench = arg;
+    if (list_request_response(&bench->client, &bench->library) == -1) {
+        exit(1);
+    }
+    return bench->response_len;
+}
+
+
+static size_t _clist_request_response_op(void *arg) {
+    HandlerBench *bench = arg;
+    if (clist_request_response(&bench->client, &bench->library) == -1) {
+        exit(1);
+    }
+    return bench->response_len;
+}
+
+
+static size_t _stream_request_response_op(void *arg) {
+    HandlerBench *bench = arg;
+    uint8_t file_index[4] = {0, 0, 0, 0};
+    if (stream_request_response(&bench->client, &bench->library, file_index, 4) == -1) {
+        exit(1);
+    }
+    return bench->response_len;
+}
+
+
+static size_t _stream_cold_op(void *arg) {
+    HandlerBench *bench = arg;
+    // Dropped from the page cache, so the stream reads it from the disk
+    posix_fadvise(bench->file_fd, 0, 0, POSIX_FADV_DONTNEED);
+    return _stream_request_response_op(arg);
+}
+
+
+/*
+** Helper for: bench_handlers, bench_scan_library
+** Makes an empty library directory under /tmp.
+**
+** returns its heap-allocated path
+*/
+static char *_make_temp_library(void) {
+    char *path = strdup("/tmp/microbench.XXXXXX");
+    if (path == NULL || mkdtemp(path) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return path;
+}
+
+
+/*
+** Removes the directory at path and everything in it.
+*/
+static void _remove_tree(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror("_remove_tree: opendir");
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char *entry_path = _join_path(path, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            _remove_tree(entry_path);
+        } else {
+            unlink(entry_path);
+        }
+        free(entry_path);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+
+static void bench_handlers(void) {
+    static HandlerBench bench;
+    pid_t pid;
+    if (_selected("handler/list_request_response")) {
+        bench.response_len = _make_list_library(&bench.library);
+        bench.client.socket = _socket_peer(0, &pid);
+        _run("handler/list_request_response", _list_request_response_op, &bench);
+        _close_socket_peer(bench.client.socket, pid);
+        _free_library(&bench.library);
+    }
+    if (_selected("handler/clist_request_response")) {
+        _make_list_library(&bench.library);
+        uint8_t *response = clist_encode(&bench.library, CLIST_FLAG_CHECKSUM, &bench.response_len);
+        free(response);
+        bench.client.socket = _socket_peer(0, &pid);
+        _run("handler/clist_request_response", _clist_request_response_op, &bench);
+        _close_socket_peer(bench.client.socket, pid);
+        _free_library(&bench.library);
+    }
+
+    if (_selected("handler/stream_request_response")) {
+        char *library_path = _make_temp_library();
+        char *file_path = _join_path(library_path, "track.wav");
+        int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, BENCH_STREAM_FILE_SIZE) == -1) {
+            perror("handler/stream_request_response: open");
+            exit(1);
+        }
+        close(fd);
+        free(file_path);
+
+        bench.library.path = library_path;
+        bench.library.num_files = 0;
+        bench.library.files = NULL;
+        if (scan_library(&bench.library) == -1 || bench.library.num_files != 1) {
+            ERR_PRINT("Could not scan %s\n", library_path);
+            exit(1);
+        }
+        bench.response_len = sizeof(uint32_t) + BENCH_STREAM_FILE_SIZE;
+        bench.client.socket = _socket_peer(0, &pid);
+        _run("handler/stream_request_response", _stream_request_response_op, &bench);
+        _close_socket_peer(bench.client.socket, pid);
+        _free_library(&bench.library);
+        _remove_tree(library_path);
+        free(library_path);
+    }
+
+    if (_selected("handler/stream_cold")) {
+        char *library_path = _make_temp_library();
+        char *file_path = _join_path(library_path, "track.wav");
+        // Real data on the disk, as a sparse file never has to be read
+        int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        uint8_t *data = malloc(BENCH_STREAM_FILE_SIZE);
+        if (fd == -1 || data == NULL) {
+            perror("handler/stream_cold: open");
+            exit(1);
+        }
+        for (int i = 0; i < BENCH_STREAM_FILE_SIZE; i++) {
+            data[i] = i * 2654435761u >> 24;
+        }
+        if (write_precisely(fd, data, BENCH_STREAM_FILE_SIZE) != BENCH_STREAM_FILE_SIZE ||
+            fsync(fd) == -1) {
+            perror("handler/stream_cold: write");
+            exit(1);
+        }
+        free(data);
+        free(file_path);
+
+        bench.library.path = library_path;
+        bench.library.num_files = 0;
+        bench.library.files = NULL;
+        if (scan_library(&bench.library) == -1 || bench.library.num_files != 1) {
+            ERR_PRINT("Could not scan %s\n", library_path);
+            exit(1);
+        }
+        bench.response_len = sizeof(uint32_t) + BENCH_STREAM_FILE_SIZE;
+        bench.file_fd = fd;
+        bench.client.socket = _socket_peer(0, &pid);
+        _run("handler/stream_cold", _stream_cold_op, &bench);
+        // The same, reading each batch only when it is about to be sent
+        uint32_t window = readahead_window;
+        readahead_window = 0;
+        _run("handler/stream_cold_sync", _stream_cold_op, &bench);
+        readahead_window = window;
+        _close_socket_peer(bench.client.socket, pid);
+        close(fd);
+        _free_library(&bench.library);
+        _remove_tree(library_path);
+        free(library_path);
+    }
+}
+
+
+/*
+** Helper for: bench_scan_library
+** Fills the directory at path with the rest of the tree, depth levels deep.
+**
+** returns the number of audio files in it
+*/
+static int _make_tree(const char *path, int depth) {
+    int num_files = 0;
+    for (int i = 0; i < BENCH_TREE_FILES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "track_%02d.%s", i, i % 2 ? "wav" : "txt");
+        char *file_path = _join_path(path, name);
+        int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("_make_tree: open");
+            exit(1);
+        }
+        close(fd);
+        free(file_path);
+        num_files += i % 2;
+    }
+    for (int i = 0; depth > 1 && i < BENCH_TREE_FANOUT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "dir_%02d", i);
+        char *dir_path = _join_path(path, name);
+        if (mkdir(dir_path, 0755) == -1) {
+            perror("_make_tree: mkdir");
+            exit(1);
+        }
+        num_files += _make_tree(dir_path, depth - 1);
+        free(dir_path);
+    }
+    return num_files;
+}
+
+
+typedef struct scan_bench {
+    Library library;
+    int num_files;
+} ScanBench;
+
+
+static size_t _scan_library_op(void *arg) {
+    ScanBench *bench = arg;
+    if (scan_library(&bench->library) == -1 || bench->library.num_files != bench->num_files) {
+        ERR_PRINT("Scanned %d files, expected %d\n", bench->library.num_files, bench->num_files);
+        exit(1);
+    }
+    return 0;
+}
+
+
+static void bench_scan_library(void) {
+    if (!_selected("scan/scan_library")) {
+        return;
+    }
+    static ScanBench bench;
+    char *library_path = _make_temp_library();
+    bench.num_files = _make_tree(library_path, BENCH_TREE_DEPTH);
+    bench.library.path = library_path;
+    _run("scan/scan_library", _scan_library_op, &bench);
+    _free_library(&bench.library);
+    _remove_tree(library_path);
+    free(library_path);
+}
+
+
+typedef struct search_bench {
+    Library library;
+    SearchIndex index;
+    const char *query;
+    uint8_t mode;
+} SearchBench;
+
+
+/*
+** The index built from scratch, as at startup.
+*/
+static size_t _search_build_op(void *arg) {
+    SearchBench *bench = arg;
+    search_index_free(&bench->index);
+    if (search_index_update(&bench->index, &bench->library) == -1) {
+        exit(1);
+    }
+    return 0;
+}
+
+
+/*
+** The index brought up to date with an unchanged library, as on most scans.
+*/
+static size_t _search_update_op(void *arg) {
+    SearchBench *bench = arg;
+    if (search_index_update(&bench->index, &bench->library) == -1) {
+        exit(1);
+    }
+    return 0;
+}
+
+
+static size_t _search_query_op(void *arg) {
+    SearchBench *bench = arg;
+    SearchMatch matches[SEARCH_DEFAULT_LIMIT];
+    if (search_index_query(&bench->index, bench->query, bench->mode, SEARCH_DEFAULT_LIMIT,
+                           matches) <= 0) {
+        ERR_PRINT("No matches for %s\n", bench->query);
+        exit(1);
+    }
+    return 0;
+}
+
+
+static void bench_search(void) {
+    // A rare track, a common word, a typo and a query too short to index
+    const struct {
+        const char *name;
+        const char *query;
+        uint8_t mode;
+    } queries[] = {
+        {"search/substring", "track_0012345", SEARCH_SUBSTRING},
+        {"search/prefix", "album_07", SEARCH_PREFIX},
+        {"search/fuzzy", "trak_0012345", SEARCH_FUZZY},
+        {"search/short", "7/", SEARCH_SUBSTRING},
+    };
+    size_t num_queries = sizeof(queries) / sizeof(queries[0]);
+    uint8_t selected = _selected("search/build") || _selected("search/update");
+    for (size_t i = 0; i < num_queries; i++) {
+        selected |= _selected(queries[i].name);
+    }
+    if (!selected) {
+        return;
+    }
+    static SearchBench bench;
+    _make_list_library(&bench.library);
+    search_index_init(&bench.index);
+    if (search_index_update(&bench.index, &bench.library) == -1) {
+        exit(1);
+    }
+    if (_selected("search/build")) {
+        _run("search/build", _search_build_op, &bench);
+    }
+    if (_selected("search/update")) {
+        _run("search/update", _search_update_op, &bench);
+    }
+    for (size_t i = 0; i < num_queries; i++) {
+        if (_selected(queries[i].name)) {
+            bench.query = queries[i].query;
+            bench.mode = queries[i].mode;
+            _run(queries[i].name, _search_query_op, &bench);
+        }
+    }
+    search_index_free(&bench.index);
+    _free_library(&bench.library);
+}
+
+
+typedef struct browse_bench {
+    Library library;
+    BrowseTree tree;
+    const char *dir;
+    const char *token;
+} BrowseBench;
+
+
+/*
+** The tree built again, as after every scan.
+*/
+static size_t _browse_build_op(void *arg) {
+    BrowseBench *bench = arg;
+    browse_tree_free(&bench->tree);
+    if (browse_tree_build(&bench->tree, &bench->library) == -1) {
+        exit(1);
+    }
+    return 0;
+}
+
+
+static size_t _browse_page_op(void *arg) {
+    BrowseBench *bench = arg;
+    uint32_t len;
+    uint8_t *response = browse_page(&bench->tree, &bench->library, bench->dir,
+                                    strlen(bench->dir), bench->token, strlen(bench->token), 0,
+                                    BROWSE_DEFAULT_COUNT, &len);
+    if (response == NULL) {
+        exit(1);
+    }
+    free(response);
+    return len;
+}
+
+
+static void bench_browse(void) {
+    // The first page of the top, a page from the middle of it, and an album
+    const struct {
+        const char *name;
+        const char *dir;
+        const char *token;
+    } pages[] = {
+        {"browse/page_top", "", ""},
+        {"browse/page_token", "", "artist_500/"},
+        {"browse/page_album", "artist_500/album_06", ""},
+    };
+    size_t num_pages = sizeof(pages) / sizeof(pages[0]);
+    uint8_t selected = _selected("browse/build");
+    for (size_t i = 0; i < num_pages; i++) {
+        selected |= _selected(pages[i].name);
+    }
+    if (!selected) {
+        return;
+    }
+    static BrowseBench bench;
+    _make_list_library(&bench.library);
+    if (browse_tree_build(&bench.tree, &bench.library) == -1) {
+        exit(1);
+    }
+    if (_selected("browse/build")) {
+        _run("browse/build", _browse_build_op, &bench);
+    }
+    for (size_t i = 0; i < num_pages; i++) {
+        if (_selected(pages[i].name)) {
+            bench.dir = pages[i].dir;
+            bench.token = pages[i].token;
+            _run(pages[i].name, _browse_page_op, &bench);
+        }
+    }
+    browse_tree_free(&bench.tree);
+    _free_library(&bench.library);
+}
+
+
+typedef struct seek_bench {
+    int fd;
+    struct stat file_stat;
+    SeekTable table;
+    uint32_t ms;
+} SeekBench;
+
+
+/*
+** Writes an MP3 file of silent frames to path, open at the returned fd.
+*/
+static int _make_mp3_file(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint8_t *frames = calloc(BENCH_MP3_FRAMES, BENCH_MP3_FRAME_SIZE);
+    if (fd == -1 || frames == NULL) {
+        perror("_make_mp3_file");
+        exit(1);
+    }
+    static const uint8_t header[4] = {0xff, 0xfb, 0x90, 0x00};
+    for (int i = 0; i < BENCH_MP3_FRAMES; i++) {
+        memcpy(frames + i * BENCH_MP3_FRAME_SIZE, header, sizeof(header));
+    }
+    size_t len = (size_t)BENCH_MP3_FRAMES * BENCH_MP3_FRAME_SIZE;
+    if (write_precisely(fd, frames, len) != (int)len) {
+        perror("_make_mp3_file: write");
+        exit(1);
+    }
+    free(frames);
+    return fd;
+}
+
+
+/*
+** The table built from scratch, as for a new file of the library.
+*/
+static size_t _seek_build_op(void *arg) {
+    SeekBench *bench = arg;
+    if (seek_table_build(&bench->table, bench->fd, &bench->file_stat) == -1) {
+        exit(1);
+    }
+    return bench->file_stat.st_size;
+}
+
+
+/*
+** A seek with the table, from its point before ms to the frame.
+*/
+static size_t _seek_prepare_op(void *arg) {
+    SeekBench *bench = arg;
+    SeekStart start;
+    if (seek_prepare(&bench->table, bench->fd, bench->file_stat.st_size, bench->ms,
+                     &start) == -1) {
+        exit(1);
+    }
+    free(start.head);
+    return 0;
+}
+
+
+static void bench_seek(void) {
+    if (!_selected("seek/build_mp3") && !_selected("seek/prepare_mp3")) {
+        return;
+    }
+    char *library_path = _make_temp_library();
+    char *path = _join_path(library_path, "bench.mp3");
+    static SeekBench bench;
+    bench.fd = _make_mp3_file(path);
+    fstat(bench.fd, &bench.file_stat);
+    if (seek_table_build(&bench.table, bench.fd, &bench.file_stat) == -1 ||
+        bench.table.format != SEEK_MP3) {
+        exit(1);
+    }
+    if (_selected("seek/build_mp3")) {
+        _run("seek/build_mp3", _seek_build_op, &bench);
+    }
+    if (_selected("seek/prepare_mp3")) {
+        // Between two points, so the walk is as long as it gets
+        bench.ms = 5 * 60 * 1000 + SEEK_INTERVAL_MS - 1;
+        _run("seek/prepare_mp3", _seek_prepare_op, &bench);
+    }
+    seek_table_free(&bench.table);
+    close(bench.fd);
+    _remove_tree(library_path);
+    free(path);
+    free(library_path);
+}
+
+
+typedef struct wave_bench {
+    int fd;
+    struct stat file_stat;
+    WaveSummary summary;
+} WaveBench;
+
+
+/*
+** Writes a stereo 44.1 kHz WAV file of bits-bit samples, integers or floats
+** if is_float is set, to path, open at the returned fd.
+*/
+static int _make_wav_file(const char *path, uint16_t bits, uint8_t is_float) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint32_t data_len = BENCH_WAV_FRAMES * 2 * (bits / 8);
+    uint8_t *data = malloc(44 + data_len);
+    if (fd == -1 || data == NULL) {
+        perror("_make_wav_file");
+        exit(1);
+    }
+    uint32_t fmt[4] = {(is_float ? 3 : 1) | 2 << 16, 44100, 44100 * 2 * (bits / 8),
+                       (2 * (bits / 8)) | bits << 16};
+    uint32_t chunk_lens[3] = {36 + data_len, 16, data_len};
+    memcpy(data, "RIFF", 4);
+    memcpy(data + 4, &chunk_lens[0], 4);
+    memcpy(data + 8, "WAVEfmt ", 8);
+    memcpy(data + 16, &chunk_lens[1], 4);
+    memcpy(data + 20, fmt, sizeof(fmt));
+    memcpy(data + 36, "data", 4);
+    memcpy(data + 40, &chunk_lens[2], 4);
+    uint32_t noise = 1;
+    for (uint32_t i = 0; i < BENCH_WAV_FRAMES * 2; i++) {
+        noise = noise * 1103515245 + 12345;
+        float sample = 0.5f * sinf(i / 2 * 0.0627f) + (noise >> 16) / 65536.0f * 0.1f - 0.05f;
+        if (is_float) {
+            memcpy(data + 44 + 4 * i, &sample, 4);
+        } else {
+            int16_t value = sample * 32767;
+            memcpy(data + 44 + 2 * i, &value, 2);
+        }
+    }
+    if (write_precisely(fd, data, 44 + data_len) != (int)(44 + data_len)) {
+        perror("_make_wav_file: write");
+        exit(1);
+    }
+    free(data);
+    return fd;
+}
+
+
+/*
+** The summary made from scratch, as for a new file of the library.
+*/
+static size_t _wave_analyze_op(void *arg) {
+    WaveBench *bench = arg;
+    if (wave_analyze(&bench->summary, bench->fd, &bench->file_stat) == -1 ||
+        !bench->summary.pcm) {
+        exit(1);
+    }
+    return bench->file_stat.st_size;
+}
+
+
+static void bench_wave(void) {
+    static const char *names[] = {"wave/analyze_s16", "wave/analyze_f32"};
+    if (!_selected(names[0]) && !_selected(names[1])) {
+        return;
+    }
+    char *library_path = _make_temp_library();
+    char *path = _join_path(library_path, "bench.wav");
+    for (int is_float = 0; is_float <= 1; is_float++) {
+        if (!_selected(names[is_float])) {
+            continue;
+        }
+        static WaveBench bench;
+        bench.fd = _make_wav_file(path, is_float ? 32 : 16, is_float);
+        fstat(bench.fd, &bench.file_stat);
+        _run(names[is_float], _wave_analyze_op, &bench);
+        wave_summary_free(&bench.summary);
+        close(bench.fd);
+    }
+    _remove_tree(library_path);
+    free(path);
+    free(library_path);
+}
+
+
+typedef struct disk_bench {
+    int fd;
+    FlightReader reader;
+    DiskPool pool;
+    DiskRead read;
+    DiskMap map;
+    uint8_t *buf;
+} DiskBench;
+
+
+/*
+** Reads the next frame's worth of the cached file, from its start again once
+** it is all read.
+*/
+static void _disk_rewind(DiskBench *bench) {
+    if (bench->reader.position + V2_MAX_FRAME_PAYLOAD > bench->reader.size) {
+        bench->reader.position = 0;
+    }
+}
+
+
+/*
+** What a v2 stream pays for a chunk it reads itself.
+*/
+static size_t _disk_read_inline_op(void *arg) {
+    DiskBench *bench = arg;
+    _disk_rewind(bench);
+    ssize_t num = flight_read(&bench->reader, bench->buf, V2_MAX_FRAME_PAYLOAD);
+    if (num <= 0) {
+        exit(1);
+    }
+    return num;
+}
+
+
+/*
+** What a v2 stream pays for a chunk its disk's worker reads, waiting on the
+** pool's pipe as a connection does.
+*/
+static size_t _disk_read_queued_op(void *arg) {
+    DiskBench *bench = arg;
+    _disk_rewind(bench);
+    if (disk_submit(&bench->pool, &bench->read) != 0) {
+        exit(1);
+    }
+    struct pollfd pollfd = {disk_pool_fd(&bench->pool), POLLIN, 0};
+    while (!disk_done(&bench->read)) {
+        poll(&pollfd, 1, -1);
+        disk_pool_drain(&bench->pool);
+    }
+    if (bench->read.result <= 0) {
+        exit(1);
+    }
+    return bench->read.result;
+}
+
+
+/*
+** What a v2 stream pays to tell whether a flight chunk is cached.
+*/
+static size_t _disk_cached_op(void *arg) {
+    DiskBench *bench = arg;
+    _disk_rewind(bench);
+    if (!disk_cached(&bench->map, bench->reader.position, FLIGHT_CHUNK_SIZE)) {
+        exit(1);
+    }
+    bench->reader.position += V2_MAX_FRAME_PAYLOAD;
+    return 0;
+}
+
+
+static void bench_disk(void) {
+    if (!_selected("disk/")) {
+        return;
+    }
+    static DiskBench bench;
+    char *library_path = _make_temp_library();
+    char *path = _join_path(library_path, "track.wav");
+    bench.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    bench.buf = malloc(BENCH_STREAM_FILE_SIZE);
+    if (bench.fd == -1 || bench.buf == NULL) {
+        perror("disk/: open");
+        exit(1);
+    }
+    // Real data, read once so it is all cached
+    memset(bench.buf, 0x5a, BENCH_STREAM_FILE_SIZE);
+    struct stat file_stat;
+    if (write_precisely(bench.fd, bench.buf, BENCH_STREAM_FILE_SIZE) != BENCH_STREAM_FILE_SIZE ||
+        pread(bench.fd, bench.buf, BENCH_STREAM_FILE_SIZE, 0) != BENCH_STREAM_FILE_SIZE ||
+        fstat(bench.fd, &file_stat) == -1) {
+        perror("disk/: write");
+        exit(1);
+    }
+    flight_open(NULL, &bench.reader, bench.fd, &file_stat);
+    disk_pool_init(&bench.pool);
+    bench.read.reader = &bench.reader;
+    bench.read.buf = bench.buf;
+    bench.read.size = V2_MAX_FRAME_PAYLOAD;
+    disk_map(&bench.map, bench.fd, file_stat.st_size, FLIGHT_CHUNK_SIZE);
+
+    _run("disk/read_inline", _disk_read_inline_op, &bench);
+    _run("disk/read_queued", _disk_read_queued_op, &bench);
+    _run("disk/cached", _disk_cached_op, &bench);
+
+    disk_unmap(&bench.map);
+    disk_pool_stop(&bench.pool);
+    flight_close(&bench.reader);
+    close(bench.fd);
+    free(bench.buf);
+    _remove_tree(library_path);
+    free(path);
+    free(library_path);
+}
+
+
+int main(int argc, char * const *argv) {
+    _argc = argc;
+    _argv = argv;
+    printf("# %-38s %20s %18s %17s %15s\n", "benchmark", "median", "fastest", "bytes", "rate");
+    bench_list_parsing();
+    bench_paths();
+    bench_socket_transfers();
+    bench_handlers();
+    bench_scan_library();
+    bench_search();
+    bench_browse();
+    bench_seek();
+    bench_wave();
+    bench_disk();
+    return 0;
+}
@@ -1,10 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Byte rate assumed when the stream has no WAV header and -r is not given
+#define DEFAULT_BYTE_RATE 176400
+#define WAV_HEADER_SIZE 44
+#define DEFAULT_PREBUFFER_MS 200
+#define DEFAULT_INTERVAL_MS 1000
+// Time between two reads that counts as a gap in the stream
+#define GAP_MS 100
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
 
 
 void print_usage(){
     printf("Usage: stream_debugger [-h] [-f DEBUG_FILE] [-c READ_CHUNK]\n");
+    printf("                       [-a] [-r BYTE_RATE] [-b PREBUFFER_MS] [-i INTERVAL_MS]\n");
+    printf("                       [-x REFERENCE_FILE] [-o REPORT_FILE]\n");
     printf("  -h: Print this help message\n");
     printf("  -f  debug_file: Use DEBUG_FILE as the file to dump the\n");
     printf("      stream into. Compare this file to the original using\n");
@@ -14,13 +31,236 @@ void print_usage(){
     printf("  -c  read_chunk: Use READ_CHUNK as the number of bytes to\n");
     printf("      read from stdin at a time. This may be useful for\n");
     printf("      debugging purposes.\n");
+    printf("  -a  Analyse the stream instead of logging every read: play it\n");
+    printf("      back in real time and report its arrival rate, gaps,\n");
+    printf("      buffer underruns and time to the first byte.\n");
+    printf("  -r  byte_rate: Play the stream at BYTE_RATE bytes per second,\n");
+    printf("      instead of the rate in its WAV header (default: %d\n", DEFAULT_BYTE_RATE);
+    printf("      without one).\n");
+    printf("  -b  prebuffer_ms: Start playing once this much of the stream\n");
+    printf("      has arrived (default: %d).\n", DEFAULT_PREBUFFER_MS);
+    printf("  -i  interval_ms: Report the arrival rate over intervals of this\n");
+    printf("      length (default: %d).\n", DEFAULT_INTERVAL_MS);
+    printf("  -x  reference_file: Check the stream against REFERENCE_FILE,\n");
+    printf("      without dumping it.\n");
+    printf("  -o  report_file: Append the analysis summary to REPORT_FILE too.\n");
+}
+
+
+static double now_sec(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
+
+/*
+** Analysis of a stream as a real-time player would consume it. Times are in
+** seconds since the debugger started, which is when the client started it.
+*/
+typedef struct analysis {
+    uint32_t byte_rate;         // 0 until known
+    uint8_t rate_from_header;
+    uint8_t header[WAV_HEADER_SIZE];
+    int header_len;
+    long prebuffer_ms;
+    long interval_ms;
+
+    double start;
+    double first_byte;          // -1 until the first byte arrives
+    double last_arrival;
+    uint64_t received;
+
+    // Playback starts once prebuffered, and pauses whenever it runs dry
+    double play_start;          // -1 until playing
+    double stalled;
+    int underruns;
+    double longest_underrun;
+
+    int gaps;
+    double longest_gap;
+
+    double interval_start;
+    uint64_t interval_bytes;
+
+    uint64_t hash;
+    FILE *reference;
+    uint64_t mismatch_at;       // offset of the first difference, or UINT64_MAX
+} Analysis;
+
+
+static void analysis_init(Analysis *analysis, uint32_t byte_rate, long prebuffer_ms,
+                          long interval_ms){
+    memset(analysis, 0, sizeof(Analysis));
+    analysis->byte_rate = byte_rate;
+    analysis->prebuffer_ms = prebuffer_ms;
+    analysis->interval_ms = interval_ms;
+    analysis->start = now_sec();
+    analysis->first_byte = -1;
+    analysis->play_start = -1;
+    analysis->hash = FNV_OFFSET_BASIS;
+    analysis->mismatch_at = UINT64_MAX;
+}
+
+
+/*
+** Takes the byte rate from the WAV header at the start of the stream, once
+** it has arrived, unless it was given.
+*/
+static void analysis_find_byte_rate(Analysis *analysis, const uint8_t *data, int len){
+    int num = len < WAV_HEADER_SIZE - analysis->header_len ? len
+                                                          : WAV_HEADER_SIZE - analysis->header_len;
+    memcpy(analysis->header + analysis->header_len, data, num);
+    analysis->header_len += num;
+    if(analysis->header_len < WAV_HEADER_SIZE){
+        return;
+    }
+    const uint8_t *header = analysis->header;
+    if(memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WAVE", 4) == 0){
+        analysis->byte_rate = header[28] | header[29] << 8 | header[30] << 16
+                              | (uint32_t)header[31] << 24;
+        analysis->rate_from_header = 1;
+    }
+    if(analysis->byte_rate == 0){
+        analysis->byte_rate = DEFAULT_BYTE_RATE;
+    }
+}
+
+
+/*
+** Compares the data, at the current offset of the stream, with the
+** reference file.
+*/
+static void analysis_compare(Analysis *analysis, const uint8_t *data, int len){
+    if(analysis->reference == NULL || analysis->mismatch_at != UINT64_MAX){
+        return;
+    }
+    uint8_t expected[len];
+    size_t num = fread(expected, 1, len, analysis->reference);
+    for(int i = 0; i < len; i++){
+        if(i >= num || expected[i] != data[i]){
+            analysis->mismatch_at = analysis->received + i;
+            return;
+        }
+    }
+}
+
+
+static void analysis_print_interval(Analysis *analysis){
+    double seconds = analysis->interval_ms / 1000.0;
+    printf("SD: %8.2f s %10llu bytes %6.2fx real time\n",
+           analysis->interval_start - analysis->start + seconds,
+           (unsigned long long)analysis->interval_bytes,
+           analysis->interval_bytes / seconds / analysis->byte_rate);
+    analysis->interval_start += seconds;
+    analysis->interval_bytes = 0;
+}
+
+
+/*
+** Accounts for len bytes of the stream arriving now.
+*/
+static void analysis_received(Analysis *analysis, const uint8_t *data, int len){
+    double now = now_sec();
+    if(analysis->first_byte < 0){
+        analysis->first_byte = now;
+        analysis->last_arrival = now;
+        analysis->interval_start = now;
+    }
+    if(analysis->header_len < WAV_HEADER_SIZE){
+        analysis_find_byte_rate(analysis, data, len);
+    }
+
+    double gap = now - analysis->last_arrival;
+    if(gap * 1000 >= GAP_MS){
+        analysis->gaps++;
+    }
+    if(gap > analysis->longest_gap){
+        analysis->longest_gap = gap;
+    }
+    analysis->last_arrival = now;
+
+    // The player wanted these bytes when it had played all the ones before
+    if(analysis->play_start >= 0){
+        double due = analysis->play_start + analysis->stalled
+                     + (double)analysis->received / analysis->byte_rate;
+        if(now > due){
+            analysis->underruns++;
+            analysis->stalled += now - due;
+            if(now - due > analysis->longest_underrun){
+                analysis->longest_underrun = now - due;
+            }
+        }
+    }
+
+    if(analysis->byte_rate > 0){
+        while((now - analysis->interval_start) * 1000 >= analysis->interval_ms){
+            analysis_print_interval(analysis);
+        }
+    }
+    analysis_compare(analysis, data, len);
+    for(int i = 0; i < len; i++){
+        analysis->hash = (analysis->hash ^ data[i]) * FNV_PRIME;
+    }
+    analysis->received += len;
+    analysis->interval_bytes += len;
+
+    if(analysis->play_start < 0 && analysis->byte_rate > 0 &&
+       analysis->received * 1000 >= (uint64_t)analysis->byte_rate * analysis->prebuffer_ms){
+        analysis->play_start = now;
+    }
+}
+
+
+/*
+** Prints the summary of the analysis to out.
+*/
+static void analysis_report(Analysis *analysis, FILE *out){
+    double end = now_sec();
+    if(analysis->byte_rate == 0){
+        // Shorter than a WAV header
+        analysis->byte_rate = DEFAULT_BYTE_RATE;
+    }
+    if(analysis->play_start < 0){
+        analysis->play_start = analysis->received > 0 ? analysis->last_arrival : end;
+    }
+    double duration = (double)analysis->received / analysis->byte_rate;
+    double transfer = analysis->first_byte >= 0 ? analysis->last_arrival - analysis->first_byte : 0;
+
+    fprintf(out, "SD: bytes %llu\n", (unsigned long long)analysis->received);
+    fprintf(out, "SD: byte_rate %u (%s)\n", analysis->byte_rate,
+            analysis->rate_from_header ? "WAV header" : "given or default");
+    fprintf(out, "SD: ttfb_ms %.1f\n", analysis->first_byte >= 0
+            ? (analysis->first_byte - analysis->start) * 1000 : -1.0);
+    fprintf(out, "SD: transfer_s %.3f (%.2fx real time)\n", transfer,
+            transfer > 0 ? duration / transfer : 0.0);
+    fprintf(out, "SD: startup_ms %.1f\n", (analysis->play_start - analysis->start) * 1000);
+    fprintf(out, "SD: gaps %d (longest %.1f ms)\n", analysis->gaps, analysis->longest_gap * 1000);
+    fprintf(out, "SD: underruns %d (stalled %.1f ms, longest %.1f ms)\n", analysis->underruns,
+            analysis->stalled * 1000, analysis->longest_underrun * 1000);
+    fprintf(out, "SD: fnv1a64 %016llx\n", (unsigned long long)analysis->hash);
+    if(analysis->reference != NULL){
+        // The stream must also not stop short of the reference
+        if(analysis->mismatch_at == UINT64_MAX && fgetc(analysis->reference) != EOF){
+            analysis->mismatch_at = analysis->received;
+        }
+        if(analysis->mismatch_at == UINT64_MAX){
+            fprintf(out, "SD: reference match\n");
+        } else {
+            fprintf(out, "SD: reference mismatch at %llu\n",
+                    (unsigned long long)analysis->mismatch_at);
+        }
+    }
+}
+
+
 /*
 ** This function reads from stdin and writes to a file if the debug_file
-** is specified.
+** is specified. With analysis set, it also analyses the stream as it
+** arrives, see Analysis, and reports on it at the end.
 */
-void stream_debugger(int read_chunk, char *debug_file){
+void stream_debugger(int read_chunk, char *debug_file, Analysis *analysis,
+                     char *reference_file, char *report_file){
     FILE *file = NULL;
     if(debug_file){
         file = fopen(debug_file, "w");
@@ -29,10 +269,29 @@ void stream_debugger(int read_chunk, char *debug_file){
             return;
         }
     }
+    if(analysis && reference_file){
+        analysis->reference = fopen(reference_file, "r");
+        if(!analysis->reference){
+            perror("stream_debugger: fopen");
+            return;
+        }
+    }
     char buffer[read_chunk];
     int bytes_read;
-    while((bytes_read = fread(buffer, 1, read_chunk, stdin)) > 0){
-        printf("SD: Read %d bytes from stdin\n", bytes_read);
+    while(1){
+        // Unbuffered, so that every read is timed as the data arrives
+        bytes_read = read(STDIN_FILENO, buffer, read_chunk);
+        if(bytes_read == -1 && errno == EINTR){
+            continue;
+        }
+        if(bytes_read <= 0){
+            break;
+        }
+        if(analysis){
+            analysis_received(analysis, (uint8_t *)buffer, bytes_read);
+        } else {
+            printf("SD: Read %d bytes from stdin\n", bytes_read);
+        }
         if(debug_file){
             int num = bytes_read;
             while(num > 0){
@@ -41,19 +300,45 @@ void stream_debugger(int read_chunk, char *debug_file){
                     perror("stream_debugger: fwrite");
                     return;
                 }
-                printf("SD: Wrote %d bytes to file\n", written);
+                if(!analysis){
+                    printf("SD: Wrote %d bytes to file\n", written);
+                }
                 num -= written;
             }
         }
     }
+    if(bytes_read == -1){
+        perror("stream_debugger: read");
+    }
     if(debug_file){
         fclose(file);
     }
+    if(analysis){
+        analysis_report(analysis, stdout);
+        if(report_file){
+            FILE *report = fopen(report_file, "a");
+            if(!report){
+                perror("stream_debugger: fopen");
+            } else {
+                analysis_report(analysis, report);
+                fclose(report);
+            }
+        }
+        if(analysis->reference){
+            fclose(analysis->reference);
+        }
+    }
 }
 
 int main(int argc, char *argv[]){
     char *debug_file = NULL;
+    char *reference_file = NULL;
+    char *report_file = NULL;
     int read_chunk = 1024;
+    int analyse = 0;
+    long byte_rate = 0;
+    long prebuffer_ms = DEFAULT_PREBUFFER_MS;
+    long interval_ms = DEFAULT_INTERVAL_MS;
     int i;
     for(i = 1; i < argc; i++){
         if(strcmp(argv[i], "-h") == 0){
@@ -76,11 +361,70 @@ int main(int argc, char *argv[]){
                 i++;
             }
         }
+        else if(strcmp(argv[i], "-a") == 0){
+            analyse = 1;
+        }
+        else if(strcmp(argv[i], "-r") == 0){
+            if(i + 1 < argc){
+                byte_rate = atol(argv[i + 1]);
+                if(byte_rate <= 0){
+                    fprintf(stderr, "stream_debugger: -r requires a positive integer argument\n");
+                    return 1;
+                }
+                i++;
+            }
+        }
+        else if(strcmp(argv[i], "-b") == 0){
+            if(i + 1 < argc){
+                prebuffer_ms = atol(argv[i + 1]);
+                if(prebuffer_ms < 0){
+                    fprintf(stderr, "stream_debugger: -b requires a non-negative integer argument\n");
+                    return 1;
+                }
+                i++;
+            }
+        }
+        else if(strcmp(argv[i], "-i") == 0){
+            if(i + 1 < argc){
+                interval_ms = atol(argv[i + 1]);
+                if(interval_ms <= 0){
+                    fprintf(stderr, "stream_debugger: -i requires a positive integer argument\n");
+                    return 1;
+                }
+                i++;
+            }
+        }
+        else if(strcmp(argv[i], "-x") == 0){
+            if(i + 1 < argc){
+                reference_file = argv[i + 1];
+                i++;
+            }
+        }
+        else if(strcmp(argv[i], "-o") == 0){
+            if(i + 1 < argc){
+                report_file = argv[i + 1];
+                i++;
+            }
+        }
         else{
             fprintf(stderr, "stream_debugger: unknown option '%s'\n", argv[i]);
             return 1;
         }
     }
-    stream_debugger(read_chunk, debug_file);
+    if(!analyse && (reference_file || report_file)){
+        fprintf(stderr, "stream_debugger: -x and -o only apply with -a\n");
+        return 1;
+    }
+
+    Analysis analysis;
+    if(analyse){
+        analysis_init(&analysis, byte_rate, prebuffer_ms, interval_ms);
+        if(byte_rate > 0){
+            // Given, so the header is not looked at
+            analysis.header_len = WAV_HEADER_SIZE;
+        }
+    }
+    stream_debugger(read_chunk, debug_file, analyse ? &analysis : NULL, reference_file,
+                    report_file);
     return 0;
 }
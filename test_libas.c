@@ -0,0 +1,669 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "libas.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+/*
+** Unit tests for the libas helpers that the round trips of test_protocol.py
+** only reach by chance, run with: make test
+**
+** Each test is a function that returns 0 if it passed; CHECK fails it with
+** the condition and its line. The output is that of test_protocol.py, and
+** only the tests named in the arguments run, if any are given:
+**   ./test_libas poller_concurrent_jobs
+** A test that hangs is stopped after TEST_TIMEOUT_SEC, failing the run.
+*/
+#define TEST_TIMEOUT_SEC 60
+
+// Jobs of the poller test: socket pairs fed by threads of their own, and
+// regular files, which epoll refuses, read and written alongside them
+#define POLLER_JOBS 8
+#define POLLER_JOB_BYTES (256 * 1024)
+#define POLLER_FILES 2
+#define POLLER_FILE_BYTES (64 * 1024)
+#define POLLER_CHUNK 4096
+#define POLLER_MAX_EVENTS 4
+
+// Buffers find_crlf is checked on, at every alignment up to CRLF_ALIGNMENTS
+// and every length up to CRLF_LENGTHS, past two AVX2 blocks and their tails,
+// and random ones CRLF_ROUNDS times over
+#define CRLF_ALIGNMENTS 64
+#define CRLF_LENGTHS 100
+#define CRLF_ROUNDS 20
+
+// Lines the line reader test splits at every byte, some longer than a vector
+#define LINES_MESSAGE "STREAM\r\n\r\nabc\rdef\n\r\n" \
+    "a line long enough for two AVX2 blocks, and some more of it\r\n\r\r\n\n\r\nend\r\n"
+#define LINES_EXPECTED {"STREAM", "", "abc\rdef\n", \
+    "a line long enough for two AVX2 blocks, and some more of it", "\r", "\n", "end"}
+#define LINES_CAPACITY 4
+#define LINES_MAX_CAPACITY 128
+
+// What the writer tests send: pieces of sizes cycling through WRITER_PIECES,
+// each after a copied header, flushed every WRITER_FLUSH_PIECES pieces, to a
+// reader that takes WRITER_READ_CHUNK bytes at a time with a pause between,
+// behind a send buffer of WRITER_SNDBUF bytes. The partial write test
+// interrupts the writer with a signal every WRITER_SIGNAL_US.
+#define WRITER_TOTAL (4 << 20)
+#define WRITER_PIECES {1, 7, 1000, 4093, 65537, 300000}
+#define WRITER_FLUSH_PIECES 12
+#define WRITER_READ_CHUNK 8192
+#define WRITER_READ_PAUSE_US 20
+#define WRITER_SNDBUF 16384
+#define WRITER_SIGNAL_US 200
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("line %d: %s\n", __LINE__, #condition); \
+        return -1; \
+    } \
+} while (0)
+
+typedef int (*TestFunction)(void);
+
+
+/*
+** Helper for: the tests
+** returns the byte at offset of the stream numbered seed, so that a byte that
+** went to the wrong stream, or out of order, shows
+*/
+static uint8_t _pattern(int seed, size_t offset) {
+    return (uint8_t)(offset * 31 + offset / 251 + seed * 7);
+}
+
+
+/*
+** Helper for: poller_concurrent_jobs
+** A socket pair's sending end, written by a thread of its own in chunks of
+** varying sizes and paces, and closed at the end.
+*/
+typedef struct poller_job {
+    int id;
+    int fds[2];
+    pthread_t thread;
+    size_t received;
+    uint8_t done;
+} PollerJob;
+
+
+static void *_feed_job(void *arg) {
+    PollerJob *job = arg;
+    uint8_t chunk[POLLER_CHUNK];
+    size_t sent = 0;
+    for (int i = 0; sent < POLLER_JOB_BYTES; i++) {
+        size_t len = MIN(POLLER_CHUNK - job->id * 97 - i % 13, POLLER_JOB_BYTES - sent);
+        for (size_t j = 0; j < len; j++) {
+            chunk[j] = _pattern(job->id, sent + j);
+        }
+        if (write_precisely(job->fds[1], chunk, len) != len) {
+            break;
+        }
+        sent += len;
+        if (i % (job->id + 2) == 0) {
+            usleep(100);
+        }
+    }
+    close(job->fds[1]);
+    return NULL;
+}
+
+
+/*
+** Helper for: poller_concurrent_jobs
+** A regular file, read to its end, or written up to POLLER_FILE_BYTES.
+*/
+typedef struct poller_file {
+    int id;
+    int fd;
+    uint8_t writing;
+    size_t done_bytes;
+    uint8_t done;
+} PollerFile;
+
+
+/*
+** Jobs on sockets and regular files, watched by one poller at once: epoll
+** takes the sockets, and refuses the files with EPERM, which the poller then
+** keeps aside and reports as ready on every wait. Every byte must arrive at
+** the job its data pointer names, the sockets must be served while the files
+** are still watched, and a wait once everything is unwatched must report
+** nothing.
+*/
+static int poller_concurrent_jobs(void) {
+    Poller poller;
+    CHECK(poller_init(&poller) == 0);
+
+    PollerJob jobs[POLLER_JOBS];
+    for (int i = 0; i < POLLER_JOBS; i++) {
+        jobs[i] = (PollerJob){i, {-1, -1}, 0, 0, 0};
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, jobs[i].fds) == 0);
+        CHECK(poller_watch(&poller, jobs[i].fds[0], POLLER_READ, &jobs[i]) == 0);
+    }
+
+    PollerFile files[POLLER_FILES];
+    for (int i = 0; i < POLLER_FILES; i++) {
+        char path[] = "/tmp/test_libas.XXXXXX";
+        int fd = mkstemp(path);
+        CHECK(fd != -1);
+        unlink(path);
+        files[i] = (PollerFile){POLLER_JOBS + i, fd, i % 2, 0, 0};
+        if (!files[i].writing) {
+            uint8_t data[POLLER_FILE_BYTES];
+            for (size_t j = 0; j < POLLER_FILE_BYTES; j++) {
+                data[j] = _pattern(files[i].id, j);
+            }
+            CHECK(write_precisely(fd, data, POLLER_FILE_BYTES) == POLLER_FILE_BYTES);
+            CHECK(lseek(fd, 0, SEEK_SET) == 0);
+        }
+        CHECK(poller_watch(&poller, fd, files[i].writing ? POLLER_WRITE : POLLER_READ,
+                           &files[i]) == 0);
+    }
+    // epoll refused them, so the poller holds them itself
+    CHECK(poller.num_fds == POLLER_FILES);
+
+    for (int i = 0; i < POLLER_JOBS; i++) {
+        CHECK(pthread_create(&jobs[i].thread, NULL, _feed_job, &jobs[i]) == 0);
+    }
+    // Data on every socket, so the first waits have it beside the files
+    for (int i = 0; i < POLLER_JOBS; i++) {
+        struct pollfd pfd = {jobs[i].fds[0], POLLIN, 0};
+        CHECK(poll(&pfd, 1, -1) == 1);
+    }
+
+    int num_left = POLLER_JOBS + POLLER_FILES;
+    int socket_events_beside_files = 0;
+    uint8_t buf[POLLER_CHUNK];
+    while (num_left > 0) {
+        PollerEvent events[POLLER_MAX_EVENTS];
+        int num_events = poller_wait(&poller, events, POLLER_MAX_EVENTS, -1);
+        CHECK(num_events > 0);
+        uint8_t files_ready = 0;
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data >= (void *)files && events[i].data < (void *)(files + POLLER_FILES)) {
+                files_ready = 1;
+            }
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data >= (void *)jobs && events[i].data < (void *)(jobs + POLLER_JOBS)) {
+                PollerJob *job = events[i].data;
+                CHECK(!job->done && events[i].fd == job->fds[0]);
+                CHECK(events[i].events & POLLER_READ);
+                ssize_t num = read(job->fds[0], buf, sizeof(buf));
+                CHECK(num >= 0);
+                for (ssize_t j = 0; j < num; j++) {
+                    CHECK(buf[j] == _pattern(job->id, job->received + j));
+                }
+                job->received += num;
+                socket_events_beside_files += files_ready;
+                if (num == 0) {
+                    CHECK(job->received == POLLER_JOB_BYTES);
+                    CHECK(poller_watch(&poller, job->fds[0], 0, NULL) == 0);
+                    close(job->fds[0]);
+                    job->done = 1;
+                    num_left--;
+                }
+                continue;
+            }
+
+            PollerFile *file = events[i].data;
+            CHECK(events[i].data != NULL && !file->done && events[i].fd == file->fd);
+            CHECK(events[i].events == (file->writing ? POLLER_WRITE : POLLER_READ));
+            ssize_t num;
+            if (file->writing) {
+                size_t len = MIN(POLLER_CHUNK / 4, POLLER_FILE_BYTES - file->done_bytes);
+                for (size_t j = 0; j < len; j++) {
+                    buf[j] = _pattern(file->id, file->done_bytes + j);
+                }
+                num = write(file->fd, buf, len);
+                CHECK(num == len);
+            } else {
+                // A little at a time, for the file to stay watched a while
+                num = read(file->fd, buf, POLLER_CHUNK / 4);
+                CHECK(num >= 0);
+                for (ssize_t j = 0; j < num; j++) {
+                    CHECK(buf[j] == _pattern(file->id, file->done_bytes + j));
+                }
+            }
+            file->done_bytes += num;
+            if ((file->writing && file->done_bytes == POLLER_FILE_BYTES) ||
+                (!file->writing && num == 0)) {
+                CHECK(file->done_bytes == POLLER_FILE_BYTES);
+                // Unwatching one moves the other within the poller's list
+                CHECK(poller_watch(&poller, file->fd, 0, NULL) == 0);
+                file->done = 1;
+                num_left--;
+            }
+        }
+    }
+    // Sockets were served while the files kept every wait from blocking
+    CHECK(socket_events_beside_files > 0);
+
+    for (int i = 0; i < POLLER_JOBS; i++) {
+        pthread_join(jobs[i].thread, NULL);
+    }
+    CHECK(poller.num_fds == 0);
+    PollerEvent events[POLLER_MAX_EVENTS];
+    CHECK(poller_wait(&poller, events, POLLER_MAX_EVENTS, 50) == 0);
+
+    // Watching a kept-aside descriptor for other events changes what it
+    // reports, without handing it to epoll
+    CHECK(poller_watch(&poller, files[0].fd, POLLER_READ, &files[0]) == 0);
+    CHECK(poller_watch(&poller, files[0].fd, POLLER_READ | POLLER_WRITE, &files[1]) == 0);
+    CHECK(poller.num_fds == 1);
+    CHECK(poller_wait(&poller, events, POLLER_MAX_EVENTS, -1) == 1);
+    CHECK(events[0].fd == files[0].fd && events[0].data == &files[1]);
+    CHECK(events[0].events == (POLLER_READ | POLLER_WRITE));
+
+    for (int i = 0; i < POLLER_FILES; i++) {
+        close(files[i].fd);
+    }
+    poller_destroy(&poller);
+    return 0;
+}
+
+
+/*
+** Helper for: find_crlf_matches_scalar
+** The plain scan find_crlf must agree with.
+*/
+static const char *_scalar_crlf(const char *buf, size_t len) {
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n') {
+            return buf + i;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+** find_crlf against the scalar scan, at every alignment and length: with a
+** single \r\n at each place, with none but a \r as the last byte and its \n
+** just past the end, and with random \r and \n. The AVX2 scan hands what is
+** left of a buffer to the SSE2 one, and that to the scalar one, so these
+** lengths reach all three on a CPU with AVX2.
+*/
+static int find_crlf_matches_scalar(void) {
+    char buf[CRLF_ALIGNMENTS + CRLF_LENGTHS + 1];
+    for (int align = 0; align < CRLF_ALIGNMENTS; align++) {
+        char *start = buf + align;
+        for (size_t len = 0; len <= CRLF_LENGTHS; len++) {
+            memset(buf, 'x', sizeof(buf));
+            for (size_t at = 0; at + 1 < len; at++) {
+                start[at] = '\r';
+                start[at + 1] = '\n';
+                CHECK(find_crlf(start, len) == start + at);
+                start[at] = '\n';
+                start[at + 1] = '\r';
+            }
+            // Only \n\r, which isn't one
+            CHECK(find_crlf(start, len) == NULL);
+
+            memset(buf, 'x', sizeof(buf));
+            if (len > 0) {
+                start[len - 1] = '\r';
+                start[len] = '\n';
+                CHECK(find_crlf(start, len) == NULL);
+            }
+
+            for (int round = 0; round < CRLF_ROUNDS; round++) {
+                for (size_t i = 0; i < len; i++) {
+                    int r = rand() % 16;
+                    start[i] = r == 0 ? '\r' : r == 1 ? '\n' : 'a' + r;
+                }
+                CHECK(find_crlf(start, len) == _scalar_crlf(start, len));
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: line_reader_split_crlf
+** Reads lines from reader, reading more from fd while there is more to come,
+** and checks them against those expected, from *num_lines on.
+*/
+static int _check_lines(LineReader *reader, int fd, size_t more, const char **expected,
+                        int num_expected, int *num_lines) {
+    char *line;
+    size_t len;
+    while (1) {
+        while ((line = line_reader_next(reader, &len)) != NULL) {
+            CHECK(*num_lines < num_expected);
+            CHECK(len == strlen(expected[*num_lines]));
+            CHECK(strcmp(line, expected[*num_lines]) == 0);
+            (*num_lines)++;
+        }
+        if (more == 0) {
+            return 0;
+        }
+        int num = line_reader_fill(reader, fd);
+        CHECK(num > 0 && num <= more);
+        more -= num;
+    }
+}
+
+
+/*
+** Lines through a line reader, sent in two writes split at every byte, so
+** that a \r\n ends up split across the two, in a buffer that starts too
+** small for them, then in single bytes with line_reader_feed. The \r that
+** ends a read must still be found with the \n the next one brings, and
+** lines must survive the buffer growing and being compacted. A line longer
+** than the largest buffer fails with ENOBUFS.
+*/
+static int line_reader_split_crlf(void) {
+    const char *message = LINES_MESSAGE;
+    size_t message_len = strlen(message);
+    const char *expected[] = LINES_EXPECTED;
+    int num_expected = sizeof(expected) / sizeof(expected[0]);
+
+    for (size_t split = 0; split <= message_len; split++) {
+        int fds[2];
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        LineReader reader;
+        CHECK(line_reader_init(&reader, LINES_CAPACITY, 0) == 0);
+        int num_lines = 0;
+        CHECK(write_precisely(fds[1], message, split) == split);
+        CHECK(_check_lines(&reader, fds[0], split, expected, num_expected, &num_lines) == 0);
+        CHECK(write_precisely(fds[1], message + split, message_len - split) ==
+              message_len - split);
+        CHECK(_check_lines(&reader, fds[0], message_len - split, expected, num_expected,
+                           &num_lines) == 0);
+        CHECK(num_lines == num_expected);
+        // Nothing left over
+        CHECK(reader.start == reader.end);
+        line_reader_free(&reader);
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    LineReader reader;
+    CHECK(line_reader_init(&reader, LINES_CAPACITY, LINES_MAX_CAPACITY) == 0);
+    int num_lines = 0;
+    for (size_t i = 0; i < message_len; i++) {
+        CHECK(line_reader_feed(&reader, message + i, 1) == 0);
+        CHECK(_check_lines(&reader, -1, 0, expected, num_expected, &num_lines) == 0);
+    }
+    CHECK(num_lines == num_expected);
+    char unending[LINES_MAX_CAPACITY + 1];
+    memset(unending, 'x', sizeof(unending));
+    CHECK(line_reader_feed(&reader, unending, LINES_MAX_CAPACITY) == 0);
+    CHECK(line_reader_next(&reader, NULL) == NULL);
+    CHECK(line_reader_feed(&reader, unending, 1) == -1 && errno == ENOBUFS);
+    line_reader_free(&reader);
+    return 0;
+}
+
+
+/*
+** Helper for: the writer tests
+** The receiving end of a writer's socket, read slowly on a thread of its own
+** until EOF, counting the bytes that matched what was sent.
+*/
+typedef struct writer_sink {
+    int fd;
+    pthread_t thread;
+    size_t received;
+    uint8_t mismatched;
+} WriterSink;
+
+
+static void *_drain_sink(void *arg) {
+    WriterSink *sink = arg;
+    uint8_t buf[WRITER_READ_CHUNK];
+    ssize_t num;
+    while ((num = read(sink->fd, buf, sizeof(buf))) != 0) {
+        if (num == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (ssize_t i = 0; i < num; i++) {
+            sink->mismatched |= buf[i] != _pattern(0, sink->received + i);
+        }
+        sink->received += num;
+        usleep(WRITER_READ_PAUSE_US);
+    }
+    return NULL;
+}
+
+
+/*
+** Helper for: the writer tests
+** Sends WRITER_TOTAL bytes of the pattern through writer, as headers copied
+** into it and pieces of data referenced from data, which is overwritten after
+** each flush, as a caller reusing its buffer would.
+**
+** returns the number of flushes made, -1 on error
+*/
+static int _write_pieces(Writer *writer, uint8_t *data) {
+    const size_t pieces[] = WRITER_PIECES;
+    int num_pieces = sizeof(pieces) / sizeof(pieces[0]);
+    size_t sent = 0;
+    size_t queued = 0;
+    int num_flushes = 0;
+    for (int i = 0; sent + queued < WRITER_TOTAL; i++) {
+        uint8_t header[3];
+        size_t header_len = MIN(sizeof(header), WRITER_TOTAL - sent - queued);
+        for (size_t j = 0; j < header_len; j++) {
+            header[j] = _pattern(0, sent + queued + j);
+        }
+        CHECK(writer_add_copy(writer, header, header_len) == 0);
+        queued += header_len;
+
+        size_t len = MIN(pieces[i % num_pieces], WRITER_TOTAL - sent - queued);
+        for (size_t j = 0; j < len; j++) {
+            data[queued + j] = _pattern(0, sent + queued + j);
+        }
+        CHECK(writer_add(writer, data + queued, len) == 0);
+        queued += len;
+
+        if (i % WRITER_FLUSH_PIECES == WRITER_FLUSH_PIECES - 1 || sent + queued == WRITER_TOTAL) {
+            CHECK(writer_flush(writer) == queued);
+            num_flushes++;
+            sent += queued;
+            // The writer is done with the data once flushed
+            memset(data, 0, queued);
+            queued = 0;
+        }
+    }
+    return num_flushes;
+}
+
+
+static void _interrupted(int signum) {
+}
+
+
+// Runs until cancelled
+static void *_interrupt_writer(void *arg) {
+    pthread_t *writer_thread = arg;
+    while (pthread_kill(*writer_thread, SIGUSR1) == 0) {
+        usleep(WRITER_SIGNAL_US);
+    }
+    return NULL;
+}
+
+
+/*
+** A writer whose writes block behind a small send buffer and a slow reader,
+** and are interrupted by signals without SA_RESTART, so that writev returns
+** early, most often partway through an iovec, or fails with EINTR. Every byte
+** must still arrive once and in order, with each flush returning all it
+** sent, in more write calls than flushes.
+*/
+static int writer_partial_writes(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _interrupted;
+    CHECK(sigaction(SIGUSR1, &action, NULL) == 0);
+
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int sndbuf = WRITER_SNDBUF;
+    CHECK(setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+    WriterSink sink = {fds[1], 0, 0, 0};
+    CHECK(pthread_create(&sink.thread, NULL, _drain_sink, &sink) == 0);
+
+    uint8_t *data = malloc(WRITER_TOTAL);
+    CHECK(data != NULL);
+    Writer writer;
+    writer_init(&writer, fds[0]);
+    uint64_t write_calls = io_stats.write_calls;
+    pthread_t self = pthread_self();
+    pthread_t interrupter;
+    CHECK(pthread_create(&interrupter, NULL, _interrupt_writer, &self) == 0);
+    int num_flushes = _write_pieces(&writer, data);
+    pthread_cancel(interrupter);
+    pthread_join(interrupter, NULL);
+    // Whatever signal is still on its way
+    signal(SIGUSR1, SIG_IGN);
+    close(fds[0]);
+    pthread_join(sink.thread, NULL);
+    free(data);
+    close(fds[1]);
+
+    CHECK(num_flushes > 0);
+    CHECK(io_stats.write_calls - write_calls > num_flushes);
+    CHECK(sink.received == WRITER_TOTAL && !sink.mismatched);
+    return 0;
+}
+
+
+/*
+** A writer with zero-copy on a TCP connection, which takes it: each large
+** flush returns only once the kernel is done with the data, so that data
+** overwritten straight after arrives as it was. A flush below
+** WRITER_ZEROCOPY_MIN is sent the plain way, and has nothing to wait on.
+*/
+static int writer_zerocopy_accepted(void) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    CHECK(listener != -1);
+    CHECK(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    CHECK(listen(listener, 1) == 0);
+    CHECK(getsockname(listener, (struct sockaddr *)&addr, &addr_len) == 0);
+    int sender = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(sender != -1);
+    CHECK(connect(sender, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    WriterSink sink = {accept(listener, NULL, NULL), 0, 0, 0};
+    CHECK(sink.fd != -1);
+    close(listener);
+    CHECK(pthread_create(&sink.thread, NULL, _drain_sink, &sink) == 0);
+
+    uint8_t *data = malloc(WRITER_TOTAL);
+    CHECK(data != NULL);
+    Writer writer;
+    writer_init(&writer, sender);
+    CHECK(writer_enable_zerocopy(&writer) == 0);
+    int num_flushes = _write_pieces(&writer, data);
+    CHECK(num_flushes > 0);
+    CHECK(writer.zerocopy_outstanding == 0);
+
+    // Too small to be worth it
+    uint8_t small[WRITER_SCRATCH_SIZE];
+    for (size_t i = 0; i < sizeof(small); i++) {
+        small[i] = _pattern(0, WRITER_TOTAL + i);
+    }
+    CHECK(writer_add(&writer, small, sizeof(small)) == 0);
+    CHECK(writer_flush(&writer) == sizeof(small));
+    CHECK(writer.zerocopy_outstanding == 0);
+
+    close(sender);
+    pthread_join(sink.thread, NULL);
+    close(sink.fd);
+    free(data);
+    CHECK(sink.received == WRITER_TOTAL + sizeof(small) && !sink.mismatched);
+    return 0;
+}
+
+
+/*
+** A writer asked for zero-copy on a socket that refuses it, a Unix one: it
+** says so, and goes on sending large flushes the plain way, without waiting
+** on completions that will never come.
+*/
+static int writer_zerocopy_refused(void) {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    WriterSink sink = {fds[1], 0, 0, 0};
+    CHECK(pthread_create(&sink.thread, NULL, _drain_sink, &sink) == 0);
+
+    uint8_t *data = malloc(WRITER_TOTAL);
+    CHECK(data != NULL);
+    Writer writer;
+    writer_init(&writer, fds[0]);
+    CHECK(writer_enable_zerocopy(&writer) == -1);
+    CHECK(!writer.zerocopy);
+    CHECK(_write_pieces(&writer, data) > 0);
+    CHECK(writer.zerocopy_outstanding == 0);
+    close(fds[0]);
+    pthread_join(sink.thread, NULL);
+    close(fds[1]);
+    free(data);
+    CHECK(sink.received == WRITER_TOTAL && !sink.mismatched);
+    return 0;
+}
+
+
+static const struct {
+    const char *name;
+    TestFunction function;
+} tests[] = {
+    {"poller_concurrent_jobs", poller_concurrent_jobs},
+    {"find_crlf_matches_scalar", find_crlf_matches_scalar},
+    {"line_reader_split_crlf", line_reader_split_crlf},
+    {"writer_partial_writes", writer_partial_writes},
+    {"writer_zerocopy_accepted", writer_zerocopy_accepted},
+    {"writer_zerocopy_refused", writer_zerocopy_refused},
+};
+
+
+static void _timed_out(int signum) {
+    static const char message[] = "Timed out\n";
+    _exit(write(STDOUT_FILENO, message, sizeof(message) - 1) == -1 ? 2 : 1);
+}
+
+
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IONBF, 0);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGALRM, _timed_out);
+
+    int num_tests = sizeof(tests) / sizeof(tests[0]);
+    int num_run = 0;
+    int num_failed = 0;
+    for (int i = 0; i < num_tests; i++) {
+        uint8_t wanted = argc == 1;
+        for (int j = 1; j < argc; j++) {
+            wanted |= strcmp(argv[j], tests[i].name) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        num_run++;
+        alarm(TEST_TIMEOUT_SEC);
+        if (tests[i].function() == 0) {
+            printf("ok      %s\n", tests[i].name);
+        } else {
+            num_failed++;
+            printf("FAILED  %s\n", tests[i].name);
+        }
+        alarm(0);
+    }
+    printf("%d of %d passed\n", num_run - num_failed, num_run);
+    return num_failed ? 1 : 0;
+}
@@ -0,0 +1,1093 @@
+# These round trips check the server's answers to the requests it knows,
+# over protocol v1 and v2, against the files in the library. They start their
+# own servers on free ports, so the server must be built first:
+#
+#     make test
+#     python3 test_protocol.py [test name]...
+#
+
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SERVER = os.path.join(HERE, "as_server")
+CLIENT = os.path.join(HERE, "as_client")
+LIBRARY = os.path.join(HERE, "library")
+AUDIO_EXTS = (".wav", ".mp3", ".flac", ".ogg", ".m4a")
+
+# See the frames in libas.h
+FRAME_HEADER = struct.Struct(">IIBB")
+FRAME_REQUEST, FRAME_DATA, FRAME_WINDOW, FRAME_CANCEL, FRAME_ERROR = 1, 2, 3, 4, 5
+FLAG_END = 0x1
+MAX_FRAME_PAYLOAD = 16384
+INITIAL_WINDOW = 65536
+
+# See as_udp.h
+UDP_HEADER = struct.Struct(">IIHBB")
+UDP_PAYLOAD_SIZE = 1200
+UDP_FLAG_END, UDP_FLAG_NACK, UDP_FLAG_DONE = 0x1, 0x4, 0x8
+
+# See as_station.h
+STATION_LIVE_SIZE = 0xffffffff
+
+# See as_search.h and as_browse.h
+SEARCH_SUBSTRING, SEARCH_PREFIX, SEARCH_FUZZY = 0, 1, 2
+SEARCH_MAX_QUERY = 255
+BROWSE_MAX_ARG = 1024
+# See as_server.h
+V2_MAX_REQUEST_SIZE = len(b"BROWSE\r\n") + 10 + 2 * BROWSE_MAX_ARG
+
+# See as_wave.h
+WAVE_MAX_BUCKETS = 1024
+WAVE_DEFAULT_BUCKETS = 256
+WAVE_SILENT = -2 ** 31
+
+# See as_flight.h
+FLIGHT_SLOTS = 32
+FLIGHT_IDLE_MS = 10000
+
+# See as_clist.h
+CLIST_BLOCK_ENTRIES = 256
+CLIST_FLAG_CHECKSUM = 0x1
+
+
+def library_files(root=LIBRARY):
+    """The library's paths, in the server's order."""
+    files = []
+    for directory, _, names in os.walk(root):
+        for name in names:
+            if name.endswith(AUDIO_EXTS):
+                path = os.path.relpath(os.path.join(directory, name), root)
+                files.append(path.encode())
+    return sorted(files)
+
+
+def read_file(index, root=LIBRARY):
+    with open(os.path.join(root, library_files(root)[index].decode()), "rb") as f:
+        return f.read()
+
+
+def scratch_library(paths, contents=None):
+    """A library of files at paths, empty unless contents maps them to their
+    bytes, in a directory the caller removes."""
+    root = tempfile.mkdtemp(prefix="as_library_")
+    for path in paths:
+        os.makedirs(os.path.dirname(os.path.join(root, path)), exist_ok=True)
+        with open(os.path.join(root, path), "wb") as f:
+            f.write((contents or {}).get(path, b""))
+    return root
+
+
+class Server:
+    """A server started with args, in a directory of its own."""
+
+    def __init__(self, *args, library=LIBRARY):
+        self.dir = tempfile.mkdtemp(prefix="as_test_")
+        with socket.socket() as sock:
+            sock.bind(("127.0.0.1", 0))
+            self.port = sock.getsockname()[1]
+        self.args = ["-p", str(self.port)] + list(args)
+        if library is not None:
+            self.args += ["-l", library]
+        self.log = open(os.path.join(self.dir, "log"), "w+")
+        # A session of its own, so that the processes it forks are stopped too
+        # Its commands are read from stdin, which is held open so it waits for none
+        self.process = subprocess.Popen([SERVER] + self.args, cwd=self.dir, stdin=subprocess.PIPE,
+                                        stdout=self.log, stderr=subprocess.STDOUT,
+                                        start_new_session=True)
+        deadline = time.time() + 5
+        while True:
+            try:
+                socket.create_connection(("127.0.0.1", self.port), timeout=1).close()
+                break
+            except OSError:
+                if time.time() > deadline or self.process.poll() is not None:
+                    self.stop()
+                    raise AssertionError("server did not start:\n" + self.output())
+                time.sleep(0.05)
+
+    def connect(self):
+        sock = socket.create_connection(("127.0.0.1", self.port), timeout=5)
+        return sock
+
+    def output(self):
+        self.log.seek(0)
+        return self.log.read()
+
+    def quit(self):
+        """Asks the server to quit once its clients are done, and returns what
+        it printed."""
+        self.process.stdin.write(b"q")
+        self.process.stdin.flush()
+        self.process.wait(timeout=30)
+        return self.output()
+
+    def stop(self):
+        try:
+            os.killpg(self.process.pid, signal.SIGKILL)
+        except ProcessLookupError:
+            pass
+        self.process.wait()
+        self.process.stdin.close()
+        self.log.close()
+        shutil.rmtree(self.dir, ignore_errors=True)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.stop()
+
+
+def run_client(port, commands, *args):
+    """Runs the client's shell on commands, against the server at port, with
+    a library and cache of its own, and returns what it printed and how many
+    seconds it took."""
+    directory = tempfile.mkdtemp(prefix="as_client_")
+    try:
+        start = time.time()
+        result = subprocess.run([CLIENT, "-p", str(port), "-l", os.path.join(directory, "library"),
+                                 "-c", os.path.join(directory, "cache")] + list(args),
+                                input="".join(line + "\n" for line in commands).encode(),
+                                stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=30)
+        return result.stdout.decode(errors="replace"), time.time() - start
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+
+def recv_exactly(sock, count):
+    data = b""
+    while len(data) < count:
+        chunk = sock.recv(count - len(data))
+        if not chunk:
+            raise AssertionError("connection closed after %d of %d bytes" % (len(data), count))
+        data += chunk
+    return data
+
+
+def recv_sized(sock):
+    """Reads a response that starts with its size, as a STREAM's does."""
+    size = struct.unpack(">I", recv_exactly(sock, 4))[0]
+    return recv_exactly(sock, size)
+
+
+def recv_list(sock):
+    """Reads a LIST response, which ends with the entry of file 0."""
+    data = b""
+    while not (data.startswith(b"0:") or b"\r\n0:" in data) or not data.endswith(b"\r\n"):
+        chunk = sock.recv(4096)
+        if not chunk:
+            raise AssertionError("connection closed during LIST")
+        data += chunk
+    return data
+
+
+def parse_entries(body):
+    """The index and path of each entry of a LIST-like body."""
+    entries = []
+    for line in body.split(b"\r\n")[:-1]:
+        index, path = line.split(b":", 1)
+        entries.append((int(index), path))
+    return entries
+
+
+def assert_closed(sock):
+    """Asserts the server closed the connection, having sent nothing more."""
+    try:
+        data = sock.recv(1)
+    except ConnectionResetError:
+        return
+    assert data == b"", "expected the connection to be closed, got %r" % data
+
+
+def assert_silent(sock, seconds=0.3):
+    sock.settimeout(seconds)
+    try:
+        data = sock.recv(1)
+    except socket.timeout:
+        return
+    finally:
+        sock.settimeout(5)
+    raise AssertionError("expected nothing from the server, got %r" % data)
+
+
+# Protocol v2
+
+def negotiate_v2(sock):
+    sock.sendall(b"V2\r\n")
+    assert recv_exactly(sock, 4) == b"V2\r\n"
+
+
+def frame(kind, stream_id, payload=b"", flags=0):
+    return FRAME_HEADER.pack(len(payload), stream_id, kind, flags) + payload
+
+
+def recv_frame(sock):
+    length, stream_id, kind, flags = FRAME_HEADER.unpack(recv_exactly(sock, FRAME_HEADER.size))
+    assert length <= MAX_FRAME_PAYLOAD, "%d byte frame" % length
+    return stream_id, kind, flags, recv_exactly(sock, length)
+
+
+def recv_streams(sock, stream_ids):
+    """Reads frames until each of the streams has ended, and returns what
+    each was sent: its response, or ("ERROR", reason)."""
+    responses = {stream_id: b"" for stream_id in stream_ids}
+    ended = set()
+    while ended != set(stream_ids):
+        stream_id, kind, flags, payload = recv_frame(sock)
+        if stream_id not in responses:
+            continue
+        assert stream_id not in ended, "frame after the end of stream %d" % stream_id
+        if kind == FRAME_ERROR:
+            assert flags & FLAG_END
+            responses[stream_id] = ("ERROR", payload)
+        else:
+            assert kind == FRAME_DATA, "frame of type %d" % kind
+            responses[stream_id] += payload
+        if flags & FLAG_END:
+            ended.add(stream_id)
+    return responses
+
+
+def v2_request(sock, stream_id, request):
+    sock.sendall(frame(FRAME_REQUEST, stream_id, request))
+    return recv_streams(sock, [stream_id])[stream_id]
+
+
+TESTS = []
+
+
+def test(function):
+    TESTS.append(function)
+    return function
+
+
+@test
+def v1_list_and_stream(server):
+    files = library_files()
+    with server.connect() as sock:
+        sock.sendall(b"LIST\r\n")
+        entries = parse_entries(recv_list(sock))
+        assert sorted(entries) == list(enumerate(files)), entries
+        last = len(files) - 1
+        sock.sendall(b"STREAM\r\n" + struct.pack(">I", last))
+        assert recv_sized(sock) == read_file(last)
+
+
+@test
+def unknown_request_answered(server):
+    with server.connect() as sock:
+        sock.settimeout(0.5)
+        sock.sendall(b"NOPE\r\n")
+        # Right away, rather than left for the client to time out on
+        assert recv_exactly(sock, 6) == b"NACK\r\n"
+        sock.settimeout(5)
+        sock.sendall(b"LIST\r\n")
+        assert sorted(parse_entries(recv_list(sock))) == list(enumerate(library_files()))
+
+
+@test
+def v2_interleaves_streams(server):
+    files = library_files()
+    with server.connect() as sock:
+        negotiate_v2(sock)
+        stream_index = max(range(len(files)), key=lambda i: len(read_file(i)))
+        sock.sendall(frame(FRAME_REQUEST, 1, b"STREAM\r\n" + struct.pack(">I", stream_index)) +
+                     frame(FRAME_REQUEST, 3, b"LIST\r\n"))
+        # The LIST is not held up behind the STREAM's window
+        responses = recv_streams(sock, [3])
+        assert sorted(parse_entries(responses[3])) == list(enumerate(files))
+        sock.sendall(frame(FRAME_CANCEL, 1))
+
+
+@test
+def v2_window(server):
+    files = library_files()
+    index = max(range(len(files)), key=lambda i: len(read_file(i)))
+    data = read_file(index)
+    assert len(data) > 2 * INITIAL_WINDOW
+    with server.connect() as sock:
+        negotiate_v2(sock)
+        sock.sendall(frame(FRAME_REQUEST, 7, b"STREAM\r\n" + struct.pack(">I", index)))
+        received = b""
+        while len(received) < INITIAL_WINDOW:
+            stream_id, kind, flags, payload = recv_frame(sock)
+            assert (stream_id, kind, flags) == (7, FRAME_DATA, 0)
+            received += payload
+        assert len(received) == INITIAL_WINDOW
+        # Nothing more until the window grows
+        assert_silent(sock)
+        sock.sendall(frame(FRAME_WINDOW, 7, struct.pack(">I", len(data) + 4)))
+        received += recv_streams(sock, [7])[7]
+        assert received == struct.pack(">I", len(data)) + data
+
+
+@test
+def v2_cancel(server):
+    files = library_files()
+    index = max(range(len(files)), key=lambda i: len(read_file(i)))
+    with server.connect() as sock:
+        negotiate_v2(sock)
+        sock.sendall(frame(FRAME_REQUEST, 1, b"STREAM\r\n" + struct.pack(">I", index)))
+        stream_id, kind, _, _ = recv_frame(sock)
+        assert (stream_id, kind) == (1, FRAME_DATA)
+        sock.sendall(frame(FRAME_CANCEL, 1) + frame(FRAME_WINDOW, 1, struct.pack(">I", 1 << 30)))
+        # Frames already sent still arrive, but the stream never ends
+        sock.sendall(frame(FRAME_REQUEST, 2, b"LIST\r\n"))
+        while True:
+            stream_id, kind, flags, payload = recv_frame(sock)
+            if stream_id == 2:
+                assert kind == FRAME_DATA
+                if flags & FLAG_END:
+                    break
+            else:
+                assert (stream_id, kind, flags) == (1, FRAME_DATA, 0)
+        assert_silent(sock)
+
+
+@test
+def v2_errors(server):
+    with server.connect() as sock:
+        negotiate_v2(sock)
+        assert v2_request(sock, 1, b"NOPE\r\n")[0] == "ERROR"
+        assert v2_request(sock, 2, b"no newline")[0] == "ERROR"
+        # A stream id in use
+        sock.sendall(frame(FRAME_REQUEST, 3, b"STREAM\r\n" + struct.pack(">I", 0)))
+        sock.sendall(frame(FRAME_REQUEST, 3, b"LIST\r\n"))
+        stream_id, kind, flags, payload = recv_frame(sock)
+        while kind != FRAME_ERROR:
+            stream_id, kind, flags, payload = recv_frame(sock)
+        assert (stream_id, payload) == (3, b"Stream already open")
+        # The connection is still fine
+        assert v2_request(sock, 4, b"STAT\r\n" + struct.pack(">I", 0))[:4] == \
+            struct.pack(">I", len(read_file(0)))
+
+
+@test
+def ustream_recovers_losses(server):
+    files = library_files()
+    index = min(range(len(files)), key=lambda i: len(read_file(i)))
+    data = read_file(index)
+    # Drop a fifth of the datagrams, for NACKs to recover
+    with Server("-d", "20") as lossy, lossy.connect() as sock, \
+            socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as udp:
+        udp.bind(("127.0.0.1", 0))
+        sock.sendall(b"USTREAM\r\n" + struct.pack(">IH", index, udp.getsockname()[1]))
+        size, byte_rate = struct.unpack(">II", recv_exactly(sock, 8))
+        assert size == len(data) and byte_rate > 0
+        num_datagrams = (size + UDP_PAYLOAD_SIZE - 1) // UDP_PAYLOAD_SIZE
+        received = {}
+        server_addr = None
+        udp.settimeout(0.5)
+        deadline = time.time() + 3 * size / byte_rate + 10
+        while len(received) < num_datagrams:
+            assert time.time() < deadline, "%d of %d datagrams" % (len(received), num_datagrams)
+            try:
+                datagram, server_addr = udp.recvfrom(UDP_HEADER.size + UDP_PAYLOAD_SIZE)
+            except socket.timeout:
+                # Ask again for whatever is missing, once the server has sent it all
+                missing = [seq for seq in range(num_datagrams) if seq not in received]
+                if server_addr is not None:
+                    nack = struct.pack(">%dI" % len(missing[:64]), *missing[:64])
+                    udp.sendto(UDP_HEADER.pack(0, 0, len(nack), UDP_FLAG_NACK, 0) + nack,
+                               server_addr)
+                continue
+            seq, _, length, flags, _ = UDP_HEADER.unpack(datagram[:UDP_HEADER.size])
+            payload = datagram[UDP_HEADER.size:]
+            assert length == len(payload)
+            assert bool(flags & UDP_FLAG_END) == (seq == num_datagrams - 1)
+            received[seq] = payload
+        udp.sendto(UDP_HEADER.pack(0, 0, 0, UDP_FLAG_DONE, 0), server_addr)
+        assert b"".join(received[seq] for seq in range(num_datagrams)) == data
+
+
+@test
+def station(server):
+    # Without a station, the size is 0 and the connection ends
+    with server.connect() as sock:
+        sock.sendall(b"STATION\r\n")
+        assert recv_exactly(sock, 4) == struct.pack(">I", 0)
+        assert_closed(sock)
+
+    files = library_files()
+    index = next(i for i, path in enumerate(files) if path.endswith(b".mp3"))
+    data = read_file(index)
+    playlist = tempfile.NamedTemporaryFile("w", suffix=".txt", delete=False)
+    try:
+        playlist.write(files[index].decode() + "\n")
+        playlist.close()
+        with Server("-s", playlist.name) as radio, radio.connect() as sock:
+            sock.sendall(b"STATION\r\n")
+            assert recv_exactly(sock, 4) == struct.pack(">I", STATION_LIVE_SIZE)
+            # The tracks' bytes back to back, joined wherever the station was
+            heard = recv_exactly(sock, 16384)
+            assert heard in data + data
+    finally:
+        os.unlink(playlist.name)
+
+
+def stats_counts(report):
+    """The count and errors of each request in a STATS report."""
+    counts = {}
+    for line in report.decode().splitlines():
+        fields = line.split()
+        if len(fields) == 7 and fields[0].isalpha() and fields[1].isdigit():
+            counts[fields[0]] = (int(fields[1]), int(fields[2]))
+    return counts
+
+
+@test
+def stats_add_up_processes(server):
+    # A server of its own, for its counts to be exact
+    with Server() as counted:
+        # Each connection is counted by a process of its own
+        for _ in range(3):
+            with counted.connect() as sock:
+                sock.sendall(b"LIST\r\n")
+                recv_list(sock)
+                sock.sendall(b"STREAM\r\n" + struct.pack(">I", 0))
+                recv_sized(sock)
+                # Only answered once the STREAM was counted
+                sock.sendall(b"STAT\r\n" + struct.pack(">I", 0))
+                recv_exactly(sock, 8)
+        with counted.connect() as sock:
+            sock.sendall(b"NOPE\r\nSTATS\r\n")
+            assert recv_exactly(sock, 6) == b"NACK\r\n"
+            report = recv_sized(sock)
+        assert report.startswith(b"Up "), report
+        counts = stats_counts(report)
+        assert counts["LIST"] == (3, 0), report
+        assert counts["STREAM"] == (3, 0), report
+        assert counts["other"][0] == 1, report
+
+
+@test
+def admission_refuses_busy(server):
+    # Beyond the connections allowed from an address
+    with Server("-a", "1") as limited:
+        # The connection Server made to see it start counts until it is reaped
+        time.sleep(0.3)
+        with limited.connect() as first:
+            first.sendall(b"LIST\r\n")
+            recv_list(first)
+            with limited.connect() as second:
+                assert recv_exactly(second, 6) == b"BUSY\r\n"
+                assert_closed(second)
+
+    # Beyond the streams allowed from an address, a v2 stream is refused alone
+    files = library_files()
+    index = max(range(len(files)), key=lambda i: len(read_file(i)))
+    with Server("-t", "1") as limited, limited.connect() as sock:
+        negotiate_v2(sock)
+        sock.sendall(frame(FRAME_REQUEST, 1, b"STREAM\r\n" + struct.pack(">I", index)))
+        # Held open by its window
+        assert recv_frame(sock)[:2] == (1, FRAME_DATA)
+        assert v2_request(sock, 2, b"STREAM\r\n" + struct.pack(">I", 0)) == ("ERROR", b"Busy")
+        with limited.connect() as other:
+            other.sendall(b"STREAM\r\n" + struct.pack(">I", 0))
+            assert recv_exactly(other, 6) == b"BUSY\r\n"
+            assert_closed(other)
+        # Not counted against the limit
+        assert v2_request(sock, 3, b"LIST\r\n")[:2] != ("ERROR", b"Busy")
+
+
+@test
+def admission_limits_rate(server):
+    files = library_files()
+    index = next(i for i, path in enumerate(files) if path.endswith(b".mp3") and
+                 len(read_file(i)) > 256 * 1024)
+    data = read_file(index)
+    with Server("-r", "256") as limited, limited.connect() as sock:
+        start = time.time()
+        # Each write waits for the bytes before it to be paid for, so the
+        # second stream waits for the first, less the burst the bucket allows
+        for _ in range(2):
+            sock.sendall(b"STREAM\r\n" + struct.pack(">I", index))
+            assert recv_sized(sock) == data
+        assert time.time() - start > len(data) / (256 * 1024) - 0.2
+
+
+@test
+def handoff_keeps_connections(server):
+    files = list(enumerate(library_files()))
+    with Server() as upgraded:
+        with upgraded.connect() as sock:
+            sock.sendall(b"LIST\r\n")
+            assert sorted(parse_entries(recv_list(sock))) == files
+            os.kill(upgraded.process.pid, signal.SIGHUP)
+            # Whichever process answers, new connections are never turned away
+            for _ in range(20):
+                with upgraded.connect() as other:
+                    other.sendall(b"LIST\r\n")
+                    assert sorted(parse_entries(recv_list(other))) == files
+                time.sleep(0.05)
+            # The connection made before carries on in its own process
+            sock.sendall(b"STREAM\r\n" + struct.pack(">I", 0))
+            assert recv_sized(sock) == read_file(0)
+        # Then the predecessor, its clients gone, leaves the successor serving
+        upgraded.process.wait(timeout=10)
+        assert "Handed the listening socket off" in upgraded.output()
+        with upgraded.connect() as sock:
+            sock.sendall(b"LIST\r\n")
+            assert sorted(parse_entries(recv_list(sock))) == files
+
+
+def read_varint(data, offset):
+    value, shift = 0, 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+
+def decode_clist(body):
+    """The entries of a CLIST body, checking each block's Adler-32."""
+    count, offset = read_varint(body, 0)
+    flags = body[offset]
+    offset += 1
+    entries = []
+    while len(entries) < count:
+        block_start = offset
+        index, path = 0, b""
+        for _ in range(min(CLIST_BLOCK_ENTRIES, count - len(entries))):
+            delta, offset = read_varint(body, offset)
+            prefix, offset = read_varint(body, offset)
+            length, offset = read_varint(body, offset)
+            index += (delta >> 1) ^ -(delta & 1)
+            path = path[:prefix] + body[offset:offset + length]
+            offset += length
+            entries.append((index, path))
+        if flags & CLIST_FLAG_CHECKSUM:
+            checksum, = struct.unpack_from(">I", body, offset)
+            assert checksum == zlib.adler32(body[block_start:offset]), len(entries)
+            offset += 4
+    assert offset == len(body)
+    return entries
+
+
+@test
+def clist_matches_list(server):
+    # Enough files sharing prefixes for the last block to be a short one
+    paths = ["artist-%d/album/track-%03d.mp3" % (i % 3, i)
+             for i in range(2 * CLIST_BLOCK_ENTRIES + 7)]
+    root = scratch_library(paths)
+    try:
+        with Server(library=root) as big, big.connect() as sock:
+            sock.sendall(b"LIST\r\n")
+            entries = parse_entries(recv_list(sock))
+            sock.sendall(b"CLIST\r\n")
+            compact = decode_clist(recv_sized(sock))
+            assert compact == sorted(entries, key=lambda entry: entry[1])
+            assert sorted(path for _, path in compact) == sorted(p.encode() for p in paths)
+            negotiate_v2(sock)
+            assert decode_clist(v2_request(sock, 1, b"CLIST\r\n")[4:]) == compact
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+@test
+def client_lists_without_clist(server):
+    # A server that knows LIST, and refuses CLIST with a NACK
+    listener = socket.socket()
+    listener.bind(("127.0.0.1", 0))
+    listener.listen()
+    connections = []
+
+    def serve():
+        while True:
+            try:
+                conn, _ = listener.accept()
+            except OSError:
+                return
+            connections.append(conn)
+            data = b""
+            while True:
+                chunk = conn.recv(4096)
+                if not chunk:
+                    break
+                data += chunk
+                while b"\r\n" in data:
+                    request, data = data.split(b"\r\n", 1)
+                    conn.sendall(b"1:b.mp3\r\n0:a.mp3\r\n" if request == b"LIST"
+                                 else b"NACK\r\n")
+            conn.close()
+    thread = threading.Thread(target=serve)
+    thread.start()
+    try:
+        output, seconds = run_client(listener.getsockname()[1], ["list", "quit"])
+    finally:
+        listener.shutdown(socket.SHUT_RDWR)
+        listener.close()
+        thread.join()
+    assert "does not support compact lists" in output, output
+    assert "0: a.mp3\n1: b.mp3" in output, output
+    # Straight away, over the same connection
+    assert seconds < 1, seconds
+    assert len(connections) == 1, len(connections)
+
+
+def search(mode, query, limit=0):
+    return b"SEARCH\r\n" + struct.pack(">BHB", mode, limit, len(query)) + query
+
+
+@test
+def search_finds_paths(server):
+    files = list(enumerate(library_files()))
+    with server.connect() as sock:
+        def matches(mode, query, limit=0):
+            sock.sendall(search(mode, query, limit))
+            return parse_entries(recv_sized(sock))
+        wavs = matches(SEARCH_SUBSTRING, b"WAV")
+        assert sorted(wavs) == [entry for entry in files if b"wav" in entry[1]], wavs
+        assert len(matches(SEARCH_SUBSTRING, b"wav", 2)) == 2
+        assert [path for _, path in matches(SEARCH_PREFIX, b"harp")] == [b"wav/magic-harp.wav"]
+        assert matches(SEARCH_PREFIX, b"arp") == []
+        assert matches(SEARCH_FUZZY, b"magik-harp")[0][1] == b"wav/magic-harp.wav"
+        # A query too long for any path in this library
+        assert matches(SEARCH_SUBSTRING, b"a" * SEARCH_MAX_QUERY) == []
+        sock.sendall(search(SEARCH_FUZZY + 1, b"wav"))
+        assert_closed(sock)
+    with server.connect() as sock:
+        negotiate_v2(sock)
+        # The longest query fits in a REQUEST frame, and one too long only fails
+        # its own stream
+        response = v2_request(sock, 1, search(SEARCH_SUBSTRING, b"a" * SEARCH_MAX_QUERY))
+        assert response == struct.pack(">I", 0), response
+        assert v2_request(sock, 2, search(SEARCH_FUZZY + 1, b"wav")) == \
+            ("ERROR", b"Unknown search mode")
+        too_long = search(SEARCH_SUBSTRING, b"wav") + b"a" * V2_MAX_REQUEST_SIZE
+        assert v2_request(sock, 3, too_long) == ("ERROR", b"Request too long")
+        response = v2_request(sock, 4, search(SEARCH_PREFIX, b"harp"))
+        assert parse_entries(response[4:]) == [entry for entry in files
+                                               if entry[1] == b"wav/magic-harp.wav"]
+
+
+def browse(directory, token=b"", count=0, offset=0):
+    return (b"BROWSE\r\n" + struct.pack(">IHHH", offset, count, len(directory), len(token)) +
+            directory + token)
+
+
+def parse_page(body):
+    """The number of children, continuation token and children of a page."""
+    lines = body.split(b"\r\n")
+    assert lines.pop() == b""
+    children, token = lines.pop(0).split(b":", 1)
+    return int(children), token, [tuple(line.split(b":", 1)) for line in lines]
+
+
+@test
+def browse_pages(server):
+    files = list(enumerate(library_files()))
+    with server.connect() as sock:
+        def page(*args, **kwargs):
+            sock.sendall(browse(*args, **kwargs))
+            return parse_page(recv_sized(sock))
+        top = page(b"")
+        assert top == page(b"/")
+        formats = sorted(set(path.split(b"/")[0] for _, path in files))
+        assert top == (len(formats), b"", [
+            (b"%d" % sum(path.startswith(name + b"/") for _, path in files), name + b"/")
+            for name in formats])
+        # One child a page, each page's token naming where the next starts
+        wavs, token = [], b""
+        while True:
+            children, token, entries = page(b"wav", token, count=1)
+            assert children == 6 and len(entries) == 1
+            wavs += [(int(index), b"wav/" + name) for index, name in entries]
+            if not token:
+                break
+            assert token == entries[0][1]
+        assert sorted(wavs) == [entry for entry in files if entry[1].startswith(b"wav/")]
+        assert page(b"wav", count=2, offset=5)[2] == [(b"%d" % wavs[5][0], wavs[5][1][4:])]
+        assert page(b"no-such-directory") == (0, b"", [])
+    with server.connect() as sock:
+        negotiate_v2(sock)
+        # The longest directory and token fit in a REQUEST frame, and longer
+        # ones only fail their own stream
+        response = v2_request(sock, 1, browse(b"d" * BROWSE_MAX_ARG, b"t" * BROWSE_MAX_ARG))
+        assert parse_page(response[4:]) == (0, b"", [])
+        assert v2_request(sock, 2, browse(b"d" * (BROWSE_MAX_ARG + 1))) == \
+            ("ERROR", b"Directory or token too long")
+        assert parse_page(v2_request(sock, 3, browse(b""))[4:]) == top
+
+
+def common_tail(a, b):
+    length = 0
+    while length < min(len(a), len(b)) and a[-1 - length] == b[-1 - length]:
+        length += 1
+    return length
+
+
+def file_slice(response, data):
+    """How long a tail of response follows on from a slice of data, found from
+    its last KiB."""
+    end = data.find(response[-1024:])
+    assert end >= 0, "the response does not end with a slice of the file"
+    return common_tail(response, data[:end + 1024])
+
+
+# What a SEEK response starts with, by format, see as_seek.h
+SEEK_HEADERS = {
+    b".wav": lambda data: data[:4] == b"RIFF" and data[8:12] == b"WAVE",
+    b".mp3": lambda data: data[0] == 0xff and data[1] & 0xe0 == 0xe0,
+    b".flac": lambda data: data[:4] == b"fLaC",
+    b".ogg": lambda data: data[:4] == b"OggS",
+    b".m4a": lambda data: data[4:8] == b"ftyp",
+}
+
+
+@test
+def seek_starts_mid_file(server):
+    files = library_files()
+    with server.connect() as sock:
+        for ext, is_header in SEEK_HEADERS.items():
+            index = next(i for i, path in enumerate(files) if path.endswith(ext))
+            data = read_file(index)
+            sock.sendall(b"SEEK\r\n" + struct.pack(">II", index, 0))
+            whole = recv_sized(sock)
+            sock.sendall(b"SEEK\r\n" + struct.pack(">II", index, 2000))
+            response = recv_sized(sock)
+            assert is_header(whole) and is_header(response), ext
+            # A header, then the rest of the audio from a frame two seconds in
+            assert 0 < file_slice(response, data) < file_slice(whole, data), ext
+        sock.sendall(b"SEEK\r\n" + struct.pack(">II", len(files), 0))
+        assert_closed(sock)
+
+
+@test
+def indexes_saved_apart(server):
+    index_dir = os.path.join(tempfile.mkdtemp(prefix="as_index_"), "index")
+    before = sorted(os.walk(LIBRARY))
+    try:
+        with Server("-i", index_dir) as indexing:
+            deadline = time.time() + 10
+            while not (os.path.exists(os.path.join(index_dir, "seek")) and
+                       os.path.exists(os.path.join(index_dir, "wave"))):
+                assert time.time() < deadline, indexing.output()
+                time.sleep(0.1)
+        assert sorted(os.walk(LIBRARY)) == before
+    finally:
+        shutil.rmtree(os.path.dirname(index_dir), ignore_errors=True)
+
+
+def wav_duration_ms(data):
+    """The length of a WAV file's data chunk, in milliseconds."""
+    offset, byte_rate = 12, None
+    while offset + 8 <= len(data):
+        name, size = struct.unpack_from("<4sI", data, offset)
+        if name == b"fmt ":
+            byte_rate, = struct.unpack_from("<I", data, offset + 16)
+        elif name == b"data":
+            return size * 1000 // byte_rate
+        offset += 8 + size + (size & 1)
+    raise AssertionError("no data chunk")
+
+
+def waveform(sock, index, buckets):
+    """The loudness, duration and buckets of a WAVEFORM, None if empty."""
+    sock.sendall(b"WAVEFORM\r\n" + struct.pack(">IH", index, buckets))
+    body = recv_sized(sock)
+    if not body:
+        return None
+    loudness, duration, count = struct.unpack_from(">iIH", body)
+    assert len(body) == 10 + 2 * count
+    peaks = struct.unpack_from(">%db" % (2 * count), body, 10)
+    return loudness, duration, list(zip(peaks[::2], peaks[1::2]))
+
+
+@test
+def waveform_summaries(server):
+    files = library_files()
+    index = files.index(b"wav/magic-harp.wav")
+    with server.connect() as sock:
+        loudness, duration, buckets = waveform(sock, index, 64)
+        assert loudness == WAVE_SILENT or -10000 < loudness < 0, loudness
+        assert abs(duration - wav_duration_ms(read_file(index))) <= 1, duration
+        assert len(buckets) == 64 and all(low <= high for low, high in buckets)
+        # Coarser envelopes are merged from the same summary
+        finer = waveform(sock, index, 128)[2]
+        assert buckets == [(min(a[0], b[0]), max(a[1], b[1]))
+                           for a, b in zip(finer[::2], finer[1::2])]
+        assert len(waveform(sock, index, 0)[2]) == WAVE_DEFAULT_BUCKETS
+        assert len(waveform(sock, index, 0xffff)[2]) == WAVE_MAX_BUCKETS
+        # Only PCM WAV files are summarized
+        assert waveform(sock, files.index(b"mp3/im-your-dj.mp3"), 64) is None
+        sock.sendall(b"WAVEFORM\r\n" + struct.pack(">IH", len(files), 64))
+        assert_closed(sock)
+
+
+@test
+def merged_roots(server):
+    # Each root with files of its own, and one path in both
+    first_paths = ["b/two.mp3", "shared/both.wav", "z.flac"]
+    second_paths = ["a/one.ogg", "b/three.m4a", "shared/both.wav"]
+    contents = {}
+    for root_name, paths in (("first", first_paths), ("second", second_paths)):
+        for path in paths:
+            contents[(root_name, path)] = ("%s:%s\n" % (root_name, path)).encode() * 100
+    first = scratch_library(first_paths, {p: contents[("first", p)] for p in first_paths})
+    second = scratch_library(second_paths, {p: contents[("second", p)] for p in second_paths})
+    try:
+        with Server("-l", first, "-l", second, library=None) as merged, \
+                merged.connect() as sock:
+            # One list, sorted by path, in which the first root wins
+            expected = sorted(set(p.encode() for p in first_paths + second_paths))
+            sock.sendall(b"LIST\r\n")
+            assert sorted(parse_entries(recv_list(sock))) == list(enumerate(expected))
+            for index, path in enumerate(expected):
+                root_name = "first" if path.decode() in first_paths else "second"
+                sock.sendall(b"STREAM\r\n" + struct.pack(">I", index))
+                assert recv_sized(sock) == contents[(root_name, path.decode())], path
+    finally:
+        shutil.rmtree(first, ignore_errors=True)
+        shutil.rmtree(second, ignore_errors=True)
+
+
+@test
+def edge_fetches_once(server):
+    files = library_files()
+    index = max(range(len(files)), key=lambda i: len(read_file(i)))
+    data = read_file(index)
+    # A slow origin, so that the second STREAM comes while the file is fetched
+    with Server("-r", "1024") as origin, \
+            Server("-u", "127.0.0.1:%d" % origin.port, library=None) as edge:
+        with edge.connect() as sock:
+            sock.sendall(b"LIST\r\n")
+            assert sorted(parse_entries(recv_list(sock))) == list(enumerate(files))
+        received = []
+
+        def stream():
+            with edge.connect() as sock:
+                sock.sendall(b"STREAM\r\n" + struct.pack(">I", index))
+                received.append(recv_sized(sock))
+        threads = [threading.Thread(target=stream) for _ in range(2)]
+        for thread in threads:
+            thread.start()
+            time.sleep(0.3)
+        for thread in threads:
+            thread.join()
+        # Then from the cache
+        stream()
+        assert received == [data] * 3
+        with edge.connect() as sock:
+            sock.sendall(b"STATS\r\n")
+            report = recv_sized(sock).decode()
+        line = next(line for line in report.splitlines() if line.startswith("Edge:"))
+        assert line.startswith("Edge: 1 hits, 1 misses, 1 followed fetches, 1 fetched"), line
+
+
+@test
+def edge_refuses_v2(server):
+    with Server("-u", "127.0.0.1:%d" % server.port, library=None) as edge:
+        with edge.connect() as sock:
+            sock.settimeout(0.5)
+            sock.sendall(b"V2\r\n")
+            assert recv_exactly(sock, 6) == b"NACK\r\n"
+            # The connection goes on with v1
+            sock.settimeout(5)
+            sock.sendall(b"LIST\r\n")
+            assert sorted(parse_entries(recv_list(sock))) == list(enumerate(library_files()))
+        # So the client falls back to v1 without waiting out its timeout
+        output, seconds = run_client(edge.port, ["quit"], "-m")
+        assert "does not support protocol v2" in output, output
+        assert seconds < 1, seconds
+
+
+@test
+def edge_refuses_whole_file_requests(server):
+    files = library_files()
+    with Server("-u", "127.0.0.1:%d" % server.port, library=None) as edge:
+        with edge.connect() as sock:
+            # All at once, so that each request's arguments follow it in the
+            # same read, then a request the edge serves
+            sock.sendall(b"SEEK\r\n" + struct.pack(">II", 0, 1000) +
+                         b"WAVEFORM\r\n" + struct.pack(">IH", 0, 64) +
+                         b"USTREAM\r\n" + struct.pack(">IH", 0, 9) +
+                         b"STATION\r\n" +
+                         b"STREAM\r\n" + struct.pack(">I", 0))
+            for _ in range(4):
+                assert recv_exactly(sock, 6) == b"NACK\r\n"
+            assert recv_sized(sock) == read_file(0)
+            # Arguments that arrive apart from their request too
+            sock.sendall(b"SEEK\r\n" + struct.pack(">I", 0))
+            time.sleep(0.1)
+            sock.sendall(struct.pack(">I", 1000))
+            assert recv_exactly(sock, 6) == b"NACK\r\n"
+            sock.sendall(b"LIST\r\n")
+            assert sorted(parse_entries(recv_list(sock))) == list(enumerate(files))
+        output, seconds = run_client(edge.port, ["list", "waveform 0", "quit"])
+        assert "Server does not support waveforms" in output, output
+        assert seconds < 1, seconds
+
+
+@test
+def flight_survives_stalled_member(server):
+    # Distinct files, small enough for the scratch library, large enough not to
+    # fit in the socket buffers of a stalled stream
+    size = 2 * 1024 * 1024
+    root = tempfile.mkdtemp(prefix="as_library_")
+    contents = []
+    for i in range(FLIGHT_SLOTS + 1):
+        contents.append(os.urandom(size))
+        with open(os.path.join(root, "track-%02d.wav" % i), "wb") as file:
+            file.write(contents[-1])
+    try:
+        with Server(library=root) as flights:
+            def start(index):
+                sock = socket.socket()
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+                sock.settimeout(30)
+                sock.connect(("127.0.0.1", flights.port))
+                sock.sendall(b"STREAM\r\n" + struct.pack(">I", index))
+                assert recv_exactly(sock, 4) == struct.pack(">I", size)
+                return sock
+            # Every slot led by a stream that stops reading, the first one
+            # also followed by a stream that reads on past it
+            stalled = [start(i) for i in range(FLIGHT_SLOTS)]
+            with start(0) as sock:
+                assert recv_exactly(sock, size) == contents[0]
+            # Once idle, a slot is taken over by a stream of another file
+            time.sleep(FLIGHT_IDLE_MS / 1000 + 1)
+            with start(FLIGHT_SLOTS) as sock:
+                assert recv_exactly(sock, size) == contents[FLIGHT_SLOTS]
+            for i, sock in enumerate(stalled):
+                with sock:
+                    assert recv_exactly(sock, size) == contents[i], i
+            report = flights.quit()
+        assert "Coalesced streams: %d led, 1 followed, 0 alone" % (FLIGHT_SLOTS + 1) in report, \
+            report
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+def serve_while_indexing(indexing, index_file, timeout=120):
+    """LISTs until the server's indexer saves index_file, and returns how long
+    the slowest LIST took."""
+    slowest = 0
+    deadline = time.time() + timeout
+    while not os.path.exists(index_file):
+        assert time.time() < deadline, indexing.output()
+        start = time.time()
+        with indexing.connect() as sock:
+            sock.sendall(b"LIST\r\n")
+            recv_list(sock)
+        slowest = max(slowest, time.time() - start)
+    return slowest
+
+
+@test
+def seek_index_built_aside(server):
+    # Chained Ogg streams, whose pages are walked for their seek table
+    ogg = read_file(library_files().index(b"ogg/rainbow-disco-bears.ogg"))
+    root = tempfile.mkdtemp(prefix="as_library_")
+    with open(os.path.join(root, "long.ogg"), "wb") as file:
+        for _ in range(100):
+            file.write(ogg)
+    try:
+        with Server("-i", os.path.join(root, "index"), library=root) as indexing:
+            slowest = serve_while_indexing(indexing, os.path.join(root, "index", "seek"))
+            assert slowest < 0.25, slowest
+            with indexing.connect() as sock:
+                sock.sendall(b"SEEK\r\n" + struct.pack(">II", 0, 60000))
+                assert SEEK_HEADERS[b".ogg"](recv_sized(sock))
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+@test
+def wave_index_built_aside(server):
+    # Silence, sparse on disk, long enough to take its indexer seconds
+    size = 512 * 1024 * 1024
+    root = tempfile.mkdtemp(prefix="as_library_")
+    with open(os.path.join(root, "long.wav"), "wb") as file:
+        file.write(b"RIFF" + struct.pack("<I", 36 + size) + b"WAVEfmt " +
+                   struct.pack("<IHHIIHH", 16, 1, 2, 44100, 44100 * 4, 4, 16) +
+                   b"data" + struct.pack("<I", size))
+        file.truncate(44 + size)
+    try:
+        with Server("-i", os.path.join(root, "index"), library=root) as indexing:
+            start = time.time()
+            slowest = serve_while_indexing(indexing, os.path.join(root, "index", "wave"))
+            indexed = time.time() - start
+            assert slowest < 0.25, slowest
+            # Loaded from the index once the server reaps its indexer, rather
+            # than analyzed again on request
+            time.sleep(1.5)
+            with indexing.connect() as sock:
+                start = time.time()
+                loudness, duration, buckets = waveform(sock, 0, 64)
+                assert time.time() - start < indexed / 4, "the index was not loaded"
+            assert loudness == WAVE_SILENT and duration == size * 1000 // (44100 * 4)
+            assert buckets == [(0, 0)] * 64
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+@test
+def stream_drops_when_file_shrinks(server):
+    size = 16 * 1024 * 1024
+    root = tempfile.mkdtemp(prefix="as_library_")
+    path = os.path.join(root, "shrinking.wav")
+    with open(path, "wb") as file:
+        file.write(os.urandom(size))
+    try:
+        with Server(library=root) as shrinking:
+            with shrinking.connect() as sock:
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+                sock.sendall(b"STREAM\r\n" + struct.pack(">I", 0))
+                assert recv_exactly(sock, 4) == struct.pack(">I", size)
+                received = len(recv_exactly(sock, 1024 * 1024))
+                os.truncate(path, 2 * 1024 * 1024)
+                # The size sent can't be kept to, so the connection ends early
+                while True:
+                    chunk = sock.recv(65536)
+                    if not chunk:
+                        break
+                    received += len(chunk)
+                assert received < size, received
+            with shrinking.connect() as sock:
+                sock.sendall(b"STATS\r\n")
+                assert stats_counts(recv_sized(sock))["STREAM"] == (1, 1)
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+
+def main(names):
+    tests = [t for t in TESTS if not names or t.__name__ in names]
+    if not os.path.exists(SERVER):
+        print("%s is not built, run make first" % SERVER)
+        return 1
+    failed = 0
+    server = Server()
+    try:
+        for function in tests:
+            try:
+                function(server)
+                print("ok      %s" % function.__name__)
+            except Exception as error:
+                failed += 1
+                print("FAILED  %s: %s: %s" % (function.__name__, type(error).__name__, error))
+            if server.process.poll() is not None:
+                print("The server stopped:\n" + server.output())
+                server.stop()
+                server = Server()
+    finally:
+        server.stop()
+    print("%d of %d passed" % (len(tests) - failed, len(tests)))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))